@@ -174,6 +174,9 @@ static void PreprocessModule(Module &M) {
 Expected<CID> BCDB::Add(std::unique_ptr<Module> M) {
   PreprocessModule(*M);
 
+  // Commit all the function parts together, rather than one at a time.
+  Store::Batch batch(*db);
+
   auto SaveModule = [&](Module &M) {
     SmallVector<char, 0> Buffer;
     WriteAlignedModule(M, Buffer);
@@ -211,16 +214,31 @@ Expected<CID> BCDB::Add(std::unique_ptr<Module> M) {
 
   auto result = Node::Map(
       {{"functions", function_map}, {"remainder", Node(*db, remainder_value)}});
-  return db->put(result);
+  CID result_cid = db->put(result);
+  batch.commit();
+  return result_cid;
 }
 
-static std::unique_ptr<Module> LoadModuleFromValue(Store *db, const CID &ref,
+static std::unique_ptr<Module> LoadModuleFromBytes(BytesRef bytes,
                                                    StringRef Name,
                                                    LLVMContext &context) {
-  Node value = db->get(ref);
   ExitOnError Err("LoadModuleFromValue: ");
-  return Err(parseBitcodeFile(
-      MemoryBufferRef(value.as<StringRef>(byte_string_arg), Name), context));
+  StringRef buffer(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+  return Err(parseBitcodeFile(MemoryBufferRef(buffer, Name), context));
+}
+
+static std::unique_ptr<Module> LoadModuleFromValue(Store *db, const CID &ref,
+                                                   StringRef Name,
+                                                   LLVMContext &context) {
+  // Parse the bitcode straight from the store's buffer, without copying it
+  // into a Node first. The module is fully materialized, so it doesn't refer
+  // to the buffer afterward.
+  std::unique_ptr<Module> m;
+  if (!db->viewBytes(ref, [&](BytesRef bytes) {
+        m = LoadModuleFromBytes(bytes, Name, context);
+      }))
+    report_fatal_error("Module not found in store");
+  return m;
 }
 
 Expected<std::unique_ptr<Module>>
@@ -255,11 +273,22 @@ bcdb::getSplitModule(LLVMContext &context, Store &store, const Name &name) {
   auto m = LoadModuleFromValue(&store, (*head)["remainder"].as<CID>(),
                                "remainder", context);
   Joiner joiner(*m);
+
+  // Fetch all the function parts at once, to avoid per-part overhead.
+  std::vector<std::string> names;
+  std::vector<CID> cids;
   for (auto &item : (*head)["functions"].map_range()) {
-    auto name = utf8ToByteString(item.key());
-    auto mpart =
-        LoadModuleFromValue(&store, item.value().as<CID>(), name, context);
-    joiner.JoinGlobal(name, std::move(mpart));
+    names.emplace_back(utf8ToByteString(item.key()));
+    cids.emplace_back(item.value().as<CID>());
+  }
+  std::vector<std::unique_ptr<Module>> parts(cids.size());
+  store.viewManyBytes(cids, [&](size_t i, BytesRef bytes) {
+    parts[i] = LoadModuleFromBytes(bytes, names[i], context);
+  });
+  for (size_t i = 0; i < names.size(); i++) {
+    if (!parts[i])
+      report_fatal_error("Function not found in store");
+    joiner.JoinGlobal(names[i], std::move(parts[i]));
   }
 
   joiner.Finish();
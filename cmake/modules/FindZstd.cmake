@@ -0,0 +1,39 @@
+# Look for the necessary header
+find_path(Zstd_INCLUDE_DIR NAMES zstd.h)
+mark_as_advanced(Zstd_INCLUDE_DIR)
+
+# Look for the necessary library
+find_library(Zstd_LIBRARY NAMES zstd)
+mark_as_advanced(Zstd_LIBRARY)
+
+# Extract version information from the header file
+if(Zstd_INCLUDE_DIR)
+  foreach(_part MAJOR MINOR RELEASE)
+    file(STRINGS ${Zstd_INCLUDE_DIR}/zstd.h _ver_line
+      REGEX "^#define ZSTD_VERSION_${_part}  *[0-9]+"
+      LIMIT_COUNT 1)
+    string(REGEX MATCH "[0-9]+$" _ver_${_part} "${_ver_line}")
+  endforeach()
+  set(Zstd_VERSION "${_ver_MAJOR}.${_ver_MINOR}.${_ver_RELEASE}")
+  unset(_ver_line)
+  unset(_ver_MAJOR)
+  unset(_ver_MINOR)
+  unset(_ver_RELEASE)
+endif()
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Zstd
+  REQUIRED_VARS Zstd_INCLUDE_DIR Zstd_LIBRARY
+  VERSION_VAR Zstd_VERSION)
+
+# Create the imported target
+if(Zstd_FOUND)
+  set(Zstd_INCLUDE_DIRS ${Zstd_INCLUDE_DIR})
+  set(Zstd_LIBRARIES ${Zstd_LIBRARY})
+  if(NOT TARGET Zstd::Zstd)
+    add_library(Zstd::Zstd UNKNOWN IMPORTED)
+    set_target_properties(Zstd::Zstd PROPERTIES
+      IMPORTED_LOCATION             "${Zstd_LIBRARY}"
+      INTERFACE_INCLUDE_DIRECTORIES "${Zstd_INCLUDE_DIR}")
+    endif()
+endif()
@@ -119,7 +119,7 @@ in rec {
   };
 
   # Test whether BCDB works without these optional libraries
-  bcdb-without-optional-deps = bcdb.override { rocksdb = null; };
+  bcdb-without-optional-deps = bcdb.override { rocksdb = null; zstd = null; };
 
   # Dependencies of BCDB
   llvm11-assert = assertLLVM (ehLLVM pkgs.llvmPackages_11.libllvm);
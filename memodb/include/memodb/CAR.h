@@ -1,16 +1,41 @@
 #ifndef MEMODB_CAR_H
 #define MEMODB_CAR_H
 
+#include <cstddef>
+
 #include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include "Store.h"
 
 namespace memodb {
 
+struct CARExportOptions {
+  /// The number of threads fetching Nodes from the store ahead of the writer.
+  /// If zero, each Node is fetched when it's needed.
+  unsigned num_threads = 8;
+  /// The maximum number of Nodes fetched ahead of the writer.
+  std::size_t prefetch_limit = 1024;
+  /// Continue an interrupted export to the same file. The store must have
+  /// the same contents as before. Blocks that were already written are kept,
+  /// and only the rest of the file is written. Only supported when exporting
+  /// to a path.
+  bool resume = false;
+};
+
+/// Export the given Names, or every Head and Call if \p names_to_export is
+/// empty, along with all the Nodes they refer to. The blocks are written in a
+/// deterministic order (a depth-first traversal from each Name), so a partial
+/// output file can be used to resume an interrupted export. Returns the CID
+/// of the root Node.
 CID exportToCARFile(llvm::raw_fd_ostream &os, Store &store,
-                    llvm::ArrayRef<Name> names_to_export = {});
+                    llvm::ArrayRef<Name> names_to_export = {},
+                    const CARExportOptions &options = {});
+CID exportToCARFile(llvm::StringRef path, Store &store,
+                    llvm::ArrayRef<Name> names_to_export = {},
+                    const CARExportOptions &options = {});
 
-}
+} // end namespace memodb
 
 #endif // MEMODB_CAR_H
@@ -0,0 +1,114 @@
+#ifndef MEMODB_CBORBODY_H
+#define MEMODB_CBORBODY_H
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+
+#include <boost/beast/core/buffers_range.hpp>
+#include <boost/beast/http/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+#include "CBORDecoder.h"
+#include "Node.h"
+
+namespace memodb {
+
+class Store;
+
+/// Boost.Beast body type for messages that are usually CBOR. A CBOR body is
+/// decoded while it's being received, so the encoded bytes never need to be
+/// buffered in full. Other bodies (like error messages) are kept as strings.
+///
+/// Set value_type::store before reading the message; if it's null, the body
+/// is never decoded.
+struct CBORBody {
+  struct value_type {
+    /// The store used for any Links in the decoded Node.
+    Store *store = nullptr;
+    /// The decoded Node, if the body was nonempty CBOR.
+    std::optional<Node> node;
+    /// The decoding error, if the body was invalid CBOR.
+    std::string error;
+    /// The body, if it wasn't CBOR.
+    std::string raw;
+  };
+
+  static bool isCBOR(llvm::StringRef content_type) {
+    return content_type.split(';').first.trim(" \t").equals_insensitive(
+        "application/cbor");
+  }
+
+  class reader {
+  public:
+    // The parser constructs the reader before it reads the header, so we
+    // can't check the content type until init() is called.
+    template <bool isRequest, class Fields>
+    reader(boost::beast::http::header<isRequest, Fields> &h, value_type &body)
+        : body(body) {
+      get_content_type = [&h]() {
+        auto content_type = h[boost::beast::http::field::content_type];
+        return llvm::StringRef(content_type.data(), content_type.size());
+      };
+    }
+
+    void init(const boost::optional<std::uint64_t> &length,
+              boost::beast::error_code &ec) {
+      if (body.store && isCBOR(get_content_type()))
+        decoder.emplace(*body.store);
+      else if (length)
+        body.raw.reserve(*length);
+      ec = {};
+    }
+
+    template <class ConstBufferSequence>
+    std::size_t put(const ConstBufferSequence &buffers,
+                    boost::beast::error_code &ec) {
+      std::size_t size = 0;
+      for (auto buffer : boost::beast::buffers_range_ref(buffers)) {
+        auto data = static_cast<const char *>(buffer.data());
+        size += buffer.size();
+        if (!decoder) {
+          body.raw.append(data, buffer.size());
+          continue;
+        }
+        if (buffer.size())
+          received = true;
+        // After an error, keep consuming the body so the connection can still
+        // be used for the next message.
+        if (body.error.empty())
+          if (llvm::Error error = decoder->feed(BytesRef(
+                  reinterpret_cast<const std::uint8_t *>(data), buffer.size())))
+            body.error = llvm::toString(std::move(error));
+      }
+      ec = {};
+      return size;
+    }
+
+    void finish(boost::beast::error_code &ec) {
+      // An empty body is treated as missing, not as invalid CBOR.
+      if (decoder && received && body.error.empty()) {
+        auto node_or_err = decoder->finish();
+        if (node_or_err)
+          body.node = std::move(*node_or_err);
+        else
+          body.error = llvm::toString(node_or_err.takeError());
+      }
+      ec = {};
+    }
+
+  private:
+    std::function<llvm::StringRef()> get_content_type;
+    value_type &body;
+    std::optional<CBORDecoder> decoder;
+    bool received = false;
+  };
+};
+
+} // end namespace memodb
+
+#endif // MEMODB_CBORBODY_H
@@ -0,0 +1,80 @@
+#ifndef MEMODB_CBORDECODER_H
+#define MEMODB_CBORDECODER_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/Error.h>
+
+#include "Node.h"
+
+namespace memodb {
+
+class Store;
+
+/// Incremental CBOR decoder. The input can be provided in arbitrary pieces
+/// (for example, as they arrive over the network), so the whole encoding never
+/// needs to be in memory at once. The result is the same as
+/// Node::loadFromCBOR().
+///
+/// https://www.rfc-editor.org/rfc/rfc8949.html
+class CBORDecoder {
+public:
+  CBORDecoder(Store &store);
+  ~CBORDecoder();
+
+  /// Decode the next piece of input. After an error is returned, the decoder
+  /// must not be used again.
+  llvm::Error feed(BytesRef in);
+
+  /// Check that the input was complete and return the decoded Node.
+  llvm::Expected<Node> finish();
+
+  /// Decode a value in the given IEEE 754 binary float format. This is the
+  /// inverse of CBOREncoder::encodeFloat().
+  static double decodeFloat(std::uint64_t value, int total_size,
+                            int mantissa_size, int exponent_bias);
+
+private:
+  struct Frame {
+    bool is_map;
+    bool indefinite;
+    std::uint64_t remaining;
+    Node::List list;
+    Node::Map map;
+    std::optional<std::string> key;
+  };
+
+  llvm::Error handleHead(int major_type, int minor_type,
+                         std::uint64_t additional, bool indefinite);
+  void appendString(BytesRef data);
+  llvm::Error endString();
+  llvm::Error emit(Node node);
+
+  Store &store;
+  std::optional<Node> result;
+  std::vector<Frame> stack;
+
+  /// The head currently being decoded, if it was split between pieces.
+  llvm::SmallVector<std::uint8_t, 9> head;
+
+  /// There was a tag 42 head, so the next item must be a CID byte string.
+  bool pending_cid = false;
+
+  /// State of the byte string or text string currently being decoded.
+  bool in_string = false;
+  bool in_string_chunk = false;
+  bool string_indefinite = false;
+  bool string_is_cid = false;
+  int string_major_type = 0;
+  std::uint64_t string_remaining = 0;
+  Node::BytesStorage bytes;
+  Node::StringStorage text;
+};
+
+} // end namespace memodb
+
+#endif // MEMODB_CBORDECODER_H
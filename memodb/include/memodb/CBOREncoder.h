@@ -2,6 +2,7 @@
 #define MEMODB_CBORENCODER_H
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 #include <llvm/ADT/StringRef.h>
@@ -16,7 +17,13 @@ namespace memodb {
 /// https://www.rfc-editor.org/rfc/rfc8949.html
 class CBOREncoder : public NodeVisitor {
 public:
+  /// Append the encoded bytes to a vector.
   CBOREncoder(std::vector<std::uint8_t> &out);
+
+  /// Write the encoded bytes to a stream as they're encoded, so large Nodes
+  /// can be sent without keeping a second copy of them in memory.
+  CBOREncoder(llvm::raw_ostream &out);
+
   virtual ~CBOREncoder();
 
   /// Return whether the already-encoded CBOR includes links (CIDs, tag 42).
@@ -62,7 +69,10 @@ public:
   void startMap(const Node::Map &value) override;
 
 protected:
-  std::vector<std::uint8_t> &out;
+  void write(BytesRef bytes);
+
+  std::unique_ptr<llvm::raw_ostream> owned_out;
+  llvm::raw_ostream &out;
   bool has_links = false;
   bool not_dag_cbor = false;
 };
@@ -0,0 +1,85 @@
+#ifndef MEMODB_CACHINGSTORE_H
+#define MEMODB_CACHINGSTORE_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/StringRef.h>
+
+#include "Store.h"
+
+namespace memodb {
+
+/// A Store that keeps recently used Nodes and Call results in memory, and
+/// forwards everything else to another Store. Nodes are immutable, so they
+/// can be cached safely. Call results are treated as immutable too, except
+/// that call_invalidate() through this CachingStore clears them; invalidation
+/// done by other processes may not be noticed until the entries are evicted.
+/// Heads are never cached.
+///
+/// The cache is split into shards with separate locks, so it can be used by
+/// many threads at once. Each shard evicts its least recently used entries
+/// when it grows beyond its share of the capacity.
+///
+/// A CachingStore can be opened with a URI like `cache:sqlite:/path/to/db`.
+class CachingStore : public Store {
+public:
+  static constexpr std::size_t DEFAULT_CAPACITY = 256 << 20;
+
+  /// Wrap \p inner, taking ownership of it. \p capacity is the approximate
+  /// number of bytes of memory to use.
+  CachingStore(std::unique_ptr<Store> inner,
+               std::size_t capacity = DEFAULT_CAPACITY);
+
+  /// Wrap \p inner without taking ownership. \p inner must outlive the
+  /// CachingStore.
+  CachingStore(Store &inner, std::size_t capacity = DEFAULT_CAPACITY);
+
+  ~CachingStore() override;
+
+  /// Get the Store being wrapped.
+  Store &getInner() { return inner; }
+
+  llvm::Optional<Node> getOptional(const CID &CID) override;
+  llvm::Optional<CID> resolveOptional(const Name &Name) override;
+  CID put(const Node &value) override;
+  void set(const Name &Name, const CID &ref) override;
+  std::vector<Name> list_names_using(const CID &ref) override;
+  std::vector<std::string> list_funcs() override;
+  void eachHead(std::function<bool(const Head &)> F) override;
+  void eachCall(llvm::StringRef Func,
+                std::function<bool(const Call &)> F) override;
+  void head_delete(const Head &Head) override;
+  void call_invalidate(llvm::StringRef name) override;
+  bool has(const CID &CID) override;
+  bool has(const Name &Name) override;
+  std::vector<llvm::Optional<Node>> getMany(llvm::ArrayRef<CID> CIDs) override;
+  std::vector<CID> putMany(llvm::ArrayRef<Node> values) override;
+  std::vector<bool> hasMany(llvm::ArrayRef<CID> CIDs) override;
+  std::vector<llvm::Optional<CID>>
+  resolveMany(llvm::ArrayRef<Name> Names) override;
+  std::vector<std::vector<Name>>
+  listNamesUsingMany(llvm::ArrayRef<CID> CIDs) override;
+  std::size_t collectGarbage(std::chrono::seconds grace_period) override;
+
+protected:
+  bool beginBatch() override;
+  void commitBatch() override;
+  void abortBatch() override;
+
+private:
+  class Cache;
+
+  std::unique_ptr<Store> owned_inner;
+  Store &inner;
+  std::unique_ptr<Cache> cache;
+};
+
+} // end namespace memodb
+
+#endif // MEMODB_CACHINGSTORE_H
@@ -54,9 +54,15 @@ public:
 
 private:
   friend class Evaluator;
-  explicit Future(std::shared_future<Link> &&future);
+  explicit Future(std::shared_future<Link> &&future,
+                  std::function<void()> wait_hook = {});
 
   std::shared_future<Link> future;
+
+  // Called before blocking on the result, if provided. The Evaluator can use
+  // this to evaluate the Call in the current thread, or to do other useful
+  // work while the Call is being evaluated.
+  std::function<void()> wait_hook;
 };
 
 /// Used to register and call MemoDB funcs. Depending on how the Evaluator is
@@ -78,9 +84,13 @@ public:
   /// submitted to the server for evaluation by distributed workers, and
   /// workers in the local thread pool may evaluate jobs received from the
   /// server from other clients. If \p num_threads is 0, no local thread pool
-  /// will be created.
+  /// will be created. If \p cache is true, or the URI starts with `cache:`,
+  /// Nodes and Call results will be cached in memory (see CachingStore). A URI
+  /// like `tiered:LOCAL|http://...` also keeps them in the local store at
+  /// `LOCAL`, so they're still cached the next time (see TieredStore).
   static std::unique_ptr<Evaluator> create(llvm::StringRef uri,
-                                           unsigned num_threads = 0);
+                                           unsigned num_threads = 0,
+                                           bool cache = false);
 
   /// Get the Store this Evaluator is connected to.
   virtual Store &getStore() = 0;
@@ -98,6 +108,15 @@ public:
   /// Start evaluation of a call, returning a Future.
   virtual Future evaluateAsync(const Call &call) = 0;
 
+  /// Start evaluation of a call with a scheduling hint, returning a Future.
+  /// When there's a backlog of calls waiting for workers, calls with higher
+  /// \p priority are started first. Calls made by a func being evaluated
+  /// should usually have a higher priority than the func's own call, so
+  /// deep pipelines keep making progress. By default, \p priority is ignored.
+  virtual Future evaluateAsync(const Call &call, int priority) {
+    return evaluateAsync(call);
+  }
+
   /// Start evaluation of a call, returning a Future. \p args can be Node or
   /// CID values.
   template <typename... Params>
@@ -127,7 +146,8 @@ public:
 protected:
   friend class Future;
 
-  Future makeFuture(std::shared_future<Link> &&future);
+  Future makeFuture(std::shared_future<Link> &&future,
+                    std::function<void()> wait_hook = {});
 
 private:
   template <typename... Params, std::size_t... indexes>
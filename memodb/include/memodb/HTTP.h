@@ -5,6 +5,7 @@
 #include <llvm/ADT/StringRef.h>
 #include <llvm/ADT/Twine.h>
 #include <optional>
+#include <string>
 
 #include "CID.h"
 #include "Node.h"
@@ -26,6 +27,8 @@ public:
 
   void sendContent(ContentType type, const llvm::StringRef &body) override;
 
+  void sendOwnedContent(ContentType type, std::string &&body) override;
+
   void sendAccepted() override;
 
   void sendCreated(const std::optional<URI> &path) override;
@@ -57,6 +60,9 @@ protected:
   // setting the Content-Length header.
   virtual void sendBody(const llvm::Twine &body) = 0;
 
+  // Like sendBody(), but takes ownership of the body.
+  virtual void sendOwnedBody(std::string &&body) { sendBody(body); }
+
   // Should set Content-Length header to 0.
   virtual void sendEmptyBody() = 0;
 
@@ -67,6 +73,8 @@ private:
 
   void startResponse(std::uint16_t status, CacheControl cache_control);
 
+  void sendContentType(ContentType type);
+
   void sendErrorAfterStatus(Status status, std::optional<llvm::StringRef> type,
                             llvm::StringRef title,
                             const std::optional<llvm::Twine> &detail);
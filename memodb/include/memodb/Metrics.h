@@ -0,0 +1,74 @@
+#ifndef MEMODB_METRICS_H
+#define MEMODB_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace memodb {
+
+/// A histogram of durations in seconds, which can be printed in the
+/// [Prometheus text format]. Thread-safe.
+///
+/// All Histograms use the same buckets, which cover everything from fast
+/// database lookups to jobs that take hours.
+///
+/// [Prometheus text format]:
+/// https://prometheus.io/docs/instrumenting/exposition_formats/
+class Histogram {
+public:
+  static constexpr std::size_t NUM_BUCKETS = 17;
+
+  /// The upper bound of each bucket, in seconds. There's also an implicit
+  /// "+Inf" bucket after these.
+  static const double BUCKET_BOUNDS[NUM_BUCKETS];
+
+  void observe(double seconds);
+
+  void observe(std::chrono::steady_clock::duration duration) {
+    observe(std::chrono::duration<double>(duration).count());
+  }
+
+  /// Print the `_bucket`, `_sum`, and `_count` lines for this histogram.
+  /// \p labels is either empty or a list of labels, like `func="foo"`, which
+  /// is added to each line.
+  void print(llvm::raw_ostream &os, llvm::StringRef name,
+             llvm::StringRef labels = "") const;
+
+private:
+  std::atomic<std::uint64_t> counts[NUM_BUCKETS + 1] = {};
+  std::atomic<double> sum = 0.0;
+};
+
+/// Adds the time between its construction and destruction to a Histogram.
+class HistogramTimer {
+public:
+  explicit HistogramTimer(Histogram &histogram)
+      : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+  HistogramTimer(const HistogramTimer &) = delete;
+  HistogramTimer &operator=(const HistogramTimer &) = delete;
+  ~HistogramTimer() {
+    histogram.observe(std::chrono::steady_clock::now() - start);
+  }
+
+private:
+  Histogram &histogram;
+  std::chrono::steady_clock::time_point start;
+};
+
+/// Print the `# HELP` and `# TYPE` lines that come before the samples of a
+/// metric. \p type is `counter`, `gauge`, or `histogram`.
+void printMetricHeader(llvm::raw_ostream &os, llvm::StringRef name,
+                       llvm::StringRef type, llvm::StringRef help);
+
+/// Escape a string so it can be used as a label value, between double quotes.
+std::string escapeMetricLabel(llvm::StringRef value);
+
+} // end namespace memodb
+
+#endif // MEMODB_METRICS_H
@@ -274,17 +274,42 @@ public:
   using Map = NodeMap<llvm::SmallString<12>, Node>;
 
 private:
-  using BytesStorage = llvm::SmallVector<std::uint8_t, 48>;
-  using StringStorage = llvm::SmallString<48>;
+  // Results can have millions of Nodes, so we keep sizeof(Node) small: short
+  // strings are stored inline, and Links (which include a whole CID) are
+  // stored out of line.
+  using BytesStorage = llvm::SmallVector<std::uint8_t, 16>;
+  using StringStorage = llvm::SmallString<16>;
+
+  class LinkStorage {
+  public:
+    LinkStorage(Link &&link);
+    LinkStorage(const LinkStorage &other);
+    // Moves copy the Link instead of stealing it, so a moved-from Node is
+    // still a valid Link that can be copied, compared, and read.
+    LinkStorage(LinkStorage &&other) noexcept;
+    LinkStorage &operator=(const LinkStorage &other);
+    LinkStorage &operator=(LinkStorage &&other) noexcept;
+    const Link &operator*() const { return *link; }
+    bool operator==(const LinkStorage &other) const {
+      return *link == *other.link;
+    }
+    bool operator<(const LinkStorage &other) const {
+      return *link < *other.link;
+    }
+
+  private:
+    std::unique_ptr<Link> link;
+  };
 
   // The monostate represents null.
   std::variant<std::monostate, bool, std::int64_t, std::uint64_t, double,
-               BytesStorage, StringStorage, Link, List, Map>
+               BytesStorage, StringStorage, LinkStorage, List, Map>
       variant_;
 
   void validateUTF8() const;
   void validateKeysUTF8() const;
 
+  friend class CBORDecoder;
   friend class NodeVisitor;
   friend struct NodeTypeTraits<bool>;
   friend struct NodeTypeTraits<std::int64_t>;
@@ -464,6 +489,9 @@ public:
   /// Save a Node to CBOR bytes.
   std::vector<std::uint8_t> saveAsCBOR() const;
 
+  /// Save a Node to CBOR bytes, writing them to a stream as they're encoded.
+  void saveAsCBOR(llvm::raw_ostream &os) const;
+
   /// Load a Node from a CID and the corresponding content bytes. The CID
   /// content type may be Raw (bytes returned as a bytestring Node), DAG-CBOR,
   /// or DAG-CBOR-Unrestricted. The CID hash type may be Identity, in which
@@ -471,6 +499,14 @@ public:
   static llvm::Expected<Node> loadFromIPLD(Store &store, const CID &CID,
                                            BytesRef Content);
 
+  /// Get the contents of a byte string IPLD block, without copying them if
+  /// possible. If the CID content type is Raw, the result refers to Content
+  /// (or to the CID itself, if it's an Identity CID). Otherwise, the block is
+  /// loaded into Storage and the result refers to Storage.
+  static llvm::Expected<BytesRef>
+  viewBytesFromIPLD(Store &store, const CID &CID, BytesRef Content,
+                    std::optional<Node> &Storage);
+
   /// Save a Node as a CID and the corresponding content bytes. The CID content
   /// type will be either Raw (if this is a bytestring Node), DAG-CBOR, or
   /// DAG-CBOR-Unrestricted. If noIdentity is false and the value is small
@@ -518,7 +554,7 @@ public:
   }
 
   constexpr bool is_link() const noexcept {
-    return std::holds_alternative<Link>(variant_);
+    return std::holds_alternative<LinkStorage>(variant_);
   }
 
   /// @}
@@ -656,7 +692,7 @@ public:
   /// Traverse this Node and call func for each CID found.
   template <typename T> void eachLink(T func) const {
     std::visit(Overloaded{
-                   [&](const Link &link) { func(link.getCID()); },
+                   [&](const LinkStorage &link) { func((*link).getCID()); },
                    [&](const List &List) {
                      for (const auto &Item : List)
                        Item.eachLink(func);
@@ -872,7 +908,7 @@ template <> struct NodeTypeTraits<CID> {
   static constexpr bool is(const Node &node) noexcept { return node.is_link(); }
 
   static const CID &as(const Node &node) {
-    return std::get<Link>(node.variant_).getCID();
+    return (*std::get<Node::LinkStorage>(node.variant_)).getCID();
   }
 };
 
@@ -0,0 +1,90 @@
+#ifndef MEMODB_PATHGRAPH_H
+#define MEMODB_PATHGRAPH_H
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+
+#include "CID.h"
+#include "Node.h"
+#include "Store.h"
+
+namespace memodb {
+
+struct PathGraphOptions {
+  /// The number of threads looking up Names at once. Other threads can't see
+  /// writes made by the calling thread's Store::Batch, so this defaults to 1;
+  /// only raise it when no Batch is in progress, as `memodb paths-to -j` does.
+  unsigned num_threads = 1;
+  /// The number of CIDs each thread looks up at once, using
+  /// Store::listNamesUsingMany() and Store::getMany().
+  std::size_t batch_size = 256;
+};
+
+/// All the paths from Heads and Calls to a target Node, stored as a DAG. Each
+/// Node that can reach the target appears once, along with the edges leading
+/// to it, so a Node shared by many paths doesn't make the graph any bigger.
+/// The paths can be expanded with eachPath(), but there may be exponentially
+/// many of them.
+class PathGraph {
+public:
+  /// One way to reach a Node: either from a Head or Call that refers to it,
+  /// or from a link inside another Node.
+  struct Edge {
+    /// The Head, Call, or CID that refers to the Node.
+    Name Parent;
+    /// The keys and indices leading from the parent Node to the link. Empty
+    /// if Parent is a Head or Call.
+    std::vector<Node> Subpath;
+
+    Edge(const Name &Parent, std::vector<Node> Subpath = {})
+        : Parent(Parent), Subpath(std::move(Subpath)) {}
+  };
+
+  explicit PathGraph(const CID &Target) : Target(Target) {}
+
+  const CID &getTarget() const { return Target; }
+
+  /// Get the edges leading to a Node. Returns an empty list if the Node isn't
+  /// in the graph.
+  llvm::ArrayRef<Edge> getEdges(const CID &CID) const;
+
+  /// Get every Node in the graph, including the target, with the edges
+  /// leading to it.
+  const std::map<CID, std::vector<Edge>> &getAllEdges() const {
+    return Edges;
+  }
+
+  /// Replace the edges leading to a Node, adding the Node to the graph if
+  /// necessary.
+  void setEdges(const CID &CID, std::vector<Edge> NewEdges);
+
+  /// Call a function for each path from a Head or Call to the target, in the
+  /// same order as Store::list_paths_to(). @p F can return true to stop
+  /// iteration.
+  void eachPath(std::function<bool(const Path &)> F) const;
+
+  /// Expand the graph into a list of every path to the target.
+  std::vector<Path> getPaths() const;
+
+  /// Count the paths to the target without expanding them. Saturates at the
+  /// maximum value of std::size_t.
+  std::size_t countPaths() const;
+
+private:
+  CID Target;
+  std::map<CID, std::vector<Edge>> Edges;
+};
+
+/// Find all the paths from Heads and Calls to \p target. Each Node is only
+/// looked up once, no matter how many paths it's on, and several Nodes are
+/// looked up at once with Store::listNamesUsingMany().
+PathGraph buildPathGraph(Store &store, const CID &target,
+                         const PathGraphOptions &options = {});
+
+} // end namespace memodb
+
+#endif // MEMODB_PATHGRAPH_H
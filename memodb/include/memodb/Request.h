@@ -2,6 +2,7 @@
 #define MEMODB_REQUEST_H
 
 #include <cstdint>
+#include <memory>
 #include <optional>
 #include <string>
 
@@ -21,7 +22,12 @@ std::string escapeForHTML(llvm::StringRef str);
 // A single request for the MemoDB server to respond to.
 // This class is intended to work not only for HTTP requests but also CoAP
 // requests, if a suitable subclass is implemented.
-class Request {
+//
+// If the Request is owned by a std::shared_ptr, the Server may keep it after
+// Server::handleRequest() returns and send the response later from a
+// different thread (long polling). Otherwise, the response is always sent
+// before Server::handleRequest() returns.
+class Request : public std::enable_shared_from_this<Request> {
 public:
   enum class Method {
     GET,
@@ -83,6 +89,12 @@ public:
 
   virtual void sendContent(ContentType type, const llvm::StringRef &body) = 0;
 
+  // Like sendContent(), but takes ownership of the body so it can be sent
+  // without copying it.
+  virtual void sendOwnedContent(ContentType type, std::string &&body) {
+    sendContent(type, body);
+  }
+
   virtual void sendAccepted() = 0;
 
   virtual void sendCreated(const std::optional<URI> &path) = 0;
@@ -102,6 +114,10 @@ public:
   virtual void sendContentURIs(const llvm::ArrayRef<URI> uris,
                                CacheControl cache_control);
 
+  // Returns true if the client is known to have gone away, so nobody would
+  // receive a response. May be called from any thread.
+  virtual bool isClientGone() const { return false; }
+
   // The Request subclass should set this to true when any of the sendXXX
   // functions is called.
   bool responded = false;
@@ -1,23 +1,48 @@
 #ifndef MEMODB_SERVER_H
 #define MEMODB_SERVER_H
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <deque>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
 
+#include "Metrics.h"
 #include "Store.h"
 
 namespace memodb {
 
 class PendingCall;
 class Request;
+class WaitingRequest;
 class WorkerGroup;
 
+// Orders the calls in a CallQueue. Calls with higher priority come first, and
+// calls with the same priority are ordered by when they were first requested.
+struct PendingCallOrder {
+  bool operator()(const PendingCall *lhs, const PendingCall *rhs) const;
+};
+
+using CallQueue = std::set<PendingCall *, PendingCallOrder>;
+
 // Keeps track of all calls of a single function we need to evaluate. A
 // CallGroup is never deleted, and has a fixed location in memory. All member
 // variables and functions are protected by CallGroup::mutex.
@@ -27,16 +52,39 @@ public:
 
   // The queue of calls we have been requested to evaluate that have not yet
   // been assigned to a worker.
-  std::deque<PendingCall *> unstarted_calls;
+  CallQueue unstarted_calls;
 
   // The queue of calls we have assigned to workers that have timed out without
   // receiving a response.
-  std::deque<PendingCall *> calls_to_retry;
+  CallQueue calls_to_retry;
 
   // The actual PendingCalls.
   std::map<Call, PendingCall> calls;
 
-  // Delete all PendingCalls from the start of unstarted_calls and
+  // Workers that are waiting for a call to be added (long polling). Some of
+  // them may already have been claimed by another CallGroup or timed out.
+  std::deque<std::shared_ptr<WaitingRequest>> waiting_workers;
+
+  // How many workers this func should get compared to other funcs, when
+  // there are calls of both with the same priority. Only used with
+  // Server::SchedulingPolicy::Fair.
+  unsigned weight = 1;
+
+  // The number of calls assigned to workers so far, divided by weight, plus
+  // any time skipped while this CallGroup had nothing queued. The CallGroup
+  // with the lowest virtual_time gets the next worker.
+  double virtual_time = 0;
+
+  // Statistics for GET /metrics, which only increase.
+  std::uint64_t num_jobs_queued = 0;
+  std::uint64_t num_jobs_assigned = 0;
+  std::uint64_t num_jobs_retried = 0;
+  std::uint64_t num_jobs_finished = 0;
+
+  // The time from assigning each job to a worker until receiving the result.
+  Histogram job_durations;
+
+  // Delete all PendingCalls from the front of unstarted_calls and
   // calls_to_retry that have already been completed. (Either by a worker we
   // previously assigned the call to and then timed out, or an unrelated worker
   // that happens to have completed the call on its own.)
@@ -68,6 +116,17 @@ public:
   // Whether the evaluation has been completed.
   bool finished = false;
 
+  // Calls with higher priority are assigned to workers first. If the call is
+  // in one of the CallGroup's queues, this can only be changed by removing it
+  // from the queue first.
+  int priority = 0;
+
+  // Increases with each new PendingCall, so older calls can go first.
+  std::uint64_t sequence;
+
+  // Evaluate requests that are waiting for the result (long polling).
+  std::vector<std::shared_ptr<WaitingRequest>> waiting_requests;
+
   PendingCall(CallGroup *call_group, const Call &call);
 
   // Delete this PendingCall from the parent CallGroup if possible.
@@ -84,18 +143,152 @@ public:
   llvm::SmallVector<CallGroup *, 0> call_groups;
 };
 
+// A map from names to CallGroups or WorkerGroups. Entries are never deleted
+// and have fixed locations in memory. The map is split into shards, each with
+// its own reader-writer lock, so threads looking up existing entries (the
+// common case) don't block each other.
+template <typename T> class GroupMap {
+public:
+  // Get the entry for key, or nullptr if there isn't one.
+  T *lookup(llvm::StringRef key) {
+    Shard &shard = getShard(key);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto iter = shard.map.find(key);
+    return iter == shard.map.end() ? nullptr : &iter->getValue();
+  }
+
+  // Get the entry for key. If there isn't one, create it by passing args to
+  // the constructor of T. If two threads create the same entry at once, one
+  // of them wins and they both get the same entry.
+  template <typename... ArgsTy>
+  T &getOrCreate(llvm::StringRef key, ArgsTy &&...args) {
+    if (T *existing = lookup(key))
+      return *existing;
+    Shard &shard = getShard(key);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    return shard.map.try_emplace(key, std::forward<ArgsTy>(args)...)
+        .first->getValue();
+  }
+
+  // Call func(key, value) for each entry. Entries added concurrently may be
+  // skipped. func must not add entries to this map.
+  template <typename FuncTy> void forEach(FuncTy func) {
+    for (Shard &shard : shards) {
+      std::shared_lock<std::shared_mutex> lock(shard.mutex);
+      for (auto &item : shard.map)
+        func(item.getKey(), item.getValue());
+    }
+  }
+
+private:
+  static constexpr std::size_t NUM_SHARDS = 16;
+
+  struct Shard {
+    std::shared_mutex mutex;
+    llvm::StringMap<T> map;
+  };
+
+  Shard &getShard(llvm::StringRef key) {
+    return shards[llvm::xxHash64(key) % NUM_SHARDS];
+  }
+
+  std::array<Shard, NUM_SHARDS> shards;
+};
+
+// A request that is being held open until a job or result is available for
+// it, or until it times out (long polling). Clients ask for long polling with
+// the "wait=N" query parameter.
+class WaitingRequest {
+public:
+  enum class Kind {
+    // POST /worker, which gets a null response when it times out.
+    Worker,
+    // POST /call/.../.../evaluate, which gets 202 Accepted when it times out.
+    Evaluate,
+  };
+
+  WaitingRequest(std::shared_ptr<Request> request, Kind kind,
+                 std::chrono::time_point<std::chrono::steady_clock> deadline);
+
+  // Returns true if the caller is the first to claim the request, in which
+  // case the caller must send the response.
+  bool claim() { return !claimed.exchange(true); }
+
+  bool isClaimed() const { return claimed; }
+
+  const std::shared_ptr<Request> request;
+  const Kind kind;
+  const std::chrono::time_point<std::chrono::steady_clock> deadline;
+
+private:
+  std::atomic<bool> claimed = false;
+};
+
 class Server {
 public:
+  // How to choose between queued calls of different funcs that have the same
+  // priority.
+  enum class SchedulingPolicy {
+    // Share workers between funcs in proportion to their weights, so one func
+    // with a huge backlog can't starve the others.
+    Fair,
+    // Start whichever call was requested first, regardless of its func.
+    OldestFirst,
+  };
+
   Server(Store &store);
+  ~Server();
+
+  // Must be called before any requests are handled. The default is
+  // SchedulingPolicy::Fair.
+  void setSchedulingPolicy(SchedulingPolicy policy);
+
+  // Set the weight of a func for SchedulingPolicy::Fair. A func with weight 2
+  // gets twice as many workers as a func with weight 1 (the default), as long
+  // as both have calls queued. Must be called before any requests are
+  // handled.
+  void setFuncWeight(llvm::StringRef func, unsigned weight);
 
   // This function will always send a response to the request. Thread-safe.
+  // If the request is owned by a std::shared_ptr and asks for long polling,
+  // the response may be sent later by a different thread.
   void handleRequest(Request &request);
 
+  // Respond to long polling requests whose wait time has expired. The owner
+  // of the Server should call this about once a second. Thread-safe.
+  void handleTimeouts();
+
+  // Return the store used to handle requests, so the owner of the Server can
+  // decode request bodies (and create Links) while receiving them.
+  Store &getStore();
+
+  // Keep a log of queued, assigned, and finished jobs in the file at \p path,
+  // so they survive a server restart. If the file already exists, the jobs
+  // in it are restored first, keeping their order, retry state, and
+  // timeouts, and the file is compacted. Must be called before any requests
+  // are handled.
+  //
+  // Records are written by a background thread and synced to disk about
+  // once a second, so a machine crash may lose the last second of changes.
+  // The log is compacted again whenever it has grown by \p compact_bytes and
+  // is at least twice its compacted size.
+  void openJobLog(llvm::StringRef path,
+                  std::uint64_t compact_bytes = 16 << 20);
+
+  // Add more metrics to the response to GET /metrics, such as ones about the
+  // connections handled by the owner of the Server. \p print must write them
+  // in the Prometheus text format, and may be called from any thread. Must be
+  // called before any requests are handled.
+  void addMetrics(std::function<void(llvm::raw_ostream &)> print);
+
 private:
+  class MeasuredStore;
+
   void handleNewRequest(Request &request);
   void handleRequestCID(Request &request,
                         std::optional<llvm::StringRef> cid_str,
                         std::optional<llvm::StringRef> sub_str);
+  void handleMissingCIDs(Request &request);
   void handleRequestHead(Request &request,
                          std::optional<llvm::StringRef> head_str);
   void handleRequestCall(Request &request,
@@ -105,15 +298,95 @@ private:
   void handleRequestWorker(Request &request);
   void handleEvaluateCall(Request &request, Call call);
   void handleCallResult(const Call &call, Link result);
-  void sendCallToWorker(PendingCall &pending_call, Request &worker,
-                        std::unique_lock<std::mutex> call_group_lock);
+  void handleCallResults(Request &request);
+  void handleRequestMetrics(Request &request);
+
+  // Mark a call as assigned to a worker, and return the job to send to the
+  // worker. call_group->mutex must be locked.
+  Node assignCall(PendingCall &pending_call);
+
+  // Assign calls from the front of call_group's queues, preferring
+  // unstarted_calls over calls_to_retry, until there are max_jobs jobs.
+  // call_group.mutex must be locked.
+  void takeJobs(CallGroup &call_group, unsigned max_jobs,
+                std::vector<Node> &jobs);
 
+  // Find the CallGroup whose next call should be assigned to a worker from
+  // worker_group, according to the priorities of the calls and the
+  // scheduling policy. Returns nullptr if none of them have calls queued.
+  // Must be called without holding any mutexes.
+  CallGroup *pickCallGroup(const WorkerGroup &worker_group);
+
+  // Add a call to one of its CallGroup's queues. call_group->mutex must be
+  // locked.
+  void queueCall(PendingCall &pending_call, CallQueue &queue);
+
+  // Respond to POST /worker with the given jobs, which may be empty.
+  void sendJobs(Request &worker, std::vector<Node> jobs);
+
+  bool sendCallToWaitingWorker(PendingCall &pending_call,
+                               std::unique_lock<std::mutex> &call_group_lock);
+  std::shared_ptr<WaitingRequest> startWaiting(Request &request,
+                                               WaitingRequest::Kind kind);
+  void sendTimeout(WaitingRequest &waiting);
+  void replayJobLog(llvm::StringRef path);
+  void logJob(llvm::StringRef kind, const PendingCall &pending_call);
+
+  // Write records for all jobs that haven't finished yet.
+  void writeLiveJobs(llvm::raw_ostream &os);
+
+  // These are only called by openJobLog() and job_log_thread.
+  void compactJobLog();
+  void writeJobLogBuffer(bool sync);
+  void jobLogThreadImpl();
+
+  // Wraps the Store passed to the constructor, measuring how long each
+  // operation takes.
+  std::unique_ptr<MeasuredStore> measured_store;
   Store &store;
+  SchedulingPolicy scheduling_policy = SchedulingPolicy::Fair;
 
-  // All variables below are protected by the mutex.
-  std::mutex mutex;
-  llvm::StringMap<CallGroup> call_groups;
-  llvm::StringMap<WorkerGroup> worker_groups;
+  // The virtual_time of the CallGroup that most recently had a call
+  // assigned. Used to keep idle CallGroups from falling behind.
+  std::atomic<double> virtual_clock = 0.0;
+
+  // The time spent handling requests, by the first segment of the path.
+  // This doesn't include the time long polling requests spend waiting. The
+  // keys are all added by the constructor, so no mutex is needed.
+  llvm::StringMap<Histogram> request_durations;
+
+  std::vector<std::function<void(llvm::raw_ostream &)>> extra_metrics;
+
+  // Groups are looked up for almost every job-related request, so these
+  // maps have their own fine-grained locks.
+  GroupMap<CallGroup> call_groups;
+  GroupMap<WorkerGroup> worker_groups;
+
+  // All requests that are waiting for a job or result, protected by
+  // waiting_mutex. No other mutexes may be locked while holding
+  // waiting_mutex.
+  std::mutex waiting_mutex;
+  std::vector<std::shared_ptr<WaitingRequest>> waiting_requests;
+
+  // Records for the job log opened by openJobLog(), if any, that haven't
+  // been written yet, protected by job_log_mutex. No other mutexes may be
+  // locked while holding job_log_mutex.
+  std::mutex job_log_mutex;
+  std::condition_variable job_log_cv;
+  std::string job_log_buffer;
+  bool job_log_stopping = false;
+
+  // Writes job_log_buffer to the job log. The fields below are only used by
+  // this thread once it starts.
+  std::thread job_log_thread;
+  std::string job_log_path;
+  std::unique_ptr<llvm::raw_fd_ostream> job_log;
+  int job_log_fd = -1;
+  std::uint64_t job_log_size = 0;
+  // The size of the live jobs written by the last compaction.
+  std::uint64_t job_log_compacted_size = 0;
+  std::uint64_t job_log_compact_bytes = 0;
+  std::chrono::time_point<std::chrono::steady_clock> job_log_last_sync;
 };
 
 } // end namespace memodb
@@ -0,0 +1,117 @@
+#ifndef MEMODB_SHARDEDSTORE_H
+#define MEMODB_SHARDEDSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/StringRef.h>
+
+#include "Store.h"
+
+namespace llvm {
+class ThreadPool;
+} // end namespace llvm
+
+namespace memodb {
+
+/// A Store that spreads its contents across several other Stores (shards), so
+/// one logical store can use the space and write bandwidth of several disks.
+/// Each Node, Head, and Call is kept in a single shard, chosen by consistent
+/// hashing of its CID or name. Operations that need every shard, like
+/// eachCall() and list_names_using(), query the shards in parallel. eachHead()
+/// and eachCall() gather every shard's results first, then call the function
+/// on the calling thread in sorted order.
+///
+/// Nodes often link to Nodes in other shards, so the shards must accept Nodes
+/// whose links they don't have. `rocksdb:` stores do, but `sqlite:` stores
+/// don't.
+///
+/// Adding a shard to the end of the list changes the shard of only about 1/N
+/// of the Nodes and names. They can be copied to their new shards with
+/// `memodb transfer`, using the old list of shards (opened as secondary
+/// instances) as the source. Copies left behind in their old shards are
+/// ignored. Shards must never be reordered or removed.
+///
+/// A ShardedStore can be opened with a URI like
+/// `shard:rocksdb:/disk1/db,rocksdb:/disk2/db`.
+class ShardedStore : public Store {
+public:
+  /// Take ownership of \p shards, which must not be empty.
+  explicit ShardedStore(std::vector<std::unique_ptr<Store>> shards);
+  ~ShardedStore() override;
+
+  std::size_t getNumShards() const { return shards.size(); }
+  Store &getShard(std::size_t index) { return *shards[index]; }
+
+  /// Get the index of the shard that stores a Node.
+  std::size_t getShardIndex(const CID &CID) const;
+
+  /// Get the index of the shard that stores a Head or Call.
+  std::size_t getShardIndex(const Name &Name) const;
+
+  llvm::Optional<Node> getOptional(const CID &CID) override;
+  llvm::Optional<CID> resolveOptional(const Name &Name) override;
+  CID put(const Node &value) override;
+  void set(const Name &Name, const CID &ref) override;
+  std::vector<Name> list_names_using(const CID &ref) override;
+  std::vector<std::string> list_funcs() override;
+  void eachHead(std::function<bool(const Head &)> F) override;
+  void eachCall(llvm::StringRef Func,
+                std::function<bool(const Call &)> F) override;
+  void head_delete(const Head &Head) override;
+  void call_invalidate(llvm::StringRef name) override;
+  bool has(const CID &CID) override;
+  bool has(const Name &Name) override;
+  std::vector<llvm::Optional<Node>> getMany(llvm::ArrayRef<CID> CIDs) override;
+  bool viewBytes(const CID &CID, std::function<void(BytesRef)> F) override;
+  void viewManyBytes(llvm::ArrayRef<CID> CIDs,
+                     std::function<void(size_t, BytesRef)> F) override;
+  std::vector<CID> putMany(llvm::ArrayRef<Node> values) override;
+  std::vector<bool> hasMany(llvm::ArrayRef<CID> CIDs) override;
+  std::vector<llvm::Optional<CID>>
+  resolveMany(llvm::ArrayRef<Name> Names) override;
+  std::vector<std::vector<Name>>
+  listNamesUsingMany(llvm::ArrayRef<CID> CIDs) override;
+
+protected:
+  bool beginBatch() override;
+  void commitBatch() override;
+  void abortBatch() override;
+
+private:
+  std::size_t getShardIndexForHash(std::uint64_t hash) const;
+
+  // Call F with the index of each shard, like runOnShards().
+  void forEachShard(const std::function<void(std::size_t)> &F);
+
+  // Call F with each of the shard indexes, in parallel on the thread pool
+  // unless there's only one or the current thread has a Batch in progress
+  // (other threads couldn't see its writes).
+  void runOnShards(llvm::ArrayRef<std::size_t> indexes,
+                   const std::function<void(std::size_t)> &F);
+
+  // Group the indexes of keys by shard, and call F for each shard that has
+  // any keys, like forEachShard().
+  template <typename T, typename FuncT>
+  void forEachGroup(llvm::ArrayRef<T> keys, FuncT F);
+
+  std::vector<std::unique_ptr<Store>> shards;
+  // Points on the consistent hashing ring, sorted by hash, and the index of
+  // the shard each one belongs to.
+  std::vector<std::pair<std::uint64_t, std::size_t>> ring;
+  // Threads for querying shards in parallel. The calling thread handles one
+  // shard itself, so this has one thread fewer than there are shards.
+  // Declared after shards so it's destroyed first.
+  std::unique_ptr<llvm::ThreadPool> pool;
+};
+
+} // end namespace memodb
+
+#endif // MEMODB_SHARDEDSTORE_H
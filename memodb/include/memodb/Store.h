@@ -1,6 +1,7 @@
 #ifndef MEMODB_STORE_H
 #define MEMODB_STORE_H
 
+#include <chrono>
 #include <functional>
 #include <iosfwd>
 #include <map>
@@ -103,7 +104,12 @@ public:
   /// the program.
   ///
   /// \param uri The URI of the store to open. Supported schemes may include
-  /// `sqlite:`, `rocksdb:`, `car:`, and `http:`.
+  /// `sqlite:`, `rocksdb:`, `car:`, and `http:`. Any of these can be prefixed
+  /// with `cache:` to cache Nodes and Call results in memory (see
+  /// CachingStore). A URI like `tiered:LOCAL|REMOTE` uses the store at
+  /// `LOCAL` as a persistent cache for the store at `REMOTE` (see
+  /// TieredStore). A URI like `shard:URI1,URI2,...` spreads Nodes and names
+  /// across several stores (see ShardedStore).
   ///
   /// \param create_if_missing If true, and the URI refers to a nonexistent
   /// file, create a new empty database there.
@@ -151,6 +157,77 @@ public:
   /// Check whether the given Head or Call is present in the store.
   virtual bool has(const Name &Name);
 
+  /// Get several Nodes at once. The result has one entry for each CID in
+  /// @p CIDs, which is None if the corresponding Node is missing. Stores may
+  /// override this to avoid per-Node overhead, like a separate lookup or
+  /// network round trip for each Node.
+  virtual std::vector<llvm::Optional<Node>> getMany(llvm::ArrayRef<CID> CIDs);
+
+  /// Call @p F with the contents of a byte string Node, or return false if
+  /// the Node is missing. Unlike get(), stores may pass a reference directly
+  /// into their own buffers instead of copying the bytes into a Node, so the
+  /// bytes are only valid until @p F returns, and @p F must not access this
+  /// store. Aborts if the Node isn't a byte string.
+  virtual bool viewBytes(const CID &CID, std::function<void(BytesRef)> F);
+
+  /// Like viewBytes(), but for several CIDs at once. @p F is called with the
+  /// index and contents of each Node that is present, in an unspecified
+  /// order.
+  virtual void viewManyBytes(llvm::ArrayRef<CID> CIDs,
+                             std::function<void(size_t, BytesRef)> F);
+
+  /// Add several Nodes at once, returning their CIDs in the same order.
+  virtual std::vector<CID> putMany(llvm::ArrayRef<Node> values);
+
+  /// Check which of several CIDs are present in the store.
+  virtual std::vector<bool> hasMany(llvm::ArrayRef<CID> CIDs);
+
+  /// Resolve several Heads or Calls at once. The result has one entry for
+  /// each Name in @p Names, which is None if the Name is missing.
+  virtual std::vector<llvm::Optional<CID>>
+  resolveMany(llvm::ArrayRef<Name> Names);
+
+  /// Call list_names_using() for several CIDs at once. The result has one
+  /// entry for each CID in @p CIDs.
+  virtual std::vector<std::vector<Name>>
+  listNamesUsingMany(llvm::ArrayRef<CID> CIDs);
+
+  /// Delete the Nodes that can't be reached from any Head or Call, and return
+  /// how many were deleted. Stores may do this in small steps, so other
+  /// clients can keep using the store while it runs. Aborts if the store
+  /// doesn't support garbage collection.
+  ///
+  /// Clients usually put() a Node before setting a Head or Call that refers
+  /// to it. Nodes added less than \p grace_period before collection starts
+  /// are kept, so that clients have that long to refer to them.
+  virtual std::size_t collectGarbage(std::chrono::seconds grace_period);
+
+  /// Groups the writes made by the current thread, so the store can commit
+  /// them all at once instead of separately. This makes bulk imports much
+  /// faster. Writes made while the Batch exists are visible to reads from
+  /// the same thread, but may not be visible to other threads until commit()
+  /// is called.
+  ///
+  /// If a Batch already exists for the current thread and store, the new
+  /// Batch does nothing and the writes are committed by the outer Batch.
+  ///
+  /// If a Batch is destroyed without calling commit(), some or all of its
+  /// writes may be discarded, depending on the store.
+  class Batch {
+  public:
+    explicit Batch(Store &store);
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+    ~Batch();
+
+    /// Commit all the writes made since the Batch was created.
+    void commit();
+
+  private:
+    Store &store;
+    bool active;
+  };
+
   /// Get a Node by its CID, aborting if it's missing.
   Node get(const CID &CID);
 
@@ -163,8 +240,27 @@ public:
   /// List all cached Calls of a given func in the store.
   std::vector<Call> list_calls(llvm::StringRef Func);
 
-  /// Recursively call list_names_using() to find all paths to a given Node.
+  /// Find all paths from Heads and Calls to a given Node. This expands the
+  /// result of buildPathGraph(), which is usually much smaller.
   std::vector<Path> list_paths_to(const CID &ref);
+
+protected:
+  /// Start grouping the current thread's writes, for Batch. Returns false if
+  /// the store doesn't support batches or the current thread already has one
+  /// in progress, in which case commitBatch() and abortBatch() won't be
+  /// called.
+  virtual bool beginBatch() { return false; }
+
+  /// Commit the current thread's batch.
+  virtual void commitBatch() {}
+
+  /// Discard as much of the current thread's batch as possible.
+  virtual void abortBatch() {}
+
+  /// Used by Stores that wrap other Stores to forward batches to them.
+  static bool beginBatchOn(Store &store) { return store.beginBatch(); }
+  static void commitBatchOn(Store &store) { store.commitBatch(); }
+  static void abortBatchOn(Store &store) { store.abortBatch(); }
 };
 
 } // end namespace memodb
@@ -0,0 +1,99 @@
+#ifndef MEMODB_TIEREDSTORE_H
+#define MEMODB_TIEREDSTORE_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/StringRef.h>
+
+#include "Store.h"
+
+namespace memodb {
+
+/// A Store that keeps a persistent local copy of the Nodes and Call results
+/// it gets from a remote Store, so separate runs (like distributed workers
+/// evaluating calls with the same arguments) only download them once.
+///
+/// Reads try the local store first. Anything fetched from the remote store is
+/// added to the local store, except that a Node is only added once all the
+/// Nodes it links to are present locally (SQLite stores require this). So a
+/// DAG that's read from the top down is cached from the bottom up, and is
+/// fully cached after it has been read twice.
+///
+/// New Nodes are added to the local store right away, but they're only sent
+/// to the remote store in batches: before anything refers to them by name
+/// (set()), when too many are pending, or when flush() is called.
+///
+/// Call results are treated as immutable, like in CachingStore. Calls
+/// invalidated through this TieredStore are removed from the local store,
+/// but invalidation done by other processes isn't noticed. Heads are never
+/// stored locally.
+///
+/// A TieredStore can be opened with a URI like
+/// `tiered:sqlite:/tmp/cache.db|http://127.0.0.1:29179`.
+class TieredStore : public Store {
+public:
+  /// Use \p local as a cache in front of \p remote, taking ownership of both.
+  TieredStore(std::unique_ptr<Store> local, std::unique_ptr<Store> remote);
+
+  /// Use \p local as a cache in front of \p remote, taking ownership of only
+  /// \p local. \p remote must outlive the TieredStore.
+  TieredStore(std::unique_ptr<Store> local, Store &remote);
+
+  /// Flushes any pending Nodes to the remote store.
+  ~TieredStore() override;
+
+  Store &getLocal() { return *local; }
+  Store &getRemote() { return remote; }
+
+  /// Send every Node added through this TieredStore to the remote store, and
+  /// wait until they've all been written. Call this before referring to new
+  /// Nodes through some other connection to the remote store.
+  void flush();
+
+  llvm::Optional<Node> getOptional(const CID &CID) override;
+  llvm::Optional<CID> resolveOptional(const Name &Name) override;
+  CID put(const Node &value) override;
+  void set(const Name &Name, const CID &ref) override;
+  std::vector<Name> list_names_using(const CID &ref) override;
+  std::vector<std::string> list_funcs() override;
+  void eachHead(std::function<bool(const Head &)> F) override;
+  void eachCall(llvm::StringRef Func,
+                std::function<bool(const Call &)> F) override;
+  void head_delete(const Head &Head) override;
+  void call_invalidate(llvm::StringRef name) override;
+  bool has(const CID &CID) override;
+  bool has(const Name &Name) override;
+  std::vector<llvm::Optional<Node>> getMany(llvm::ArrayRef<CID> CIDs) override;
+  std::vector<bool> hasMany(llvm::ArrayRef<CID> CIDs) override;
+  std::vector<llvm::Optional<CID>>
+  resolveMany(llvm::ArrayRef<Name> Names) override;
+  std::vector<std::vector<Name>>
+  listNamesUsingMany(llvm::ArrayRef<CID> CIDs) override;
+
+private:
+  class Pending;
+
+  // Check whether all the Nodes linked to by a Node are present locally.
+  bool linksAreLocal(const Node &node);
+  // Add fetched Nodes to the local store, if their links are present there.
+  void cacheNodes(llvm::ArrayRef<CID> CIDs,
+                  llvm::ArrayRef<llvm::Optional<Node>> nodes);
+  // Add a fetched Call result to the local store, if the Nodes it refers to
+  // are present there.
+  void cacheCall(const Call &call, const CID &result);
+
+  std::unique_ptr<Store> local;
+  std::unique_ptr<Store> owned_remote;
+  Store &remote;
+  std::unique_ptr<Pending> pending;
+};
+
+} // end namespace memodb
+
+#endif // MEMODB_TIEREDSTORE_H
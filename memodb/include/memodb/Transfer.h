@@ -0,0 +1,49 @@
+#ifndef MEMODB_TRANSFER_H
+#define MEMODB_TRANSFER_H
+
+#include <cstddef>
+#include <functional>
+
+#include <llvm/ADT/ArrayRef.h>
+
+#include "CID.h"
+#include "Store.h"
+
+namespace memodb {
+
+struct TransferOptions {
+  /// The number of threads copying Nodes at once.
+  unsigned num_threads = 8;
+  /// The number of CIDs each thread checks and copies at once, using
+  /// Store::hasMany(), Store::getMany(), and Store::putMany().
+  std::size_t batch_size = 256;
+  /// If set, called each time another \p progress_interval Nodes have been
+  /// copied, with the number of Nodes copied so far and the number of CIDs
+  /// still waiting to be checked. May be called from any of the copying
+  /// threads, but never from two at once.
+  std::function<void(std::size_t num_copied, std::size_t num_waiting)>
+      progress;
+  std::size_t progress_interval = 100000;
+};
+
+/// Copy the Nodes with the given CIDs, and all Nodes they link to, from
+/// \p source to \p target. If \p target already has a Node, it's assumed to
+/// have all the Nodes that Node links to, so they aren't checked. Aborts if a
+/// Node that needs to be copied is missing from \p source. Each Node is only
+/// written after all the Nodes it links to, so this assumption still holds if
+/// the transfer is interrupted. Returns the number of Nodes copied.
+std::size_t transferNodes(Store &source, Store &target,
+                          llvm::ArrayRef<CID> roots,
+                          const TransferOptions &options = {});
+
+/// Copy the given CIDs, Heads, and Calls from \p source to \p target, along
+/// with all the Nodes they refer to. Heads and Calls are only set in
+/// \p target after all their Nodes have been copied. Returns the number of
+/// Nodes copied.
+std::size_t transferNames(Store &source, Store &target,
+                          llvm::ArrayRef<Name> names,
+                          const TransferOptions &options = {});
+
+} // end namespace memodb
+
+#endif // MEMODB_TRANSFER_H
@@ -1,17 +1,29 @@
 #include "memodb/CAR.h"
 #include "memodb_internal.h"
 
+#include <algorithm>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/EndianStream.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Process.h>
 #include <llvm/Support/raw_ostream.h>
-#include <map>
+#include <llvm/Support/xxhash.h>
 #include <memory>
+#include <mutex>
 #include <optional>
-#include <set>
 #include <system_error>
-#include <unistd.h>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "memodb/Multibase.h"
 #include "memodb/URI.h"
@@ -20,20 +32,36 @@ using namespace memodb;
 
 namespace {
 class CARStore : public Store {
-  llvm::sys::fs::file_t FileHandle;
+  // The whole CAR file is mapped into memory, so reads don't need any system
+  // calls and are safe to do from multiple threads at once.
+  std::unique_ptr<llvm::sys::fs::mapped_file_region> File;
+  llvm::ArrayRef<std::uint8_t> Data;
   Node Root;
-  std::map<CID, std::uint64_t> BlockPositions;
 
-  bool readBytes(llvm::MutableArrayRef<std::uint8_t> Buf, std::uint64_t *Pos);
-  std::optional<std::uint64_t> readVarInt(std::uint64_t *Pos);
-  CID readCID(std::uint64_t *Pos);
+  // Used to check whether a sidecar index was made for this CAR file.
+  std::uint64_t ModificationTime = 0;
+  std::uint64_t EdgeHash = 0;
+
+  // The file offset of every block, sorted by CID. This either points into
+  // the mapped index file or into OwnedBlockPositions.
+  std::unique_ptr<llvm::sys::fs::mapped_file_region> IndexFile;
+  llvm::ArrayRef<llvm::support::ulittle64_t> BlockPositions;
+  std::vector<llvm::support::ulittle64_t> OwnedBlockPositions;
+
+  llvm::ArrayRef<std::uint8_t> readBlock(std::uint64_t Pos,
+                                         llvm::ArrayRef<std::uint8_t> *CID);
   Node readValue(std::uint64_t *Pos, std::uint64_t Size);
+  llvm::Optional<llvm::ArrayRef<std::uint8_t>> findBlock(const CID &CID);
+
+  bool loadIndex(const std::string &Path);
+  void buildIndex(std::uint64_t Pos);
+  void writeIndex(const std::string &Path);
 
 public:
   void open(llvm::StringRef uri, bool create_if_missing);
-  ~CARStore() override;
 
   llvm::Optional<Node> getOptional(const CID &CID) override;
+  bool viewBytes(const CID &CID, std::function<void(BytesRef)> F) override;
   llvm::Optional<CID> resolveOptional(const Name &Name) override;
   std::vector<Name> list_names_using(const CID &ref) override;
   std::vector<std::string> list_funcs() override;
@@ -48,35 +76,38 @@ public:
 };
 } // end anonymous namespace
 
-bool CARStore::readBytes(llvm::MutableArrayRef<std::uint8_t> Buf,
-                         std::uint64_t *Pos) {
-  // We need to use pread() or equivalent because there may be multiple threads
-  // accessing the CARStore at once.
-  while (!Buf.empty()) {
-    llvm::ExitOnError Err("readNativeFileSlice: ");
-    size_t RC = Err(llvm::sys::fs::readNativeFileSlice(
-        FileHandle,
-        llvm::MutableArrayRef(reinterpret_cast<char *>(Buf.data()), Buf.size()),
-        *Pos));
-    if (RC == 0)
-      return false;
-    Buf = Buf.drop_front(RC);
-    *Pos += RC;
-  }
-  return true;
+// A sidecar index file, stored next to the CAR file with an ".index" suffix,
+// lets us open a CAR file without scanning all of it. It consists of the
+// magic bytes; the size, modification time, and edge hash of the CAR file it
+// was made for; and the offset of each block in the CAR file, sorted by CID.
+// All integers are little-endian 64-bit.
+static const char INDEX_MAGIC[8] = {'M', 'D', 'B', 'C', 'A', 'R', 'I', '1'};
+static const std::uint64_t INDEX_HEADER_SIZE = sizeof(INDEX_MAGIC) + 3 * 8;
+
+// The edge hash covers the start and end of the CAR file, where the header
+// and the root block are, so an index isn't used for a different CAR file
+// that happens to have the same size and modification time.
+static std::uint64_t hashEdges(llvm::ArrayRef<std::uint8_t> Data) {
+  const size_t EDGE_SIZE = 64 << 10;
+  if (Data.size() <= 2 * EDGE_SIZE)
+    return llvm::xxHash64(Data);
+  return llvm::xxHash64(Data.take_front(EDGE_SIZE)) ^
+         llvm::xxHash64(Data.take_back(EDGE_SIZE)) * 31;
 }
 
-std::optional<std::uint64_t> CARStore::readVarInt(std::uint64_t *Pos) {
+static std::optional<std::uint64_t>
+readVarInt(llvm::ArrayRef<std::uint8_t> &Bytes) {
   std::uint64_t Result = 0;
   for (unsigned Shift = 0; true; Shift += 7) {
     if (Shift >= 64 - 7)
       llvm::report_fatal_error("VarInt too large");
-    std::uint8_t Byte;
-    if (!readBytes(Byte, Pos)) {
+    if (Bytes.empty()) {
       if (Shift)
         llvm::report_fatal_error("Unexpected end of file in VarInt");
       return {};
     }
+    std::uint8_t Byte = Bytes.front();
+    Bytes = Bytes.drop_front();
     Result |= (std::uint64_t)(Byte & 0x7f) << Shift;
     if (!(Byte & 0x80)) {
       if (!Byte && Shift)
@@ -87,60 +118,177 @@ std::optional<std::uint64_t> CARStore::readVarInt(std::uint64_t *Pos) {
   return Result;
 }
 
-CID CARStore::readCID(std::uint64_t *Pos) {
-  std::uint64_t StartPos = *Pos;
-  auto CIDVersion = *readVarInt(Pos);
+// Return the block at Pos, not including the CID, and set *CID to the bytes
+// of its CID.
+llvm::ArrayRef<std::uint8_t>
+CARStore::readBlock(std::uint64_t Pos, llvm::ArrayRef<std::uint8_t> *CID) {
+  if (Pos >= Data.size())
+    llvm::report_fatal_error("Invalid block position");
+  auto Bytes = Data.drop_front(Pos);
+  auto BlockSize = *readVarInt(Bytes);
+  if (BlockSize > Bytes.size())
+    llvm::report_fatal_error("Unexpected end of file in block");
+  Bytes = Bytes.take_front(BlockSize);
+
+  auto Start = Bytes;
+  auto CIDVersion = readVarInt(Bytes);
   if (CIDVersion != 1)
     llvm::report_fatal_error("Unsupported CID version");
-  *readVarInt(Pos);
-  *readVarInt(Pos);
-  auto HashSize = *readVarInt(Pos);
-  *Pos += HashSize;
-  std::vector<std::uint8_t> Buffer(*Pos - StartPos);
-  if (!readBytes(Buffer, &StartPos))
-    llvm::report_fatal_error("Unexpected end of file in CID");
-  auto CID = CID::fromBytes(Buffer);
-  if (!CID)
-    llvm::report_fatal_error("Invalid CID");
-  return *CID;
+  readVarInt(Bytes);
+  readVarInt(Bytes);
+  auto HashSize = readVarInt(Bytes);
+  if (!HashSize || *HashSize > Bytes.size())
+    llvm::report_fatal_error("Invalid size of block");
+  Bytes = Bytes.drop_front(*HashSize);
+  *CID = Start.take_front(Start.size() - Bytes.size());
+  return Bytes;
 }
 
 Node CARStore::readValue(std::uint64_t *Pos, std::uint64_t Size) {
-  std::vector<std::uint8_t> Buf(Size);
-  if (!readBytes(Buf, Pos))
+  if (*Pos > Data.size() || Size > Data.size() - *Pos)
     llvm::report_fatal_error("Unexpected end of file in value");
+  auto Buf = Data.slice(*Pos, Size);
+  *Pos += Size;
   return llvm::cantFail(Node::loadFromCBOR(*this, Buf));
 }
 
+bool CARStore::loadIndex(const std::string &Path) {
+  int FD;
+  if (llvm::sys::fs::openFileForRead(Path, FD))
+    return false;
+  llvm::sys::fs::file_status Status;
+  std::error_code EC = llvm::sys::fs::status(FD, Status);
+  std::uint64_t Size = EC ? 0 : Status.getSize();
+  const std::uint64_t HeaderSize = INDEX_HEADER_SIZE;
+  if (Size < HeaderSize || (Size - HeaderSize) % 8) {
+    llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+    return false;
+  }
+  auto Region = std::make_unique<llvm::sys::fs::mapped_file_region>(
+      llvm::sys::fs::convertFDToNativeFile(FD),
+      llvm::sys::fs::mapped_file_region::readonly, Size, 0, EC);
+  llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+  if (EC)
+    return false;
+
+  const char *Bytes = Region->const_data();
+  if (std::memcmp(Bytes, INDEX_MAGIC, sizeof(INDEX_MAGIC)))
+    return false;
+  // If the CAR file has been replaced, the index is stale.
+  const char *Header = Bytes + sizeof(INDEX_MAGIC);
+  if (llvm::support::endian::read64le(Header) != Data.size() ||
+      llvm::support::endian::read64le(Header + 8) != ModificationTime ||
+      llvm::support::endian::read64le(Header + 16) != EdgeHash)
+    return false;
+  BlockPositions = llvm::makeArrayRef(
+      reinterpret_cast<const llvm::support::ulittle64_t *>(Bytes + HeaderSize),
+      (Size - HeaderSize) / 8);
+  IndexFile = std::move(Region);
+  return true;
+}
+
+void CARStore::buildIndex(std::uint64_t Pos) {
+  std::vector<std::pair<llvm::ArrayRef<std::uint8_t>, std::uint64_t>> Blocks;
+  while (Pos < Data.size()) {
+    llvm::ArrayRef<std::uint8_t> CID;
+    auto Content = readBlock(Pos, &CID);
+    Blocks.emplace_back(CID, Pos);
+    Pos = Content.end() - Data.begin();
+  }
+
+  // The padding block may be a duplicate of another block, so we need to
+  // remove duplicate CIDs.
+  auto CIDLess = [](const auto &A, const auto &B) {
+    return std::lexicographical_compare(A.first.begin(), A.first.end(),
+                                        B.first.begin(), B.first.end());
+  };
+  std::stable_sort(Blocks.begin(), Blocks.end(), CIDLess);
+  Blocks.erase(std::unique(Blocks.begin(), Blocks.end(),
+                           [](const auto &A, const auto &B) {
+                             return A.first == B.first;
+                           }),
+               Blocks.end());
+
+  OwnedBlockPositions.clear();
+  OwnedBlockPositions.reserve(Blocks.size());
+  for (const auto &Block : Blocks)
+    OwnedBlockPositions.emplace_back(Block.second);
+  BlockPositions = OwnedBlockPositions;
+}
+
+void CARStore::writeIndex(const std::string &Path) {
+  // Write to a temporary file and rename it, so other processes never see a
+  // partially written index.
+  llvm::ExitOnError Err("CARStore::writeIndex: ");
+  auto Temp = Err(llvm::sys::fs::TempFile::create(Path + ".tmp-%%%%%%"));
+  {
+    llvm::raw_fd_ostream OS(Temp.FD, /*shouldClose*/ false);
+    OS.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    for (std::uint64_t Value : {std::uint64_t(Data.size()), ModificationTime,
+                                EdgeHash})
+      llvm::support::endian::write<std::uint64_t>(OS, Value,
+                                                  llvm::support::little);
+    OS.write(reinterpret_cast<const char *>(BlockPositions.data()),
+             BlockPositions.size() * sizeof(BlockPositions[0]));
+  }
+  Err(Temp.keep(Path));
+}
+
 void CARStore::open(llvm::StringRef uri, bool create_if_missing) {
   llvm::ExitOnError Err("CARStore::open: ");
   auto Parsed = URI::parse(uri, /*allow_dot_segments*/ true);
   if (!Parsed || Parsed->scheme != "car" || !Parsed->host.empty() ||
-      Parsed->port != 0 || !Parsed->query_params.empty() ||
-      !Parsed->fragment.empty())
+      Parsed->port != 0 || !Parsed->fragment.empty())
     llvm::report_fatal_error("Unsupported CAR URI");
-  FileHandle = Err(llvm::sys::fs::openNativeFile(
-      Parsed->getPathString(), llvm::sys::fs::CD_OpenExisting,
-      llvm::sys::fs::FA_Read, llvm::sys::fs::OF_None));
 
-  std::uint64_t Pos = 0;
-  auto HeaderSize = *readVarInt(&Pos);
+  // index=auto (the default) uses the sidecar index if it's up to date.
+  // index=write also creates or updates the sidecar index if necessary.
+  // index=none always scans the CAR file.
+  llvm::StringRef IndexMode = "auto";
+  for (llvm::StringRef Param : Parsed->query_params) {
+    if (!Param.consume_front("index="))
+      llvm::report_fatal_error("Unsupported CAR URI");
+    IndexMode = Param;
+  }
+  if (IndexMode != "auto" && IndexMode != "write" && IndexMode != "none")
+    llvm::report_fatal_error("Unsupported CAR index mode");
+
+  std::string Path = Parsed->getPathString();
+  int FD;
+  if (std::error_code EC = llvm::sys::fs::openFileForRead(Path, FD))
+    Err(llvm::errorCodeToError(EC));
+  llvm::sys::fs::file_status Status;
+  if (std::error_code EC = llvm::sys::fs::status(FD, Status))
+    Err(llvm::errorCodeToError(EC));
+  if (Status.getSize() == 0)
+    llvm::report_fatal_error("Unexpected end of file in VarInt");
+  std::error_code EC;
+  File = std::make_unique<llvm::sys::fs::mapped_file_region>(
+      llvm::sys::fs::convertFDToNativeFile(FD),
+      llvm::sys::fs::mapped_file_region::readonly, Status.getSize(), 0, EC);
+  llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+  if (EC)
+    Err(llvm::errorCodeToError(EC));
+  Data = llvm::makeArrayRef(
+      reinterpret_cast<const std::uint8_t *>(File->const_data()),
+      File->size());
+  ModificationTime =
+      Status.getLastModificationTime().time_since_epoch().count();
+  EdgeHash = hashEdges(Data);
+
+  auto Bytes = Data;
+  auto HeaderSize = *readVarInt(Bytes);
+  std::uint64_t Pos = Bytes.begin() - Data.begin();
   auto Header = readValue(&Pos, HeaderSize);
   if (Header["version"] != 1 || Header["roots"].size() != 1)
     llvm::report_fatal_error("Unsupported CAR header");
   CID RootRef = Header["roots"][0].as<CID>();
 
-  while (true) {
-    auto BlockStart = Pos;
-    auto BlockSize = readVarInt(&Pos);
-    if (!BlockSize)
-      break;
-    auto BlockEnd = Pos + *BlockSize;
-    CID CID = readCID(&Pos);
-    if (Pos > BlockEnd)
-      llvm::report_fatal_error("Invalid size of block");
-    BlockPositions[std::move(CID)] = BlockStart;
-    Pos = BlockEnd;
+  std::string IndexPath = Path + ".index";
+  if (IndexMode == "none" || !loadIndex(IndexPath)) {
+    buildIndex(Pos);
+    if (IndexMode == "write")
+      writeIndex(IndexPath);
   }
 
   Root = get(RootRef);
@@ -148,26 +296,43 @@ void CARStore::open(llvm::StringRef uri, bool create_if_missing) {
     llvm::report_fatal_error("Unsupported MemoDB CAR version");
 }
 
-CARStore::~CARStore() {
-  // ignore errors
-  llvm::sys::fs::closeFile(FileHandle);
+llvm::Optional<llvm::ArrayRef<std::uint8_t>>
+CARStore::findBlock(const CID &CID) {
+  auto Key = CID.asBytes();
+  llvm::ArrayRef<std::uint8_t> FoundCID;
+  auto Iter = std::partition_point(
+      BlockPositions.begin(), BlockPositions.end(), [&](std::uint64_t Pos) {
+        (void)readBlock(Pos, &FoundCID);
+        return std::lexicographical_compare(FoundCID.begin(), FoundCID.end(),
+                                            Key.begin(), Key.end());
+      });
+  if (Iter == BlockPositions.end())
+    return {};
+  auto Content = readBlock(*Iter, &FoundCID);
+  if (FoundCID != Key)
+    return {};
+  return Content;
 }
 
 llvm::Optional<Node> CARStore::getOptional(const CID &CID) {
   if (CID.isIdentity())
     return llvm::cantFail(Node::loadFromIPLD(*this, CID, {}));
-  if (!BlockPositions.count(CID))
+  auto Content = findBlock(CID);
+  if (!Content)
     return {};
-  auto Pos = BlockPositions[CID];
-  auto BlockSize = *readVarInt(&Pos);
-  auto BlockEnd = Pos + BlockSize;
-  ::CID CIDFromFile = readCID(&Pos);
-  if (CID != CIDFromFile)
-    llvm::report_fatal_error("CID mismatch (file changed while reading?)");
-  std::vector<std::uint8_t> Buffer(BlockEnd - Pos);
-  if (!readBytes(Buffer, &Pos))
-    llvm::report_fatal_error("Unexpected end of file in content");
-  return llvm::cantFail(Node::loadFromIPLD(*this, CID, Buffer));
+  return llvm::cantFail(Node::loadFromIPLD(*this, CID, *Content));
+}
+
+bool CARStore::viewBytes(const CID &CID, std::function<void(BytesRef)> F) {
+  llvm::Optional<llvm::ArrayRef<std::uint8_t>> Content;
+  if (!CID.isIdentity() && !(Content = findBlock(CID)))
+    return false;
+  // The content is read straight from the mapped file.
+  std::optional<Node> Storage;
+  F(llvm::cantFail(Node::viewBytesFromIPLD(*this, CID,
+                                           Content.getValueOr(BytesRef()),
+                                           Storage)));
+  return true;
 }
 
 llvm::Optional<memodb::CID> CARStore::resolveOptional(const Name &Name) {
@@ -256,8 +421,161 @@ std::unique_ptr<Store> memodb_car_open(llvm::StringRef path,
   return db;
 }
 
-CID memodb::exportToCARFile(llvm::raw_fd_ostream &os, Store &store,
-                            llvm::ArrayRef<Name> names_to_export) {
+namespace {
+// Fetches Nodes from a store using several threads, ahead of the thread that
+// writes them. The writer requests Nodes in the reverse of the order it will
+// take them, so the most recently requested Nodes are fetched first.
+class Prefetcher {
+public:
+  Prefetcher(Store &store, const CARExportOptions &options);
+  ~Prefetcher();
+
+  void request(const CID &cid);
+  Node take(const CID &cid);
+
+private:
+  struct Entry {
+    std::optional<Node> node;
+    bool fetching = false;
+  };
+
+  static llvm::StringRef getKey(const CID &cid);
+  void work();
+
+  Store &store;
+  std::size_t limit;
+  std::vector<std::thread> threads;
+
+  std::mutex mutex;
+  std::condition_variable work_cv, ready_cv;
+  // The following fields are protected by mutex.
+  std::vector<CID> queue;
+  llvm::StringMap<Entry> entries;
+  // The number of Nodes fetched or being fetched, but not taken yet.
+  std::size_t num_ahead = 0;
+  bool stopping = false;
+};
+} // end anonymous namespace
+
+Prefetcher::Prefetcher(Store &store, const CARExportOptions &options)
+    : store(store), limit(std::max(options.prefetch_limit, std::size_t(1))) {
+  for (unsigned i = 0; i < options.num_threads; ++i)
+    threads.emplace_back([this]() { work(); });
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  work_cv.notify_all();
+  for (auto &thread : threads)
+    thread.join();
+}
+
+llvm::StringRef Prefetcher::getKey(const CID &cid) {
+  auto bytes = cid.asBytes();
+  return llvm::StringRef(reinterpret_cast<const char *>(bytes.data()),
+                         bytes.size());
+}
+
+void Prefetcher::request(const CID &cid) {
+  if (threads.empty())
+    return;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (entries.try_emplace(getKey(cid)).second) {
+    queue.push_back(cid);
+    work_cv.notify_one();
+  }
+}
+
+Node Prefetcher::take(const CID &cid) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto iter = entries.find(getKey(cid));
+  if (iter != entries.end() && iter->second.fetching) {
+    // Other threads may insert entries while we wait, which can rehash the
+    // map and invalidate iter, but the Entry itself stays put.
+    Entry *entry = &iter->second;
+    ready_cv.wait(lock, [&]() { return entry->node.has_value(); });
+    Node node = std::move(*entry->node);
+    entries.erase(getKey(cid));
+    --num_ahead;
+    work_cv.notify_one();
+    return node;
+  }
+  // Don't wait for a thread to start fetching it. A worker that finds the
+  // CID in the queue later will just skip it.
+  if (iter != entries.end())
+    entries.erase(iter);
+  lock.unlock();
+  return store.get(cid);
+}
+
+void Prefetcher::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    work_cv.wait(lock, [this]() {
+      return stopping || (!queue.empty() && num_ahead < limit);
+    });
+    if (stopping)
+      return;
+    CID cid = queue.back();
+    queue.pop_back();
+    auto iter = entries.find(getKey(cid));
+    // The entry may have been taken by the writer already, or the CID may
+    // have been requested again after that and be queued twice.
+    if (iter == entries.end() || iter->second.fetching)
+      continue;
+    // Keep a pointer to the Entry rather than iter, which may be invalidated
+    // if another thread rehashes the map while we're unlocked. The Entry
+    // can't be erased until its node has been set.
+    Entry *entry = &iter->second;
+    entry->fetching = true;
+    ++num_ahead;
+    lock.unlock();
+    Node node = store.get(cid);
+    lock.lock();
+    entry->node = std::move(node);
+    ready_cv.notify_all();
+  }
+}
+
+// Find the blocks that were written by an interrupted export, starting at
+// Pos. Stops at the first block that is incomplete, and sets Pos to its
+// position.
+static std::vector<std::pair<CID, llvm::ArrayRef<std::uint8_t>>>
+scanPartialBlocks(llvm::ArrayRef<std::uint8_t> Data, std::uint64_t &Pos) {
+  std::vector<std::pair<CID, llvm::ArrayRef<std::uint8_t>>> Result;
+  while (Pos < Data.size()) {
+    auto Bytes = Data.drop_front(Pos);
+    std::uint64_t BlockSize = 0;
+    bool Valid = false;
+    for (unsigned Shift = 0; !Bytes.empty() && Shift < 64; Shift += 7) {
+      std::uint8_t Byte = Bytes.front();
+      Bytes = Bytes.drop_front();
+      BlockSize |= (std::uint64_t)(Byte & 0x7f) << Shift;
+      if (!(Byte & 0x80)) {
+        Valid = true;
+        break;
+      }
+    }
+    if (!Valid || BlockSize == 0 || BlockSize > Bytes.size())
+      break;
+    Bytes = Bytes.take_front(BlockSize);
+    auto CID = CID::loadFromSequence(Bytes);
+    if (!CID)
+      break;
+    Result.emplace_back(*CID, Bytes);
+    Pos = Bytes.end() - Data.begin();
+  }
+  return Result;
+}
+
+// If ResumeFD isn't -1, it must be a readable descriptor for the file that
+// os writes to.
+static CID exportToCAR(llvm::raw_fd_ostream &os, int ResumeFD, Store &store,
+                       llvm::ArrayRef<Name> names_to_export,
+                       const CARExportOptions &options) {
   // Create a CAR file:
   // https://github.com/ipld/specs/blob/master/block-layer/content-addressable-archives.md
 
@@ -294,26 +612,118 @@ CID memodb::exportToCARFile(llvm::raw_fd_ostream &os, Store &store,
   // everything. Leave an empty space which will be filled with header +
   // padding later. The header is normally 0x3d bytes, so this gives us plenty
   // of room.
-  os.write_zeros(0x200);
-  auto DataStartPos = os.tell();
+  const std::uint64_t DataStartPos = 0x200;
+
+  // When resuming, the blocks that were already written must be exactly the
+  // ones we would write first, because the order is deterministic. Instead of
+  // fetching them from the store again, we read them back from the file.
+  std::unique_ptr<llvm::sys::fs::mapped_file_region> ExistingFile;
+  std::vector<std::pair<CID, llvm::ArrayRef<std::uint8_t>>> ExistingBlocks;
+  std::uint64_t ResumePos = DataStartPos;
+  if (ResumeFD >= 0) {
+    llvm::ExitOnError Err("exportToCARFile: ");
+    os.flush();
+    llvm::sys::fs::file_status Status;
+    if (std::error_code EC = llvm::sys::fs::status(ResumeFD, Status))
+      Err(llvm::errorCodeToError(EC));
+    if (Status.getSize() > DataStartPos) {
+      std::error_code EC;
+      ExistingFile = std::make_unique<llvm::sys::fs::mapped_file_region>(
+          llvm::sys::fs::convertFDToNativeFile(ResumeFD),
+          llvm::sys::fs::mapped_file_region::readonly, Status.getSize(), 0, EC);
+      if (EC)
+        Err(llvm::errorCodeToError(EC));
+      auto Bytes = reinterpret_cast<const std::uint8_t *>(
+          ExistingFile->const_data());
+      ExistingBlocks = scanPartialBlocks(
+          llvm::makeArrayRef(Bytes, ExistingFile->size()), ResumePos);
+    }
+    // Remove any incomplete block at the end.
+    if (std::error_code EC = llvm::sys::fs::resize_file(
+            ResumeFD, std::max<std::uint64_t>(ResumePos, DataStartPos)))
+      Err(llvm::errorCodeToError(EC));
+    if (!ExistingBlocks.empty())
+      llvm::errs() << "resuming after " << ExistingBlocks.size()
+                   << " blocks\n";
+  }
+  if (ExistingBlocks.empty()) {
+    os.seek(0);
+    os.write_zeros(DataStartPos);
+  } else {
+    os.seek(ResumePos);
+  }
+
+  Prefetcher Prefetcher(store, options);
+  llvm::StringSet<llvm::BumpPtrAllocator> AlreadyWritten;
+  std::size_t NextExisting = 0;
+  std::vector<CID> Stack;
 
-  std::set<CID> AlreadyWritten;
-  std::function<void(const CID &)> exportRef;
-  std::function<CID(const Node &)> exportValue;
+  auto getKey = [](const CID &Ref) {
+    auto Bytes = Ref.asBytes();
+    return llvm::StringRef(reinterpret_cast<const char *>(Bytes.data()),
+                           Bytes.size());
+  };
 
-  exportRef = [&](const CID &Ref) {
-    if (AlreadyWritten.insert(Ref).second)
-      exportValue(store.get(Ref));
+  auto pushRef = [&](const CID &Ref) {
+    if (AlreadyWritten.count(getKey(Ref)))
+      return;
+    Stack.push_back(Ref);
+    // Identity CIDs don't need to be fetched, and blocks that are already in
+    // the file will be read from it instead.
+    if (!Ref.isIdentity() && NextExisting == ExistingBlocks.size())
+      Prefetcher.request(Ref);
   };
 
-  exportValue = [&](const Node &Value) {
+  // Write the block for a Node (unless it's already in the file being
+  // resumed), and traverse its links depth-first.
+  auto writeValue = [&](const Node &Value) {
     auto Block = Value.saveAsIPLD();
-    if (!Block.first.isIdentity())
-      writeBlock(Block);
-    Value.eachLink(exportRef);
+    if (!Block.first.isIdentity()) {
+      if (NextExisting < ExistingBlocks.size()) {
+        if (ExistingBlocks[NextExisting].first != Block.first)
+          llvm::report_fatal_error(
+              "CAR file being resumed doesn't match the store");
+        if (++NextExisting == ExistingBlocks.size()) {
+          // From now on, prefetch everything that's waiting to be written.
+          for (const CID &Ref : Stack)
+            if (!Ref.isIdentity())
+              Prefetcher.request(Ref);
+        }
+      } else {
+        writeBlock(Block);
+      }
+    }
+    // Push the links in reverse, so they're written in order.
+    std::vector<CID> Links;
+    Value.eachLink([&](const CID &Link) { Links.push_back(Link); });
+    for (const CID &Link : llvm::reverse(Links))
+      pushRef(Link);
     return Block.first;
   };
 
+  auto getValue = [&](const CID &Ref) {
+    if (Ref.isIdentity())
+      return store.get(Ref);
+    if (NextExisting < ExistingBlocks.size()) {
+      if (ExistingBlocks[NextExisting].first != Ref)
+        llvm::report_fatal_error(
+            "CAR file being resumed doesn't match the store");
+      return llvm::cantFail(Node::loadFromIPLD(
+          store, Ref, ExistingBlocks[NextExisting].second));
+    }
+    return Prefetcher.take(Ref);
+  };
+
+  auto exportRef = [&](const CID &Ref) {
+    pushRef(Ref);
+    while (!Stack.empty()) {
+      CID Next = Stack.back();
+      Stack.pop_back();
+      if (AlreadyWritten.insert(getKey(Next)).second)
+        writeValue(getValue(Next));
+    }
+  };
+
   Node Root = Node(node_map_arg, {{"format", "MemoDB CAR"},
                                   {"version", 0},
                                   {"calls", Node(node_map_arg)},
@@ -366,7 +776,9 @@ CID memodb::exportToCARFile(llvm::raw_fd_ostream &os, Store &store,
     }
   }
 
-  CID RootRef = exportValue(Root);
+  CID RootRef = writeValue(Root);
+  if (NextExisting < ExistingBlocks.size())
+    llvm::report_fatal_error("CAR file being resumed doesn't match the store");
 
   Node Header = Node::Map(
       {{"roots", Node(node_list_arg, {Node(store, RootRef)})}, {"version", 1}});
@@ -400,3 +812,31 @@ CID memodb::exportToCARFile(llvm::raw_fd_ostream &os, Store &store,
 
   return RootRef;
 }
+
+CID memodb::exportToCARFile(llvm::raw_fd_ostream &os, Store &store,
+                            llvm::ArrayRef<Name> names_to_export,
+                            const CARExportOptions &options) {
+  if (options.resume)
+    llvm::report_fatal_error("can only resume exporting to a named file");
+  return exportToCAR(os, -1, store, names_to_export, options);
+}
+
+CID memodb::exportToCARFile(llvm::StringRef path, Store &store,
+                            llvm::ArrayRef<Name> names_to_export,
+                            const CARExportOptions &options) {
+  llvm::ExitOnError Err("exportToCARFile: ");
+  int FD;
+  if (std::error_code EC = llvm::sys::fs::openFileForReadWrite(
+          path, FD,
+          options.resume ? llvm::sys::fs::CD_OpenAlways
+                         : llvm::sys::fs::CD_CreateAlways,
+          llvm::sys::fs::OF_None))
+    Err(llvm::createFileError(path, EC));
+  llvm::raw_fd_ostream os(FD, /*shouldClose*/ true);
+  CID Result = exportToCAR(os, options.resume ? FD : -1, store,
+                           names_to_export, options);
+  os.close();
+  if (os.has_error())
+    Err(llvm::createFileError(path, os.error()));
+  return Result;
+}
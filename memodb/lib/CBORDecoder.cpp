@@ -0,0 +1,284 @@
+#include "memodb/CBORDecoder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <llvm/Support/ConvertUTF.h>
+#include <system_error>
+
+#include "memodb/CID.h"
+#include "memodb/Store.h"
+
+using namespace memodb;
+
+using std::int64_t;
+using std::uint64_t;
+using std::uint8_t;
+
+// Lengths come from untrusted input, so don't reserve more than this much
+// memory for a string or container until the data actually arrives.
+static constexpr uint64_t MAX_STRING_RESERVE = 1 << 24;
+static constexpr uint64_t MAX_ITEMS_RESERVE = 1 << 12;
+
+static llvm::Error createInvalidCBORError(llvm::StringRef message) {
+  return llvm::createStringError(
+      std::make_error_code(std::errc::invalid_argument),
+      "Invalid CBOR: " + message);
+}
+
+static llvm::Error createUnsupportedCBORError(llvm::StringRef message) {
+  return llvm::createStringError(std::make_error_code(std::errc::not_supported),
+                                 "Unsupported CBOR: " + message);
+}
+
+// Return the total size of a head, given its first byte.
+static size_t getHeadSize(uint8_t initial) {
+  int minor_type = initial & 0x1f;
+  if (minor_type >= 24 && minor_type < 28)
+    return 1 + (1 << (minor_type - 24));
+  return 1;
+}
+
+CBORDecoder::CBORDecoder(Store &store) : store(store) {}
+
+CBORDecoder::~CBORDecoder() {}
+
+double CBORDecoder::decodeFloat(uint64_t value, int total_size,
+                                int mantissa_size, int exponent_bias) {
+  uint64_t exponent_mask = (1ull << (total_size - mantissa_size - 1)) - 1;
+  uint64_t exponent = (value >> mantissa_size) & exponent_mask;
+  uint64_t mantissa = value & ((1ull << mantissa_size) - 1);
+  double result;
+  if (exponent == 0)
+    result =
+        std::ldexp(mantissa, 1 - (mantissa_size + exponent_bias)); // denormal
+  else if (exponent == exponent_mask)
+    result = mantissa == 0 ? INFINITY : NAN;
+  else
+    result = std::ldexp(mantissa + (1ull << mantissa_size),
+                        exponent - (mantissa_size + exponent_bias));
+  return value & (1ull << (total_size - 1)) ? -result : result;
+}
+
+llvm::Error CBORDecoder::feed(BytesRef in) {
+  while (!in.empty()) {
+    if (in_string_chunk) {
+      size_t size = std::min<uint64_t>(string_remaining, in.size());
+      appendString(in.take_front(size));
+      in = in.drop_front(size);
+      string_remaining -= size;
+      if (string_remaining == 0) {
+        in_string_chunk = false;
+        if (!string_indefinite)
+          if (auto error = endString())
+            return error;
+      }
+      continue;
+    }
+
+    if (result)
+      return llvm::createStringError(std::errc::invalid_argument,
+                                     "Extra bytes after CBOR node");
+
+    // Decode the head directly from the input if possible, and only buffer it
+    // if it's split between pieces.
+    BytesRef head_bytes;
+    if (head.empty() && in.size() >= getHeadSize(in.front())) {
+      head_bytes = in.take_front(getHeadSize(in.front()));
+      in = in.drop_front(head_bytes.size());
+    } else {
+      if (head.empty()) {
+        head.push_back(in.front());
+        in = in.drop_front();
+      }
+      size_t size =
+          std::min<size_t>(getHeadSize(head[0]) - head.size(), in.size());
+      head.append(in.begin(), in.begin() + size);
+      in = in.drop_front(size);
+      if (head.size() < getHeadSize(head[0]))
+        break;
+      head_bytes = head;
+    }
+
+    int major_type = head_bytes[0] >> 5;
+    int minor_type = head_bytes[0] & 0x1f;
+    uint64_t additional = minor_type < 24 ? minor_type : 0;
+    for (uint8_t byte : head_bytes.drop_front())
+      additional = additional << 8 | byte;
+    bool indefinite = minor_type == 31;
+    head.clear();
+    if (auto error = handleHead(major_type, minor_type, additional, indefinite))
+      return error;
+  }
+  return llvm::Error::success();
+}
+
+llvm::Error CBORDecoder::handleHead(int major_type, int minor_type,
+                                    uint64_t additional, bool indefinite) {
+  if (major_type == 7 && minor_type == 31) {
+    // Break: the end of an indefinite-length string or container.
+    if (in_string)
+      return endString();
+    if (!stack.empty() && stack.back().indefinite && !stack.back().key &&
+        !pending_cid) {
+      Frame frame = std::move(stack.back());
+      stack.pop_back();
+      if (frame.is_map)
+        return emit(Node(std::move(frame.map)));
+      return emit(Node(std::move(frame.list)));
+    }
+    return createInvalidCBORError("invalid minor type");
+  }
+
+  if (minor_type >= 28 && !(minor_type == 31 && major_type >= 2 &&
+                            major_type <= 5))
+    return createInvalidCBORError("invalid minor type");
+
+  if (in_string) {
+    // The next chunk of an indefinite-length string.
+    if (major_type != string_major_type || indefinite)
+      return createInvalidCBORError("invalid indefinite-length string");
+    string_remaining = additional;
+    in_string_chunk = additional > 0;
+    return llvm::Error::success();
+  }
+
+  if (pending_cid && major_type != 2)
+    return createInvalidCBORError("invalid kind in CID tag");
+
+  switch (major_type) {
+  case 0:
+    return emit(Node(additional));
+  case 1:
+    if (additional > uint64_t(std::numeric_limits<int64_t>::max()))
+      return createUnsupportedCBORError("integer too large");
+    return emit(Node(-int64_t(additional) - 1));
+  case 2:
+  case 3:
+    in_string = true;
+    string_major_type = major_type;
+    string_indefinite = indefinite;
+    string_is_cid = pending_cid;
+    pending_cid = false;
+    bytes.clear();
+    text.clear();
+    if (indefinite)
+      return llvm::Error::success();
+    if (major_type == 2)
+      bytes.reserve(std::min(additional, MAX_STRING_RESERVE));
+    else
+      text.reserve(std::min(additional, MAX_STRING_RESERVE));
+    string_remaining = additional;
+    in_string_chunk = additional > 0;
+    if (!in_string_chunk)
+      return endString();
+    return llvm::Error::success();
+  case 4:
+  case 5: {
+    Frame &frame = stack.emplace_back();
+    frame.is_map = major_type == 5;
+    frame.indefinite = indefinite;
+    frame.remaining = additional;
+    if (!indefinite && additional == 0) {
+      stack.pop_back();
+      return emit(major_type == 5 ? Node(Node::Map()) : Node(Node::List()));
+    }
+    if (!indefinite) {
+      if (frame.is_map)
+        frame.map.reserve(std::min(additional, MAX_ITEMS_RESERVE));
+      else
+        frame.list.reserve(std::min(additional, MAX_ITEMS_RESERVE));
+    }
+    return llvm::Error::success();
+  }
+  case 6:
+    if (additional != 42)
+      return createUnsupportedCBORError("unsupported tag");
+    pending_cid = true;
+    return llvm::Error::success();
+  case 7:
+    switch (minor_type) {
+    case 20:
+      return emit(Node(false));
+    case 21:
+      return emit(Node(true));
+    case 22:
+    case 23: // undefined
+      return emit(Node(nullptr));
+    case 25:
+      return emit(Node(decodeFloat(additional, 16, 10, 15)));
+    case 26:
+      return emit(Node(decodeFloat(additional, 32, 23, 127)));
+    case 27:
+      return emit(Node(decodeFloat(additional, 64, 52, 1023)));
+    }
+    return createUnsupportedCBORError("unsupported simple value");
+  default:
+    llvm_unreachable("impossible major type");
+  }
+}
+
+void CBORDecoder::appendString(BytesRef data) {
+  if (string_major_type == 2)
+    bytes.append(data.begin(), data.end());
+  else
+    text.append(data.begin(), data.end());
+}
+
+llvm::Error CBORDecoder::endString() {
+  in_string = false;
+  Node node;
+  if (string_major_type == 2) {
+    if (string_is_cid) {
+      if (bytes.empty() || bytes[0] != 0x00)
+        return createInvalidCBORError("missing CID prefix");
+      auto CID = CID::fromBytes(BytesRef(bytes).drop_front(1));
+      if (!CID)
+        return createUnsupportedCBORError("unsupported or invalid CID");
+      return emit(Node(store, *CID));
+    }
+    node.variant_ = std::move(bytes);
+  } else {
+    auto ptr = reinterpret_cast<const llvm::UTF8 *>(text.data());
+    if (!llvm::isLegalUTF8String(&ptr, ptr + text.size()))
+      return createInvalidCBORError("invalid UTF-8 in string value");
+    node.variant_ = std::move(text);
+  }
+  return emit(std::move(node));
+}
+
+llvm::Error CBORDecoder::emit(Node node) {
+  // Add the node to its parent, and repeat for every container it completes.
+  while (!stack.empty()) {
+    Frame &frame = stack.back();
+    if (frame.is_map && !frame.key) {
+      if (!node.is<llvm::StringRef>())
+        return createUnsupportedCBORError("map keys must be strings");
+      frame.key = node.as<llvm::StringRef>().str();
+      return llvm::Error::success();
+    }
+    if (frame.is_map) {
+      frame.map.insert_or_assign(*frame.key, std::move(node));
+      frame.key.reset();
+    } else {
+      frame.list.emplace_back(std::move(node));
+    }
+    if (frame.indefinite || --frame.remaining > 0)
+      return llvm::Error::success();
+    if (frame.is_map)
+      node = Node(std::move(frame.map));
+    else
+      node = Node(std::move(frame.list));
+    stack.pop_back();
+  }
+  result = std::move(node);
+  return llvm::Error::success();
+}
+
+llvm::Expected<Node> CBORDecoder::finish() {
+  if (!result || !head.empty() || in_string || pending_cid || !stack.empty())
+    return createInvalidCBORError("unexpected end of input");
+  Node node = std::move(*result);
+  result.reset();
+  return node;
+}
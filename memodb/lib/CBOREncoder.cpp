@@ -13,7 +13,30 @@ using std::int64_t;
 using std::uint64_t;
 using std::uint8_t;
 
-CBOREncoder::CBOREncoder(std::vector<uint8_t> &out) : out(out) {}
+namespace {
+// Unbuffered stream that appends to a byte vector, like
+// llvm::raw_svector_ostream.
+class raw_byte_vector_ostream : public llvm::raw_ostream {
+public:
+  explicit raw_byte_vector_ostream(std::vector<uint8_t> &out) : out(out) {
+    SetUnbuffered();
+  }
+
+private:
+  void write_impl(const char *ptr, size_t size) override {
+    out.insert(out.end(), ptr, ptr + size);
+  }
+  uint64_t current_pos() const override { return out.size(); }
+
+  std::vector<uint8_t> &out;
+};
+} // end anonymous namespace
+
+CBOREncoder::CBOREncoder(std::vector<uint8_t> &out)
+    : owned_out(std::make_unique<raw_byte_vector_ostream>(out)),
+      out(*owned_out) {}
+
+CBOREncoder::CBOREncoder(llvm::raw_ostream &out) : out(out) {}
 
 CBOREncoder::~CBOREncoder() {}
 
@@ -21,28 +44,34 @@ bool CBOREncoder::hasLinks() const { return has_links; }
 
 bool CBOREncoder::isValidDAGCBOR() const { return !not_dag_cbor; }
 
+void CBOREncoder::write(BytesRef bytes) {
+  out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+}
+
 void CBOREncoder::encodeHead(int major_type, uint64_t argument,
                              int force_additional) {
+  uint8_t head[9];
   int num_bytes;
   if (force_additional == 0 && argument < 24) {
-    out.push_back(major_type << 5 | argument);
+    head[0] = major_type << 5 | argument;
     num_bytes = 0;
   } else if (force_additional ? force_additional == 24 : argument < 0x100) {
-    out.push_back(major_type << 5 | 24);
+    head[0] = major_type << 5 | 24;
     num_bytes = 1;
   } else if (force_additional ? force_additional == 25 : argument < 0x10000) {
-    out.push_back(major_type << 5 | 25);
+    head[0] = major_type << 5 | 25;
     num_bytes = 2;
   } else if (force_additional ? force_additional == 26
                               : argument < 0x100000000) {
-    out.push_back(major_type << 5 | 26);
+    head[0] = major_type << 5 | 26;
     num_bytes = 4;
   } else {
-    out.push_back(major_type << 5 | 27);
+    head[0] = major_type << 5 | 27;
     num_bytes = 8;
   }
   for (int i = 0; i < num_bytes; i++)
-    out.push_back((argument >> 8 * (num_bytes - i - 1)) & 0xff);
+    head[i + 1] = (argument >> 8 * (num_bytes - i - 1)) & 0xff;
+  write(BytesRef(head, num_bytes + 1));
 }
 
 void CBOREncoder::visitNull() { encodeHead(7, 22); }
@@ -120,12 +149,12 @@ void CBOREncoder::visitFloat(double value) {
 
 void CBOREncoder::visitString(llvm::StringRef value) {
   encodeHead(3, value.size());
-  out.insert(out.end(), value.begin(), value.end());
+  out << value;
 }
 
 void CBOREncoder::visitBytes(BytesRef value) {
   encodeHead(2, value.size());
-  out.insert(out.end(), value.begin(), value.end());
+  write(value);
 }
 
 void CBOREncoder::visitLink(const Link &value) {
@@ -133,8 +162,8 @@ void CBOREncoder::visitLink(const Link &value) {
   auto bytes = value.getCID().asBytes();
   encodeHead(6, 42); // CID tag
   encodeHead(2, bytes.size() + 1);
-  out.push_back(0x00); // DAG-CBOR requires multibase prefix
-  out.insert(out.end(), bytes.begin(), bytes.end());
+  out << '\0'; // DAG-CBOR requires multibase prefix
+  write(bytes);
   has_links = true;
 }
 
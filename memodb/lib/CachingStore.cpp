@@ -0,0 +1,341 @@
+#include "memodb/CachingStore.h"
+
+#include <array>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <llvm/ADT/Hashing.h>
+#include <llvm/Support/xxhash.h>
+
+using namespace memodb;
+
+namespace {
+struct CIDHash {
+  std::size_t operator()(const CID &cid) const {
+    return llvm::xxHash64(cid.asBytes());
+  }
+};
+
+struct CallHash {
+  std::size_t operator()(const Call &call) const {
+    std::size_t result = llvm::xxHash64(call.Name);
+    for (const CID &arg : call.Args)
+      result = llvm::hash_combine(result, llvm::xxHash64(arg.asBytes()));
+    return result;
+  }
+};
+
+// A size-bounded LRU map, split into shards that each have their own lock.
+template <typename Key, typename Value, typename Hash> class ShardedLRU {
+public:
+  explicit ShardedLRU(std::size_t capacity)
+      : shard_capacity(capacity / NUM_SHARDS) {}
+
+  llvm::Optional<Value> lookup(const Key &key) {
+    Shard &shard = getShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.index.find(key);
+    if (iter == shard.index.end())
+      return llvm::None;
+    // Move the entry to the front of the list.
+    shard.entries.splice(shard.entries.begin(), shard.entries, iter->second);
+    return iter->second->value;
+  }
+
+  void insert(const Key &key, Value value, std::size_t size) {
+    Shard &shard = getShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.index.find(key);
+    if (iter != shard.index.end()) {
+      shard.size -= iter->second->size;
+      shard.entries.erase(iter->second);
+      shard.index.erase(iter);
+    }
+    if (size > shard_capacity)
+      return;
+    shard.entries.push_front(Entry{key, std::move(value), size});
+    shard.index[key] = shard.entries.begin();
+    shard.size += size;
+    while (shard.size > shard_capacity) {
+      Entry &victim = shard.entries.back();
+      shard.size -= victim.size;
+      shard.index.erase(victim.key);
+      shard.entries.pop_back();
+    }
+  }
+
+  template <typename Pred> void eraseIf(Pred pred) {
+    for (Shard &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for (auto iter = shard.entries.begin(); iter != shard.entries.end();) {
+        if (pred(iter->key)) {
+          shard.size -= iter->size;
+          shard.index.erase(iter->key);
+          iter = shard.entries.erase(iter);
+        } else {
+          ++iter;
+        }
+      }
+    }
+  }
+
+  void clear() {
+    eraseIf([](const Key &) { return true; });
+  }
+
+private:
+  static constexpr std::size_t NUM_SHARDS = 16;
+
+  struct Entry {
+    Key key;
+    Value value;
+    std::size_t size;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    // Most recently used entries first.
+    std::list<Entry> entries;
+    std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> index;
+    std::size_t size = 0;
+  };
+
+  Shard &getShard(const Key &key) { return shards[Hash()(key) % NUM_SHARDS]; }
+
+  std::size_t shard_capacity;
+  std::array<Shard, NUM_SHARDS> shards;
+};
+} // end anonymous namespace
+
+// Approximate memory usage of a Node, including its children.
+static std::size_t estimateSize(const Node &node) {
+  std::size_t size = sizeof(Node);
+  switch (node.kind()) {
+  case Kind::String:
+    size += node.as<llvm::StringRef>().size();
+    break;
+  case Kind::Bytes:
+    size += node.as<BytesRef>().size();
+    break;
+  case Kind::List:
+    for (const Node &item : node.list_range())
+      size += estimateSize(item);
+    break;
+  case Kind::Map:
+    for (const auto &item : node.map_range())
+      size += item.key().size() + estimateSize(item.value());
+    break;
+  case Kind::Link:
+    size += node.as<CID>().asBytes().size();
+    break;
+  default:
+    break;
+  }
+  return size;
+}
+
+static std::size_t estimateSize(const Call &call) {
+  std::size_t size = sizeof(Call) + sizeof(CID) + call.Name.size();
+  for (const CID &arg : call.Args)
+    size += sizeof(CID) + arg.asBytes().size();
+  return size;
+}
+
+class CachingStore::Cache {
+public:
+  explicit Cache(std::size_t capacity)
+      : nodes(capacity - capacity / 4), calls(capacity / 4) {}
+
+  ShardedLRU<CID, std::shared_ptr<const Node>, CIDHash> nodes;
+  ShardedLRU<Call, CID, CallHash> calls;
+
+  llvm::Optional<Node> lookupNode(const CID &cid) {
+    if (auto node = nodes.lookup(cid))
+      return **node;
+    return llvm::None;
+  }
+
+  void insertNode(const CID &cid, const Node &node) {
+    nodes.insert(cid, std::make_shared<const Node>(node), estimateSize(node));
+  }
+
+  llvm::Optional<CID> lookupCall(const Name &name) {
+    if (const Call *call = std::get_if<Call>(&name))
+      return calls.lookup(*call);
+    return llvm::None;
+  }
+
+  void insertCall(const Name &name, const CID &result) {
+    if (const Call *call = std::get_if<Call>(&name))
+      calls.insert(*call, result, estimateSize(*call));
+  }
+};
+
+CachingStore::CachingStore(std::unique_ptr<Store> inner, std::size_t capacity)
+    : owned_inner(std::move(inner)), inner(*owned_inner),
+      cache(std::make_unique<Cache>(capacity)) {}
+
+CachingStore::CachingStore(Store &inner, std::size_t capacity)
+    : inner(inner), cache(std::make_unique<Cache>(capacity)) {}
+
+CachingStore::~CachingStore() {}
+
+llvm::Optional<Node> CachingStore::getOptional(const CID &CID) {
+  // Identity CIDs contain the whole Node already.
+  if (CID.isIdentity())
+    return inner.getOptional(CID);
+  if (auto node = cache->lookupNode(CID))
+    return node;
+  auto node = inner.getOptional(CID);
+  if (node)
+    cache->insertNode(CID, *node);
+  return node;
+}
+
+llvm::Optional<CID> CachingStore::resolveOptional(const Name &Name) {
+  if (auto cid = cache->lookupCall(Name))
+    return cid;
+  auto cid = inner.resolveOptional(Name);
+  if (cid)
+    cache->insertCall(Name, *cid);
+  return cid;
+}
+
+CID CachingStore::put(const Node &value) { return inner.put(value); }
+
+void CachingStore::set(const Name &Name, const CID &ref) {
+  inner.set(Name, ref);
+  cache->insertCall(Name, ref);
+}
+
+std::vector<Name> CachingStore::list_names_using(const CID &ref) {
+  return inner.list_names_using(ref);
+}
+
+std::vector<std::string> CachingStore::list_funcs() {
+  return inner.list_funcs();
+}
+
+void CachingStore::eachHead(std::function<bool(const Head &)> F) {
+  inner.eachHead(std::move(F));
+}
+
+void CachingStore::eachCall(llvm::StringRef Func,
+                            std::function<bool(const Call &)> F) {
+  inner.eachCall(Func, std::move(F));
+}
+
+void CachingStore::head_delete(const Head &Head) { inner.head_delete(Head); }
+
+void CachingStore::call_invalidate(llvm::StringRef name) {
+  inner.call_invalidate(name);
+  cache->calls.eraseIf([&](const Call &call) { return call.Name == name; });
+}
+
+bool CachingStore::has(const CID &CID) {
+  if (!CID.isIdentity() && cache->nodes.lookup(CID))
+    return true;
+  return inner.has(CID);
+}
+
+bool CachingStore::has(const Name &Name) {
+  if (cache->lookupCall(Name))
+    return true;
+  return inner.has(Name);
+}
+
+std::vector<llvm::Optional<Node>>
+CachingStore::getMany(llvm::ArrayRef<CID> CIDs) {
+  std::vector<llvm::Optional<Node>> result(CIDs.size());
+  std::vector<CID> missing;
+  std::vector<std::size_t> missing_indexes;
+  for (std::size_t i = 0; i < CIDs.size(); i++) {
+    if (!CIDs[i].isIdentity())
+      result[i] = cache->lookupNode(CIDs[i]);
+    if (!result[i]) {
+      missing.push_back(CIDs[i]);
+      missing_indexes.push_back(i);
+    }
+  }
+  if (missing.empty())
+    return result;
+  auto fetched = inner.getMany(missing);
+  for (std::size_t i = 0; i < missing.size(); i++) {
+    if (fetched[i] && !missing[i].isIdentity())
+      cache->insertNode(missing[i], *fetched[i]);
+    result[missing_indexes[i]] = std::move(fetched[i]);
+  }
+  return result;
+}
+
+std::vector<CID> CachingStore::putMany(llvm::ArrayRef<Node> values) {
+  return inner.putMany(values);
+}
+
+std::vector<bool> CachingStore::hasMany(llvm::ArrayRef<CID> CIDs) {
+  std::vector<bool> result(CIDs.size());
+  std::vector<CID> missing;
+  std::vector<std::size_t> missing_indexes;
+  for (std::size_t i = 0; i < CIDs.size(); i++) {
+    if (!CIDs[i].isIdentity() && cache->nodes.lookup(CIDs[i])) {
+      result[i] = true;
+    } else {
+      missing.push_back(CIDs[i]);
+      missing_indexes.push_back(i);
+    }
+  }
+  if (missing.empty())
+    return result;
+  auto fetched = inner.hasMany(missing);
+  for (std::size_t i = 0; i < missing.size(); i++)
+    result[missing_indexes[i]] = fetched[i];
+  return result;
+}
+
+std::vector<llvm::Optional<CID>>
+CachingStore::resolveMany(llvm::ArrayRef<Name> Names) {
+  std::vector<llvm::Optional<CID>> result(Names.size());
+  std::vector<Name> missing;
+  std::vector<std::size_t> missing_indexes;
+  for (std::size_t i = 0; i < Names.size(); i++) {
+    result[i] = cache->lookupCall(Names[i]);
+    if (!result[i]) {
+      missing.push_back(Names[i]);
+      missing_indexes.push_back(i);
+    }
+  }
+  if (missing.empty())
+    return result;
+  auto fetched = inner.resolveMany(missing);
+  for (std::size_t i = 0; i < missing.size(); i++) {
+    if (fetched[i])
+      cache->insertCall(missing[i], *fetched[i]);
+    result[missing_indexes[i]] = std::move(fetched[i]);
+  }
+  return result;
+}
+
+std::vector<std::vector<Name>>
+CachingStore::listNamesUsingMany(llvm::ArrayRef<CID> CIDs) {
+  return inner.listNamesUsingMany(CIDs);
+}
+
+std::size_t CachingStore::collectGarbage(std::chrono::seconds grace_period) {
+  std::size_t num_deleted = inner.collectGarbage(grace_period);
+  // We don't know which Nodes were deleted.
+  cache->nodes.clear();
+  return num_deleted;
+}
+
+bool CachingStore::beginBatch() { return beginBatchOn(inner); }
+
+void CachingStore::commitBatch() { commitBatchOn(inner); }
+
+void CachingStore::abortBatch() {
+  abortBatchOn(inner);
+  // Some Calls we cached may have been rolled back.
+  cache->calls.clear();
+}
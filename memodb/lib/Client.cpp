@@ -3,6 +3,7 @@
 #include <atomic>
 #include <chrono>
 #include <cstddef>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -13,24 +14,30 @@
 #include <vector>
 
 #include <boost/asio/connect.hpp>
+#include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/fiber/all.hpp>
 #include <llvm/ADT/ArrayRef.h>
-#include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/Optional.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/ScopeExit.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include "memodb/CBORBody.h"
 #include "memodb/CID.h"
+#include "memodb/CachingStore.h"
 #include "memodb/Evaluator.h"
 #include "memodb/Multibase.h"
 #include "memodb/Store.h"
+#include "memodb/TieredStore.h"
 #include "memodb/URI.h"
 
 using namespace memodb;
@@ -42,8 +49,6 @@ namespace this_fiber = boost::this_fiber;
 using tcp = net::ip::tcp;
 namespace local = net::local;
 using llvm::ArrayRef;
-using llvm::cantFail;
-using llvm::DenseMap;
 using llvm::raw_svector_ostream;
 using llvm::report_fatal_error;
 using llvm::SmallVector;
@@ -51,7 +56,8 @@ using llvm::StringRef;
 using llvm::Twine;
 
 using BeastRequest = http::request<http::vector_body<std::uint8_t>>;
-using BeastResponse = http::response<http::vector_body<std::uint8_t>>;
+// Response bodies are decoded while they're received; see CBORBody.
+using BeastResponse = http::response<CBORBody>;
 
 namespace {
 struct Response {
@@ -64,12 +70,63 @@ struct Response {
 };
 } // end anonymous namespace
 
+// Called on the I/O thread when an asynchronous operation finishes.
+using IOHandler = std::function<void(beast::error_code)>;
+
 namespace {
+// An HTTP connection, which may be shared by several requests at once using
+// HTTP pipelining. The socket and the request queues are only accessed by the
+// HTTPStore's I/O thread; fibers waiting for a response are suspended, so
+// other fibers on the same thread can keep running.
 class Connection {
 public:
   virtual ~Connection() {}
-  virtual void write(const BeastRequest &req) = 0;
-  virtual void read(beast::flat_buffer &buffer, BeastResponse &res) = 0;
+
+  // Start sending a request. The result is set when the response has been
+  // received into \p res. Requests are sent in the order start() is called,
+  // without waiting for the responses to previous requests.
+  fibers::future<beast::error_code> start(const BeastRequest &req,
+                                          BeastResponse &res);
+
+  // Send a request and wait for its response.
+  void request(const BeastRequest &req, BeastResponse &res);
+
+  // Used by HTTPStore to keep track of how the connection is being used.
+  // Protected by HTTPStore::pool_mutex.
+  unsigned num_outstanding = 0;
+  // True if the current request can't be pipelined with other requests.
+  bool exclusive = false;
+  // True if the current request is a long polling request.
+  bool long_poll = false;
+
+  // Close the connection, aborting any requests in progress. The Connection
+  // must not be used for new requests afterward.
+  virtual void close() = 0;
+
+protected:
+  // Start writing or reading on the I/O thread, and call the handler there
+  // when the operation finishes.
+  virtual void asyncWrite(const BeastRequest &req, IOHandler handler) = 0;
+  virtual void asyncRead(BeastResponse &res, IOHandler handler) = 0;
+  virtual void post(std::function<void()> f) = 0;
+
+  // Holds data received after the end of the current response.
+  beast::flat_buffer buffer;
+
+private:
+  struct Pending {
+    const BeastRequest *req;
+    BeastResponse *res;
+    IOHandler handler;
+  };
+
+  void writeNext();
+  void readNext();
+
+  // Requests that haven't been written yet, and requests that are waiting
+  // for responses, in order. The front of each queue is being written or
+  // read.
+  std::deque<Pending> write_queue, read_queue;
 };
 } // end anonymous namespace
 
@@ -84,16 +141,86 @@ public:
 
   ~ProtocolConnection() override {}
 
-  void write(const BeastRequest &req) override { http::write(stream, req); }
+  beast::basic_stream<Protocol> stream;
 
-  void read(beast::flat_buffer &buffer, BeastResponse &res) override {
-    http::read(stream, buffer, res);
+protected:
+  void asyncWrite(const BeastRequest &req, IOHandler handler) override {
+    http::async_write(
+        stream, req,
+        [handler](beast::error_code ec, std::size_t) { handler(ec); });
   }
 
-  beast::basic_stream<Protocol> stream;
+  void asyncRead(BeastResponse &res, IOHandler handler) override {
+    // Results can be much larger than Beast's default body limit.
+    auto parser =
+        std::make_shared<http::response_parser<CBORBody>>(std::move(res));
+    parser->body_limit({});
+    http::async_read(
+        stream, buffer, *parser,
+        [handler, parser, &res](beast::error_code ec, std::size_t) {
+          if (!ec)
+            res = parser->release();
+          handler(ec);
+        });
+  }
+
+  void post(std::function<void()> f) override {
+    net::post(stream.get_executor(), std::move(f));
+  }
+
+  void close() override {
+    post([this]() { stream.close(); });
+  }
 };
 } // end anonymous namespace
 
+fibers::future<beast::error_code> Connection::start(const BeastRequest &req,
+                                                    BeastResponse &res) {
+  // The promise must stay alive until the handler returns, even if the
+  // waiting fiber wakes up first.
+  auto promise = std::make_shared<fibers::promise<beast::error_code>>();
+  auto future = promise->get_future();
+  post([this, &req, &res, promise]() {
+    write_queue.push_back(
+        {&req, &res,
+         [promise](beast::error_code ec) { promise->set_value(ec); }});
+    if (write_queue.size() == 1)
+      writeNext();
+  });
+  return future;
+}
+
+void Connection::request(const BeastRequest &req, BeastResponse &res) {
+  if (beast::error_code ec = start(req, res).get())
+    report_fatal_error("HTTP request failed: " + Twine(ec.message()));
+}
+
+void Connection::writeNext() {
+  asyncWrite(*write_queue.front().req, [this](beast::error_code ec) {
+    Pending pending = std::move(write_queue.front());
+    write_queue.pop_front();
+    if (ec) {
+      pending.handler(ec);
+    } else {
+      read_queue.emplace_back(std::move(pending));
+      if (read_queue.size() == 1)
+        readNext();
+    }
+    if (!write_queue.empty())
+      writeNext();
+  });
+}
+
+void Connection::readNext() {
+  asyncRead(*read_queue.front().res, [this](beast::error_code ec) {
+    Pending pending = std::move(read_queue.front());
+    read_queue.pop_front();
+    pending.handler(ec);
+    if (!read_queue.empty())
+      readNext();
+  });
+}
+
 namespace {
 class HTTPStore : public Store {
 public:
@@ -110,6 +237,10 @@ public:
   void eachCall(StringRef Func, std::function<bool(const Call &)> F) override;
   void head_delete(const Head &Head) override;
   void call_invalidate(StringRef name) override;
+  std::vector<llvm::Optional<Node>> getMany(ArrayRef<CID> CIDs) override;
+  std::vector<CID> putMany(ArrayRef<Node> values) override;
+  std::vector<bool> hasMany(ArrayRef<CID> CIDs) override;
+  std::vector<llvm::Optional<CID>> resolveMany(ArrayRef<Name> Names) override;
 
 private:
   friend struct AsyncRequest;
@@ -120,54 +251,181 @@ private:
   Response getResponse(BeastResponse &res);
   Response request(const Twine &method, const Twine &path,
                    const std::optional<Node> &body = std::nullopt);
+  std::vector<Response> requestMany(ArrayRef<BeastRequest> reqs);
+
+  // Send a request that the server may hold open for a long time, until it
+  // has something to send back (long polling). Returns std::nullopt if the
+  // request was cancelled by cancelLongPolls().
+  std::optional<Response>
+  longPoll(const Twine &method, const Twine &path,
+           const std::optional<Node> &body = std::nullopt);
+
+  // Abort any long polling requests in progress, and make future calls to
+  // longPoll() return std::nullopt immediately.
+  void cancelLongPolls();
+
+  // Open a new connection to the server.
+  std::unique_ptr<Connection> connect();
+
+  enum class ConnUse {
+    // The request may share the connection with other Pipelined requests.
+    Pipelined,
+    // The request needs exclusive use of the connection.
+    Exclusive,
+    // Like Exclusive, but the request may take a long time, so a connection
+    // is opened even if we're already at max_connections.
+    LongPoll,
+  };
+
+  // Get a connection from the pool, waiting until one is available. Returns
+  // nullptr for LongPoll if cancelLongPolls() has been called.
+  Connection *acquireConn(ConnUse use);
+
+  // Return a connection obtained from acquireConn(). pool_mutex must be
+  // locked.
+  void releaseConnLocked(Connection &conn);
+
+  // Return a connection obtained from acquireConn().
+  void releaseConn(Connection &conn);
+
+  // Remove a connection from the pool and destroy it. pool_mutex must be
+  // locked.
+  void discardConnLocked(Connection &conn);
 
   // The base server URI.
   URI base_uri;
 
-  net::io_context ioc;
+  // The maximum number of connections to open, set by the "connections=N"
+  // URI parameter.
+  std::size_t max_connections = 8;
 
-  // Get the current thread's HTTP connection, creating a new one if necessary.
-  Connection &getConn();
+  // The maximum number of outstanding requests on each connection. The server
+  // only queues a limited number of responses, so we limit the number of
+  // outstanding requests to match.
+  static constexpr unsigned max_pipelined = 8;
 
-  // Used by each thread to look up its own HTTP connection.
-  // TODO: entries in this map are never removed, even when the HTTPStore is
-  // destroyed, which could cause memory leaks.
-  static thread_local DenseMap<HTTPStore *, Connection *> thread_connections;
-
-  // Closes all connections in the destructor.
-  std::vector<std::unique_ptr<Connection>> open_connections = {};
-
-  // Protects access to open_connections.
-  std::mutex mutex;
+  // All socket operations are run by io_thread.
+  net::io_context ioc;
+  net::executor_work_guard<net::io_context::executor_type> work_guard =
+      net::make_work_guard(ioc);
+  std::thread io_thread;
+
+  // The connection pool, protected by pool_mutex. These are fiber-aware, so
+  // a fiber waiting for a connection lets other fibers on the same thread
+  // run.
+  fibers::mutex pool_mutex;
+  fibers::condition_variable pool_cv;
+  std::vector<std::unique_ptr<Connection>> connections;
+  // Number of connections currently being opened by connect().
+  std::size_t num_connecting = 0;
+  // Set by cancelLongPolls().
+  bool long_polls_cancelled = false;
 };
 } // end anonymous namespace
 
-thread_local DenseMap<HTTPStore *, Connection *> HTTPStore::thread_connections =
-    DenseMap<HTTPStore *, Connection *>();
-
-Connection &HTTPStore::getConn() {
-  Connection *&result = thread_connections[this];
-  if (!result) {
-    std::unique_ptr<Connection> stream;
-    if (base_uri.scheme == "http" || base_uri.scheme == "tcp") {
-      if (!base_uri.path_segments.empty())
-        report_fatal_error("HTTP URL must have an empty path");
-      tcp::resolver resolver(ioc);
-      auto const port_name = llvm::Twine(base_uri.port).str();
-      auto const resolved = resolver.resolve(base_uri.host, port_name);
-      stream = std::make_unique<ProtocolConnection<tcp>>(ioc, resolved);
-    } else if (base_uri.scheme == "unix") {
-      local::stream_protocol::endpoint endpoint(base_uri.getPathString());
-      stream = std::make_unique<ProtocolConnection<local::stream_protocol>>(
-          ioc, endpoint);
-    } else {
-      report_fatal_error("unsupported protocol in URL");
+std::unique_ptr<Connection> HTTPStore::connect() {
+  if (base_uri.scheme == "http" || base_uri.scheme == "tcp") {
+    if (!base_uri.path_segments.empty())
+      report_fatal_error("HTTP URL must have an empty path");
+    tcp::resolver resolver(ioc);
+    auto const port_name = llvm::Twine(base_uri.port).str();
+    auto const resolved = resolver.resolve(base_uri.host, port_name);
+    auto conn = std::make_unique<ProtocolConnection<tcp>>(ioc, resolved);
+    // Pipelined requests are written back to back, so we don't want Nagle's
+    // algorithm to delay them.
+    conn->stream.socket().set_option(tcp::no_delay(true));
+    return conn;
+  } else if (base_uri.scheme == "unix") {
+    local::stream_protocol::endpoint endpoint(base_uri.getPathString());
+    return std::make_unique<ProtocolConnection<local::stream_protocol>>(
+        ioc, endpoint);
+  } else {
+    report_fatal_error("unsupported protocol in URL");
+  }
+}
+
+Connection *HTTPStore::acquireConn(ConnUse use) {
+  const bool pipelined = use == ConnUse::Pipelined;
+  std::unique_lock lock(pool_mutex);
+  while (true) {
+    if (use == ConnUse::LongPoll && long_polls_cancelled)
+      return nullptr;
+
+    // Find the least busy connection that can accept another request.
+    // Connections being used for long polling don't count toward
+    // max_connections, so they can't starve other requests.
+    Connection *best = nullptr;
+    std::size_t num_active = num_connecting;
+    for (auto &conn : connections) {
+      if (!conn->long_poll)
+        ++num_active;
+      if (!conn->exclusive &&
+          (!best || conn->num_outstanding < best->num_outstanding))
+        best = conn.get();
+    }
+
+    // Prefer an idle connection, then a new connection, then pipelining.
+    if (!(best && best->num_outstanding == 0) &&
+        (num_active < max_connections || use == ConnUse::LongPoll)) {
+      ++num_connecting;
+      lock.unlock();
+      std::unique_ptr<Connection> conn;
+      {
+        // Give the slot back even if connect() throws, or the pool would
+        // shrink with every failed connection.
+        auto relock = llvm::make_scope_exit([&] {
+          lock.lock();
+          --num_connecting;
+          if (!conn)
+            pool_cv.notify_all();
+        });
+        conn = connect();
+      }
+      connections.emplace_back(std::move(conn));
+      best = connections.back().get();
+    }
+    if (best && (best->num_outstanding == 0 ||
+                 (pipelined && best->num_outstanding < max_pipelined))) {
+      ++best->num_outstanding;
+      best->exclusive = !pipelined;
+      best->long_poll = use == ConnUse::LongPoll;
+      return best;
     }
-    const std::lock_guard<std::mutex> lock(mutex);
-    open_connections.emplace_back(std::move(stream));
-    result = open_connections.back().get();
+    pool_cv.wait(lock);
   }
-  return *result;
+}
+
+void HTTPStore::releaseConnLocked(Connection &conn) {
+  --conn.num_outstanding;
+  conn.exclusive = false;
+  conn.long_poll = false;
+  pool_cv.notify_all();
+}
+
+void HTTPStore::releaseConn(Connection &conn) {
+  std::unique_lock lock(pool_mutex);
+  releaseConnLocked(conn);
+}
+
+void HTTPStore::discardConnLocked(Connection &conn) {
+  auto iter = llvm::find_if(connections, [&](const auto &item) {
+    return item.get() == &conn;
+  });
+  assert(iter != connections.end());
+  // The I/O thread may still be running a handler for this connection, so
+  // destroy it on the I/O thread.
+  std::shared_ptr<Connection> doomed = std::move(*iter);
+  connections.erase(iter);
+  net::post(ioc, [doomed]() {});
+  pool_cv.notify_all();
+}
+
+void HTTPStore::cancelLongPolls() {
+  std::unique_lock lock(pool_mutex);
+  long_polls_cancelled = true;
+  for (auto &conn : connections)
+    if (conn->long_poll)
+      conn->close();
 }
 
 void HTTPStore::open(StringRef uri, bool create_if_missing) {
@@ -176,14 +434,29 @@ void HTTPStore::open(StringRef uri, bool create_if_missing) {
     report_fatal_error("invalid HTTP URL");
   base_uri = std::move(*uri_or_none);
 
-  // Remove stale connection pointers in case a previous HTTPStore existed at
-  // the same address but was destroyed.
-  thread_connections.erase(this);
+  for (StringRef param : base_uri.query_params) {
+    if (param.consume_front("connections=")) {
+      if (param.getAsInteger(10, max_connections) || max_connections == 0)
+        report_fatal_error("invalid number of connections in HTTP URL");
+    } else {
+      report_fatal_error("unsupported parameter in HTTP URL");
+    }
+  }
+  base_uri.query_params.clear();
 
-  getConn();
+  io_thread = std::thread([this]() { ioc.run(); });
+
+  // Open the first connection now, so we fail early if the server can't be
+  // reached.
+  connections.emplace_back(connect());
 }
 
-HTTPStore::~HTTPStore() {}
+HTTPStore::~HTTPStore() {
+  // Let ioc.run() return once there are no more operations in progress.
+  work_guard.reset();
+  if (io_thread.joinable())
+    io_thread.join();
+}
 
 llvm::Optional<Node> HTTPStore::getOptional(const CID &CID) {
   auto response = request("GET", "/cid/" + CID.asString(Multibase::base64url));
@@ -228,6 +501,97 @@ void HTTPStore::set(const Name &Name, const CID &ref) {
     response.raiseError();
 }
 
+std::vector<llvm::Optional<Node>> HTTPStore::getMany(ArrayRef<CID> CIDs) {
+  std::vector<BeastRequest> reqs;
+  reqs.reserve(CIDs.size());
+  for (const CID &CID : CIDs)
+    reqs.emplace_back(
+        buildRequest("GET", "/cid/" + CID.asString(Multibase::base64url)));
+  std::vector<llvm::Optional<Node>> result;
+  result.reserve(CIDs.size());
+  for (auto &response : requestMany(reqs)) {
+    if (response.status == 404) {
+      result.emplace_back(llvm::None);
+      continue;
+    }
+    if (response.status != 200)
+      response.raiseError();
+    result.emplace_back(std::move(response.body));
+  }
+  return result;
+}
+
+std::vector<CID> HTTPStore::putMany(ArrayRef<Node> values) {
+  std::vector<BeastRequest> reqs;
+  reqs.reserve(values.size());
+  for (const Node &value : values)
+    reqs.emplace_back(buildRequest("POST", "/cid", value));
+  std::vector<CID> result;
+  result.reserve(values.size());
+  for (auto &response : requestMany(reqs)) {
+    if (response.status != 201)
+      response.raiseError();
+    if (!StringRef(response.location).startswith("/cid/"))
+      report_fatal_error("invalid 201 response location");
+    result.emplace_back(
+        *CID::parse(StringRef(response.location).drop_front(5)));
+  }
+  return result;
+}
+
+std::vector<bool> HTTPStore::hasMany(ArrayRef<CID> CIDs) {
+  // Ask the server which CIDs are missing, instead of downloading the Nodes.
+  std::vector<bool> result(CIDs.size(), true);
+  if (CIDs.empty())
+    return result;
+  Node body(node_list_arg);
+  for (const CID &CID : CIDs)
+    body.emplace_back(*this, CID);
+  auto response = request("POST", "/cid?missing", body);
+  if (response.status != 200)
+    response.raiseError();
+  // The missing CIDs are listed in the same order as the request.
+  auto missing = response.body.list_range();
+  auto next_missing = missing.begin();
+  for (size_t i = 0; i < CIDs.size(); ++i) {
+    if (next_missing != missing.end() && next_missing->as<CID>() == CIDs[i]) {
+      result[i] = false;
+      ++next_missing;
+    }
+  }
+  return result;
+}
+
+std::vector<llvm::Optional<CID>> HTTPStore::resolveMany(ArrayRef<Name> Names) {
+  std::vector<BeastRequest> reqs;
+  for (const Name &Name : Names) {
+    if (std::holds_alternative<CID>(Name))
+      continue;
+    SmallVector<char, 128> buffer;
+    raw_svector_ostream os(buffer);
+    os << Name;
+    reqs.emplace_back(buildRequest("GET", os.str()));
+  }
+  auto responses = requestMany(reqs);
+  std::vector<llvm::Optional<CID>> result;
+  result.reserve(Names.size());
+  auto response = responses.begin();
+  for (const Name &Name : Names) {
+    if (const CID *ref = std::get_if<CID>(&Name)) {
+      result.emplace_back(*ref);
+      continue;
+    }
+    if (response->status == 404)
+      result.emplace_back(llvm::None);
+    else if (response->status != 200)
+      response->raiseError();
+    else
+      result.emplace_back(response->body.as<CID>());
+    ++response;
+  }
+  return result;
+}
+
 std::vector<Name> HTTPStore::list_names_using(const CID &ref) {
   return {}; // TODO: unimplemented
 }
@@ -314,33 +678,86 @@ Response HTTPStore::getResponse(BeastResponse &res) {
   Response response;
   response.status = res.result_int();
   response.location = res[http::field::location];
-  void *res_data = res.body().data();
-  size_t res_size = res.body().size();
-  if (res[http::field::content_type] == "application/cbor")
-    response.body = cantFail(Node::loadFromCBOR(
-        *this, ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(res_data),
-                                 res_size)));
+  auto &body = res.body();
+  if (!body.error.empty())
+    report_fatal_error("Invalid CBOR response: " + Twine(body.error));
+  if (body.node)
+    response.body = std::move(*body.node);
   else
-    response.error =
-        StringRef(reinterpret_cast<const char *>(res_data), res_size).str();
+    response.error = std::move(body.raw);
   return response;
 }
 
 Response HTTPStore::request(const Twine &method, const Twine &path,
                             const std::optional<Node> &body) {
-  auto &stream = getConn();
   auto req = buildRequest(method, path, body);
-  beast::flat_buffer buffer;
+  // Only GET requests are pipelined. Other requests may have side effects or
+  // take a long time on the server, which would delay the requests behind
+  // them.
+  Connection &conn = *acquireConn(req.method() == http::verb::get
+                                     ? ConnUse::Pipelined
+                                     : ConnUse::Exclusive);
   BeastResponse res;
-  // XXX: There must not be any fiber switches (fibers::mutex::lock(),
-  // this_fiber::sleep_for(), etc.) between the calls to http::write() and
-  // http::read(). We use 1 HTTP connection per thread, and this ensures that
-  // each thread makes only 1 HTTP request at a time.
-  stream.write(req);
-  stream.read(buffer, res);
+  res.body().store = this;
+  conn.request(req, res);
+  releaseConn(conn);
+  return getResponse(res);
+}
+
+std::optional<Response> HTTPStore::longPoll(const Twine &method,
+                                            const Twine &path,
+                                            const std::optional<Node> &body) {
+  auto req = buildRequest(method, path, body);
+  Connection *conn = acquireConn(ConnUse::LongPoll);
+  if (!conn)
+    return std::nullopt;
+  BeastResponse res;
+  res.body().store = this;
+  beast::error_code ec = conn->start(req, res).get();
+  std::unique_lock lock(pool_mutex);
+  if (long_polls_cancelled) {
+    // cancelLongPolls() may have closed the connection.
+    discardConnLocked(*conn);
+    if (ec)
+      return std::nullopt;
+  } else if (ec) {
+    report_fatal_error("HTTP request failed: " + Twine(ec.message()));
+  } else {
+    releaseConnLocked(*conn);
+  }
+  lock.unlock();
   return getResponse(res);
 }
 
+std::vector<Response> HTTPStore::requestMany(ArrayRef<BeastRequest> reqs) {
+  // Pipeline the requests: send more requests before the responses to the
+  // previous ones arrive, instead of waiting for a full round trip each time.
+  Connection &conn = *acquireConn(ConnUse::Exclusive);
+  std::vector<BeastResponse> responses(reqs.size());
+  for (auto &res : responses)
+    res.body().store = this;
+  std::deque<fibers::future<beast::error_code>> futures;
+  auto wait = [&]() {
+    if (beast::error_code ec = futures.front().get())
+      report_fatal_error("HTTP request failed: " + Twine(ec.message()));
+    futures.pop_front();
+  };
+  for (size_t i = 0; i < reqs.size(); i++) {
+    if (futures.size() >= max_pipelined)
+      wait();
+    futures.emplace_back(conn.start(reqs[i], responses[i]));
+  }
+  while (!futures.empty())
+    wait();
+  releaseConn(conn);
+
+  std::vector<Response> result;
+  result.reserve(reqs.size());
+  for (auto &res : responses)
+    result.emplace_back(getResponse(res));
+  return result;
+}
+
 void Response::raiseError() {
   report_fatal_error("Error response " + Twine(status) + ": " + error);
 }
@@ -364,12 +781,20 @@ public:
       count--;
   }
 
+  // Wait until acquire() would succeed without blocking, but don't actually
+  // decrement the count.
+  void waitUntilAvailable() {
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [this]() { return cancelled || count != 0; });
+  }
+
   void release(unsigned update = 1) {
     {
       auto lock = std::unique_lock(mutex);
       count += update;
     }
-    cv.notify_one();
+    // Wake waitUntilAvailable() callers as well as one acquire() caller.
+    cv.notify_all();
   }
 
   void cancel() {
@@ -442,22 +867,67 @@ private:
 namespace {
 class ClientEvaluator : public Evaluator {
 public:
-  ClientEvaluator(std::unique_ptr<HTTPStore> store, unsigned num_threads);
+  ClientEvaluator(std::unique_ptr<HTTPStore> store, unsigned num_threads,
+                  bool cache, std::unique_ptr<Store> local);
   ~ClientEvaluator() override;
   Store &getStore() override;
   Link evaluate(const Call &call) override;
   Future evaluateAsync(const Call &call) override;
+  Future evaluateAsync(const Call &call, int priority) override;
   void registerFunc(
       llvm::StringRef name,
       std::function<NodeOrCID(Evaluator &, const Call &)> func) override;
 
 private:
-  void updateWorkerInfo();
-  std::optional<Link> tryEvaluate(const Call &call,
-                                  bool inc_started_if_success);
-  Link evaluateDeferred(const Call &call);
+  // A job received from the server.
+  struct Job {
+    Call call;
+    int priority;
+  };
+
+  // How long to ask the server to hold long polling requests before
+  // responding without a job or result.
+  static constexpr unsigned WAIT_SECONDS = 30;
+
+  // The maximum number of evaluateDeferred() calls that use long polling at
+  // once. Each one needs its own connection, so any others poll once a
+  // second instead.
+  static constexpr unsigned MAX_LONG_POLLS = 32;
+
+  std::optional<CID> updateWorkerInfo();
+  std::optional<Link> tryEvaluate(const Call &call, int priority,
+                                  bool inc_started_if_success,
+                                  unsigned wait_seconds = 0);
+  Link evaluateDeferred(const Call &call, int priority);
+
+  // The priority to use for calls that don't specify one. Calls made while
+  // evaluating a job get a higher priority than the job itself, so the
+  // server starts them before other jobs like it.
+  int getDefaultPriority();
+
+  // Get the next job, from prefetched_jobs or from the server. Returns
+  // std::nullopt if the ClientEvaluator is being destroyed.
+  std::optional<Job> getJob();
+
+  // Ask the server for up to max_jobs jobs, waiting until at least one is
+  // available. Returns an empty vector if the ClientEvaluator is being
+  // destroyed.
+  std::vector<Job> fetchJobs();
+
+  // Send the result of a job to the server. If another fiber is already
+  // sending results, the result is sent along with the next batch instead.
+  void sendResult(const Call &call, const CID &result);
+
+  // Make sure the server has every Node added through getStore(), before a
+  // request that refers to them.
+  void flushStore();
 
   std::unique_ptr<HTTPStore> store;
+  // Optional persistent local store in front of store.
+  std::unique_ptr<TieredStore> tiered;
+  // Optional cache in front of store (or tiered), used for everything except
+  // the job requests.
+  std::unique_ptr<CachingStore> cache;
   llvm::StringMap<std::function<NodeOrCID(Evaluator &, const Call &)>> funcs;
   bool funcs_changed = false;
   fibers::mutex funcs_mutex;
@@ -475,16 +945,48 @@ private:
 
   // These counters only increase, never decrease.
   std::atomic<unsigned> num_requested = 0, num_started = 0, num_finished = 0;
+  // The number of evaluateDeferred() calls currently long polling.
+  std::atomic<unsigned> num_long_polls = 0;
+
+  // The number of jobs to request from the server at once. Extra jobs are
+  // kept in prefetched_jobs until a worker thread is free to start them.
+  unsigned max_jobs;
+
+  // Jobs we've received from the server but haven't started yet, protected
+  // by jobs_mutex. Only one thread fetches more jobs at a time.
+  fibers::mutex jobs_mutex;
+  fibers::condition_variable jobs_cv;
+  std::deque<Job> prefetched_jobs;
+  bool fetching_jobs = false;
+  // The worker info sent with the previous request for jobs. Only used by
+  // the thread that is fetching jobs.
+  std::optional<CID> last_info_cid;
+
+  // Results that haven't been sent to the server yet, protected by
+  // results_mutex.
+  fibers::mutex results_mutex;
+  std::vector<std::pair<Call, CID>> unsent_results;
+  bool sending_results = false;
   fibers::mutex stderr_mutex;
 
+  // The priority of the job being evaluated by the current fiber, if any.
+  fibers::fiber_specific_ptr<int> job_priority;
+
   void workerThreadImpl(unsigned num_threads);
   void printProgress();
 };
 } // end anonymous namespace
 
 ClientEvaluator::ClientEvaluator(std::unique_ptr<HTTPStore> store,
-                                 unsigned num_threads)
-    : store(std::move(store)), work_semaphore(num_threads) {
+                                 unsigned num_threads, bool cache,
+                                 std::unique_ptr<Store> local)
+    : store(std::move(store)), work_semaphore(num_threads),
+      max_jobs(num_threads) {
+  if (local)
+    tiered = std::make_unique<TieredStore>(std::move(local), *this->store);
+  if (cache)
+    this->cache = std::make_unique<CachingStore>(
+        tiered ? static_cast<Store &>(*tiered) : *this->store);
   worker_threads.reserve(num_threads);
   for (unsigned i = 0; i < num_threads; ++i) {
     worker_threads.emplace_back(&ClientEvaluator::workerThreadImpl, this,
@@ -494,27 +996,54 @@ ClientEvaluator::ClientEvaluator(std::unique_ptr<HTTPStore> store,
 
 ClientEvaluator::~ClientEvaluator() {
   work_semaphore.cancel();
-  // FIXME: cancel in-progress requests from threads.
+  // Don't make the threads wait for their long polling requests to time out.
+  store->cancelLongPolls();
   for (auto &thread : worker_threads)
     thread.join();
 }
 
-Store &ClientEvaluator::getStore() { return *store; }
+Store &ClientEvaluator::getStore() {
+  if (cache)
+    return *cache;
+  if (tiered)
+    return *tiered;
+  return *store;
+}
+
+void ClientEvaluator::flushStore() {
+  if (tiered)
+    tiered->flush();
+}
 
 std::optional<Link> ClientEvaluator::tryEvaluate(const Call &call,
-                                                 bool inc_started_if_success) {
+                                                 int priority,
+                                                 bool inc_started_if_success,
+                                                 unsigned wait_seconds) {
+  flushStore();
   SmallVector<char, 256> buffer;
   llvm::raw_svector_ostream os(buffer);
   os << call << "/evaluate";
+  char separator = '?';
+  if (priority) {
+    os << separator << "priority=" << priority;
+    separator = '&';
+  }
 
-  Response response;
+  std::optional<Response> response;
 
-  response = store->request("POST", os.str());
-  if (response.status == 202) {
+  if (wait_seconds) {
+    os << separator << "wait=" << wait_seconds;
+    response = store->longPoll("POST", os.str());
+    if (!response)
+      return std::nullopt; // cancelled
+  } else {
+    response = store->request("POST", os.str());
+  }
+  if (response->status == 202) {
     // No result yet.
     return std::nullopt;
-  } else if (response.status != 200) {
-    response.raiseError();
+  } else if (response->status != 200) {
+    response->raiseError();
   }
 
   if (inc_started_if_success)
@@ -525,7 +1054,7 @@ std::optional<Link> ClientEvaluator::tryEvaluate(const Call &call,
     llvm::errs() << " finished " << call << "\n";
   }
 
-  return Link(*store, response.body.as<CID>());
+  return Link(getStore(), response->body.as<CID>());
 }
 
 Link ClientEvaluator::evaluate(const Call &call) {
@@ -534,37 +1063,56 @@ Link ClientEvaluator::evaluate(const Call &call) {
     printProgress();
     llvm::errs() << " starting " << call << "\n";
   }
-  return evaluateDeferred(call);
+  return evaluateDeferred(call, getDefaultPriority());
 }
 
-Link ClientEvaluator::evaluateDeferred(const Call &call) {
+Link ClientEvaluator::evaluateDeferred(const Call &call, int priority) {
   using namespace std::chrono_literals;
   ++num_started;
   work_semaphore.release();
   std::optional<Link> result;
-  while (!(result = tryEvaluate(call, false)))
-    this_fiber::sleep_for(1000ms); // TODO: exponential backoff
+  while (true) {
+    auto start = std::chrono::steady_clock::now();
+    bool wait = num_long_polls++ < MAX_LONG_POLLS;
+    result = tryEvaluate(call, priority, false, wait ? WAIT_SECONDS : 0);
+    --num_long_polls;
+    if (result)
+      break;
+    // If we didn't use long polling, or the server responded early (maybe it
+    // doesn't support long polling), wait before trying again.
+    this_fiber::sleep_until(start + 1000ms); // TODO: exponential backoff
+  }
   work_semaphore.acquire();
   return *result;
 }
 
 Future ClientEvaluator::evaluateAsync(const Call &call) {
+  return evaluateAsync(call, getDefaultPriority());
+}
+
+Future ClientEvaluator::evaluateAsync(const Call &call, int priority) {
   ++num_requested;
   if (auto stderr_lock = std::unique_lock(stderr_mutex, std::try_to_lock)) {
     printProgress();
     llvm::errs() << " starting " << call << "\n";
   }
-  auto early_result = tryEvaluate(call, true);
+  auto early_result = tryEvaluate(call, priority, true);
   if (early_result) {
     std::promise<Link> promise;
     promise.set_value(*early_result);
     return makeFuture(promise.get_future().share());
   }
   auto future = std::async(std::launch::deferred,
-                           &ClientEvaluator::evaluateDeferred, this, call);
+                           &ClientEvaluator::evaluateDeferred, this, call,
+                           priority);
   return makeFuture(future.share());
 }
 
+int ClientEvaluator::getDefaultPriority() {
+  int *priority = job_priority.get();
+  return priority ? *priority + 1 : 0;
+}
+
 void ClientEvaluator::registerFunc(
     llvm::StringRef name,
     std::function<NodeOrCID(Evaluator &, const Call &)> func) {
@@ -583,19 +1131,19 @@ void ClientEvaluator::printProgress() {
                << " -> " << finished;
 }
 
-void ClientEvaluator::updateWorkerInfo() {
+std::optional<CID> ClientEvaluator::updateWorkerInfo() {
   std::unique_lock lock(funcs_mutex);
   if (funcs_changed) {
     Node worker_info(node_map_arg, {{"funcs", Node(node_list_arg)}});
     for (const auto &item : funcs)
       worker_info["funcs"].emplace_back(Node(utf8_string_arg, item.getKey()));
     worker_info_cid = store->put(worker_info);
+    funcs_changed = false;
   }
+  return worker_info_cid;
 }
 
 void ClientEvaluator::workerThreadImpl(unsigned num_threads) {
-  using namespace std::chrono_literals;
-
   // work_stealing would be faster, but it busywaits if there's nothing to do,
   // which is undesirable.
   //
@@ -608,32 +1156,20 @@ void ClientEvaluator::workerThreadImpl(unsigned num_threads) {
         /*suspend*/ true);
 
   while (true) {
-    work_semaphore.acquire();
+    // Don't acquire work_semaphore until we actually get a job. Otherwise, a
+    // fiber that just got the result of evaluate() could be stuck waiting for
+    // us to finish long polling.
+    work_semaphore.waitUntilAvailable();
     if (work_semaphore.isCancelled())
       return;
 
-    Response response;
-    while (true) {
-      updateWorkerInfo();
-      if (work_semaphore.isCancelled())
-        return;
-      if (worker_info_cid) {
-        response =
-            store->request("POST", "/worker", Node(*store, *worker_info_cid));
-        if (response.status < 200 || response.status > 299)
-          response.raiseError();
-      }
-      if (!response.body.is_null())
-        break;
-      // No jobs available, or worker_info_cid is nullopt (no funcs
-      // registered yet).
-      this_fiber::sleep_for(1000ms); // TODO: exponential backoff
-    }
+    std::optional<Job> job = getJob();
+    if (!job)
+      return; // cancelled
 
-    Call call("", {});
-    call.Name = response.body["func"].as<std::string>();
-    for (const auto &arg : response.body["args"].list_range())
-      call.Args.emplace_back(arg.as<CID>());
+    work_semaphore.acquire();
+    if (work_semaphore.isCancelled())
+      return;
 
     // Prevent this ClientEvaluator from being destroyed while the fiber is
     // running. We need to acquire the shared lock here, before the fiber
@@ -641,7 +1177,10 @@ void ClientEvaluator::workerThreadImpl(unsigned num_threads) {
     // between the creation of the fiber and its execution.
     std::shared_lock shared_lock(work_shared_mutex);
 
-    fibers::fiber([this, call, shared_lock = std::move(shared_lock)]() {
+    fibers::fiber([this, job = std::move(*job),
+                   shared_lock = std::move(shared_lock)]() {
+      const Call &call = job.call;
+      job_priority.reset(new int(job.priority));
       // FIXME: doesn't work with fibers
       // PrettyStackTraceCall stack_printer(call);
       std::function<NodeOrCID(Evaluator &, const Call &)> *func;
@@ -649,14 +1188,8 @@ void ClientEvaluator::workerThreadImpl(unsigned num_threads) {
         std::unique_lock lock(funcs_mutex);
         func = &funcs[call.Name];
       }
-      Link result(*store, (*func)(*this, call));
-      SmallVector<char, 256> buffer;
-      llvm::raw_svector_ostream os(buffer);
-      os << call;
-      auto response =
-          store->request("PUT", os.str(), Node(*store, result.getCID()));
-      if (response.status != 201)
-        response.raiseError();
+      Link result(getStore(), (*func)(*this, call));
+      sendResult(call, result.getCID());
       work_semaphore.release();
     }).detach();
   }
@@ -668,9 +1201,118 @@ void ClientEvaluator::workerThreadImpl(unsigned num_threads) {
   std::unique_lock lock(work_shared_mutex);
 }
 
-std::unique_ptr<Evaluator> memodb::createClientEvaluator(llvm::StringRef path,
-                                                         unsigned num_threads) {
+std::optional<ClientEvaluator::Job> ClientEvaluator::getJob() {
+  std::unique_lock lock(jobs_mutex);
+  while (prefetched_jobs.empty()) {
+    if (work_semaphore.isCancelled())
+      return std::nullopt;
+    if (!fetching_jobs) {
+      fetching_jobs = true;
+      lock.unlock();
+      std::vector<Job> jobs = fetchJobs();
+      lock.lock();
+      fetching_jobs = false;
+      prefetched_jobs.insert(prefetched_jobs.end(), jobs.begin(), jobs.end());
+      jobs_cv.notify_all();
+    } else {
+      jobs_cv.wait(lock);
+    }
+  }
+  Job job = std::move(prefetched_jobs.front());
+  prefetched_jobs.pop_front();
+  return job;
+}
+
+std::vector<ClientEvaluator::Job> ClientEvaluator::fetchJobs() {
+  using namespace std::chrono_literals;
+  while (true) {
+    std::optional<CID> info_cid = updateWorkerInfo();
+    if (work_semaphore.isCancelled())
+      return {};
+    auto start = std::chrono::steady_clock::now();
+    if (info_cid) {
+      // If funcs were just registered, more are probably on the way, so
+      // don't let the server hold the request for long.
+      unsigned wait_seconds = info_cid == last_info_cid ? WAIT_SECONDS : 1;
+      last_info_cid = info_cid;
+      auto response = store->longPoll("POST",
+                                      "/worker?max_jobs=" + Twine(max_jobs) +
+                                          "&wait=" + Twine(wait_seconds),
+                                      Node(*store, *info_cid));
+      if (!response)
+        return {}; // cancelled
+      if (response->status < 200 || response->status > 299)
+        response->raiseError();
+      std::vector<Job> jobs;
+      for (const Node &job : response->body.list_range()) {
+        int priority = 0;
+        if (job.contains("priority"))
+          priority = job["priority"].as<int>();
+        jobs.push_back(
+            Job{Call(job["func"].as<StringRef>(), ArrayRef<CID>()), priority});
+        for (const auto &arg : job["args"].list_range())
+          jobs.back().call.Args.emplace_back(arg.as<CID>());
+      }
+      if (!jobs.empty())
+        return jobs;
+    }
+    // No jobs available, or info_cid is nullopt (no funcs registered yet).
+    // Wait before trying again, unless the server already waited.
+    this_fiber::sleep_until(start + 1000ms); // TODO: exponential backoff
+  }
+}
+
+void ClientEvaluator::sendResult(const Call &call, const CID &result) {
+  std::unique_lock lock(results_mutex);
+  unsent_results.emplace_back(call, result);
+  if (sending_results)
+    return;
+  sending_results = true;
+  // If sending fails, let later results be sent by whoever calls us next.
+  auto reset_sending = llvm::make_scope_exit([&] {
+    if (!lock.owns_lock())
+      lock.lock();
+    sending_results = false;
+  });
+  // Results that finish while we're sending are sent together in the next
+  // request, so busy workers need fewer requests.
+  while (!unsent_results.empty()) {
+    auto results = std::move(unsent_results);
+    unsent_results.clear();
+    lock.unlock();
+    flushStore();
+    if (results.size() == 1) {
+      SmallVector<char, 256> buffer;
+      llvm::raw_svector_ostream os(buffer);
+      os << results[0].first;
+      auto response = store->request("PUT", os.str(),
+                                     Node(*store, results[0].second));
+      if (response.status != 201)
+        response.raiseError();
+    } else {
+      Node body(node_list_arg);
+      for (const auto &item : results) {
+        Node args(node_list_arg);
+        for (const CID &arg : item.first.Args)
+          args.emplace_back(*store, arg);
+        body.emplace_back(Node(
+            node_map_arg, {{"func", Node(utf8_string_arg, item.first.Name)},
+                           {"args", std::move(args)},
+                           {"result", Node(*store, item.second)}}));
+      }
+      auto response = store->request("POST", "/call", body);
+      if (response.status != 201)
+        response.raiseError();
+    }
+    lock.lock();
+  }
+}
+
+std::unique_ptr<Evaluator>
+memodb::createClientEvaluator(llvm::StringRef path, unsigned num_threads,
+                              bool cache, std::unique_ptr<Store> local) {
   auto store = std::make_unique<HTTPStore>();
   store->open(path, false);
-  return std::make_unique<ClientEvaluator>(std::move(store), num_threads);
+  return std::make_unique<ClientEvaluator>(std::move(store), num_threads,
+                                           cache, std::move(local));
 }
@@ -1,14 +1,18 @@
 #include "memodb/Evaluator.h"
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <future>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <random>
 #include <thread>
 #include <utility>
 #include <vector>
@@ -22,6 +26,7 @@
 #include <llvm/Support/Threading.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include "memodb/CachingStore.h"
 #include "memodb/ToolSupport.h"
 #include "memodb_internal.h"
 
@@ -29,13 +34,19 @@ using namespace memodb;
 using llvm::Twine;
 
 const Link &Future::get() {
+  if (wait_hook)
+    wait_hook();
   // The shared_future's state will be accessed from two places: this Future,
-  // and Evaluator::workerThreadImpl. Only this Future will actually access the
-  // Link, so there's no race condition on the fields of the Link.
+  // and the thread that evaluates the Call. Only this Future will actually
+  // access the Link, so there's no race condition on the fields of the Link.
   return future.get();
 }
 
-void Future::wait() { future.wait(); }
+void Future::wait() {
+  if (wait_hook)
+    wait_hook();
+  future.wait();
+}
 
 bool Future::checkForResult() const {
   return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
@@ -49,7 +60,9 @@ const CID &Future::getCID() { return get().getCID(); }
 
 void Future::freeNode() { get().freeNode(); }
 
-Future::Future(std::shared_future<Link> &&future) : future(std::move(future)) {}
+Future::Future(std::shared_future<Link> &&future,
+               std::function<void()> wait_hook)
+    : future(std::move(future)), wait_hook(std::move(wait_hook)) {}
 
 namespace {
 class ThreadPoolEvaluator : public Evaluator {
@@ -58,47 +71,132 @@ public:
   ~ThreadPoolEvaluator() override;
   Store &getStore() override;
   Link evaluate(const Call &call) override;
+  // Tasks are always evaluated depth-first, so priorities aren't needed.
+  using Evaluator::evaluateAsync;
   Future evaluateAsync(const Call &call) override;
   void registerFunc(
       llvm::StringRef name,
       std::function<NodeOrCID(Evaluator &, const Call &)> func) override;
 
 private:
+  // A Call passed to evaluateAsync() or being evaluated by evaluate().
+  // Whichever thread claims it first evaluates it: a worker thread, or a
+  // thread waiting for the result.
+  struct Task {
+    Task(const Call &call, std::shared_ptr<Task> parent)
+        : call(call), parent(std::move(parent)),
+          result(promise.get_future()) {}
+
+    bool isDescendantOf(const Task *ancestor) const {
+      for (const Task *task = this; task; task = task->parent.get())
+        if (task == ancestor)
+          return true;
+      return false;
+    }
+
+    Call call;
+    // The Task that was running on the thread that created this one, if any.
+    std::shared_ptr<Task> parent;
+    std::atomic<bool> claimed = false;
+    std::atomic<bool> finished = false;
+    std::promise<Link> promise;
+    std::shared_future<Link> result;
+  };
+
+  // Each worker thread pushes and pops Tasks at the back of its own deque, so
+  // nested calls are evaluated depth-first. Idle threads steal Tasks from the
+  // front of other threads' deques, which are usually the biggest ones.
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<Task>> tasks;
+    // The size of tasks, so thieves can skip empty queues without locking.
+    std::atomic<size_t> size = 0;
+  };
+
+  // A thread in waitForTask(). It can only help with descendants of the Task
+  // it's waiting for, so it's only woken up when one of those is pushed or
+  // the Task finishes.
+  struct Helper {
+    const Task *task;
+    std::condition_variable cv;
+    // The following fields are protected by sleep_mutex.
+    bool sleeping = false;
+    bool woken = false;
+  };
+
   std::unique_ptr<Store> store;
   llvm::StringMap<std::function<NodeOrCID(Evaluator &, const Call &)>> funcs;
 
+  // Calls currently being evaluated by evaluate(). If another thread asks for
+  // the same Call, it waits for the existing Task instead of evaluating the
+  // Call again.
+  std::mutex in_flight_mutex;
+  std::map<Call, std::shared_ptr<Task>> in_flight;
+
   std::vector<std::thread> threads;
-  std::mutex work_mutex;
-  std::condition_variable work_cv;
-  std::queue<std::shared_future<Link>> work_queue;
+  std::vector<std::unique_ptr<WorkerQueue>> worker_queues;
+  // Tasks submitted by threads outside the pool.
+  WorkerQueue shared_queue;
+  // Number of Tasks in all queues, including ones that have already been
+  // claimed by a waiting thread.
+  std::atomic<size_t> num_pending = 0;
+
+  // Used by worker threads to sleep when there's nothing to do, and by
+  // threads waiting for a Future to sleep when there's nothing to help with.
+  std::mutex sleep_mutex;
+  std::condition_variable idle_cv;
+  std::atomic<unsigned> num_idle = 0, num_helpers = 0;
+  // Protected by sleep_mutex.
+  std::vector<Helper *> helpers;
   bool work_done = false;
 
   // These counters only increase, never decrease.
   std::atomic<unsigned> num_queued = 0, num_started = 0, num_finished = 0;
   std::mutex stderr_mutex;
 
-  void workerThreadImpl();
+  // The pool and queue index of the worker running on the current thread, if
+  // any.
+  static thread_local ThreadPoolEvaluator *current_pool;
+  static thread_local unsigned current_worker;
+  // The innermost Task being evaluated on the current thread, if any.
+  static thread_local std::shared_ptr<Task> current_task;
+
+  void workerThreadImpl(unsigned index);
+
+  void pushTask(std::shared_ptr<Task> task);
+  std::shared_ptr<Task> popTask(const Task *ancestor = nullptr);
+  bool runTask(const std::shared_ptr<Task> &task);
+  void finishTask(Task &task, const Link &result);
+  void waitForTask(const std::shared_ptr<Task> &task);
 
-  Link evaluateDeferred(const Call &call);
+  Link evaluateTask(const Call &call);
 
   void printProgress();
 };
 } // end anonymous namespace
 
+thread_local ThreadPoolEvaluator *ThreadPoolEvaluator::current_pool = nullptr;
+thread_local unsigned ThreadPoolEvaluator::current_worker = 0;
+thread_local std::shared_ptr<ThreadPoolEvaluator::Task>
+    ThreadPoolEvaluator::current_task = nullptr;
+
 ThreadPoolEvaluator::ThreadPoolEvaluator(std::unique_ptr<Store> store,
                                          unsigned num_threads)
     : store(std::move(store)) {
+  worker_queues.reserve(num_threads);
+  for (unsigned i = 0; i < num_threads; ++i)
+    worker_queues.emplace_back(std::make_unique<WorkerQueue>());
   threads.reserve(num_threads);
   for (unsigned i = 0; i < num_threads; ++i)
-    threads.emplace_back(&ThreadPoolEvaluator::workerThreadImpl, this);
+    threads.emplace_back(&ThreadPoolEvaluator::workerThreadImpl, this, i);
 }
 
 ThreadPoolEvaluator::~ThreadPoolEvaluator() {
   {
-    std::lock_guard<std::mutex> lock(work_mutex);
+    std::lock_guard<std::mutex> lock(sleep_mutex);
     work_done = true;
   }
-  work_cv.notify_all();
+  idle_cv.notify_all();
   for (auto &thread : threads)
     thread.join();
 }
@@ -106,33 +204,60 @@ ThreadPoolEvaluator::~ThreadPoolEvaluator() {
 Store &ThreadPoolEvaluator::getStore() { return *store; }
 
 Link ThreadPoolEvaluator::evaluate(const Call &call) {
+  // If another thread is already evaluating the same Call, wait for it
+  // instead of evaluating it twice. We register the Call before checking the
+  // store, so there's no window where two threads can both miss.
+  std::shared_ptr<Task> task;
+  bool is_owner = false;
+  {
+    std::lock_guard<std::mutex> lock(in_flight_mutex);
+    auto &entry = in_flight[call];
+    if (!entry) {
+      entry = std::make_shared<Task>(call, current_task);
+      entry->claimed = true;
+      is_owner = true;
+    }
+    task = entry;
+  }
+  if (!is_owner) {
+    waitForTask(task);
+    return task->result.get();
+  }
+  std::shared_ptr<Task> outer_task = std::exchange(current_task, task);
+
+  llvm::Optional<Link> result;
   auto cid_or_null = getStore().resolveOptional(call);
-  if (cid_or_null)
-    return Link(getStore(), *cid_or_null);
-  const auto func_iter = funcs.find(call.Name);
-  if (func_iter == funcs.end())
-    llvm::report_fatal_error("No implementation of " + Twine(call.Name) +
-                             " available");
-  PrettyStackTraceCall pretty_stack_trace(call);
-  auto result = Link(getStore(), func_iter->getValue()(*this, call));
-  getStore().set(call, result.getCID());
-  return result;
+  if (cid_or_null) {
+    result.emplace(getStore(), *cid_or_null);
+  } else {
+    const auto func_iter = funcs.find(call.Name);
+    if (func_iter == funcs.end())
+      llvm::report_fatal_error("No implementation of " + Twine(call.Name) +
+                               " available");
+    PrettyStackTraceCall pretty_stack_trace(call);
+    result.emplace(getStore(), func_iter->getValue()(*this, call));
+    getStore().set(call, result->getCID());
+  }
+  current_task = std::move(outer_task);
+
+  {
+    std::lock_guard<std::mutex> lock(in_flight_mutex);
+    in_flight.erase(call);
+  }
+  finishTask(*task, *result);
+  return std::move(*result);
 }
 
 Future ThreadPoolEvaluator::evaluateAsync(const Call &call) {
   num_queued++;
-  std::shared_future<Link> future =
-      std::async(std::launch::deferred, &ThreadPoolEvaluator::evaluateDeferred,
-                 this, call);
-
-  if (!threads.empty()) {
-    {
-      std::lock_guard<std::mutex> lock(work_mutex);
-      work_queue.emplace(future);
-    }
-    work_cv.notify_one();
-  }
-  return makeFuture(std::move(future));
+  auto task = std::make_shared<Task>(call, current_task);
+  std::shared_future<Link> future = task->result;
+
+  // If there are no worker threads, the Task will be evaluated by the first
+  // thread that waits for the Future.
+  if (!threads.empty())
+    pushTask(task);
+  return makeFuture(std::move(future), [this, task] { waitForTask(task); });
 }
 
 void ThreadPoolEvaluator::registerFunc(
@@ -142,20 +267,175 @@ void ThreadPoolEvaluator::registerFunc(
   funcs[name] = std::move(func);
 }
 
-void ThreadPoolEvaluator::workerThreadImpl() {
+void ThreadPoolEvaluator::pushTask(std::shared_ptr<Task> task) {
+  WorkerQueue &queue = current_pool == this ? *worker_queues[current_worker]
+                                            : shared_queue;
+  const Task *pushed = task.get();
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.emplace_back(std::move(task));
+    queue.size = queue.tasks.size();
+  }
+  num_pending++;
+
+  // Sleeping threads increment num_idle or num_helpers before checking
+  // num_pending, so at least one side will notice the other. Wake one thread
+  // for the new Task: a sleeping helper that can use it if there is one, since
+  // it has nothing better to do, or else an idle worker. Helpers that are busy
+  // are told to check again before they sleep.
+  bool woke_helper = false;
+  if (num_helpers) {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    for (Helper *helper : helpers) {
+      if (helper->woken || !pushed->isDescendantOf(helper->task))
+        continue;
+      helper->woken = true;
+      if (helper->sleeping) {
+        helper->cv.notify_one();
+        woke_helper = true;
+        break;
+      }
+    }
+  }
+  if (!woke_helper && num_idle) {
+    { std::lock_guard<std::mutex> lock(sleep_mutex); }
+    idle_cv.notify_one();
+  }
+}
+
+// If ancestor is given, only Tasks descended from it are returned.
+std::shared_ptr<ThreadPoolEvaluator::Task>
+ThreadPoolEvaluator::popTask(const Task *ancestor) {
+  auto popFrom = [this, ancestor](WorkerQueue &queue, bool back) {
+    std::shared_ptr<Task> task;
+    if (!queue.size)
+      return task;
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    auto matches = [ancestor](const std::shared_ptr<Task> &task) {
+      return !ancestor || task->isDescendantOf(ancestor);
+    };
+    if (back) {
+      auto iter = std::find_if(queue.tasks.rbegin(), queue.tasks.rend(),
+                               matches);
+      if (iter != queue.tasks.rend()) {
+        task = std::move(*iter);
+        queue.tasks.erase(std::next(iter).base());
+      }
+    } else {
+      auto iter =
+          std::find_if(queue.tasks.begin(), queue.tasks.end(), matches);
+      if (iter != queue.tasks.end()) {
+        task = std::move(*iter);
+        queue.tasks.erase(iter);
+      }
+    }
+    if (task) {
+      queue.size = queue.tasks.size();
+      num_pending--;
+    }
+    return task;
+  };
+
+  if (!num_pending)
+    return nullptr;
+  if (current_pool == this)
+    if (auto task = popFrom(*worker_queues[current_worker], true))
+      return task;
+  if (auto task = popFrom(shared_queue, false))
+    return task;
+  if (worker_queues.empty())
+    return nullptr;
+  // Start at a random victim, so idle threads don't all pile onto the same
+  // queue.
+  static thread_local std::minstd_rand victim_rng(
+      std::hash<std::thread::id>()(std::this_thread::get_id()));
+  size_t start = victim_rng() % worker_queues.size();
+  for (size_t i = 0; i < worker_queues.size(); ++i)
+    if (auto task =
+            popFrom(*worker_queues[(start + i) % worker_queues.size()], false))
+      return task;
+  return nullptr;
+}
+
+bool ThreadPoolEvaluator::runTask(const std::shared_ptr<Task> &task) {
+  if (task->claimed.exchange(true))
+    return false;
+  std::shared_ptr<Task> outer_task = std::exchange(current_task, task);
+  Link result = evaluateTask(task->call);
+  current_task = std::move(outer_task);
+  finishTask(*task, result);
+  return true;
+}
+
+void ThreadPoolEvaluator::finishTask(Task &task, const Link &result) {
+  task.promise.set_value(result);
+  task.finished = true;
+  if (num_helpers) {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    for (Helper *helper : helpers)
+      if (helper->task == &task)
+        helper->cv.notify_one();
+  }
+}
+
+void ThreadPoolEvaluator::waitForTask(const std::shared_ptr<Task> &task) {
+  // If nobody has started the Task yet, evaluate it ourselves.
+  if (runTask(task) || task->finished)
+    return;
+
+  // Otherwise, help with calls made by the thread evaluating our Task until
+  // it finishes. We don't run unrelated Tasks here: they would sit on top of
+  // whatever this thread is already evaluating, and if one of them waited
+  // for a thread that was waiting for a Call lower on our stack, neither
+  // could ever finish.
+  Helper helper;
+  helper.task = task.get();
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    helpers.push_back(&helper);
+    num_helpers++;
+  }
+  while (!task->finished) {
+    if (auto other = popTask(task.get())) {
+      runTask(other);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    helper.sleeping = true;
+    helper.cv.wait(lock, [&] { return task->finished || helper.woken; });
+    helper.sleeping = false;
+    helper.woken = false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    helpers.erase(std::find(helpers.begin(), helpers.end(), &helper));
+    num_helpers--;
+  }
+}
+
+void ThreadPoolEvaluator::workerThreadImpl(unsigned index) {
+  current_pool = this;
+  current_worker = index;
   while (true) {
-    std::unique_lock<std::mutex> lock(work_mutex);
-    work_cv.wait(lock, [this] { return work_done || !work_queue.empty(); });
-    if (work_done)
+    if (auto task = popTask()) {
+      runTask(task);
+      continue;
+    }
+    num_idle++;
+    bool done;
+    {
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      idle_cv.wait(lock, [this] { return work_done || num_pending > 0; });
+      done = work_done;
+    }
+    num_idle--;
+    if (done)
       break;
-    std::shared_future<Link> future = std::move(work_queue.front());
-    work_queue.pop();
-    lock.unlock();
-    future.get();
   }
+  current_pool = nullptr;
 }
 
-Link ThreadPoolEvaluator::evaluateDeferred(const Call &call) {
+Link ThreadPoolEvaluator::evaluateTask(const Call &call) {
   llvm::PrettyStackTraceString stack_printer("Worker thread (single process)");
 
   num_started++;
@@ -195,8 +475,9 @@ Evaluator::Evaluator() {}
 
 Evaluator::~Evaluator() {}
 
-Future Evaluator::makeFuture(std::shared_future<Link> &&future) {
-  return Future(std::move(future));
+Future Evaluator::makeFuture(std::shared_future<Link> &&future,
+                             std::function<void()> wait_hook) {
+  return Future(std::move(future), std::move(wait_hook));
 }
 
 std::unique_ptr<Evaluator> Evaluator::createLocal(std::unique_ptr<Store> store,
@@ -207,14 +488,32 @@ std::unique_ptr<Evaluator> Evaluator::createLocal(std::unique_ptr<Store> store,
   return result;
 }
 
+static bool isServerURI(llvm::StringRef uri) {
+  return uri.startswith("http:") || uri.startswith("https:") ||
+         uri.startswith("tcp:") || uri.startswith("unix:");
+}
+
 std::unique_ptr<Evaluator> Evaluator::create(llvm::StringRef uri,
-                                             unsigned num_threads) {
+                                             unsigned num_threads, bool cache) {
+  if (uri.consume_front("cache:"))
+    cache = true;
+  // A ClientEvaluator needs direct access to the server, so it handles
+  // tiered: URIs itself.
+  std::unique_ptr<Store> local;
+  if (uri.startswith("tiered:")) {
+    auto [local_uri, remote_uri] = uri.drop_front(7).split('|');
+    if (isServerURI(remote_uri)) {
+      local = Store::open(local_uri, /*create_if_missing*/ true);
+      uri = remote_uri;
+    }
+  }
   std::unique_ptr<Evaluator> result;
-  if (uri.startswith("http:") || uri.startswith("https:") ||
-      uri.startswith("tcp:") || uri.startswith("unix:")) {
-    result = createClientEvaluator(uri, num_threads);
+  if (isServerURI(uri)) {
+    result = createClientEvaluator(uri, num_threads, cache, std::move(local));
   } else {
     auto store = Store::open(uri);
+    if (cache)
+      store = std::make_unique<CachingStore>(std::move(store));
     result =
         std::make_unique<ThreadPoolEvaluator>(std::move(store), num_threads);
   }
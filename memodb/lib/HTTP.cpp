@@ -10,6 +10,7 @@
 #include <optional>
 #include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include "memodb/CID.h"
@@ -321,7 +322,7 @@ bool HTTPRequest::sendETag(std::uint64_t etag, CacheControl cache_control) {
   return matched;
 }
 
-void HTTPRequest::sendContent(ContentType type, const llvm::StringRef &body) {
+void HTTPRequest::sendContentType(ContentType type) {
   switch (type) {
   case ContentType::OctetStream:
     sendHeader("Content-Type", "application/octet-stream");
@@ -335,13 +336,24 @@ void HTTPRequest::sendContent(ContentType type, const llvm::StringRef &body) {
   case ContentType::JSON:
     sendHeader("Content-Type", "application/json");
     break;
-  case ContentType::ProblemJSON:
   case ContentType::Plain:
+    sendHeader("Content-Type", "text/plain; charset=utf-8");
+    break;
+  case ContentType::ProblemJSON:
     llvm_unreachable("impossible content type");
   }
+}
+
+void HTTPRequest::sendContent(ContentType type, const llvm::StringRef &body) {
+  sendContentType(type);
   sendBody(body);
 }
 
+void HTTPRequest::sendOwnedContent(ContentType type, std::string &&body) {
+  sendContentType(type);
+  sendOwnedBody(std::move(body));
+}
+
 void HTTPRequest::sendAccepted() {
   startResponse(202, CacheControl::Ephemeral);
   sendEmptyBody();
@@ -0,0 +1,68 @@
+#include "memodb/Metrics.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <llvm/Support/Format.h>
+
+using namespace memodb;
+
+const double Histogram::BUCKET_BOUNDS[NUM_BUCKETS] = {
+    0.00001, 0.00003, 0.0001, 0.0003, 0.001, 0.003, 0.01, 0.03, 0.1,
+    0.3,     1,       3,      10,     30,    100,   300,  1000,
+};
+
+void Histogram::observe(double seconds) {
+  auto bucket =
+      std::lower_bound(std::begin(BUCKET_BOUNDS), std::end(BUCKET_BOUNDS),
+                       seconds) -
+      std::begin(BUCKET_BOUNDS);
+  counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  double old_sum = sum.load(std::memory_order_relaxed);
+  while (!sum.compare_exchange_weak(old_sum, old_sum + seconds,
+                                    std::memory_order_relaxed))
+    ;
+}
+
+void Histogram::print(llvm::raw_ostream &os, llvm::StringRef name,
+                      llvm::StringRef labels) const {
+  llvm::StringRef separator = labels.empty() ? "" : ",";
+  // Prometheus buckets are cumulative.
+  std::uint64_t count = 0;
+  for (std::size_t i = 0; i <= NUM_BUCKETS; i++) {
+    count += counts[i].load(std::memory_order_relaxed);
+    os << name << "_bucket{" << labels << separator << "le=\"";
+    if (i < NUM_BUCKETS)
+      os << llvm::format("%g", BUCKET_BOUNDS[i]);
+    else
+      os << "+Inf";
+    os << "\"} " << count << "\n";
+  }
+  llvm::StringRef open = labels.empty() ? "" : "{";
+  llvm::StringRef close = labels.empty() ? "" : "}";
+  os << name << "_sum" << open << labels << close << " "
+     << llvm::format("%.9g", sum.load(std::memory_order_relaxed)) << "\n";
+  os << name << "_count" << open << labels << close << " " << count << "\n";
+}
+
+void memodb::printMetricHeader(llvm::raw_ostream &os, llvm::StringRef name,
+                               llvm::StringRef type, llvm::StringRef help) {
+  os << "# HELP " << name << " " << help << "\n";
+  os << "# TYPE " << name << " " << type << "\n";
+}
+
+std::string memodb::escapeMetricLabel(llvm::StringRef value) {
+  std::string result;
+  result.reserve(value.size());
+  for (char c : value) {
+    if (c == '\\')
+      result += "\\\\";
+    else if (c == '"')
+      result += "\\\"";
+    else if (c == '\n')
+      result += "\\n";
+    else
+      result += c;
+  }
+  return result;
+}
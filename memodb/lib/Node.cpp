@@ -10,6 +10,7 @@
 #include <sstream>
 #include <system_error>
 
+#include "memodb/CBORDecoder.h"
 #include "memodb/CBOREncoder.h"
 #include "memodb/JSONEncoder.h"
 #include "memodb/Multibase.h"
@@ -65,14 +66,14 @@ bool Link::operator<(const Link &other) const {
 }
 
 void Node::validateUTF8() const {
-  auto Str = std::get<StringStorage>(variant_);
+  const auto &Str = std::get<StringStorage>(variant_);
   auto Ptr = reinterpret_cast<const llvm::UTF8 *>(Str.data());
   if (!llvm::isLegalUTF8String(&Ptr, Ptr + Str.size()))
     llvm::report_fatal_error("invalid UTF-8 in string value");
 }
 
 void Node::validateKeysUTF8() const {
-  auto map = std::get<Map>(variant_);
+  const auto &map = std::get<Map>(variant_);
   for (const auto &Item : map) {
     auto Ptr = reinterpret_cast<const llvm::UTF8 *>(Item.key().data());
     if (!llvm::isLegalUTF8String(&Ptr, Ptr + Item.key().size()))
@@ -136,6 +137,26 @@ Node::Node(NodeMapArg,
 Node::Node(const Map &map) : variant_(map) { validateKeysUTF8(); }
 Node::Node(Map &&map) : variant_(std::forward<Map>(map)) { validateKeysUTF8(); }
 
+Node::LinkStorage::LinkStorage(Link &&link)
+    : link(std::make_unique<Link>(std::move(link))) {}
+
+Node::LinkStorage::LinkStorage(const LinkStorage &other)
+    : link(std::make_unique<Link>(*other.link)) {}
+
+Node::LinkStorage::LinkStorage(LinkStorage &&other) noexcept
+    : link(std::make_unique<Link>(*other.link)) {}
+
+Node::LinkStorage &Node::LinkStorage::operator=(const LinkStorage &other) {
+  link = std::make_unique<Link>(*other.link);
+  return *this;
+}
+
+Node::LinkStorage &Node::LinkStorage::operator=(LinkStorage &&other) noexcept {
+  // Both sides hold valid Links, so we can swap without allocating.
+  std::swap(link, other.link);
+  return *this;
+}
+
 Node::Node(Store &store, const CID &val) : variant_(Link(store, val)) {}
 Node::Node(Store &store, CID &&val)
     : variant_(Link(store, std::forward<CID>(val))) {}
@@ -195,7 +216,7 @@ Kind Node::kind() const {
                         [](const BytesStorage &) { return Kind::Bytes; },
                         [](const List &) { return Kind::List; },
                         [](const Map &) { return Kind::Map; },
-                        [](const Link &) { return Kind::Link; },
+                        [](const LinkStorage &) { return Kind::Link; },
                     },
                     variant_);
 }
@@ -333,23 +354,6 @@ std::ostream &memodb::operator<<(std::ostream &os, const Node &value) {
   return os;
 }
 
-static double decode_float(std::uint64_t value, int total_size,
-                           int mantissa_size, int exponent_bias) {
-  std::uint64_t exponent_mask = (1ull << (total_size - mantissa_size - 1)) - 1;
-  std::uint64_t exponent = (value >> mantissa_size) & exponent_mask;
-  std::uint64_t mantissa = value & ((1ull << mantissa_size) - 1);
-  double result;
-  if (exponent == 0)
-    result =
-        std::ldexp(mantissa, 1 - (mantissa_size + exponent_bias)); // denormal
-  else if (exponent == exponent_mask)
-    result = mantissa == 0 ? INFINITY : NAN;
-  else
-    result = std::ldexp(mantissa + (1ull << mantissa_size),
-                        exponent - (mantissa_size + exponent_bias));
-  return value & (1ull << (total_size - 1)) ? -result : result;
-}
-
 static llvm::Error createInvalidCBORError(llvm::StringRef message) {
   return llvm::createStringError(
       std::make_error_code(std::errc::invalid_argument),
@@ -477,7 +481,7 @@ Node::loadFromCBORSequence(Store &store, llvm::ArrayRef<std::uint8_t> &in) {
       return Node(store, *CID);
     }
     Node node;
-    node.variant_ = result;
+    node.variant_ = std::move(result);
     return node;
   }
   case 3: {
@@ -496,20 +500,27 @@ Node::loadFromCBORSequence(Store &store, llvm::ArrayRef<std::uint8_t> &in) {
     auto ptr = reinterpret_cast<const llvm::UTF8 *>(result.data());
     if (!llvm::isLegalUTF8String(&ptr, ptr + result.size()))
       return createInvalidCBORError("invalid UTF-8 in string value");
-    return Node(utf8_string_arg, std::move(result));
+    Node node;
+    node.variant_ = std::move(result);
+    return node;
   }
   case 4: {
     List result;
+    // Every item takes at least one byte, so this can't reserve too much.
+    if (!indefinite)
+      result.reserve(std::min<std::uint64_t>(additional, in.size()));
     while (next_item()) {
       auto item = loadFromCBORSequence(store, in);
       if (!item)
         return item.takeError();
-      result.emplace_back(*item);
+      result.emplace_back(std::move(*item));
     }
-    return result;
+    return Node(std::move(result));
   }
   case 5: {
     Map result;
+    if (!indefinite)
+      result.reserve(std::min<std::uint64_t>(additional, in.size() / 2));
     while (next_item()) {
       auto key = loadFromCBORSequence(store, in);
       if (!key)
@@ -519,9 +530,9 @@ Node::loadFromCBORSequence(Store &store, llvm::ArrayRef<std::uint8_t> &in) {
       auto value = loadFromCBORSequence(store, in);
       if (!value)
         return value.takeError();
-      result.insert_or_assign(key->as<llvm::StringRef>(), *value);
+      result.insert_or_assign(key->as<llvm::StringRef>(), std::move(*value));
     }
-    return result;
+    return Node(std::move(result));
   }
   case 7:
     switch (minor_type) {
@@ -534,11 +545,11 @@ Node::loadFromCBORSequence(Store &store, llvm::ArrayRef<std::uint8_t> &in) {
     case 23: // undefined
       return nullptr;
     case 25:
-      return decode_float(additional, 16, 10, 15);
+      return CBORDecoder::decodeFloat(additional, 16, 10, 15);
     case 26:
-      return decode_float(additional, 32, 23, 127);
+      return CBORDecoder::decodeFloat(additional, 32, 23, 127);
     case 27:
-      return decode_float(additional, 64, 52, 1023);
+      return CBORDecoder::decodeFloat(additional, 64, 52, 1023);
     }
     return createUnsupportedCBORError("unsupported simple value");
   default:
@@ -552,6 +563,10 @@ std::vector<std::uint8_t> Node::saveAsCBOR() const {
   return out;
 }
 
+void Node::saveAsCBOR(llvm::raw_ostream &os) const {
+  CBOREncoder(os).visitNode(*this);
+}
+
 static llvm::Error createInvalidIPLDError(llvm::StringRef message) {
   return llvm::createStringError(
       std::make_error_code(std::errc::invalid_argument),
@@ -578,6 +593,25 @@ llvm::Expected<Node> Node::loadFromIPLD(Store &store, const CID &CID,
   return createUnsupportedIPLDError("unsupported CID content type");
 }
 
+llvm::Expected<BytesRef>
+Node::viewBytesFromIPLD(Store &store, const CID &CID, BytesRef Content,
+                        std::optional<Node> &Storage) {
+  if (CID.getContentType() == Multicodec::Raw) {
+    if (!CID.isIdentity())
+      return Content;
+    if (!Content.empty())
+      return createInvalidIPLDError("identity CID should have empty payload");
+    return CID.getHashBytes();
+  }
+  auto NodeOrErr = loadFromIPLD(store, CID, Content);
+  if (!NodeOrErr)
+    return NodeOrErr.takeError();
+  if (!NodeOrErr->is<BytesRef>())
+    return createInvalidIPLDError("expected byte string");
+  Storage = std::move(*NodeOrErr);
+  return Storage->as<BytesRef>();
+}
+
 std::pair<CID, std::vector<std::uint8_t>>
 Node::saveAsIPLD(bool noIdentity) const {
   bool raw = kind() == Kind::Bytes;
@@ -0,0 +1,248 @@
+#include "memodb/PathGraph.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <variant>
+
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/ErrorHandling.h>
+
+#include "memodb/Multibase.h"
+
+using namespace memodb;
+using llvm::ArrayRef;
+using llvm::Twine;
+
+ArrayRef<PathGraph::Edge> PathGraph::getEdges(const CID &CID) const {
+  auto iter = Edges.find(CID);
+  if (iter == Edges.end())
+    return {};
+  return iter->second;
+}
+
+void PathGraph::setEdges(const CID &CID, std::vector<Edge> NewEdges) {
+  Edges[CID] = std::move(NewEdges);
+}
+
+void PathGraph::eachPath(std::function<bool(const Path &)> F) const {
+  // Paths can be very long, so use an explicit stack instead of recursing.
+  struct Frame {
+    ArrayRef<Edge> Edges;
+    std::size_t Next = 0;
+    // The number of items pushed onto BackwardsPath for the current edge.
+    std::size_t Pushed = 0;
+  };
+  std::vector<Node> BackwardsPath;
+  std::vector<Frame> Stack;
+  Stack.push_back({getEdges(Target)});
+  while (!Stack.empty()) {
+    Frame &Top = Stack.back();
+    BackwardsPath.erase(BackwardsPath.end() - Top.Pushed, BackwardsPath.end());
+    Top.Pushed = 0;
+    if (Top.Next == Top.Edges.size()) {
+      Stack.pop_back();
+      continue;
+    }
+    const Edge &Edge = Top.Edges[Top.Next++];
+    if (const CID *ParentRef = std::get_if<CID>(&Edge.Parent)) {
+      BackwardsPath.insert(BackwardsPath.end(), Edge.Subpath.rbegin(),
+                           Edge.Subpath.rend());
+      Top.Pushed = Edge.Subpath.size();
+      Stack.push_back({getEdges(*ParentRef)});
+    } else {
+      Path Path(Edge.Parent, std::vector<Node>(BackwardsPath.rbegin(),
+                                               BackwardsPath.rend()));
+      if (F(Path))
+        return;
+    }
+  }
+}
+
+std::vector<Path> PathGraph::getPaths() const {
+  std::vector<Path> Result;
+  eachPath([&](const Path &Path) {
+    Result.emplace_back(Path);
+    return false;
+  });
+  return Result;
+}
+
+std::size_t PathGraph::countPaths() const {
+  constexpr std::size_t Max = std::numeric_limits<std::size_t>::max();
+  std::map<CID, std::size_t> Counts;
+  std::vector<CID> Stack{Target};
+  while (!Stack.empty()) {
+    const CID Ref = Stack.back();
+    if (Counts.count(Ref)) {
+      Stack.pop_back();
+      continue;
+    }
+    // Count the parents first, then come back to this CID.
+    bool Ready = true;
+    std::size_t Count = 0;
+    for (const Edge &Edge : getEdges(Ref)) {
+      std::size_t EdgeCount = 1;
+      if (const CID *ParentRef = std::get_if<CID>(&Edge.Parent)) {
+        auto Iter = Counts.find(*ParentRef);
+        if (Iter == Counts.end()) {
+          Ready = false;
+          Stack.push_back(*ParentRef);
+          continue;
+        }
+        EdgeCount = Iter->second;
+      }
+      Count = Count > Max - EdgeCount ? Max : Count + EdgeCount;
+    }
+    if (Ready) {
+      Counts[Ref] = Count;
+      Stack.pop_back();
+    }
+  }
+  return Counts[Target];
+}
+
+// List the paths within Value that lead to links to Ref.
+static std::vector<std::vector<Node>> listPathsWithin(const Node &Value,
+                                                      const CID &Ref) {
+  std::vector<std::vector<Node>> Result;
+  std::vector<Node> CurPath;
+  std::function<void(const Node &)> recurse = [&](const Node &Value) {
+    if (Value.kind() == Kind::Link) {
+      if (Value.as<CID>() == Ref)
+        Result.push_back(CurPath);
+    } else if (Value.kind() == Kind::List) {
+      for (size_t i = 0; i < Value.size(); i++) {
+        CurPath.push_back(i);
+        recurse(Value[i]);
+        CurPath.pop_back();
+      }
+    } else if (Value.kind() == Kind::Map) {
+      for (const auto &item : Value.map_range()) {
+        CurPath.emplace_back(utf8_string_arg, item.key());
+        recurse(item.value());
+        CurPath.pop_back();
+      }
+    }
+  };
+  recurse(Value);
+  return Result;
+}
+
+namespace {
+// Builds a PathGraph using several threads. Like Transfer, each thread takes
+// a batch of CIDs from a shared worklist, looks up the Names that use them,
+// and adds any new parent CIDs back to the worklist. The graph itself
+// remembers which CIDs have been seen, so each CID is looked up only once.
+class PathGraphBuilder {
+public:
+  PathGraphBuilder(Store &store, const CID &target,
+                   const PathGraphOptions &options)
+      : store(store), options(options), graph(target) {
+    graph.setEdges(target, {});
+    worklist.push_back(target);
+  }
+
+  PathGraph run();
+
+private:
+  void work();
+  void lookupBatch(std::unique_lock<std::mutex> &lock);
+
+  Store &store;
+  const PathGraphOptions &options;
+  std::size_t batch_size;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  // The following fields are protected by mutex.
+  PathGraph graph;
+  // CIDs that are in the graph but haven't been looked up yet.
+  std::vector<CID> worklist;
+  // The number of threads working on a batch.
+  unsigned num_busy = 0;
+};
+} // end anonymous namespace
+
+PathGraph PathGraphBuilder::run() {
+  batch_size = std::max(options.batch_size, std::size_t(1));
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < std::max(options.num_threads, 1u); ++i)
+    threads.emplace_back([this]() { work(); });
+  work();
+  for (auto &thread : threads)
+    thread.join();
+  return std::move(graph);
+}
+
+void PathGraphBuilder::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cv.wait(lock, [this]() { return !worklist.empty() || num_busy == 0; });
+    if (worklist.empty())
+      return; // No thread is busy, so no more work will be added.
+    lookupBatch(lock);
+    cv.notify_all();
+  }
+}
+
+void PathGraphBuilder::lookupBatch(std::unique_lock<std::mutex> &lock) {
+  std::size_t size = std::min(batch_size, worklist.size());
+  std::vector<CID> batch(worklist.end() - size, worklist.end());
+  worklist.erase(worklist.end() - size, worklist.end());
+  ++num_busy;
+  lock.unlock();
+
+  auto names = store.listNamesUsingMany(batch);
+
+  // Fetch each parent Node once, even if it links to several CIDs in the
+  // batch.
+  std::vector<CID> parents;
+  for (const auto &item_names : names)
+    for (const Name &name : item_names)
+      if (const CID *parent = std::get_if<CID>(&name))
+        parents.push_back(*parent);
+  std::sort(parents.begin(), parents.end());
+  parents.erase(std::unique(parents.begin(), parents.end()), parents.end());
+  auto nodes = store.getMany(parents);
+  auto getParentNode = [&](const CID &parent) -> const Node & {
+    auto iter = std::lower_bound(parents.begin(), parents.end(), parent);
+    const auto &node = nodes[iter - parents.begin()];
+    if (!node)
+      llvm::report_fatal_error("Node missing from store: " +
+                               Twine(parent.asString(Multibase::base64url)));
+    return *node;
+  };
+
+  std::vector<std::vector<PathGraph::Edge>> edges(batch.size());
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    for (const Name &name : names[i]) {
+      if (const CID *parent = std::get_if<CID>(&name)) {
+        for (auto &subpath : listPathsWithin(getParentNode(*parent), batch[i]))
+          edges[i].emplace_back(name, std::move(subpath));
+      } else {
+        edges[i].emplace_back(name);
+      }
+    }
+  }
+
+  lock.lock();
+  --num_busy;
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    for (const PathGraph::Edge &edge : edges[i]) {
+      const CID *parent = std::get_if<CID>(&edge.Parent);
+      if (parent && !graph.getAllEdges().count(*parent)) {
+        graph.setEdges(*parent, {});
+        worklist.push_back(*parent);
+      }
+    }
+    graph.setEdges(batch[i], std::move(edges[i]));
+  }
+}
+
+PathGraph memodb::buildPathGraph(Store &store, const CID &target,
+                                 const PathGraphOptions &options) {
+  return PathGraphBuilder(store, target, options).run();
+}
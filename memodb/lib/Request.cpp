@@ -82,17 +82,20 @@ void Request::sendContentNode(const Node &node,
   // Query parameters don't need to affect the etag because caches must use the
   // full URI as a cache key.
 
+  // Encode into the string that will become the response body, so the
+  // server can take it over without copying. The whole body is built in
+  // memory before any of it is sent, because the ETag may be a hash of it;
+  // responses aren't streamed. raw_string_ostream is unbuffered, so body
+  // stays up to date.
   llvm::StringRef body;
-  std::vector<std::uint8_t> byte_buffer;
-  llvm::SmallVector<char, 256> char_buffer;
-  llvm::raw_svector_ostream stream(char_buffer);
+  std::string body_buffer;
+  llvm::raw_string_ostream stream(body_buffer);
 
   if (type == ContentType::OctetStream) {
     body = node.as<llvm::StringRef>(byte_string_arg);
   } else if (type == ContentType::CBOR) {
-    byte_buffer = node.saveAsCBOR();
-    body = llvm::StringRef(reinterpret_cast<const char *>(byte_buffer.data()),
-                           byte_buffer.size());
+    node.saveAsCBOR(stream);
+    body = stream.str();
   } else if (type == ContentType::HTML) {
     std::string cid_string = "MemoDB Node";
     if (cid_if_known)
@@ -148,7 +151,10 @@ void Request::sendContentNode(const Node &node,
       return;
   }
 
-  sendContent(type, body);
+  if (type == ContentType::OctetStream)
+    sendContent(type, body);
+  else
+    sendOwnedContent(type, std::move(body_buffer));
 }
 
 void Request::sendContentURIs(const llvm::ArrayRef<URI> uris,
@@ -2,17 +2,25 @@
 
 #if BCDB_WITH_ROCKSDB
 
+#include <cctype>
+#include <cstdint>
 #include <functional>
 #include <llvm/ADT/Optional.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/Error.h>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <rocksdb/comparator.h>
 #include <rocksdb/db.h>
 #include <rocksdb/filter_policy.h>
+#include <rocksdb/slice_transform.h>
 #include <rocksdb/table.h>
 #include <rocksdb/utilities/optimistic_transaction_db.h>
 #include <rocksdb/utilities/transaction.h>
+#include <rocksdb/utilities/write_batch_with_index.h>
+#include <shared_mutex>
 #include <string>
 #include <vector>
 
@@ -38,6 +46,7 @@ using llvm::Twine;
  * "calls"
  * - Contains (CBOR(function_name) + CID(arg0) + CID(arg1) + ..., CID(result))
  *   for every call.
+ * - The prefix extractor returns CBOR(function_name).
  *
  * "refs"
  * - Contains (UsedCID + TYPE_BLOCK + UserCID, "") for every block UserCID that
@@ -45,6 +54,7 @@ using llvm::Twine;
  * - Contains (UsedCID + TYPE_HEAD + name, "") for every head.
  * - Contains (UsedCID + TYPE_CALL + CBOR(function_name) + CID(arg0) +
  *   CID(arg1) + ..., "") for every call's result and arguments.
+ * - The prefix extractor returns UsedCID.
  *
  * NOTE: as an alternative, it would be possible to store hashes of call
  * arguments instead of putting the arguments directly in the key. This would
@@ -62,6 +72,16 @@ static const char TYPE_BLOCK = 'b';
 static const char TYPE_CALL = 'c';
 static const char TYPE_HEAD = 'h';
 
+// Pending Store::Batch writes are written early once they reach this size,
+// to limit memory usage.
+static const size_t MAX_PENDING_BATCH_SIZE = 64 << 20;
+
+// Readahead for iterators that may scan many calls.
+static const size_t SCAN_READAHEAD_SIZE = 2 << 20;
+
+// call_invalidate() deletes this many calls in each write.
+static const size_t INVALIDATE_CHUNK_SIZE = 4096;
+
 static llvm::ArrayRef<uint8_t> makeBytes(const rocksdb::Slice &Slice) {
   return llvm::ArrayRef(reinterpret_cast<const uint8_t *>(Slice.data()),
                         Slice.size());
@@ -72,10 +92,129 @@ static rocksdb::Slice makeSlice(const llvm::ArrayRef<uint8_t> &Bytes) {
                         Bytes.size());
 }
 
+// Parse a size like "4G" or "512M" (binary units). Returns true on error, like
+// StringRef::getAsInteger().
+static bool parseSize(llvm::StringRef Str, uint64_t &Result) {
+  unsigned Shift = 0;
+  if (!Str.empty()) {
+    switch (std::toupper(Str.back())) {
+    case 'K':
+      Shift = 10;
+      break;
+    case 'M':
+      Shift = 20;
+      break;
+    case 'G':
+      Shift = 30;
+      break;
+    case 'T':
+      Shift = 40;
+      break;
+    }
+  }
+  if (Shift)
+    Str = Str.drop_back();
+  if (Str.getAsInteger(10, Result) || Result > (UINT64_MAX >> Shift))
+    return true;
+  Result <<= Shift;
+  return false;
+}
+
+// Return the smallest key that's greater than every key starting with Prefix,
+// or an empty string if there isn't one.
+static std::string getPrefixSuccessor(const rocksdb::Slice &Prefix) {
+  std::string Result = Prefix.ToString();
+  while (!Result.empty()) {
+    auto &Last = reinterpret_cast<unsigned char &>(Result.back());
+    if (Last != 0xff) {
+      ++Last;
+      break;
+    }
+    Result.pop_back();
+  }
+  return Result;
+}
+
+// Return the size of the CBOR text string at the start of Key, or 0 if there
+// isn't a complete one.
+static size_t getFuncNamePrefixSize(const rocksdb::Slice &Key) {
+  if (Key.empty() || uint8_t(Key[0]) >> 5 != 3)
+    return 0;
+  unsigned Minor = Key[0] & 0x1f;
+  if (Minor >= 28)
+    return 0;
+  size_t HeadSize = Minor < 24 ? 1 : 1 + (size_t(1) << (Minor - 24));
+  if (Key.size() < HeadSize)
+    return 0;
+  uint64_t Length = Minor < 24 ? Minor : 0;
+  for (size_t i = 1; i < HeadSize; i++)
+    Length = Length << 8 | uint8_t(Key[i]);
+  if (Length > Key.size() - HeadSize)
+    return 0;
+  return HeadSize + Length;
+}
+
+// Return the size of the CID at the start of Key, or 0 if there isn't one.
+static size_t getCIDPrefixSize(const rocksdb::Slice &Key) {
+  auto Bytes = makeBytes(Key);
+  if (!CID::loadFromSequence(Bytes))
+    return 0;
+  return Key.size() - Bytes.size();
+}
+
+namespace {
+// A prefix extractor that uses a function to find the size of each prefix.
+class KeyPrefix : public rocksdb::SliceTransform {
+public:
+  KeyPrefix(const char *Name, size_t (*GetSize)(const rocksdb::Slice &))
+      : PrefixName(Name), GetSize(GetSize) {}
+  const char *Name() const override { return PrefixName; }
+  rocksdb::Slice Transform(const rocksdb::Slice &Key) const override {
+    return rocksdb::Slice(Key.data(), GetSize(Key));
+  }
+  bool InDomain(const rocksdb::Slice &Key) const override {
+    return GetSize(Key) != 0;
+  }
+
+private:
+  const char *PrefixName;
+  size_t (*GetSize)(const rocksdb::Slice &);
+};
+
+// ReadOptions for iterating over the keys that start with Prefix, using the
+// column family's prefix extractor. Prefix must be a whole prefix, as returned
+// by the extractor.
+struct PrefixReadOptions : public rocksdb::ReadOptions {
+  explicit PrefixReadOptions(const rocksdb::Slice &Prefix)
+      : UpperBound(getPrefixSuccessor(Prefix)), UpperBoundSlice(UpperBound) {
+    prefix_same_as_start = true;
+    if (!UpperBound.empty())
+      iterate_upper_bound = &UpperBoundSlice;
+  }
+  PrefixReadOptions(const PrefixReadOptions &) = delete;
+  PrefixReadOptions &operator=(const PrefixReadOptions &) = delete;
+
+  std::string UpperBound;
+  rocksdb::Slice UpperBoundSlice;
+};
+} // end anonymous namespace
+
+static bool parseBool(llvm::StringRef Str, bool &Result) {
+  if (Str == "0" || Str == "false")
+    Result = false;
+  else if (Str == "1" || Str == "true")
+    Result = true;
+  else
+    return true;
+  return false;
+}
+
 namespace {
 class RocksDBStore : public Store {
 private:
-  std::unique_ptr<rocksdb::OptimisticTransactionDB> DB;
+  std::unique_ptr<rocksdb::DB> DB;
+  // The same database as DB, or nullptr if it was opened read-only.
+  rocksdb::OptimisticTransactionDB *TxnDB = nullptr;
   rocksdb::ColumnFamilyHandle *DefaultFamily;
   rocksdb::ColumnFamilyHandle *BlocksFamily;
   rocksdb::ColumnFamilyHandle *CallsFamily;
@@ -84,6 +223,7 @@ private:
 
   void checkStatus(const rocksdb::Status &Status);
   bool checkFound(const rocksdb::Status &Status);
+  void checkWritable();
 
   template <typename BatchT>
   void addRef(BatchT &Batch, char Type, const rocksdb::Slice &From,
@@ -91,11 +231,33 @@ private:
   template <typename BatchT>
   void deleteRef(BatchT &Batch, char Type, const rocksdb::Slice &From,
                  const rocksdb::Slice &To);
-  void addRefs(rocksdb::WriteBatch &Batch, char Type,
-               const llvm::ArrayRef<uint8_t> &Key, const Node &Value);
+  template <typename BatchT>
+  void addRefs(BatchT &Batch, char Type, const llvm::ArrayRef<uint8_t> &Key,
+               const Node &Value);
 
   std::string makeKeyForCall(const Call &Call);
 
+  // One lock for each func. set() holds it shared while setting a call, and
+  // call_invalidate() holds it exclusively, because call_invalidate() writes
+  // outside of transactions. Only one process can open the database for
+  // writing, so locking within the process is enough.
+  std::mutex FuncLocksMutex;
+  llvm::StringMap<std::unique_ptr<std::shared_mutex>> FuncLocks;
+  std::shared_mutex &getFuncLock(llvm::StringRef Func);
+
+  // Writes made by each thread's current Store::Batch, if it has one.
+  static thread_local std::map<RocksDBStore *,
+                               std::unique_ptr<rocksdb::WriteBatchWithIndex>>
+      thread_batches;
+
+  // Get the current thread's pending batch, or nullptr if there isn't one.
+  rocksdb::WriteBatchWithIndex *getPendingBatch();
+
+  // Write any pending batch for the current thread to the database. Heads and
+  // calls are always written immediately, so this is used to make sure the
+  // blocks they refer to are written first.
+  void flushPendingBatch();
+
 public:
   void open(llvm::StringRef uri, bool create_if_missing);
   ~RocksDBStore() override;
@@ -111,9 +273,26 @@ public:
                 std::function<bool(const Call &)> F) override;
   void head_delete(const Head &Head) override;
   void call_invalidate(llvm::StringRef name) override;
+  std::vector<llvm::Optional<Node>> getMany(llvm::ArrayRef<CID> CIDs) override;
+  bool viewBytes(const CID &CID, std::function<void(BytesRef)> F) override;
+  void viewManyBytes(llvm::ArrayRef<CID> CIDs,
+                     std::function<void(size_t, BytesRef)> F) override;
+  std::vector<CID> putMany(llvm::ArrayRef<Node> values) override;
+  std::vector<bool> hasMany(llvm::ArrayRef<CID> CIDs) override;
+  std::vector<llvm::Optional<CID>>
+  resolveMany(llvm::ArrayRef<Name> Names) override;
+
+protected:
+  bool beginBatch() override;
+  void commitBatch() override;
+  void abortBatch() override;
 };
 } // end anonymous namespace
 
+thread_local std::map<RocksDBStore *,
+                      std::unique_ptr<rocksdb::WriteBatchWithIndex>>
+    RocksDBStore::thread_batches;
+
 void RocksDBStore::checkStatus(const rocksdb::Status &Status) {
   if (!Status.ok())
     llvm::report_fatal_error("RocksDB error: " + Twine(Status.ToString()));
@@ -126,6 +305,11 @@ bool RocksDBStore::checkFound(const rocksdb::Status &Status) {
   return true;
 }
 
+void RocksDBStore::checkWritable() {
+  if (!TxnDB)
+    llvm::report_fatal_error("RocksDB store was opened read-only");
+}
+
 template <typename BatchT>
 void RocksDBStore::addRef(BatchT &Batch, char Type, const rocksdb::Slice &From,
                           const CID &To) {
@@ -150,10 +334,11 @@ void RocksDBStore::deleteRef(BatchT &Batch, char Type,
       From,
   };
   rocksdb::SliceParts Key(Slices, 3);
-  Batch.Delete(RefsFamily, Key, {});
+  Batch.Delete(RefsFamily, Key);
 }
 
-void RocksDBStore::addRefs(rocksdb::WriteBatch &Batch, char Type,
+template <typename BatchT>
+void RocksDBStore::addRefs(BatchT &Batch, char Type,
                            const llvm::ArrayRef<uint8_t> &Key,
                            const Node &Value) {
   Value.eachLink([&](const auto &Link) {
@@ -162,6 +347,39 @@ void RocksDBStore::addRefs(rocksdb::WriteBatch &Batch, char Type,
   });
 }
 
+rocksdb::WriteBatchWithIndex *RocksDBStore::getPendingBatch() {
+  auto Iter = thread_batches.find(this);
+  return Iter == thread_batches.end() ? nullptr : Iter->second.get();
+}
+
+void RocksDBStore::flushPendingBatch() {
+  auto *Pending = getPendingBatch();
+  if (!Pending || !Pending->GetWriteBatch()->Count())
+    return;
+  checkStatus(DB->Write({}, Pending->GetWriteBatch()));
+  Pending->Clear();
+}
+
+bool RocksDBStore::beginBatch() {
+  auto &Pending = thread_batches[this];
+  if (Pending)
+    return false;
+  // Use overwrite_key so GetFromBatchAndDB() works for repeated keys.
+  Pending = std::make_unique<rocksdb::WriteBatchWithIndex>(
+      rocksdb::BytewiseComparator(), 0, /*overwrite_key*/ true);
+  return true;
+}
+
+void RocksDBStore::commitBatch() {
+  flushPendingBatch();
+  thread_batches.erase(this);
+}
+
+void RocksDBStore::abortBatch() {
+  // Anything written early by flushPendingBatch() stays in the database.
+  thread_batches.erase(this);
+}
+
 std::string RocksDBStore::makeKeyForCall(const Call &Call) {
   std::vector<std::uint8_t> Buffer;
   std::string Key =
@@ -173,29 +391,74 @@ std::string RocksDBStore::makeKeyForCall(const Call &Call) {
   return Key;
 }
 
+std::shared_mutex &RocksDBStore::getFuncLock(llvm::StringRef Func) {
+  std::lock_guard<std::mutex> Lock(FuncLocksMutex);
+  auto &FuncLock = FuncLocks[Func];
+  if (!FuncLock)
+    FuncLock = std::make_unique<std::shared_mutex>();
+  return *FuncLock;
+}
+
 void RocksDBStore::open(llvm::StringRef uri, bool create_if_missing) {
   auto Parsed = URI::parse(uri, /*allow_dot_segments*/ true);
   if (!Parsed || Parsed->scheme != "rocksdb" || !Parsed->host.empty() ||
-      Parsed->port != 0 || !Parsed->query_params.empty() ||
-      !Parsed->fragment.empty())
+      Parsed->port != 0 || !Parsed->fragment.empty())
     llvm::report_fatal_error("Unsupported RocksDB URI");
 
+  // The defaults use about 1GB of memory; see docs/tutorial.md.
+  uint64_t CacheSize = 256 << 20;
+  uint64_t WriteBufferSize = 256 << 20;
+  uint64_t MinBlobSize = 64 << 10;
+  unsigned Threads = 16;
+  bool BlobGC = true;
+  bool ReadOnly = false;
+  std::string SecondaryPath;
+  for (llvm::StringRef Param : Parsed->query_params) {
+    if (Param.consume_front("cache=")) {
+      if (parseSize(Param, CacheSize))
+        llvm::report_fatal_error("invalid cache size in RocksDB URI");
+    } else if (Param.consume_front("write_buffer=")) {
+      if (parseSize(Param, WriteBufferSize) || WriteBufferSize == 0)
+        llvm::report_fatal_error("invalid write buffer size in RocksDB URI");
+    } else if (Param.consume_front("min_blob_size=")) {
+      if (parseSize(Param, MinBlobSize))
+        llvm::report_fatal_error("invalid minimum blob size in RocksDB URI");
+    } else if (Param.consume_front("threads=")) {
+      if (Param.getAsInteger(10, Threads) || Threads == 0)
+        llvm::report_fatal_error("invalid number of threads in RocksDB URI");
+    } else if (Param.consume_front("blob_gc=")) {
+      if (parseBool(Param, BlobGC))
+        llvm::report_fatal_error("invalid blob_gc value in RocksDB URI");
+    } else if (Param.consume_front("read_only=")) {
+      if (parseBool(Param, ReadOnly))
+        llvm::report_fatal_error("invalid read_only value in RocksDB URI");
+    } else if (Param.consume_front("secondary=")) {
+      if (Param.empty())
+        llvm::report_fatal_error("invalid secondary path in RocksDB URI");
+      SecondaryPath = Param.str();
+    } else {
+      llvm::report_fatal_error("unsupported parameter in RocksDB URI");
+    }
+  }
+  if (!SecondaryPath.empty())
+    ReadOnly = true;
+
   rocksdb::ColumnFamilyOptions BaseCFOptions;
   rocksdb::DBOptions DBOptions;
   rocksdb::BlockBasedTableOptions TableOptions;
 
-  DBOptions.create_if_missing = create_if_missing;
-  DBOptions.create_missing_column_families = create_if_missing;
+  DBOptions.create_if_missing = create_if_missing && !ReadOnly;
+  DBOptions.create_missing_column_families = create_if_missing && !ReadOnly;
 
   // https://github.com/facebook/rocksdb/wiki/Setup-Options-and-Basic-Tuning
   // Some obsolete options from that page have been replaced.
-  TableOptions.block_cache = rocksdb::NewLRUCache(256 << 20);
+  TableOptions.block_cache = rocksdb::NewLRUCache(CacheSize);
   BaseCFOptions.compression = rocksdb::kLZ4Compression;
   BaseCFOptions.bottommost_compression = rocksdb::kZSTD;
   TableOptions.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
   TableOptions.optimize_filters_for_memory = true;
   BaseCFOptions.level_compaction_dynamic_level_bytes = true;
-  DBOptions.IncreaseParallelism(16);
+  DBOptions.IncreaseParallelism(Threads);
   DBOptions.bytes_per_sync = 1 << 20;
   TableOptions.block_size = 16 << 10;
   TableOptions.cache_index_and_filter_blocks = true;
@@ -221,7 +484,7 @@ void RocksDBStore::open(llvm::StringRef uri, bool create_if_missing) {
 
   // We want fewer, larger blob files and table files, to make sure huge
   // databases have a reasonable number of files.
-  BaseCFOptions.write_buffer_size = 256 << 20;
+  BaseCFOptions.write_buffer_size = WriteBufferSize;
   BaseCFOptions.target_file_size_base =
       BaseCFOptions.write_buffer_size *
       BaseCFOptions.min_write_buffer_number_to_merge;
@@ -237,11 +500,12 @@ void RocksDBStore::open(llvm::StringRef uri, bool create_if_missing) {
   DBOptions.db_write_buffer_size = BaseCFOptions.write_buffer_size * 3;
   DBOptions.max_total_wal_size = DBOptions.db_write_buffer_size * 4;
 
-  // With our 256MB block cache and 768MB db_write_buffer_size, total memory
-  // usage by RocksDB should be ~1GB.
+  // Total memory usage by RocksDB should be about CacheSize plus
+  // db_write_buffer_size (~1GB with the defaults).
 
-  // Prevent EMFILE error when opening too many files.
-  DBOptions.max_open_files = 1024;
+  // Prevent EMFILE error when opening too many files. Secondary instances
+  // must keep all files open, because the primary may delete them.
+  DBOptions.max_open_files = SecondaryPath.empty() ? 1024 : -1;
 
   BaseCFOptions.table_factory.reset(
       rocksdb::NewBlockBasedTableFactory(TableOptions));
@@ -253,23 +517,51 @@ void RocksDBStore::open(llvm::StringRef uri, bool create_if_missing) {
   auto BlocksCFOptions = BaseCFOptions;
   BlocksCFOptions.enable_blob_files = true;
   BlocksCFOptions.blob_compression_type = rocksdb::kZSTD;
-  BlocksCFOptions.min_blob_size = 64 << 10;
-  // Combine blob files into larger ones.
-  // BlocksCFOptions.enable_blob_garbage_collection = true;
+  BlocksCFOptions.min_blob_size = MinBlobSize;
+  // Relocate the blobs in the oldest quarter of blob files whenever
+  // compaction reaches them. This combines the small blob files written by
+  // early flushes into larger ones, and removes any blobs that are no longer
+  // referenced.
+  BlocksCFOptions.enable_blob_garbage_collection = BlobGC;
+  BlocksCFOptions.blob_garbage_collection_age_cutoff = 0.25;
+
+  // Calls and refs are usually scanned by function name or CID, so let those
+  // scans use bloom filters and skip irrelevant files.
+  auto CallsCFOptions = BaseCFOptions;
+  CallsCFOptions.prefix_extractor =
+      std::make_shared<KeyPrefix>("memodb.FuncName", getFuncNamePrefixSize);
+  auto RefsCFOptions = BaseCFOptions;
+  RefsCFOptions.prefix_extractor =
+      std::make_shared<KeyPrefix>("memodb.CID", getCIDPrefixSize);
 
   std::vector<rocksdb::ColumnFamilyDescriptor> FamilyDescs;
   FamilyDescs.emplace_back(rocksdb::kDefaultColumnFamilyName, BaseCFOptions);
   FamilyDescs.emplace_back("blocks", BlocksCFOptions);
-  FamilyDescs.emplace_back("calls", BaseCFOptions);
+  FamilyDescs.emplace_back("calls", CallsCFOptions);
   FamilyDescs.emplace_back("heads", BaseCFOptions);
-  FamilyDescs.emplace_back("refs", BaseCFOptions);
+  FamilyDescs.emplace_back("refs", RefsCFOptions);
 
   std::vector<rocksdb::ColumnFamilyHandle *> FamilyHandles;
-  rocksdb::OptimisticTransactionDB *TmpDB;
-  checkStatus(rocksdb::OptimisticTransactionDB::Open(
-      DBOptions, {}, Parsed->getPathString(), FamilyDescs, &FamilyHandles,
-      &TmpDB));
-  DB.reset(TmpDB);
+  std::string Path = Parsed->getPathString();
+  if (!SecondaryPath.empty()) {
+    // A secondary instance can be used while another process has the database
+    // open. It sees the primary's writes up to the time it was opened.
+    rocksdb::DB *TmpDB;
+    checkStatus(rocksdb::DB::OpenAsSecondary(DBOptions, Path, SecondaryPath,
+                                             FamilyDescs, &FamilyHandles,
+                                             &TmpDB));
+    DB.reset(TmpDB);
+    checkStatus(DB->TryCatchUpWithPrimary());
+  } else if (ReadOnly) {
+    rocksdb::DB *TmpDB;
+    checkStatus(rocksdb::DB::OpenForReadOnly(DBOptions, Path, FamilyDescs,
+                                             &FamilyHandles, &TmpDB));
+    DB.reset(TmpDB);
+  } else {
+    checkStatus(rocksdb::OptimisticTransactionDB::Open(
+        DBOptions, {}, Path, FamilyDescs, &FamilyHandles, &TxnDB));
+    DB.reset(TxnDB);
+  }
 
   assert(FamilyHandles.size() == 5);
   DefaultFamily = FamilyHandles[0];
@@ -292,6 +584,8 @@ void RocksDBStore::open(llvm::StringRef uri, bool create_if_missing) {
       llvm::report_fatal_error("unsupported database version");
   } else {
     checkStatus(Iterator->status());
+    if (ReadOnly)
+      llvm::report_fatal_error("this is not a MemoDB database");
     // empty database, insert magic values
     checkStatus(DB->Put({}, DefaultFamily, "format", "MemoDB"));
     checkStatus(DB->Put({}, DefaultFamily, "version", "0"));
@@ -299,7 +593,8 @@ void RocksDBStore::open(llvm::StringRef uri, bool create_if_missing) {
 }
 
 RocksDBStore::~RocksDBStore() {
-  checkStatus(DB->FlushWAL(true));
+  if (TxnDB)
+    checkStatus(DB->FlushWAL(true));
   checkStatus(DB->DestroyColumnFamilyHandle(DefaultFamily));
   checkStatus(DB->DestroyColumnFamilyHandle(BlocksFamily));
   checkStatus(DB->DestroyColumnFamilyHandle(CallsFamily));
@@ -312,12 +607,36 @@ llvm::Optional<Node> RocksDBStore::getOptional(const CID &CID) {
   if (CID.isIdentity())
     return llvm::cantFail(Node::loadFromIPLD(*this, CID, {}));
   rocksdb::PinnableSlice Fetched;
-  if (!checkFound(
-          DB->Get({}, BlocksFamily, makeSlice(CID.asBytes()), &Fetched)))
+  auto Key = makeSlice(CID.asBytes());
+  auto *Pending = getPendingBatch();
+  if (!checkFound(Pending ? Pending->GetFromBatchAndDB(DB.get(), {},
+                                                       BlocksFamily, Key,
+                                                       &Fetched)
+                          : DB->Get({}, BlocksFamily, Key, &Fetched)))
     return {};
   return llvm::cantFail(Node::loadFromIPLD(*this, CID, makeBytes(Fetched)));
 }
 
+bool RocksDBStore::viewBytes(const CID &CID,
+                             std::function<void(BytesRef)> F) {
+  // The PinnableSlice can refer directly to RocksDB's block cache, so the
+  // bytes don't need to be copied.
+  rocksdb::PinnableSlice Fetched;
+  if (!CID.isIdentity()) {
+    auto Key = makeSlice(CID.asBytes());
+    auto *Pending = getPendingBatch();
+    if (!checkFound(Pending ? Pending->GetFromBatchAndDB(DB.get(), {},
+                                                         BlocksFamily, Key,
+                                                         &Fetched)
+                            : DB->Get({}, BlocksFamily, Key, &Fetched)))
+      return false;
+  }
+  std::optional<Node> Storage;
+  F(llvm::cantFail(
+      Node::viewBytesFromIPLD(*this, CID, makeBytes(Fetched), Storage)));
+  return true;
+}
+
 llvm::Optional<CID> RocksDBStore::resolveOptional(const Name &Name) {
   if (const CID *Ref = std::get_if<CID>(&Name)) {
     return *Ref;
@@ -341,8 +660,21 @@ CID RocksDBStore::put(const Node &value) {
   auto IPLD = value.saveAsIPLD();
   if (IPLD.second.empty())
     return IPLD.first;
+  checkWritable();
   auto Key = IPLD.first.asBytes();
 
+  if (auto *Pending = getPendingBatch()) {
+    rocksdb::PinnableSlice Fetched;
+    if (checkFound(Pending->GetFromBatchAndDB(
+            DB.get(), {}, BlocksFamily, makeSlice(Key), &Fetched)))
+      return IPLD.first;
+    Pending->Put(BlocksFamily, makeSlice(Key), makeSlice(IPLD.second));
+    addRefs(*Pending, TYPE_BLOCK, Key, value);
+    if (Pending->GetWriteBatch()->GetDataSize() > MAX_PENDING_BATCH_SIZE)
+      flushPendingBatch();
+    return IPLD.first;
+  }
+
   rocksdb::PinnableSlice Fetched;
   if (checkFound(DB->Get({}, BlocksFamily, makeSlice(Key), &Fetched))) {
     assert(makeSlice(IPLD.second) == Fetched);
@@ -356,11 +688,161 @@ CID RocksDBStore::put(const Node &value) {
   return IPLD.first;
 }
 
+std::vector<llvm::Optional<Node>>
+RocksDBStore::getMany(llvm::ArrayRef<CID> CIDs) {
+  if (getPendingBatch())
+    return Store::getMany(CIDs); // MultiGet can't see the pending writes.
+  std::vector<rocksdb::Slice> Keys;
+  Keys.reserve(CIDs.size());
+  for (const CID &CID : CIDs)
+    Keys.emplace_back(makeSlice(CID.asBytes()));
+  std::vector<rocksdb::PinnableSlice> Values(CIDs.size());
+  std::vector<rocksdb::Status> Statuses(CIDs.size());
+  DB->MultiGet({}, BlocksFamily, Keys.size(), Keys.data(), Values.data(),
+               Statuses.data());
+
+  std::vector<llvm::Optional<Node>> Result;
+  Result.reserve(CIDs.size());
+  for (size_t i = 0; i < CIDs.size(); i++) {
+    if (CIDs[i].isIdentity())
+      Result.emplace_back(
+          llvm::cantFail(Node::loadFromIPLD(*this, CIDs[i], {})));
+    else if (!checkFound(Statuses[i]))
+      Result.emplace_back(llvm::None);
+    else
+      Result.emplace_back(llvm::cantFail(
+          Node::loadFromIPLD(*this, CIDs[i], makeBytes(Values[i]))));
+  }
+  return Result;
+}
+
+void RocksDBStore::viewManyBytes(llvm::ArrayRef<CID> CIDs,
+                                 std::function<void(size_t, BytesRef)> F) {
+  if (getPendingBatch())
+    return Store::viewManyBytes(CIDs, F); // MultiGet can't see pending writes.
+  std::vector<rocksdb::Slice> Keys;
+  Keys.reserve(CIDs.size());
+  for (const CID &CID : CIDs)
+    Keys.emplace_back(makeSlice(CID.asBytes()));
+  std::vector<rocksdb::PinnableSlice> Values(CIDs.size());
+  std::vector<rocksdb::Status> Statuses(CIDs.size());
+  DB->MultiGet({}, BlocksFamily, Keys.size(), Keys.data(), Values.data(),
+               Statuses.data());
+
+  for (size_t i = 0; i < CIDs.size(); i++) {
+    if (!CIDs[i].isIdentity() && !checkFound(Statuses[i]))
+      continue;
+    std::optional<Node> Storage;
+    F(i, llvm::cantFail(Node::viewBytesFromIPLD(
+             *this, CIDs[i], makeBytes(Values[i]), Storage)));
+    // Release the pinned block as soon as possible.
+    Values[i].Reset();
+  }
+}
+
+std::vector<CID> RocksDBStore::putMany(llvm::ArrayRef<Node> values) {
+  checkWritable();
+  if (getPendingBatch())
+    return Store::putMany(values); // Add to the pending batch.
+  std::vector<CID> Result;
+  std::vector<std::pair<size_t, std::vector<std::uint8_t>>> NewBlocks;
+  Result.reserve(values.size());
+  for (size_t i = 0; i < values.size(); i++) {
+    auto IPLD = values[i].saveAsIPLD();
+    Result.emplace_back(IPLD.first);
+    if (!IPLD.second.empty())
+      NewBlocks.emplace_back(i, std::move(IPLD.second));
+  }
+
+  // Skip blocks that are already present, like put() does, so we don't
+  // rewrite them and their refs.
+  std::vector<rocksdb::Slice> Keys;
+  Keys.reserve(NewBlocks.size());
+  for (const auto &Item : NewBlocks)
+    Keys.emplace_back(makeSlice(Result[Item.first].asBytes()));
+  std::vector<rocksdb::PinnableSlice> Values(Keys.size());
+  std::vector<rocksdb::Status> Statuses(Keys.size());
+  DB->MultiGet({}, BlocksFamily, Keys.size(), Keys.data(), Values.data(),
+               Statuses.data());
+
+  rocksdb::WriteBatch Batch;
+  for (size_t i = 0; i < NewBlocks.size(); i++) {
+    if (checkFound(Statuses[i]))
+      continue;
+    auto Key = Result[NewBlocks[i].first].asBytes();
+    Batch.Put(BlocksFamily, makeSlice(Key), makeSlice(NewBlocks[i].second));
+    addRefs(Batch, TYPE_BLOCK, Key, values[NewBlocks[i].first]);
+  }
+  if (Batch.Count())
+    checkStatus(DB->Write({}, &Batch));
+  return Result;
+}
+
+std::vector<bool> RocksDBStore::hasMany(llvm::ArrayRef<CID> CIDs) {
+  if (getPendingBatch())
+    return Store::hasMany(CIDs); // MultiGet can't see the pending writes.
+  std::vector<rocksdb::Slice> Keys;
+  Keys.reserve(CIDs.size());
+  for (const CID &CID : CIDs)
+    Keys.emplace_back(makeSlice(CID.asBytes()));
+  std::vector<rocksdb::PinnableSlice> Values(CIDs.size());
+  std::vector<rocksdb::Status> Statuses(CIDs.size());
+  DB->MultiGet({}, BlocksFamily, Keys.size(), Keys.data(), Values.data(),
+               Statuses.data());
+
+  std::vector<bool> Result;
+  Result.reserve(CIDs.size());
+  for (size_t i = 0; i < CIDs.size(); i++)
+    Result.push_back(CIDs[i].isIdentity() || checkFound(Statuses[i]));
+  return Result;
+}
+
+std::vector<llvm::Optional<CID>>
+RocksDBStore::resolveMany(llvm::ArrayRef<Name> Names) {
+  // MultiGet can look up keys in several column families at once.
+  std::vector<std::string> CallKeys;
+  std::vector<rocksdb::ColumnFamilyHandle *> Families;
+  std::vector<rocksdb::Slice> Keys;
+  std::vector<size_t> Indices;
+  // Make sure CallKeys is never reallocated, since Keys points into it.
+  CallKeys.reserve(Names.size());
+  for (size_t i = 0; i < Names.size(); i++) {
+    if (const Head *head = std::get_if<Head>(&Names[i])) {
+      Families.push_back(HeadsFamily);
+      Keys.emplace_back(head->Name);
+      Indices.push_back(i);
+    } else if (const Call *call = std::get_if<Call>(&Names[i])) {
+      CallKeys.emplace_back(makeKeyForCall(*call));
+      Families.push_back(CallsFamily);
+      Keys.emplace_back(CallKeys.back());
+      Indices.push_back(i);
+    }
+  }
+  std::vector<rocksdb::PinnableSlice> Values(Keys.size());
+  std::vector<rocksdb::Status> Statuses(Keys.size());
+  DB->MultiGet({}, Keys.size(), Families.data(), Keys.data(), Values.data(),
+               Statuses.data());
+
+  std::vector<llvm::Optional<CID>> Result(Names.size());
+  for (size_t i = 0; i < Names.size(); i++)
+    if (const CID *Ref = std::get_if<CID>(&Names[i]))
+      Result[i] = *Ref;
+  for (size_t i = 0; i < Keys.size(); i++)
+    if (checkFound(Statuses[i]))
+      Result[Indices[i]] = *CID::fromBytes(makeBytes(Values[i]));
+  return Result;
+}
+
 void RocksDBStore::set(const Name &Name, const CID &ref) {
+  checkWritable();
+  flushPendingBatch();
+  std::shared_lock<std::shared_mutex> FuncLock;
+  if (const Call *call = std::get_if<Call>(&Name))
+    FuncLock = std::shared_lock(getFuncLock(call->Name));
   rocksdb::Status TxnStatus;
   auto refKey = ref.asBytes();
   do {
-    std::unique_ptr<rocksdb::Transaction> Txn(DB->BeginTransaction({}, {}));
+    std::unique_ptr<rocksdb::Transaction> Txn(TxnDB->BeginTransaction({}, {}));
     if (const Head *head = std::get_if<Head>(&Name)) {
       rocksdb::PinnableSlice Fetched;
       if (checkFound(Txn->GetForUpdate({}, HeadsFamily, head->Name, &Fetched)))
@@ -387,11 +869,11 @@ void RocksDBStore::set(const Name &Name, const CID &ref) {
 std::vector<Name> RocksDBStore::list_names_using(const CID &ref) {
   std::vector<Name> Result;
   auto Key = ref.asBytes();
-  std::unique_ptr<rocksdb::Iterator> Iterator(DB->NewIterator({}, RefsFamily));
+  PrefixReadOptions Options(makeSlice(Key));
+  std::unique_ptr<rocksdb::Iterator> Iterator(
+      DB->NewIterator(Options, RefsFamily));
   for (Iterator->Seek(makeSlice(Key)); Iterator->Valid(); Iterator->Next()) {
     auto Ref = Iterator->key();
-    if (!Ref.starts_with(makeSlice(Key)))
-      break;
     Ref.remove_prefix(Key.size());
     if (Ref.empty())
       llvm::report_fatal_error("missing type in refs family");
@@ -419,18 +901,21 @@ std::vector<Name> RocksDBStore::list_names_using(const CID &ref) {
 
 std::vector<std::string> RocksDBStore::list_funcs() {
   std::vector<std::string> Result;
-  std::unique_ptr<rocksdb::Iterator> Iterator(DB->NewIterator({}, CallsFamily));
+  // Each Seek() skips to the next function, so we can't use prefix seeks.
+  rocksdb::ReadOptions Options;
+  Options.total_order_seek = true;
+  std::unique_ptr<rocksdb::Iterator> Iterator(
+      DB->NewIterator(Options, CallsFamily));
   for (Iterator->SeekToFirst(); Iterator->Valid();) {
     auto Bytes = makeBytes(Iterator->key());
     Result.emplace_back(llvm::cantFail(Node::loadFromCBORSequence(*this, Bytes))
                             .as<llvm::StringRef>());
 
-    std::vector<std::uint8_t> NextKey =
-        makeBytes(Iterator->key()).drop_back(Bytes.size());
-    for (auto I = NextKey.rbegin(), IE = NextKey.rend(); I != IE; I++)
-      if (++(*I))
-        break;
-    Iterator->Seek(makeSlice(NextKey));
+    std::string NextKey = getPrefixSuccessor(
+        makeSlice(makeBytes(Iterator->key()).drop_back(Bytes.size())));
+    if (NextKey.empty())
+      break;
+    Iterator->Seek(NextKey);
   }
   checkStatus(Iterator->status());
   return Result;
@@ -447,10 +932,11 @@ void RocksDBStore::eachHead(std::function<bool(const Head &)> F) {
 void RocksDBStore::eachCall(llvm::StringRef Func,
                             std::function<bool(const Call &)> F) {
   auto Prefix = Node(utf8_string_arg, Func).saveAsCBOR();
-  std::unique_ptr<rocksdb::Iterator> Iterator(DB->NewIterator({}, CallsFamily));
+  PrefixReadOptions Options(makeSlice(Prefix));
+  Options.readahead_size = SCAN_READAHEAD_SIZE;
+  std::unique_ptr<rocksdb::Iterator> Iterator(
+      DB->NewIterator(Options, CallsFamily));
   for (Iterator->Seek(makeSlice(Prefix)); Iterator->Valid(); Iterator->Next()) {
-    if (!makeBytes(Iterator->key()).take_front(Prefix.size()).equals(Prefix))
-      break;
     auto Bytes = makeBytes(Iterator->key()).drop_front(Prefix.size());
     Call Call(Func, {});
     while (!Bytes.empty())
@@ -462,9 +948,11 @@ void RocksDBStore::eachCall(llvm::StringRef Func,
 }
 
 void RocksDBStore::head_delete(const Head &Head) {
+  checkWritable();
+  flushPendingBatch();
   rocksdb::Status TxnStatus;
   do {
-    std::unique_ptr<rocksdb::Transaction> Txn(DB->BeginTransaction({}, {}));
+    std::unique_ptr<rocksdb::Transaction> Txn(TxnDB->BeginTransaction({}, {}));
     rocksdb::PinnableSlice Fetched;
     if (checkFound(Txn->GetForUpdate({}, HeadsFamily, Head.Name, &Fetched)))
       deleteRef(*Txn, TYPE_HEAD, Head.Name, Fetched);
@@ -474,27 +962,54 @@ void RocksDBStore::head_delete(const Head &Head) {
   checkStatus(TxnStatus);
 }
 
+// Delete every call of the function, along with the refs they added. The
+// calls are deleted in chunks, each with a single DeleteRange written
+// atomically with that chunk's refs. Transactions don't support DeleteRange,
+// so the write batches go straight to TxnDB->GetBaseDB() and bypass
+// OptimisticTransactionDB's conflict checking. Instead, we hold the func's
+// lock exclusively, so no calls of the function can be set until we finish.
 void RocksDBStore::call_invalidate(llvm::StringRef name) {
+  checkWritable();
+  flushPendingBatch();
+  std::unique_lock<std::shared_mutex> FuncLock(getFuncLock(name));
   auto Prefix = Node(utf8_string_arg, name).saveAsCBOR();
-  std::unique_ptr<rocksdb::Iterator> Iterator(DB->NewIterator({}, CallsFamily));
-  for (Iterator->Seek(makeSlice(Prefix)); Iterator->Valid(); Iterator->Next()) {
-    if (!makeBytes(Iterator->key()).take_front(Prefix.size()).equals(Prefix))
+  PrefixReadOptions Options(makeSlice(Prefix));
+  Options.readahead_size = SCAN_READAHEAD_SIZE;
+  // The first byte of a CBOR string is never 0xff.
+  assert(!Options.UpperBound.empty());
+  std::unique_ptr<rocksdb::Iterator> Iterator(
+      DB->NewIterator(Options, CallsFamily));
+
+  rocksdb::WriteBatch Batch;
+  std::string ChunkStart;
+  size_t ChunkSize = 0;
+  Iterator->Seek(makeSlice(Prefix));
+  while (true) {
+    bool Valid = Iterator->Valid();
+    if (!Valid)
+      checkStatus(Iterator->status());
+    if (ChunkSize && (!Valid || ChunkSize == INVALIDATE_CHUNK_SIZE)) {
+      std::string ChunkEnd =
+          Valid ? Iterator->key().ToString() : Options.UpperBound;
+      checkStatus(Batch.DeleteRange(CallsFamily, ChunkStart, ChunkEnd));
+      checkStatus(TxnDB->GetBaseDB()->Write({}, &Batch));
+      Batch.Clear();
+      ChunkSize = 0;
+    }
+    if (!Valid)
       break;
-    rocksdb::Status TxnStatus;
-    do {
-      std::unique_ptr<rocksdb::Transaction> Txn(DB->BeginTransaction({}, {}));
-      Txn->Delete(CallsFamily, Iterator->key());
-      deleteRef(*Txn, TYPE_CALL, Iterator->key(), Iterator->value());
-      auto Bytes = makeBytes(Iterator->key()).drop_front(Prefix.size());
-      while (!Bytes.empty()) {
-        auto Arg = CID::loadFromSequence(Bytes);
-        deleteRef(*Txn, TYPE_CALL, Iterator->key(), makeSlice(Arg->asBytes()));
-      }
-      TxnStatus = Txn->Commit();
-    } while (TxnStatus.IsBusy() || TxnStatus.IsTryAgain());
-    checkStatus(TxnStatus);
+
+    if (ChunkSize == 0)
+      ChunkStart = Iterator->key().ToString();
+    deleteRef(Batch, TYPE_CALL, Iterator->key(), Iterator->value());
+    auto Bytes = makeBytes(Iterator->key()).drop_front(Prefix.size());
+    while (!Bytes.empty()) {
+      auto Arg = CID::loadFromSequence(Bytes);
+      deleteRef(Batch, TYPE_CALL, Iterator->key(), makeSlice(Arg->asBytes()));
+    }
+    ++ChunkSize;
+    Iterator->Next();
   }
-  checkStatus(Iterator->status());
 }
 
 std::unique_ptr<Store> memodb_rocksdb_open(llvm::StringRef path,
@@ -1,16 +1,29 @@
 #include "memodb_internal.h"
 
 #include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/ErrorHandling.h>
 #include <llvm/Support/ScopedPrinter.h>
+#include <llvm/Support/WithColor.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <map>
 #include <mutex>
+#include <random>
 #include <sqlite3.h>
+#include <thread>
 #include <vector>
 
+#if BCDB_WITH_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
 #include "memodb/Store.h"
 
 using namespace memodb;
@@ -37,12 +50,16 @@ static const std::vector<const char *> SQLITE_PRAGMAS = {
     "PRAGMA journal_size_limit = 536870912;\n",
 };
 
-static const unsigned int CURRENT_VERSION = 7;
+static const unsigned int CURRENT_VERSION = 8;
 
+// Values for blocks.codec.
 static const int CODEC_RAW = 0;
+// A single zstd frame. If the frame header has a dictionary ID, the
+// dictionary is in the zstd_dicts table.
+static const int CODEC_ZSTD = 1;
 
 static const char SQLITE_INIT_STMTS[] =
-    "PRAGMA user_version = 7;\n"
+    "PRAGMA user_version = 8;\n"
     "PRAGMA application_id = 1111704642;\n"
     "CREATE TABLE blocks(\n"
     "  bid     INTEGER PRIMARY KEY,\n"
@@ -80,30 +97,116 @@ static const char SQLITE_INIT_STMTS[] =
     "  dest    INTEGER NOT NULL REFERENCES blocks(bid),\n"
     "  UNIQUE(dest, funcid, callid)\n"
     ");\n"
-    "CREATE INDEX call_ref_by_funcid ON call_refs(funcid);\n";
+    "CREATE INDEX call_ref_by_funcid ON call_refs(funcid);\n"
+    "CREATE TABLE zstd_dicts(\n"
+    "  seq     INTEGER PRIMARY KEY,\n"
+    "  dictid  INTEGER NOT NULL UNIQUE,\n"
+    "          -- ID stored in the dictionary and in frames that use it\n"
+    "  content BLOB    NOT NULL\n"
+    ");\n";
+
+// Upgrade a version 7 database to version 8.
+static const char SQLITE_UPGRADE_7_STMTS[] =
+    "PRAGMA user_version = 8;\n"
+    "CREATE TABLE zstd_dicts(\n"
+    "  seq     INTEGER PRIMARY KEY,\n"
+    "  dictid  INTEGER NOT NULL UNIQUE,\n"
+    "  content BLOB    NOT NULL\n"
+    ");\n";
 
 namespace {
+struct Stmt;
+
+// A prepared statement kept in a Connection's statement cache.
+struct CachedStmt {
+  sqlite3_stmt *stmt = nullptr;
+
+  // Whether a Stmt is currently using this statement. If the same SQL is
+  // needed again while the statement is in use (for instance, by a recursive
+  // call), a separate uncached statement is prepared.
+  bool in_use = false;
+};
+
+// A single thread's connection to the database, along with the prepared
+// statements that have been used on it.
+struct Connection {
+  sqlite3 *db = nullptr;
+
+  // Prepared statements, keyed by their SQL text. Using these avoids parsing
+  // the SQL every time a block is read or written.
+  llvm::StringMap<CachedStmt> stmts;
+
+  // Whether an ExclusiveTransaction or Store::Batch is in progress on this
+  // connection.
+  bool in_transaction = false;
+
+#if BCDB_WITH_ZSTD
+  // zstd contexts for this thread, created when first needed.
+  ZSTD_CCtx *zstd_cctx = nullptr;
+  ZSTD_DCtx *zstd_dctx = nullptr;
+#endif
+
+  ~Connection();
+};
+
 class sqlite_db : public Store {
-  // Used by each thread to look up its own connection to the database.
+  // Used by each thread to look up its own connection to the database. The
+  // map is keyed by id rather than address, because a new sqlite_db may be
+  // allocated at the address of a destroyed one, whose connections have been
+  // closed.
   // TODO: entries in this map are never removed, even when the sqlite_db is
   // destroyed, which could cause memory leaks.
-  static thread_local llvm::DenseMap<sqlite_db *, sqlite3 *> thread_connections;
+  static thread_local llvm::DenseMap<std::uint64_t, Connection *>
+      thread_connections;
+
+  // Used to give each sqlite_db a unique id.
+  static std::atomic<std::uint64_t> next_id;
+  const std::uint64_t id = next_id++;
 
   // Used to make new connections to the database.
   std::string uri = {};
 
   // This field is used solely so that all threads' connections can be closed
   // in the single thread that calls the destructor.
-  std::vector<sqlite3 *> open_connections = {};
+  std::vector<std::unique_ptr<Connection>> open_connections = {};
 
-  // Protects access to open_connections and uri.
+  // Protects access to open_connections, uri, and zstd_read_dicts.
   std::mutex mutex;
 
-  // Get the current thread's database connection (creating a new connection if
+  // Compression settings, from the URI parameters. These are only changed by
+  // open(). Blocks smaller than compression_min_size are never compressed.
+  bool compression_enabled = false;
+  int compression_level = 3;
+  size_t compression_min_size = 64;
+
+#if BCDB_WITH_ZSTD
+  // The dictionary used to compress new blocks, if any. Only changed by
+  // open().
+  ZSTD_CDict *zstd_write_dict = nullptr;
+
+  // Dictionaries used to decompress blocks, keyed by dictionary ID.
+  std::map<unsigned, ZSTD_DDict *> zstd_read_dicts;
+
+  ZSTD_DDict *get_zstd_read_dict(unsigned dictid);
+  void load_zstd_write_dict();
+  // Returns false, without training, if there are too few blocks to sample.
+  bool train_dictionary();
+  void recompress_blocks();
+#endif
+
+  // Get the current thread's connection (creating a new connection if
   // necessary). The create_file_if_missing argument will cause a new database
   // file to be created if there isn't one.
+  Connection &get_conn(bool create_file_if_missing = false);
+
+  // Get the current thread's database connection.
   sqlite3 *get_db(bool create_file_if_missing = false);
 
+  // Get a prepared statement for the given SQL from the current thread's
+  // statement cache, preparing it if necessary. The statement is reset when
+  // the returned Stmt is destroyed.
+  Stmt prepare(const char *sql);
+
   void fatal_error();
   void checkStatus(int rc);
   void checkDone(int rc);
@@ -117,8 +220,30 @@ class sqlite_db : public Store {
 
   void add_refs_from(sqlite3_int64 id, const Node &value);
 
+  // Check whether any Head, Call, or block refers to a block.
+  bool is_block_used(sqlite3_int64 bid);
+
+  // Delete a block and its refs to other blocks. Any of those blocks that
+  // were added after this one (which only happens for identity blocks) are
+  // added to Recheck. Returns false if the block was already deleted.
+  bool delete_block(sqlite3_int64 bid, std::vector<sqlite3_int64> &Recheck);
+
   void upgrade_schema();
 
+  void configure_compression(const char *filename);
+
+  // Compress a block if compression is enabled and worthwhile. Returns the
+  // codec to store in the blocks table; if it isn't CODEC_RAW, Buffer
+  // contains the compressed content.
+  int encodeBlock(llvm::ArrayRef<std::uint8_t> Bytes,
+                  std::vector<std::uint8_t> &Buffer);
+
+  // Decompress a block's content if necessary. The result may point to
+  // Content or to Buffer.
+  llvm::ArrayRef<std::uint8_t> decodeBlock(int codec,
+                                           llvm::ArrayRef<std::uint8_t> Content,
+                                           std::vector<std::uint8_t> &Buffer);
+
   sqlite3_int64 putInternal(const CID &CID,
                             const llvm::ArrayRef<std::uint8_t> &Bytes,
                             const Node &Value);
@@ -127,6 +252,7 @@ class sqlite_db : public Store {
   Call identifyCall(sqlite3_int64 callid);
 
   friend class ExclusiveTransaction;
+  friend class ReadTransaction;
 
 public:
   void open(const char *uri, bool create_if_missing);
@@ -143,21 +269,53 @@ public:
                 std::function<bool(const Call &)> F) override;
   void head_delete(const Head &Head) override;
   void call_invalidate(llvm::StringRef name) override;
+  std::vector<llvm::Optional<Node>> getMany(llvm::ArrayRef<CID> CIDs) override;
+  bool viewBytes(const CID &CID, std::function<void(BytesRef)> F) override;
+  void viewManyBytes(llvm::ArrayRef<CID> CIDs,
+                     std::function<void(size_t, BytesRef)> F) override;
+  std::vector<CID> putMany(llvm::ArrayRef<Node> values) override;
+  std::vector<bool> hasMany(llvm::ArrayRef<CID> CIDs) override;
+  std::vector<llvm::Optional<CID>>
+  resolveMany(llvm::ArrayRef<Name> Names) override;
+  std::vector<std::vector<Name>>
+  listNamesUsingMany(llvm::ArrayRef<CID> CIDs) override;
+  std::size_t collectGarbage(std::chrono::seconds grace_period) override;
+
+protected:
+  bool beginBatch() override;
+  void commitBatch() override;
+  void abortBatch() override;
 };
 } // end anonymous namespace
 
-thread_local llvm::DenseMap<sqlite_db *, sqlite3 *>
-    sqlite_db::thread_connections = llvm::DenseMap<sqlite_db *, sqlite3 *>();
+thread_local llvm::DenseMap<std::uint64_t, Connection *>
+    sqlite_db::thread_connections =
+        llvm::DenseMap<std::uint64_t, Connection *>();
+
+std::atomic<std::uint64_t> sqlite_db::next_id = 0;
 
 namespace {
 struct Stmt {
   sqlite3_stmt *stmt = nullptr;
   int rc;
 
+  // If non-null, stmt belongs to a statement cache and will be reset instead
+  // of finalized.
+  CachedStmt *cached = nullptr;
+
   Stmt(sqlite3 *db, const char *sql) {
     rc = sqlite3_prepare_v2(db, sql, /*nByte*/ -1, &stmt, nullptr);
   }
 
+  Stmt(CachedStmt &cached) : stmt(cached.stmt), rc(SQLITE_OK) {
+    assert(!cached.in_use);
+    cached.in_use = true;
+    this->cached = &cached;
+  }
+
+  Stmt(const Stmt &) = delete;
+  Stmt &operator=(const Stmt &) = delete;
+
   void bind_blob(int i, llvm::ArrayRef<std::uint8_t> Bytes) {
     if (rc != SQLITE_OK)
       return;
@@ -205,40 +363,90 @@ struct Stmt {
 
   void reset() { sqlite3_reset(stmt); }
 
-  ~Stmt() { sqlite3_finalize(stmt); }
+  ~Stmt() {
+    if (cached) {
+      // Release any locks held by the statement and any pointers to our
+      // caller's memory (bound with SQLITE_STATIC).
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      cached->in_use = false;
+    } else {
+      sqlite3_finalize(stmt);
+    }
+  }
 };
 } // end anonymous namespace
 
+Connection::~Connection() {
+  for (auto &item : stmts) {
+    assert(!item.getValue().in_use);
+    sqlite3_finalize(item.getValue().stmt);
+  }
+  sqlite3_close(db);
+#if BCDB_WITH_ZSTD
+  ZSTD_freeCCtx(zstd_cctx);
+  ZSTD_freeDCtx(zstd_dctx);
+#endif
+}
+
 namespace {
+// Does nothing if the connection is already in a transaction (for instance,
+// because of a Store::Batch); the outer transaction will commit everything.
 class ExclusiveTransaction {
   sqlite_db &db;
+  bool active;
   bool committed = false;
 
 public:
-  static thread_local bool in_transaction;
-
-  ExclusiveTransaction(sqlite_db &db) : db(db) {
+  ExclusiveTransaction(sqlite_db &db)
+      : db(db), active(!db.get_conn().in_transaction) {
+    if (!active)
+      return;
     db.checkStatus(sqlite3_exec(db.get_db(), "BEGIN EXCLUSIVE", nullptr,
                                 nullptr, nullptr));
-    in_transaction = true;
+    db.get_conn().in_transaction = true;
   }
   void commit() {
     assert(!committed);
     committed = true;
+    if (!active)
+      return;
     db.checkStatus(
         sqlite3_exec(db.get_db(), "COMMIT", nullptr, nullptr, nullptr));
-    in_transaction = false;
+    db.get_conn().in_transaction = false;
   }
   ~ExclusiveTransaction() {
-    if (!committed)
-      sqlite3_exec(db.get_db(), "ROLLBACK", nullptr, nullptr, nullptr);
-    in_transaction = false;
+    if (!active || committed)
+      return;
+    sqlite3_exec(db.get_db(), "ROLLBACK", nullptr, nullptr, nullptr);
     // ignore return code
+    db.get_conn().in_transaction = false;
   }
 };
 } // end anonymous namespace
 
-thread_local bool ExclusiveTransaction::in_transaction = false;
+namespace {
+// Groups several reads into a single transaction, so the database lock is
+// only acquired once and all the reads see the same snapshot. Does nothing if
+// the current thread is already in a transaction.
+class ReadTransaction {
+  sqlite_db &db;
+  bool active;
+
+public:
+  ReadTransaction(sqlite_db &db)
+      : db(db), active(sqlite3_get_autocommit(db.get_db())) {
+    if (active)
+      db.checkStatus(
+          sqlite3_exec(db.get_db(), "BEGIN", nullptr, nullptr, nullptr));
+  }
+  ~ReadTransaction() {
+    if (active)
+      sqlite3_exec(db.get_db(), "COMMIT", nullptr, nullptr, nullptr);
+    // ignore return code
+  }
+};
+} // end anonymous namespace
 
 static int busy_callback(void *, int count) {
   int ms = 1;
@@ -273,29 +481,53 @@ static int wal_hook(void *, sqlite3 *db, const char *DatabaseName,
   return rc;
 }
 
-sqlite3 *sqlite_db::get_db(bool create_file_if_missing) {
-  sqlite3 *&result = thread_connections[this];
+Connection &sqlite_db::get_conn(bool create_file_if_missing) {
+  Connection *&result = thread_connections[id];
 
   if (!result) {
     const std::lock_guard<std::mutex> lock(mutex);
 
+    open_connections.push_back(std::make_unique<Connection>());
+    result = open_connections.back().get();
+    sqlite3 *&db = result->db;
+
     int flags = SQLITE_OPEN_URI | SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX |
                 (create_file_if_missing ? SQLITE_OPEN_CREATE : 0);
-    checkStatus(sqlite3_open_v2(uri.c_str(), &result, flags, /*zVfs*/ nullptr));
+    checkStatus(sqlite3_open_v2(uri.c_str(), &db, flags, /*zVfs*/ nullptr));
 
-    checkStatus(sqlite3_busy_handler(result, busy_callback, nullptr));
-    sqlite3_wal_hook(result, wal_hook, nullptr);
+    checkStatus(sqlite3_busy_handler(db, busy_callback, nullptr));
+    sqlite3_wal_hook(db, wal_hook, nullptr);
 
     for (const char *stmt : SQLITE_PRAGMAS) {
-      sqlite3_exec(result, stmt, nullptr, nullptr, nullptr);
+      sqlite3_exec(db, stmt, nullptr, nullptr, nullptr);
       // ignore return code
     }
     upgrade_schema();
-
-    open_connections.push_back(result);
   }
 
-  return result;
+  return *result;
+}
+
+sqlite3 *sqlite_db::get_db(bool create_file_if_missing) {
+  return get_conn(create_file_if_missing).db;
+}
+
+Stmt sqlite_db::prepare(const char *sql) {
+  Connection &conn = get_conn();
+  CachedStmt &cached = conn.stmts[sql];
+  if (cached.in_use)
+    return Stmt(conn.db, sql);
+  if (!cached.stmt) {
+    int rc = sqlite3_prepare_v3(conn.db, sql, /*nByte*/ -1,
+                                SQLITE_PREPARE_PERSISTENT, &cached.stmt,
+                                nullptr);
+    if (rc != SQLITE_OK) {
+      sqlite3_finalize(cached.stmt);
+      cached.stmt = nullptr;
+      fatal_error();
+    }
+  }
+  return Stmt(cached);
 }
 
 void sqlite_db::fatal_error() {
@@ -331,7 +563,8 @@ void sqlite_db::open(const char *uri, bool create_if_missing) {
   // memodb_sqlite_open knows about the sqlite_db at this point.
   assert(open_connections.empty());
   this->uri = uri;
-  get_db(create_if_missing);
+  sqlite3 *db = get_db(create_if_missing);
+  configure_compression(sqlite3_db_filename(db, "main"));
 }
 
 sqlite_db::~sqlite_db() {
@@ -339,8 +572,12 @@ sqlite_db::~sqlite_db() {
   // ignore return code
 
   const std::lock_guard<std::mutex> lock(mutex);
-  for (sqlite3 *db : open_connections)
-    sqlite3_close(db);
+  open_connections.clear();
+#if BCDB_WITH_ZSTD
+  ZSTD_freeCDict(zstd_write_dict);
+  for (auto &item : zstd_read_dicts)
+    ZSTD_freeDDict(item.second);
+#endif
 }
 
 void sqlite_db::upgrade_schema() {
@@ -362,8 +599,7 @@ void sqlite_db::upgrade_schema() {
 
   // If the database is empty, initialize it.
   {
-    Stmt exists_stmt(
-        db, "SELECT 1 FROM sqlite_master WHERE type='table' AND name='value'");
+    Stmt exists_stmt(db, "SELECT 1 FROM sqlite_master");
     if (!checkRow(exists_stmt.step()))
       checkStatus(
           sqlite3_exec(db, SQLITE_INIT_STMTS, nullptr, nullptr, nullptr));
@@ -375,6 +611,12 @@ void sqlite_db::upgrade_schema() {
     user_version = stmt.columnInt(0);
   }
 
+  if (user_version == 7) {
+    checkStatus(
+        sqlite3_exec(db, SQLITE_UPGRADE_7_STMTS, nullptr, nullptr, nullptr));
+    user_version = 8;
+  }
+
   if (user_version > CURRENT_VERSION) {
     llvm::errs() << "The BCDB format is too new (this BCDB file uses format "
                  << user_version << ", but we only support format "
@@ -403,16 +645,14 @@ void sqlite_db::upgrade_schema() {
 }
 
 CID sqlite_db::bid_to_cid(sqlite3_int64 bid) {
-  sqlite3 *db = get_db();
-  Stmt stmt(db, "SELECT cid FROM blocks WHERE bid = ?1");
+  Stmt stmt = prepare("SELECT cid FROM blocks WHERE bid = ?1");
   stmt.bind_int(1, bid);
   requireRow(stmt.step());
   return *CID::fromBytes(stmt.columnBytes(0));
 }
 
 sqlite3_int64 sqlite_db::cid_to_bid(const CID &ref) {
-  sqlite3 *db = get_db();
-  Stmt stmt(db, "SELECT bid FROM blocks WHERE cid = ?1");
+  Stmt stmt = prepare("SELECT bid FROM blocks WHERE cid = ?1");
   stmt.bind_blob(1, ref.asBytes());
   if (checkRow(stmt.step()))
     return stmt.columnInt(0);
@@ -423,6 +663,254 @@ sqlite3_int64 sqlite_db::cid_to_bid(const CID &ref) {
   return putInternal(ref, Value.saveAsCBOR(), Value);
 }
 
+void sqlite_db::configure_compression(const char *filename) {
+  // Compression settings are passed as URI parameters, which SQLite ignores:
+  //   sqlite:/path/to/db?compression=zstd&compression_level=3
+  const char *compression = sqlite3_uri_parameter(filename, "compression");
+  if (compression && llvm::StringRef(compression) == "zstd")
+    compression_enabled = true;
+  else if (compression && llvm::StringRef(compression) != "none")
+    llvm::report_fatal_error("unsupported SQLite compression " +
+                             llvm::Twine(compression));
+  compression_level =
+      sqlite3_uri_int64(filename, "compression_level", compression_level);
+  compression_min_size =
+      sqlite3_uri_int64(filename, "compression_min_size", compression_min_size);
+  bool train = sqlite3_uri_boolean(filename, "train_dictionary", false);
+
+  if (!compression_enabled) {
+    if (train)
+      llvm::report_fatal_error("train_dictionary requires compression=zstd");
+    return;
+  }
+
+#if BCDB_WITH_ZSTD
+  if (train && train_dictionary()) {
+    load_zstd_write_dict();
+    recompress_blocks();
+  } else {
+    load_zstd_write_dict();
+  }
+#else
+  llvm::report_fatal_error("MemoDB was compiled without zstd support");
+#endif
+}
+
+#if BCDB_WITH_ZSTD
+void sqlite_db::load_zstd_write_dict() {
+  // Use the most recently trained dictionary.
+  Stmt stmt =
+      prepare("SELECT content FROM zstd_dicts ORDER BY seq DESC LIMIT 1");
+  if (!checkRow(stmt.step()))
+    return;
+  auto Dict = stmt.columnBytes(0);
+  ZSTD_freeCDict(zstd_write_dict);
+  zstd_write_dict =
+      ZSTD_createCDict(Dict.data(), Dict.size(), compression_level);
+  if (!zstd_write_dict)
+    llvm::report_fatal_error("invalid zstd dictionary");
+}
+
+ZSTD_DDict *sqlite_db::get_zstd_read_dict(unsigned dictid) {
+  {
+    const std::lock_guard<std::mutex> lock(mutex);
+    auto iter = zstd_read_dicts.find(dictid);
+    if (iter != zstd_read_dicts.end())
+      return iter->second;
+  }
+
+  Stmt stmt = prepare("SELECT content FROM zstd_dicts WHERE dictid = ?1");
+  stmt.bind_int(1, dictid);
+  if (!checkRow(stmt.step()))
+    llvm::report_fatal_error("missing zstd dictionary " + llvm::Twine(dictid));
+  auto Dict = stmt.columnBytes(0);
+  ZSTD_DDict *ddict = ZSTD_createDDict(Dict.data(), Dict.size());
+  if (!ddict)
+    llvm::report_fatal_error("invalid zstd dictionary");
+
+  // Another thread may have loaded the same dictionary in the meantime.
+  const std::lock_guard<std::mutex> lock(mutex);
+  auto inserted = zstd_read_dicts.insert({dictid, ddict});
+  if (!inserted.second)
+    ZSTD_freeDDict(ddict);
+  return inserted.first->second;
+}
+
+bool sqlite_db::train_dictionary() {
+  // These limits follow zstd's recommendations: a dictionary of ~100 KiB,
+  // trained on ~100 times as much sample data.
+  const size_t MAX_DICT_SIZE = 112640;
+  const size_t MAX_SAMPLES_SIZE = 100 * MAX_DICT_SIZE;
+  const size_t MAX_SAMPLE_SIZE = 128 << 10;
+
+  // Stop sampling after this many probes in a row find no new block.
+  const unsigned MAX_MISSES = 1000;
+
+  sqlite3_int64 max_bid = 0;
+  {
+    Stmt stmt = prepare("SELECT max(bid) FROM blocks");
+    if (checkRow(stmt.step()))
+      max_bid = stmt.columnInt(0);
+  }
+
+  // Sample blocks by probing random bids, instead of using ORDER BY random(),
+  // which would read and sort the whole table.
+  std::vector<std::uint8_t> Samples;
+  std::vector<size_t> SampleSizes;
+  if (max_bid > 0) {
+    std::mt19937_64 rng(std::random_device{}());
+    std::uniform_int_distribution<sqlite3_int64> dist(1, max_bid);
+    llvm::DenseSet<sqlite3_int64> seen;
+    Stmt stmt = prepare("SELECT bid, codec, content FROM blocks WHERE bid >= "
+                        "?1 ORDER BY bid LIMIT 1");
+    std::vector<std::uint8_t> Buffer;
+    unsigned misses = 0;
+    while (Samples.size() < MAX_SAMPLES_SIZE && misses < MAX_MISSES) {
+      stmt.bind_int(1, dist(rng));
+      if (!checkRow(stmt.step()) || !seen.insert(stmt.columnInt(0)).second) {
+        stmt.reset();
+        ++misses;
+        continue;
+      }
+      misses = 0;
+      auto Bytes = decodeBlock(stmt.columnInt(1), stmt.columnBytes(2), Buffer);
+      // Big blocks would mostly be compressed well without a dictionary.
+      if (Bytes.size() >= compression_min_size &&
+          Bytes.size() <= MAX_SAMPLE_SIZE) {
+        Samples.insert(Samples.end(), Bytes.begin(), Bytes.end());
+        SampleSizes.push_back(Bytes.size());
+      }
+      stmt.reset();
+    }
+  }
+
+  if (SampleSizes.size() < 100) {
+    llvm::WithColor::warning()
+        << "not enough blocks to train a zstd dictionary; compressing "
+           "without one\n";
+    return false;
+  }
+
+  std::vector<std::uint8_t> Dict(MAX_DICT_SIZE);
+  size_t DictSize =
+      ZDICT_trainFromBuffer(Dict.data(), Dict.size(), Samples.data(),
+                            SampleSizes.data(), SampleSizes.size());
+  if (ZDICT_isError(DictSize))
+    llvm::report_fatal_error("can't train zstd dictionary: " +
+                             llvm::Twine(ZDICT_getErrorName(DictSize)));
+  Dict.resize(DictSize);
+
+  Stmt stmt =
+      prepare("INSERT OR IGNORE INTO zstd_dicts(dictid, content) "
+              "VALUES(?1, ?2)");
+  stmt.bind_int(1, ZSTD_getDictID_fromDict(Dict.data(), Dict.size()));
+  stmt.bind_blob(2, Dict);
+  checkDone(stmt.step());
+  return true;
+}
+
+void sqlite_db::recompress_blocks() {
+  // Recompress existing blocks with the current settings and dictionary.
+  // This is done in small transactions so other processes can still write
+  // to the database. Note that the database file won't shrink unless VACUUM
+  // is run afterwards.
+  sqlite3_int64 last_bid = 0;
+  while (true) {
+    std::vector<std::pair<sqlite3_int64, std::vector<std::uint8_t>>> Blocks;
+    ExclusiveTransaction transaction(*this);
+    {
+      Stmt stmt = prepare("SELECT bid, codec, content FROM blocks WHERE bid > "
+                          "?1 ORDER BY bid LIMIT 1000");
+      stmt.bind_int(1, last_bid);
+      std::vector<std::uint8_t> Buffer;
+      while (checkRow(stmt.step())) {
+        last_bid = stmt.columnInt(0);
+        auto Bytes =
+            decodeBlock(stmt.columnInt(1), stmt.columnBytes(2), Buffer);
+        Blocks.emplace_back(last_bid,
+                            std::vector<std::uint8_t>(Bytes.begin(),
+                                                      Bytes.end()));
+      }
+    }
+    if (Blocks.empty())
+      break;
+
+    Stmt stmt =
+        prepare("UPDATE blocks SET codec = ?1, content = ?2 WHERE bid = ?3");
+    std::vector<std::uint8_t> Buffer;
+    for (const auto &Block : Blocks) {
+      int codec = encodeBlock(Block.second, Buffer);
+      stmt.bind_int(1, codec);
+      stmt.bind_blob(2, codec == CODEC_RAW ? llvm::makeArrayRef(Block.second)
+                                           : llvm::makeArrayRef(Buffer));
+      stmt.bind_int(3, Block.first);
+      checkDone(stmt.step());
+      stmt.reset();
+    }
+    transaction.commit();
+  }
+}
+#endif // BCDB_WITH_ZSTD
+
+int sqlite_db::encodeBlock(llvm::ArrayRef<std::uint8_t> Bytes,
+                           std::vector<std::uint8_t> &Buffer) {
+  if (!compression_enabled || Bytes.size() < compression_min_size)
+    return CODEC_RAW;
+#if BCDB_WITH_ZSTD
+  Connection &conn = get_conn();
+  if (!conn.zstd_cctx)
+    conn.zstd_cctx = ZSTD_createCCtx();
+  Buffer.resize(ZSTD_compressBound(Bytes.size()));
+  size_t Size =
+      zstd_write_dict
+          ? ZSTD_compress_usingCDict(conn.zstd_cctx, Buffer.data(),
+                                     Buffer.size(), Bytes.data(),
+                                     Bytes.size(), zstd_write_dict)
+          : ZSTD_compressCCtx(conn.zstd_cctx, Buffer.data(), Buffer.size(),
+                              Bytes.data(), Bytes.size(), compression_level);
+  if (ZSTD_isError(Size))
+    llvm::report_fatal_error("zstd compression failed: " +
+                             llvm::Twine(ZSTD_getErrorName(Size)));
+  // Store the block raw if compression doesn't help.
+  if (Size >= Bytes.size())
+    return CODEC_RAW;
+  Buffer.resize(Size);
+  return CODEC_ZSTD;
+#else
+  llvm_unreachable("compression enabled without zstd support");
+#endif
+}
+
+llvm::ArrayRef<std::uint8_t>
+sqlite_db::decodeBlock(int codec, llvm::ArrayRef<std::uint8_t> Content,
+                       std::vector<std::uint8_t> &Buffer) {
+  if (codec == CODEC_RAW)
+    return Content;
+#if BCDB_WITH_ZSTD
+  if (codec == CODEC_ZSTD) {
+    auto Size = ZSTD_getFrameContentSize(Content.data(), Content.size());
+    if (Size == ZSTD_CONTENTSIZE_UNKNOWN || Size == ZSTD_CONTENTSIZE_ERROR)
+      llvm::report_fatal_error("invalid zstd block");
+    Buffer.resize(Size);
+    Connection &conn = get_conn();
+    if (!conn.zstd_dctx)
+      conn.zstd_dctx = ZSTD_createDCtx();
+    unsigned dictid = ZSTD_getDictID_fromFrame(Content.data(), Content.size());
+    size_t Result =
+        dictid ? ZSTD_decompress_usingDDict(
+                     conn.zstd_dctx, Buffer.data(), Buffer.size(),
+                     Content.data(), Content.size(), get_zstd_read_dict(dictid))
+               : ZSTD_decompressDCtx(conn.zstd_dctx, Buffer.data(),
+                                     Buffer.size(), Content.data(),
+                                     Content.size());
+    if (ZSTD_isError(Result) || Result != Size)
+      llvm::report_fatal_error("invalid zstd block");
+    return Buffer;
+  }
+#endif
+  llvm::report_fatal_error("unsupported compression codec");
+}
+
 sqlite3_int64 sqlite_db::putInternal(const CID &CID,
                                      const llvm::ArrayRef<std::uint8_t> &Bytes,
                                      const Node &Value) {
@@ -430,21 +918,23 @@ sqlite3_int64 sqlite_db::putInternal(const CID &CID,
 
   // Optimistically check for an existing entry (without a transaction).
   {
-    Stmt stmt(db, "SELECT bid FROM blocks WHERE cid = ?1");
+    Stmt stmt = prepare("SELECT bid FROM blocks WHERE cid = ?1");
     stmt.bind_blob(1, CID.asBytes());
     if (checkRow(stmt.step()))
       return stmt.columnInt(0);
   }
 
+  // Compress the block before locking the database.
+  std::vector<std::uint8_t> Buffer;
+  int codec = encodeBlock(Bytes, Buffer);
+
   // We may need to add a new entry. Start an exclusive transaction (if we
   // aren't already in one) and check again (an entry may have been added since
   // the previous check).
-  std::optional<ExclusiveTransaction> transaction;
-  if (!ExclusiveTransaction::in_transaction)
-    transaction.emplace(*this);
+  ExclusiveTransaction transaction(*this);
 
   {
-    Stmt stmt(db, "SELECT bid FROM blocks WHERE cid = ?1");
+    Stmt stmt = prepare("SELECT bid FROM blocks WHERE cid = ?1");
     stmt.bind_blob(1, CID.asBytes());
     if (checkRow(stmt.step()))
       return stmt.columnInt(0);
@@ -453,10 +943,11 @@ sqlite3_int64 sqlite_db::putInternal(const CID &CID,
   // Add the new entry to the blocks table.
   sqlite3_int64 new_id;
   {
-    Stmt stmt(db, "INSERT INTO blocks(cid,codec,content) VALUES (?1,?2,?3)");
+    Stmt stmt =
+        prepare("INSERT INTO blocks(cid,codec,content) VALUES (?1,?2,?3)");
     stmt.bind_blob(1, CID.asBytes());
-    stmt.bind_int(2, CODEC_RAW);
-    stmt.bind_blob(3, Bytes);
+    stmt.bind_int(2, codec);
+    stmt.bind_blob(3, codec == CODEC_RAW ? Bytes : llvm::makeArrayRef(Buffer));
     checkDone(stmt.step());
     new_id = sqlite3_last_insert_rowid(db);
     assert(new_id);
@@ -465,8 +956,7 @@ sqlite3_int64 sqlite_db::putInternal(const CID &CID,
   // Update the refs table.
   add_refs_from(new_id, Value);
 
-  if (transaction)
-    transaction->commit();
+  transaction.commit();
   return new_id;
 }
 
@@ -478,9 +968,8 @@ std::vector<std::uint8_t> sqlite_db::encodeArgs(const Call &Call) {
 }
 
 Call sqlite_db::identifyCall(sqlite3_int64 callid) {
-  sqlite3 *db = get_db();
-  Stmt stmt(
-      db, "SELECT name, args FROM calls NATURAL JOIN funcs WHERE callid = ?1");
+  Stmt stmt = prepare(
+      "SELECT name, args FROM calls NATURAL JOIN funcs WHERE callid = ?1");
   stmt.bind_int(1, callid);
   requireRow(stmt.step());
 
@@ -502,7 +991,8 @@ CID sqlite_db::put(const Node &value) {
 void sqlite_db::set(const Name &Name, const CID &ref) {
   sqlite3 *db = get_db();
   if (const Head *head = std::get_if<Head>(&Name)) {
-    Stmt stmt(db, "INSERT OR REPLACE INTO heads(name, bid) VALUES(?1,?2)");
+    Stmt stmt =
+        prepare("INSERT OR REPLACE INTO heads(name, bid) VALUES(?1,?2)");
     stmt.bind_text(1, head->Name);
     stmt.bind_int(2, cid_to_bid(ref));
     checkDone(stmt.step());
@@ -516,7 +1006,8 @@ void sqlite_db::set(const Name &Name, const CID &ref) {
     bool existing;
     sqlite3_int64 CallID;
     {
-      Stmt stmt(db, "SELECT callid FROM calls WHERE funcid = ?1 AND args = ?2");
+      Stmt stmt =
+          prepare("SELECT callid FROM calls WHERE funcid = ?1 AND args = ?2");
       stmt.bind_int(1, funcid);
       stmt.bind_blob(2, Args);
       existing = checkRow(stmt.step());
@@ -526,14 +1017,14 @@ void sqlite_db::set(const Name &Name, const CID &ref) {
 
     if (existing) {
       // The existing call_refs rows don't need to change.
-      Stmt stmt(db, "UPDATE calls SET result = ?1 WHERE callid = ?2");
+      Stmt stmt = prepare("UPDATE calls SET result = ?1 WHERE callid = ?2");
       stmt.bind_int(1, cid_to_bid(ref));
       stmt.bind_int(2, CallID);
       checkDone(stmt.step());
     } else {
       {
-        Stmt stmt(db,
-                  "INSERT INTO calls(funcid, args, result) VALUES(?1,?2,?3)");
+        Stmt stmt = prepare(
+            "INSERT INTO calls(funcid, args, result) VALUES(?1,?2,?3)");
         stmt.bind_int(1, funcid);
         stmt.bind_blob(2, Args);
         stmt.bind_int(3, cid_to_bid(ref));
@@ -541,8 +1032,8 @@ void sqlite_db::set(const Name &Name, const CID &ref) {
         CallID = sqlite3_last_insert_rowid(db);
       }
       {
-        Stmt stmt(db, "INSERT OR IGNORE INTO call_refs(funcid, callid, dest) "
-                      "VALUES(?1,?2,?3)");
+        Stmt stmt = prepare("INSERT OR IGNORE INTO call_refs(funcid, callid, "
+                            "dest) VALUES(?1,?2,?3)");
         for (const CID &Arg : call->Args) {
           stmt.bind_int(1, funcid);
           stmt.bind_int(2, CallID);
@@ -558,45 +1049,249 @@ void sqlite_db::set(const Name &Name, const CID &ref) {
   }
 }
 
+std::vector<llvm::Optional<Node>> sqlite_db::getMany(llvm::ArrayRef<CID> CIDs) {
+  ReadTransaction transaction(*this);
+  return Store::getMany(CIDs);
+}
+
+bool sqlite_db::viewBytes(const CID &CID, std::function<void(BytesRef)> F) {
+  std::optional<Node> Storage;
+  if (CID.isIdentity()) {
+    F(llvm::cantFail(Node::viewBytesFromIPLD(*this, CID, {}, Storage)));
+    return true;
+  }
+  Stmt stmt = prepare("SELECT codec, content FROM blocks WHERE cid = ?1");
+  stmt.bind_blob(1, CID.asBytes());
+  if (!checkRow(stmt.step()))
+    return false;
+  // Uncompressed blocks are passed straight from SQLite's column buffer,
+  // which stays valid until the statement is stepped or reset.
+  std::vector<std::uint8_t> Buffer;
+  auto Bytes = decodeBlock(stmt.columnInt(0), stmt.columnBytes(1), Buffer);
+  F(llvm::cantFail(Node::viewBytesFromIPLD(*this, CID, Bytes, Storage)));
+  return true;
+}
+
+void sqlite_db::viewManyBytes(llvm::ArrayRef<CID> CIDs,
+                              std::function<void(size_t, BytesRef)> F) {
+  ReadTransaction transaction(*this);
+  for (size_t i = 0; i < CIDs.size(); i++)
+    viewBytes(CIDs[i], [&](BytesRef Bytes) { F(i, Bytes); });
+}
+
+std::vector<CID> sqlite_db::putMany(llvm::ArrayRef<Node> values) {
+  // Add everything in one transaction, instead of one transaction per Node.
+  ExclusiveTransaction transaction(*this);
+  auto Result = Store::putMany(values);
+  transaction.commit();
+  return Result;
+}
+
+std::vector<bool> sqlite_db::hasMany(llvm::ArrayRef<CID> CIDs) {
+  ReadTransaction transaction(*this);
+  std::vector<bool> Result;
+  Result.reserve(CIDs.size());
+  Stmt stmt = prepare("SELECT 1 FROM blocks WHERE cid = ?1");
+  for (const CID &CID : CIDs) {
+    if (CID.isIdentity()) {
+      Result.push_back(true);
+      continue;
+    }
+    stmt.bind_blob(1, CID.asBytes());
+    Result.push_back(checkRow(stmt.step()));
+    stmt.reset();
+  }
+  return Result;
+}
+
+std::vector<llvm::Optional<CID>>
+sqlite_db::resolveMany(llvm::ArrayRef<Name> Names) {
+  ReadTransaction transaction(*this);
+  return Store::resolveMany(Names);
+}
+
+std::vector<std::vector<Name>>
+sqlite_db::listNamesUsingMany(llvm::ArrayRef<CID> CIDs) {
+  ReadTransaction transaction(*this);
+  return Store::listNamesUsingMany(CIDs);
+}
+
+bool sqlite_db::beginBatch() {
+  // Hold a single exclusive transaction until the batch is committed. This
+  // prevents other connections from writing in the meantime, but it means we
+  // only need to sync the database once.
+  Connection &conn = get_conn();
+  if (conn.in_transaction)
+    return false;
+  checkStatus(
+      sqlite3_exec(conn.db, "BEGIN EXCLUSIVE", nullptr, nullptr, nullptr));
+  conn.in_transaction = true;
+  return true;
+}
+
+void sqlite_db::commitBatch() {
+  Connection &conn = get_conn();
+  assert(conn.in_transaction);
+  checkStatus(sqlite3_exec(conn.db, "COMMIT", nullptr, nullptr, nullptr));
+  conn.in_transaction = false;
+}
+
+void sqlite_db::abortBatch() {
+  Connection &conn = get_conn();
+  assert(conn.in_transaction);
+  sqlite3_exec(conn.db, "ROLLBACK", nullptr, nullptr, nullptr);
+  // ignore return code
+  conn.in_transaction = false;
+}
+
 void sqlite_db::add_refs_from(sqlite3_int64 id, const Node &value) {
-  sqlite3 *db = get_db();
   value.eachLink([&](const CID &Link) {
     auto dest = cid_to_bid(Link);
-    Stmt stmt(db, "INSERT OR IGNORE INTO block_refs(src, dest) VALUES (?1,?2)");
+    Stmt stmt =
+        prepare("INSERT OR IGNORE INTO block_refs(src, dest) VALUES (?1,?2)");
     stmt.bind_int(1, id);
     stmt.bind_int(2, dest);
     checkDone(stmt.step());
   });
 }
 
+bool sqlite_db::is_block_used(sqlite3_int64 bid) {
+  Stmt stmt = prepare("SELECT EXISTS(SELECT 1 FROM block_refs WHERE dest = ?1)"
+                      " OR EXISTS(SELECT 1 FROM heads WHERE bid = ?1)"
+                      " OR EXISTS(SELECT 1 FROM calls WHERE result = ?1)"
+                      " OR EXISTS(SELECT 1 FROM call_refs WHERE dest = ?1)");
+  stmt.bind_int(1, bid);
+  requireRow(stmt.step());
+  return stmt.columnInt(0);
+}
+
+bool sqlite_db::delete_block(sqlite3_int64 bid,
+                             std::vector<sqlite3_int64> &Recheck) {
+  llvm::Optional<Node> Value;
+  {
+    Stmt stmt =
+        prepare("SELECT cid, codec, content FROM blocks WHERE bid = ?1");
+    stmt.bind_int(1, bid);
+    if (!checkRow(stmt.step()))
+      return false; // already deleted
+    auto Ref = CID::fromBytes(stmt.columnBytes(0));
+    if (!Ref)
+      fatal_error();
+    std::vector<std::uint8_t> Buffer;
+    llvm::ArrayRef<std::uint8_t> Bytes;
+    // Identity blocks are stored with their content, but the content is
+    // also in the CID.
+    if (!Ref->isIdentity())
+      Bytes = decodeBlock(stmt.columnInt(1), stmt.columnBytes(2), Buffer);
+    Value = llvm::cantFail(Node::loadFromIPLD(*this, *Ref, Bytes));
+  }
+
+  Value->eachLink([&](const CID &Link) {
+    Stmt bid_stmt = prepare("SELECT bid FROM blocks WHERE cid = ?1");
+    bid_stmt.bind_blob(1, Link.asBytes());
+    if (!checkRow(bid_stmt.step()))
+      return;
+    sqlite3_int64 dest = bid_stmt.columnInt(0);
+    Stmt delete_stmt =
+        prepare("DELETE FROM block_refs WHERE dest = ?1 AND src = ?2");
+    delete_stmt.bind_int(1, dest);
+    delete_stmt.bind_int(2, bid);
+    checkDone(delete_stmt.step());
+    if (dest > bid)
+      Recheck.push_back(dest);
+  });
+
+  Stmt delete_stmt = prepare("DELETE FROM blocks WHERE bid = ?1");
+  delete_stmt.bind_int(1, bid);
+  checkDone(delete_stmt.step());
+  return true;
+}
+
+std::size_t sqlite_db::collectGarbage(std::chrono::seconds grace_period) {
+  // A block is always added after all the blocks it links to, except for
+  // identity blocks, which are added when they're first linked to. So if we
+  // check blocks from newest to oldest, each block's users have already been
+  // checked (and deleted, if they were garbage) by the time we get to it.
+  //
+  // Every ref to a block is recorded in the heads, calls, call_refs, or
+  // block_refs tables, so a block is garbage if and only if there are no refs
+  // to it. We check and delete each block within a transaction, so if another
+  // client adds a ref to a block, it's never deleted.
+  //
+  // Blocks are handled in small batches, so other clients only have to wait
+  // for the database lock briefly.
+  //
+  // A client may put() a block and only refer to it later, so we only check
+  // blocks that already existed grace_period ago. We also never delete the
+  // newest block. SQLite picks new bids by adding 1 to the largest existing
+  // bid, so keeping the newest block means that blocks added while we run
+  // get larger bids than any we check, rather than reusing deleted ones.
+  const int BATCH_SIZE = 1000;
+  std::size_t NumDeleted = 0;
+  sqlite3_int64 Newest;
+  {
+    Stmt stmt = prepare("SELECT max(bid) FROM blocks");
+    requireRow(stmt.step());
+    Newest = stmt.columnInt(0);
+  }
+  std::this_thread::sleep_for(grace_period);
+  sqlite3_int64 Next = Newest - 1;
+
+  while (Next > 0) {
+    ExclusiveTransaction transaction(*this);
+    std::vector<sqlite3_int64> Bids;
+    {
+      Stmt stmt = prepare(
+          "SELECT bid FROM blocks WHERE bid <= ?1 ORDER BY bid DESC LIMIT ?2");
+      stmt.bind_int(1, Next);
+      stmt.bind_int(2, BATCH_SIZE);
+      while (checkRow(stmt.step()))
+        Bids.push_back(stmt.columnInt(0));
+    }
+    if (Bids.empty())
+      break;
+    Next = Bids.back() - 1;
+
+    // Check the newest block first. Blocks that need to be checked again are
+    // added to the end.
+    std::reverse(Bids.begin(), Bids.end());
+    while (!Bids.empty()) {
+      sqlite3_int64 bid = Bids.back();
+      Bids.pop_back();
+      if (bid < Newest && !is_block_used(bid) && delete_block(bid, Bids))
+        ++NumDeleted;
+    }
+    transaction.commit();
+  }
+  return NumDeleted;
+}
+
 llvm::Optional<Node> sqlite_db::getOptional(const CID &CID) {
   if (CID.isIdentity())
     return llvm::cantFail(Node::loadFromIPLD(*this, CID, {}));
-  sqlite3 *db = get_db();
-  Stmt stmt(db, "SELECT codec, content FROM blocks WHERE cid = ?1");
+  Stmt stmt = prepare("SELECT codec, content FROM blocks WHERE cid = ?1");
   stmt.bind_blob(1, CID.asBytes());
   if (!checkRow(stmt.step()))
     return llvm::None;
-  if (stmt.columnInt(0) != CODEC_RAW)
-    llvm::report_fatal_error("unsupported compression codec");
-  return llvm::cantFail(Node::loadFromIPLD(*this, CID, stmt.columnBytes(1)));
+  std::vector<std::uint8_t> Buffer;
+  auto Bytes = decodeBlock(stmt.columnInt(0), stmt.columnBytes(1), Buffer);
+  return llvm::cantFail(Node::loadFromIPLD(*this, CID, Bytes));
 }
 
 llvm::Optional<CID> sqlite_db::resolveOptional(const Name &Name) {
   if (const CID *Ref = std::get_if<CID>(&Name)) {
     return *Ref;
   } else if (const Head *head = std::get_if<Head>(&Name)) {
-    sqlite3 *db = get_db();
-    Stmt stmt(db, "SELECT bid FROM heads WHERE name = ?1");
+    Stmt stmt = prepare("SELECT bid FROM heads WHERE name = ?1");
     stmt.bind_text(1, head->Name);
     if (!checkRow(stmt.step()))
       return llvm::None;
     return bid_to_cid(stmt.columnInt(0));
   } else if (const Call *call = std::get_if<Call>(&Name)) {
-    sqlite3 *db = get_db();
     auto funcid = get_funcid(call->Name);
     auto Args = encodeArgs(*call);
-    Stmt stmt(db, "SELECT result FROM calls WHERE funcid = ?1 AND args = ?2");
+    Stmt stmt =
+        prepare("SELECT result FROM calls WHERE funcid = ?1 AND args = ?2");
     stmt.bind_int(1, funcid);
     stmt.bind_blob(2, Args);
     if (!checkRow(stmt.step()))
@@ -608,34 +1303,33 @@ llvm::Optional<CID> sqlite_db::resolveOptional(const Name &Name) {
 }
 
 std::vector<Name> sqlite_db::list_names_using(const CID &ref) {
-  sqlite3 *db = get_db();
   std::vector<Name> Result;
 
   auto BID = cid_to_bid(ref);
 
   {
-    Stmt stmt(db, "SELECT src FROM block_refs WHERE dest = ?1");
+    Stmt stmt = prepare("SELECT src FROM block_refs WHERE dest = ?1");
     stmt.bind_int(1, BID);
     while (checkRow(stmt.step()))
       Result.emplace_back(bid_to_cid(stmt.columnInt(0)));
   }
 
   {
-    Stmt stmt(db, "SELECT name FROM heads WHERE bid = ?1");
+    Stmt stmt = prepare("SELECT name FROM heads WHERE bid = ?1");
     stmt.bind_int(1, BID);
     while (checkRow(stmt.step()))
       Result.emplace_back(Head(stmt.columnString(0)));
   }
 
   {
-    Stmt stmt(db, "SELECT callid FROM calls WHERE result = ?1");
+    Stmt stmt = prepare("SELECT callid FROM calls WHERE result = ?1");
     stmt.bind_int(1, BID);
     while (checkRow(stmt.step()))
       Result.emplace_back(identifyCall(stmt.columnInt(0)));
   }
 
   {
-    Stmt stmt(db, "SELECT callid FROM call_refs WHERE dest = ?1");
+    Stmt stmt = prepare("SELECT callid FROM call_refs WHERE dest = ?1");
     stmt.bind_int(1, BID);
     while (checkRow(stmt.step()))
       Result.emplace_back(identifyCall(stmt.columnInt(0)));
@@ -646,9 +1340,8 @@ std::vector<Name> sqlite_db::list_names_using(const CID &ref) {
 
 void sqlite_db::eachCall(llvm::StringRef Func,
                          std::function<bool(const Call &)> F) {
-  sqlite3 *db = get_db();
   sqlite3_int64 FuncID = get_funcid(Func);
-  Stmt stmt(db, "SELECT callid FROM calls WHERE funcid = ?");
+  Stmt stmt = prepare("SELECT callid FROM calls WHERE funcid = ?");
   stmt.bind_int(1, FuncID);
   while (checkRow(stmt.step()))
     if (F(identifyCall(stmt.columnInt(0))))
@@ -656,25 +1349,22 @@ void sqlite_db::eachCall(llvm::StringRef Func,
 }
 
 std::vector<std::string> sqlite_db::list_funcs() {
-  sqlite3 *db = get_db();
   std::vector<std::string> result;
-  Stmt stmt(db, "SELECT name FROM funcs");
+  Stmt stmt = prepare("SELECT name FROM funcs");
   while (checkRow(stmt.step()))
     result.emplace_back(stmt.columnString(0));
   return result;
 }
 
 void sqlite_db::eachHead(std::function<bool(const Head &)> F) {
-  sqlite3 *db = get_db();
-  Stmt stmt(db, "SELECT name FROM heads");
+  Stmt stmt = prepare("SELECT name FROM heads");
   while (checkRow(stmt.step()))
     if (F(Head(stmt.columnString(0))))
       break;
 }
 
 void sqlite_db::head_delete(const Head &Head) {
-  sqlite3 *db = get_db();
-  Stmt delete_stmt(db, "DELETE FROM heads WHERE name = ?1");
+  Stmt delete_stmt = prepare("DELETE FROM heads WHERE name = ?1");
   delete_stmt.bind_text(1, Head.Name);
   checkDone(delete_stmt.step());
 }
@@ -682,7 +1372,7 @@ void sqlite_db::head_delete(const Head &Head) {
 sqlite3_int64 sqlite_db::get_funcid(llvm::StringRef name,
                                     bool create_if_missing) {
   sqlite3 *db = get_db();
-  Stmt stmt(db, "SELECT funcid FROM funcs WHERE name = ?1");
+  Stmt stmt = prepare("SELECT funcid FROM funcs WHERE name = ?1");
   stmt.bind_text(1, name);
   if (checkRow(stmt.step()))
     return stmt.columnInt(0);
@@ -694,7 +1384,7 @@ sqlite3_int64 sqlite_db::get_funcid(llvm::StringRef name,
   if (checkRow(stmt.step()))
     return stmt.columnInt(0);
 
-  Stmt insert_stmt(db, "INSERT INTO funcs(name) VALUES (?1)");
+  Stmt insert_stmt = prepare("INSERT INTO funcs(name) VALUES (?1)");
   insert_stmt.bind_text(1, name);
   checkDone(insert_stmt.step());
   sqlite3_int64 newid = sqlite3_last_insert_rowid(db);
@@ -704,17 +1394,16 @@ sqlite3_int64 sqlite_db::get_funcid(llvm::StringRef name,
 }
 
 void sqlite_db::call_invalidate(llvm::StringRef name) {
-  sqlite3 *db = get_db();
   auto funcid = get_funcid(name);
 
   ExclusiveTransaction transaction(*this);
   {
-    Stmt stmt(db, "DELETE FROM calls WHERE funcid = ?1");
+    Stmt stmt = prepare("DELETE FROM calls WHERE funcid = ?1");
     stmt.bind_int(1, funcid);
     checkDone(stmt.step());
   }
   {
-    Stmt stmt(db, "DELETE FROM call_refs WHERE funcid = ?1");
+    Stmt stmt = prepare("DELETE FROM call_refs WHERE funcid = ?1");
     stmt.bind_int(1, funcid);
     checkDone(stmt.step());
   }
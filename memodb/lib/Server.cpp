@@ -1,16 +1,34 @@
 #include "memodb/Server.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <deque>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Twine.h>
 #include <llvm/Support/ConvertUTF.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <variant>
+#include <vector>
 
 #include "memodb/CID.h"
+#include "memodb/Metrics.h"
 #include "memodb/Multibase.h"
 #include "memodb/Node.h"
 #include "memodb/Request.h"
@@ -19,6 +37,7 @@
 using namespace memodb;
 using llvm::SmallVector;
 using llvm::StringRef;
+using llvm::Twine;
 namespace chrono = std::chrono;
 using std::chrono::steady_clock;
 
@@ -27,32 +46,52 @@ using std::chrono::steady_clock;
 // requeued.
 static const unsigned INITIAL_TIMEOUT_MINUTES = 4;
 
+// The longest time a client can ask us to hold a long polling request open.
+static const unsigned MAX_WAIT_SECONDS = 300;
+
+// The most jobs we will send in response to a single POST /worker request.
+static const unsigned MAX_JOBS_PER_REQUEST = 1024;
+
+// How often the job log is synced to disk, at most. Records logged since the
+// last sync may be lost if the machine crashes.
+static const chrono::seconds JOB_LOG_SYNC_INTERVAL(1);
+
 static bool isLegalUTF8(llvm::StringRef str) {
   auto source = reinterpret_cast<const llvm::UTF8 *>(str.data());
   auto sourceEnd = source + str.size();
   return llvm::isLegalUTF8String(&source, sourceEnd);
 }
 
+bool PendingCallOrder::operator()(const PendingCall *lhs,
+                                  const PendingCall *rhs) const {
+  if (lhs->priority != rhs->priority)
+    return lhs->priority > rhs->priority;
+  return lhs->sequence < rhs->sequence;
+}
+
 void CallGroup::deleteSomeFinishedCalls() {
   while (!unstarted_calls.empty()) {
-    PendingCall *pending_call = unstarted_calls.front();
+    PendingCall *pending_call = *unstarted_calls.begin();
     if (!pending_call->finished)
       break;
-    unstarted_calls.pop_front();
+    unstarted_calls.erase(unstarted_calls.begin());
     calls.erase(pending_call->call);
   }
   while (!calls_to_retry.empty()) {
-    PendingCall *pending_call = calls_to_retry.front();
+    PendingCall *pending_call = *calls_to_retry.begin();
     if (!pending_call->finished)
       break;
-    calls_to_retry.pop_front();
+    calls_to_retry.erase(calls_to_retry.begin());
     calls.erase(pending_call->call);
   }
 }
 
+static std::atomic<std::uint64_t> next_pending_call_sequence = 0;
+
 PendingCall::PendingCall(CallGroup *call_group, const Call &call)
     : call_group(call_group), call(call),
-      timeout_minutes(INITIAL_TIMEOUT_MINUTES) {}
+      timeout_minutes(INITIAL_TIMEOUT_MINUTES),
+      sequence(next_pending_call_sequence++) {}
 
 void PendingCall::deleteIfPossible() {
   if (assigned) {
@@ -62,11 +101,556 @@ void PendingCall::deleteIfPossible() {
   }
 }
 
-Server::Server(Store &store) : store(store) {}
+WaitingRequest::WaitingRequest(std::shared_ptr<Request> request, Kind kind,
+                               steady_clock::time_point deadline)
+    : request(std::move(request)), kind(kind), deadline(deadline) {}
+
+static bool isClaimed(const std::shared_ptr<WaitingRequest> &waiting) {
+  return waiting->isClaimed();
+}
+
+// Get the "max_jobs=N" query parameter of a POST /worker request, or 0 if it
+// wasn't given (in which case the response has a single job, not a list).
+static unsigned getMaxJobs(const Request &request) {
+  unsigned max_jobs = 0;
+  if (request.uri) {
+    for (StringRef query_param : request.uri->query_params) {
+      if (query_param.consume_front("max_jobs="))
+        query_param.getAsInteger(10, max_jobs); // ignore errors
+    }
+  }
+  return std::min(max_jobs, MAX_JOBS_PER_REQUEST);
+}
+
+// Get the "priority=N" query parameter of an evaluate request, or 0 if it
+// wasn't given. N may be negative.
+static int getPriority(const Request &request) {
+  int priority = 0;
+  if (request.uri) {
+    for (StringRef query_param : request.uri->query_params) {
+      if (query_param.consume_front("priority="))
+        query_param.getAsInteger(10, priority); // ignore errors
+    }
+  }
+  return priority;
+}
+
+// A Store that measures how long each operation on another Store takes.
+class Server::MeasuredStore : public Store {
+public:
+  enum Operation {
+    Get,
+    Put,
+    Resolve,
+    Set,
+    Has,
+    List,
+    Delete,
+    Commit,
+    NUM_OPERATIONS,
+  };
+
+  explicit MeasuredStore(Store &inner) : inner(inner) {}
+
+  void printMetrics(llvm::raw_ostream &os) const {
+    static const char *const names[NUM_OPERATIONS] = {
+        "get", "put", "resolve", "set", "has", "list", "delete", "commit",
+    };
+    printMetricHeader(os, "memodb_store_operation_duration_seconds",
+                      "histogram", "Time spent on store operations.");
+    for (unsigned i = 0; i < NUM_OPERATIONS; i++)
+      durations[i].print(os, "memodb_store_operation_duration_seconds",
+                         "operation=\"" + std::string(names[i]) + "\"");
+  }
+
+  llvm::Optional<Node> getOptional(const CID &CID) override {
+    HistogramTimer timer(durations[Get]);
+    return inner.getOptional(CID);
+  }
+
+  llvm::Optional<CID> resolveOptional(const Name &Name) override {
+    HistogramTimer timer(durations[Resolve]);
+    return inner.resolveOptional(Name);
+  }
+
+  CID put(const Node &value) override {
+    HistogramTimer timer(durations[Put]);
+    return inner.put(value);
+  }
+
+  void set(const Name &Name, const CID &ref) override {
+    HistogramTimer timer(durations[Set]);
+    inner.set(Name, ref);
+  }
+
+  std::vector<Name> list_names_using(const CID &ref) override {
+    HistogramTimer timer(durations[List]);
+    return inner.list_names_using(ref);
+  }
+
+  std::vector<std::string> list_funcs() override {
+    HistogramTimer timer(durations[List]);
+    return inner.list_funcs();
+  }
+
+  void eachHead(std::function<bool(const Head &)> F) override {
+    HistogramTimer timer(durations[List]);
+    inner.eachHead(std::move(F));
+  }
+
+  void eachCall(StringRef Func, std::function<bool(const Call &)> F) override {
+    HistogramTimer timer(durations[List]);
+    inner.eachCall(Func, std::move(F));
+  }
+
+  void head_delete(const Head &Head) override {
+    HistogramTimer timer(durations[Delete]);
+    inner.head_delete(Head);
+  }
+
+  void call_invalidate(StringRef name) override {
+    HistogramTimer timer(durations[Delete]);
+    inner.call_invalidate(name);
+  }
+
+  bool has(const CID &CID) override {
+    HistogramTimer timer(durations[Has]);
+    return inner.has(CID);
+  }
+
+  bool has(const Name &Name) override {
+    HistogramTimer timer(durations[Has]);
+    return inner.has(Name);
+  }
+
+  std::vector<llvm::Optional<Node>>
+  getMany(llvm::ArrayRef<CID> CIDs) override {
+    HistogramTimer timer(durations[Get]);
+    return inner.getMany(CIDs);
+  }
+
+  bool viewBytes(const CID &CID, std::function<void(BytesRef)> F) override {
+    HistogramTimer timer(durations[Get]);
+    return inner.viewBytes(CID, std::move(F));
+  }
+
+  void viewManyBytes(llvm::ArrayRef<CID> CIDs,
+                     std::function<void(size_t, BytesRef)> F) override {
+    HistogramTimer timer(durations[Get]);
+    inner.viewManyBytes(CIDs, std::move(F));
+  }
+
+  std::vector<CID> putMany(llvm::ArrayRef<Node> values) override {
+    HistogramTimer timer(durations[Put]);
+    return inner.putMany(values);
+  }
+
+  std::vector<bool> hasMany(llvm::ArrayRef<CID> CIDs) override {
+    HistogramTimer timer(durations[Has]);
+    return inner.hasMany(CIDs);
+  }
+
+  std::vector<llvm::Optional<CID>>
+  resolveMany(llvm::ArrayRef<Name> Names) override {
+    HistogramTimer timer(durations[Resolve]);
+    return inner.resolveMany(Names);
+  }
+
+  std::vector<std::vector<Name>>
+  listNamesUsingMany(llvm::ArrayRef<CID> CIDs) override {
+    HistogramTimer timer(durations[List]);
+    return inner.listNamesUsingMany(CIDs);
+  }
+
+protected:
+  bool beginBatch() override { return beginBatchOn(inner); }
+
+  void commitBatch() override {
+    HistogramTimer timer(durations[Commit]);
+    commitBatchOn(inner);
+  }
+
+  void abortBatch() override { abortBatchOn(inner); }
+
+private:
+  Store &inner;
+  Histogram durations[NUM_OPERATIONS];
+};
+
+// The first path segments that get their own request_durations entry.
+static const char *const ROUTES[] = {"cid", "head", "call", "worker",
+                                     "metrics"};
+
+Server::Server(Store &store)
+    : measured_store(std::make_unique<MeasuredStore>(store)),
+      store(*measured_store) {
+  for (const char *route : ROUTES)
+    request_durations[route];
+  request_durations["other"];
+}
+
+Server::~Server() {
+  if (job_log_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(job_log_mutex);
+      job_log_stopping = true;
+    }
+    job_log_cv.notify_one();
+    job_log_thread.join();
+  }
+}
+
+void Server::addMetrics(std::function<void(llvm::raw_ostream &)> print) {
+  extra_metrics.emplace_back(std::move(print));
+}
+
+void Server::setSchedulingPolicy(SchedulingPolicy policy) {
+  scheduling_policy = policy;
+}
+
+void Server::setFuncWeight(StringRef func, unsigned weight) {
+  CallGroup &call_group = call_groups.getOrCreate(func);
+  // No deadlock: we don't hold any other mutexes.
+  std::lock_guard<std::mutex> cg_lock(call_group.mutex);
+  call_group.weight = std::max(weight, 1u);
+}
 
 void Server::handleRequest(Request &request) {
-  handleNewRequest(request);
-  assert(request.responded);
+  // If the request can be answered later by another thread, it isn't safe to
+  // check request.responded.
+  bool may_wait = !request.weak_from_this().expired();
+  StringRef route = "other";
+  if (request.uri && !request.uri->path_segments.empty() &&
+      request_durations.count(request.uri->path_segments[0]))
+    route = request.uri->path_segments[0];
+  {
+    HistogramTimer timer(request_durations.find(route)->getValue());
+    handleNewRequest(request);
+  }
+  assert(may_wait || request.responded);
+  (void)may_wait;
+}
+
+Store &Server::getStore() { return store; }
+
+void Server::handleTimeouts() {
+  auto now = steady_clock::now();
+  std::vector<std::shared_ptr<WaitingRequest>> expired;
+  {
+    // No deadlock: we don't hold any other mutexes.
+    std::lock_guard<std::mutex> lock(waiting_mutex);
+    llvm::erase_if(waiting_requests,
+                   [&](const std::shared_ptr<WaitingRequest> &waiting) {
+                     if (waiting->isClaimed())
+                       return true;
+                     if (waiting->deadline > now)
+                       return false;
+                     expired.emplace_back(waiting);
+                     return true;
+                   });
+  }
+  for (auto &waiting : expired)
+    if (waiting->claim())
+      sendTimeout(*waiting);
+}
+
+// Each line of the job log is a record like "assigned 4 1650000000 0
+// /call/func/arg0,arg1". The first word is "queued", "assigned", "retry", or
+// "finished"; the numbers are the job's timeout in minutes, the time it was
+// assigned in seconds since the Unix epoch (if it's assigned), and its
+// priority. Records written by older servers don't have the priority.
+static void writeJobLogRecord(llvm::raw_ostream &os, StringRef kind,
+                              const PendingCall &pending_call) {
+  std::int64_t start_seconds = 0;
+  if (pending_call.assigned) {
+    auto elapsed = steady_clock::now() - pending_call.start_time;
+    auto start = chrono::system_clock::now() -
+                 chrono::duration_cast<chrono::system_clock::duration>(elapsed);
+    start_seconds =
+        chrono::duration_cast<chrono::seconds>(start.time_since_epoch())
+            .count();
+  }
+  os << kind << " " << pending_call.timeout_minutes << " " << start_seconds
+     << " " << pending_call.priority << " " << pending_call.call << "\n";
+}
+
+// Remove a PendingCall from CallGroup::unstarted_calls or
+// CallGroup::calls_to_retry, so it can be requeued. Returns the queue it was
+// removed from, or nullptr if it wasn't in either.
+static CallQueue *removeFromQueues(CallGroup &call_group,
+                                   PendingCall *pending_call) {
+  for (auto *queue :
+       {&call_group.unstarted_calls, &call_group.calls_to_retry})
+    if (queue->erase(pending_call))
+      return queue;
+  return nullptr;
+}
+
+void Server::openJobLog(StringRef path, std::uint64_t compact_bytes) {
+  assert(!job_log && "job log already open");
+  replayJobLog(path);
+  job_log_path = path.str();
+  job_log_compact_bytes = compact_bytes;
+  compactJobLog();
+  job_log_thread = std::thread(&Server::jobLogThreadImpl, this);
+}
+
+void Server::writeLiveJobs(llvm::raw_ostream &os) {
+  // Collect the CallGroups first, so we don't hold a shard lock while waiting
+  // for a CallGroup's mutex.
+  std::vector<CallGroup *> all_call_groups;
+  call_groups.forEach([&](StringRef, CallGroup &call_group) {
+    all_call_groups.push_back(&call_group);
+  });
+  for (CallGroup *call_group : all_call_groups) {
+    // No deadlock: we don't hold any other mutexes.
+    std::lock_guard<std::mutex> cg_lock(call_group->mutex);
+    for (PendingCall *pending_call : call_group->unstarted_calls)
+      if (!pending_call->finished)
+        writeJobLogRecord(os, "queued", *pending_call);
+    for (PendingCall *pending_call : call_group->calls_to_retry)
+      if (!pending_call->finished)
+        writeJobLogRecord(os, "retry", *pending_call);
+    for (const auto &call_item : call_group->calls)
+      if (call_item.second.assigned && !call_item.second.finished)
+        writeJobLogRecord(os, "assigned", call_item.second);
+  }
+}
+
+void Server::compactJobLog() {
+  // Anything logged before now is about to be replaced, but finish writing it
+  // to the old log in case we crash before the rename.
+  writeJobLogBuffer(/*sync*/ true);
+
+  // Rewrite the log with only the jobs that are still pending. Jobs may
+  // change while we're doing this, so once we're done, we also copy over
+  // every record logged since we started. Some of those records will already
+  // be reflected in the pending jobs we wrote, but replaying them again has
+  // no effect.
+  std::string tmp_path = job_log_path + ".tmp";
+  int fd;
+  std::error_code ec = llvm::sys::fs::openFileForWrite(tmp_path, fd);
+  if (ec)
+    llvm::report_fatal_error("can't write job log " + Twine(tmp_path) + ": " +
+                             ec.message());
+  auto os = std::make_unique<llvm::raw_fd_ostream>(fd, /*shouldClose*/ true);
+  writeLiveJobs(*os);
+  std::uint64_t live_size = os->tell();
+  std::string records;
+  {
+    std::lock_guard<std::mutex> lock(job_log_mutex);
+    std::swap(records, job_log_buffer);
+  }
+  *os << records;
+  os->flush();
+  if (os->has_error() || ::fsync(fd))
+    llvm::report_fatal_error("can't write job log " + Twine(tmp_path));
+  ec = llvm::sys::fs::rename(tmp_path, job_log_path);
+  if (ec)
+    llvm::report_fatal_error("can't replace job log " + Twine(job_log_path) +
+                             ": " + ec.message());
+
+  job_log = std::move(os);
+  job_log_fd = fd;
+  job_log_size = job_log->tell();
+  job_log_compacted_size = live_size;
+  job_log_last_sync = steady_clock::now();
+}
+
+void Server::writeJobLogBuffer(bool sync) {
+  if (!job_log)
+    return;
+  std::string records;
+  {
+    std::lock_guard<std::mutex> lock(job_log_mutex);
+    std::swap(records, job_log_buffer);
+  }
+  *job_log << records;
+  job_log->flush();
+  job_log_size += records.size();
+  if (sync) {
+    if (::fsync(job_log_fd))
+      llvm::report_fatal_error("can't sync job log " + Twine(job_log_path));
+    job_log_last_sync = steady_clock::now();
+  }
+  if (job_log->has_error())
+    llvm::report_fatal_error("can't write job log: " +
+                             Twine(job_log->error().message()));
+}
+
+void Server::jobLogThreadImpl() {
+  while (true) {
+    bool stopping;
+    {
+      std::unique_lock<std::mutex> lock(job_log_mutex);
+      job_log_cv.wait_for(lock, JOB_LOG_SYNC_INTERVAL, [this] {
+        return job_log_stopping || !job_log_buffer.empty();
+      });
+      stopping = job_log_stopping;
+    }
+
+    // Records logged while we were writing the last batch are all written
+    // together in this one.
+    bool sync = stopping || steady_clock::now() - job_log_last_sync >=
+                                JOB_LOG_SYNC_INTERVAL;
+    writeJobLogBuffer(sync);
+    if (stopping)
+      break;
+
+    // Compact the log once it's mostly records of jobs that are done or
+    // superseded.
+    if (job_log_size - job_log_compacted_size >= job_log_compact_bytes &&
+        job_log_size >= 2 * job_log_compacted_size)
+      compactJobLog();
+  }
+}
+
+void Server::replayJobLog(StringRef path) {
+  auto buffer_or_err = llvm::MemoryBuffer::getFile(path);
+  if (!buffer_or_err) {
+    if (buffer_or_err.getError() == std::errc::no_such_file_or_directory)
+      return;
+    llvm::report_fatal_error("can't read job log " + path + ": " +
+                             buffer_or_err.getError().message());
+  }
+
+  auto system_now = chrono::system_clock::now();
+  auto steady_now = steady_clock::now();
+  SmallVector<StringRef, 0> lines;
+  (*buffer_or_err)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    StringRef kind, timeout_str, start_str, priority_str = "0", call_str;
+    std::tie(kind, call_str) = line.split(' ');
+    std::tie(timeout_str, call_str) = call_str.split(' ');
+    std::tie(start_str, call_str) = call_str.split(' ');
+    if (!call_str.startswith("/"))
+      std::tie(priority_str, call_str) = call_str.split(' ');
+    unsigned timeout_minutes;
+    std::int64_t start_seconds;
+    int priority;
+    auto name = Name::parse(call_str);
+    const Call *call = name ? std::get_if<Call>(&*name) : nullptr;
+    if ((kind != "queued" && kind != "assigned" && kind != "retry" &&
+         kind != "finished") ||
+        timeout_str.getAsInteger(10, timeout_minutes) ||
+        start_str.getAsInteger(10, start_seconds) ||
+        priority_str.getAsInteger(10, priority) || !call) {
+      // The server may have been killed while writing the last record.
+      llvm::errs() << "Ignoring invalid job log record: " << line << "\n";
+      continue;
+    }
+
+    CallGroup &call_group = call_groups.getOrCreate(call->Name);
+    auto item = call_group.calls.try_emplace(*call, &call_group, *call);
+    PendingCall *pending_call = &item.first->second;
+    if (!item.second && pending_call->finished && !pending_call->assigned) {
+      // We haven't deleted this finished call yet, but the server had. Start
+      // over with a new PendingCall.
+      removeFromQueues(call_group, pending_call);
+      call_group.calls.erase(item.first);
+      item = call_group.calls.try_emplace(*call, &call_group, *call);
+      pending_call = &item.first->second;
+    }
+
+    if (kind == "queued") {
+      // An existing call is queued again when its priority is raised.
+      if (!pending_call->assigned) {
+        removeFromQueues(call_group, pending_call);
+        pending_call->priority = priority;
+        call_group.unstarted_calls.insert(pending_call);
+      }
+    } else if (kind == "finished") {
+      if (item.second) {
+        call_group.calls.erase(item.first);
+      } else {
+        pending_call->finished = true;
+        pending_call->deleteIfPossible();
+      }
+    } else {
+      if (!item.second && !pending_call->assigned)
+        removeFromQueues(call_group, pending_call);
+      pending_call->timeout_minutes = timeout_minutes;
+      pending_call->priority = priority;
+      if (kind == "assigned") {
+        auto start = chrono::system_clock::time_point(
+            chrono::seconds(start_seconds));
+        pending_call->assigned = true;
+        pending_call->start_time =
+            steady_now -
+            chrono::duration_cast<steady_clock::duration>(system_now - start);
+      } else {
+        pending_call->assigned = false;
+        call_group.calls_to_retry.insert(pending_call);
+      }
+    }
+  }
+
+  // Results may have been stored after the last record was written.
+  call_groups.forEach([&](StringRef, CallGroup &call_group) {
+    for (auto iter = call_group.calls.begin();
+         iter != call_group.calls.end();) {
+      PendingCall &pending_call = iter->second;
+      if (!pending_call.finished && store.resolveOptional(pending_call.call))
+        pending_call.finished = true;
+      if (pending_call.finished && pending_call.assigned)
+        iter = call_group.calls.erase(iter);
+      else
+        ++iter;
+    }
+    call_group.deleteSomeFinishedCalls();
+  });
+}
+
+void Server::logJob(StringRef kind, const PendingCall &pending_call) {
+  // job_log_thread is only started before any requests are handled.
+  if (!job_log_thread.joinable())
+    return;
+  // Format the record before taking the lock, and leave the I/O to
+  // job_log_thread, so callers holding CallGroup mutexes don't wait for it.
+  std::string record;
+  llvm::raw_string_ostream os(record);
+  writeJobLogRecord(os, kind, pending_call);
+  os.flush();
+  bool was_empty;
+  {
+    // No deadlock: job_log_mutex is always the last mutex to be locked.
+    std::lock_guard<std::mutex> lock(job_log_mutex);
+    was_empty = job_log_buffer.empty();
+    job_log_buffer += record;
+  }
+  if (was_empty)
+    job_log_cv.notify_one();
+}
+
+std::shared_ptr<WaitingRequest>
+Server::startWaiting(Request &request, WaitingRequest::Kind kind) {
+  unsigned seconds = 0;
+  if (request.uri) {
+    for (StringRef query_param : request.uri->query_params) {
+      if (query_param.consume_front("wait="))
+        query_param.getAsInteger(10, seconds); // ignore errors
+    }
+  }
+  if (seconds == 0)
+    return nullptr;
+  std::shared_ptr<Request> request_ptr = request.weak_from_this().lock();
+  if (!request_ptr)
+    return nullptr;
+  seconds = std::min(seconds, MAX_WAIT_SECONDS);
+  auto waiting = std::make_shared<WaitingRequest>(
+      std::move(request_ptr), kind,
+      steady_clock::now() + chrono::seconds(seconds));
+  // No deadlock: waiting_mutex is always the last mutex to be locked.
+  std::lock_guard<std::mutex> lock(waiting_mutex);
+  waiting_requests.emplace_back(waiting);
+  return waiting;
+}
+
+void Server::sendTimeout(WaitingRequest &waiting) {
+  if (waiting.kind == WaitingRequest::Kind::Worker)
+    sendJobs(*waiting.request, {});
+  else
+    waiting.request->sendAccepted();
 }
 
 void Server::handleNewRequest(Request &request) {
@@ -112,6 +696,8 @@ void Server::handleNewRequest(Request &request) {
   }
   if (uri.path_segments.size() == 1 && uri.path_segments[0] == "worker")
     return handleRequestWorker(request);
+  if (uri.path_segments.size() == 1 && uri.path_segments[0] == "metrics")
+    return handleRequestMetrics(request);
 
   return request.sendError(Request::Status::NotFound, std::nullopt, "Not Found",
                            std::nullopt);
@@ -153,6 +739,9 @@ void Server::handleRequestCID(Request &request,
                                "Not Found", std::nullopt);
     if (request.method != Request::Method::POST)
       return request.sendMethodNotAllowed("POST");
+    if (request.uri &&
+        llvm::is_contained(request.uri->query_params, "missing"))
+      return handleMissingCIDs(request);
     // POST /cid
     auto node_or_null = request.getContentNode(store);
     if (!node_or_null)
@@ -165,6 +754,35 @@ void Server::handleRequestCID(Request &request,
   }
 }
 
+void Server::handleMissingCIDs(Request &request) {
+  // POST /cid?missing
+  auto node_or_null = request.getContentNode(store);
+  if (!node_or_null)
+    return;
+  const Node &node = *node_or_null;
+  auto sendInvalid = [&]() {
+    request.sendError(Request::Status::BadRequest,
+                      "/problems/expected-cid-list", "Expected a list of CIDs",
+                      std::nullopt);
+  };
+  if (!node.is_list())
+    return sendInvalid();
+  std::vector<CID> cids;
+  for (const Node &item : node.list_range()) {
+    if (!item.is<CID>())
+      return sendInvalid();
+    cids.emplace_back(item.as<CID>());
+  }
+
+  Node result(node_list_arg);
+  std::vector<bool> present = store.hasMany(cids);
+  for (size_t i = 0; i < cids.size(); ++i)
+    if (!present[i])
+      result.emplace_back(store, cids[i]);
+  return request.sendContentNode(result, std::nullopt,
+                                 Request::CacheControl::Ephemeral);
+}
+
 void Server::handleRequestHead(Request &request,
                                std::optional<llvm::StringRef> head_str) {
   if (head_str) {
@@ -299,8 +917,10 @@ void Server::handleRequestCall(Request &request,
       return request.sendMethodNotAllowed("DELETE, GET, HEAD");
     }
   } else {
+    if (request.method == Request::Method::POST)
+      return handleCallResults(request);
     if (request.method != Request::Method::GET)
-      return request.sendMethodNotAllowed("GET, HEAD");
+      return request.sendMethodNotAllowed("GET, HEAD, POST");
 
     // GET /call
     std::vector<URI> uris;
@@ -312,6 +932,157 @@ void Server::handleRequestCall(Request &request,
   }
 }
 
+void Server::handleCallResults(Request &request) {
+  // POST /call
+  auto node_or_null = request.getContentNode(store);
+  if (!node_or_null)
+    return;
+  const Node &node = *node_or_null;
+  auto sendInvalid = [&]() {
+    request.sendError(Request::Status::BadRequest,
+                      "/problems/invalid-call-results",
+                      "Provided call results are invalid", std::nullopt);
+  };
+  if (!node.is_list())
+    return sendInvalid();
+
+  // Check all the results before storing any of them.
+  std::vector<std::pair<Call, CID>> results;
+  for (const Node &item : node.list_range()) {
+    if (!item.is_map() || !item.contains("func") || !item.contains("args") ||
+        !item.contains("result") || !item["func"].is<StringRef>() ||
+        !item["args"].is_list() || !item["result"].is<CID>())
+      return sendInvalid();
+    StringRef func = item["func"].as<StringRef>();
+    if (func.empty() || !isLegalUTF8(func))
+      return sendInvalid();
+    Call call(func, {});
+    for (const Node &arg : item["args"].list_range()) {
+      if (!arg.is<CID>())
+        return sendInvalid();
+      call.Args.emplace_back(arg.as<CID>());
+    }
+    results.emplace_back(std::move(call), item["result"].as<CID>());
+  }
+
+  Store::Batch batch(store);
+  for (const auto &result : results)
+    store.set(result.first, result.second);
+  batch.commit();
+  for (const auto &result : results)
+    handleCallResult(result.first, Link(store, result.second));
+  return request.sendCreated(std::nullopt);
+}
+
+void Server::handleRequestMetrics(Request &request) {
+  if (request.method != Request::Method::GET)
+    return request.sendMethodNotAllowed("GET, HEAD");
+  // GET /metrics
+
+  // Copy what we need from each CallGroup, so we don't hold the locks while
+  // formatting.
+  struct FuncMetrics {
+    std::string label;
+    std::uint64_t queued, running;
+    std::uint64_t num_queued, num_assigned, num_retried, num_finished;
+    const Histogram *job_durations;
+  };
+  std::vector<std::pair<StringRef, CallGroup *>> all_call_groups;
+  std::size_t num_worker_groups = 0;
+  worker_groups.forEach(
+      [&](StringRef, WorkerGroup &) { num_worker_groups++; });
+  // CallGroups are never deleted, so the keys and pointers stay valid.
+  call_groups.forEach([&](StringRef key, CallGroup &call_group) {
+    all_call_groups.emplace_back(key, &call_group);
+  });
+  std::vector<FuncMetrics> funcs;
+  for (const auto &item : all_call_groups) {
+    CallGroup &call_group = *item.second;
+    FuncMetrics func;
+    func.label = "func=\"" + escapeMetricLabel(item.first) + "\"";
+    {
+      // No deadlock: we don't hold any other mutexes.
+      std::lock_guard<std::mutex> cg_lock(call_group.mutex);
+      // Use the sizes of the queues instead of scanning every PendingCall.
+      // A PendingCall that isn't queued is running, because finished calls
+      // are deleted right away unless they're queued. Queued calls that were
+      // finished by another worker stay queued until they reach the front.
+      func.queued =
+          call_group.unstarted_calls.size() + call_group.calls_to_retry.size();
+      func.running = call_group.calls.size() - func.queued;
+      func.num_queued = call_group.num_jobs_queued;
+      func.num_assigned = call_group.num_jobs_assigned;
+      func.num_retried = call_group.num_jobs_retried;
+      func.num_finished = call_group.num_jobs_finished;
+    }
+    // Histograms are thread-safe.
+    func.job_durations = &call_group.job_durations;
+    funcs.emplace_back(std::move(func));
+  }
+  std::size_t num_waiting_workers = 0;
+  {
+    // No deadlock: waiting_mutex is always the last mutex to be locked.
+    std::lock_guard<std::mutex> lock(waiting_mutex);
+    for (const auto &waiting : waiting_requests)
+      if (waiting->kind == WaitingRequest::Kind::Worker &&
+          !waiting->isClaimed())
+        num_waiting_workers++;
+  }
+
+  std::string buffer;
+  llvm::raw_string_ostream os(buffer);
+  auto printFuncMetric = [&](StringRef name, StringRef type, StringRef help,
+                             std::uint64_t FuncMetrics::*field) {
+    printMetricHeader(os, name, type, help);
+    for (const FuncMetrics &func : funcs)
+      os << name << "{" << func.label << "} " << func.*field << "\n";
+  };
+  printFuncMetric("memodb_jobs_queued", "gauge",
+                  "Jobs waiting to be assigned to a worker, including some "
+                  "that were finished by another worker.",
+                  &FuncMetrics::queued);
+  printFuncMetric("memodb_jobs_running", "gauge",
+                  "Jobs assigned to a worker without a result yet.",
+                  &FuncMetrics::running);
+  printFuncMetric("memodb_jobs_queued_total", "counter",
+                  "Jobs added to the queue.", &FuncMetrics::num_queued);
+  printFuncMetric("memodb_jobs_assigned_total", "counter",
+                  "Jobs assigned to workers, including retries.",
+                  &FuncMetrics::num_assigned);
+  printFuncMetric("memodb_jobs_retried_total", "counter",
+                  "Jobs requeued after a worker took too long.",
+                  &FuncMetrics::num_retried);
+  printFuncMetric("memodb_jobs_finished_total", "counter",
+                  "Jobs whose results were received.",
+                  &FuncMetrics::num_finished);
+  printMetricHeader(os, "memodb_job_duration_seconds", "histogram",
+                    "Time from assigning a job to receiving its result.");
+  for (const FuncMetrics &func : funcs)
+    func.job_durations->print(os, "memodb_job_duration_seconds", func.label);
+
+  printMetricHeader(os, "memodb_workers_waiting", "gauge",
+                    "Workers waiting for a job (long polling).");
+  os << "memodb_workers_waiting " << num_waiting_workers << "\n";
+  printMetricHeader(os, "memodb_worker_groups", "gauge",
+                    "Distinct sets of funcs that workers have offered.");
+  os << "memodb_worker_groups " << num_worker_groups << "\n";
+
+  printMetricHeader(os, "memodb_request_duration_seconds", "histogram",
+                    "Time spent handling requests, excluding long polling.");
+  for (const auto &item : request_durations)
+    item.getValue().print(os, "memodb_request_duration_seconds",
+                          "route=\"" + item.getKey().str() + "\"");
+
+  measured_store->printMetrics(os);
+  for (const auto &print : extra_metrics)
+    print(os);
+
+  if (request.sendETag(llvm::xxHash64(os.str()),
+                       Request::CacheControl::Ephemeral))
+    return;
+  request.sendContent(Request::ContentType::Plain, os.str());
+}
+
 void Server::handleRequestWorker(Request &request) {
   if (request.method != Request::Method::POST)
     return request.sendMethodNotAllowed("POST");
@@ -328,11 +1099,8 @@ void Server::handleRequestWorker(Request &request) {
   StringRef key(reinterpret_cast<const char *>(cid_bytes.data()),
                 cid_bytes.size());
 
-  // No deadlock: we don't hold any other mutexes.
-  std::unique_lock<std::mutex> lock(mutex);
-  auto iter = worker_groups.find(key);
-  WorkerGroup *worker_group;
-  if (iter == worker_groups.end()) {
+  WorkerGroup *worker_group = worker_groups.lookup(key);
+  if (!worker_group) {
     auto info_or_null = store.getOptional(cid);
     if (!info_or_null)
       return request.sendError(
@@ -343,51 +1111,60 @@ void Server::handleRequestWorker(Request &request) {
       return request.sendError(Request::Status::BadRequest,
                                "/problems/invalid-worker-info",
                                "Provided worker info is invalid", std::nullopt);
-    worker_group = &worker_groups[key];
-    // Other threads can't access this worker_group yet, because worker_groups
-    // is protected by our lock on Server::mutex. So it's safe to modify.
+    // Fill in the WorkerGroup before adding it to worker_groups, so other
+    // threads never see it partially constructed. If another thread adds the
+    // same WorkerGroup first, we use that one and discard ours; both have the
+    // same contents anyway.
+    WorkerGroup new_group;
     for (const Node &func : (*info_or_null)["funcs"].list_range()) {
       if (!func.is<StringRef>())
         continue;
       // This may create a new CallGroup.
-      CallGroup &call_group = call_groups[func.as<StringRef>()];
-      worker_group->call_groups.emplace_back(&call_group);
+      CallGroup &call_group = call_groups.getOrCreate(func.as<StringRef>());
+      new_group.call_groups.emplace_back(&call_group);
     }
-    lock.unlock();
-  } else {
-    worker_group = &iter->getValue();
-    lock.unlock();
+    worker_group = &worker_groups.getOrCreate(key, std::move(new_group));
   }
 
-  // Submit all possible unstarted_calls before we submit any jobs from
-  // calls_to_retry (which have already been assigned at least once).
-  for (CallGroup *call_group : worker_group->call_groups) {
+  // Pick each job separately, so a batch of jobs can include several funcs.
+  unsigned max_jobs = std::max(getMaxJobs(request), 1u);
+  std::vector<Node> jobs;
+  while (jobs.size() < max_jobs) {
+    CallGroup *call_group = pickCallGroup(*worker_group);
+    if (!call_group)
+      break;
     // No deadlock: we don't hold any other mutexes.
     std::unique_lock<std::mutex> cg_lock(call_group->mutex);
-    call_group->deleteSomeFinishedCalls();
-    if (call_group->unstarted_calls.empty())
-      continue;
-    PendingCall *pending_call = call_group->unstarted_calls.front();
-    call_group->unstarted_calls.pop_front();
-    sendCallToWorker(*pending_call, request, std::move(cg_lock));
-    return;
+    // This may not take anything if another worker got there first.
+    takeJobs(*call_group, jobs.size() + 1, jobs);
   }
+  if (!jobs.empty())
+    return sendJobs(request, std::move(jobs));
 
+  // No PendingCall found. If the worker asked to wait, keep the request until
+  // handleEvaluateCall() adds a call it can handle.
+  auto waiting = startWaiting(request, WaitingRequest::Kind::Worker);
+  if (!waiting)
+    return sendJobs(request, {});
   for (CallGroup *call_group : worker_group->call_groups) {
     // No deadlock: we don't hold any other mutexes.
     std::unique_lock<std::mutex> cg_lock(call_group->mutex);
+    // A call may have been added since we checked above.
     call_group->deleteSomeFinishedCalls();
-    if (call_group->calls_to_retry.empty())
-      continue;
-    PendingCall *pending_call = call_group->calls_to_retry.front();
-    call_group->calls_to_retry.pop_front();
-    sendCallToWorker(*pending_call, request, std::move(cg_lock));
-    return;
+    if (!call_group->unstarted_calls.empty() ||
+        !call_group->calls_to_retry.empty()) {
+      // If we can't claim the request, another CallGroup has already sent a
+      // call to it.
+      if (waiting->claim()) {
+        takeJobs(*call_group, max_jobs, jobs);
+        cg_lock.unlock();
+        sendJobs(request, std::move(jobs));
+      }
+      return;
+    }
+    llvm::erase_if(call_group->waiting_workers, isClaimed);
+    call_group->waiting_workers.emplace_back(waiting);
   }
-
-  // No PendingCall found.
-  return request.sendContentNode(nullptr, std::nullopt,
-                                 Request::CacheControl::Ephemeral);
 }
 
 void Server::handleEvaluateCall(Request &request, Call call) {
@@ -400,12 +1177,9 @@ void Server::handleEvaluateCall(Request &request, Call call) {
     return;
   }
 
+  CallGroup &call_group = call_groups.getOrCreate(call.Name);
   // No deadlock: we don't hold any other mutexes.
-  std::unique_lock<std::mutex> lock(mutex);
-  CallGroup &call_group = call_groups[call.Name];
-  lock.unlock();
-  // No deadlock: we don't hold any other mutexes.
-  lock = std::unique_lock<std::mutex>(call_group.mutex);
+  std::unique_lock<std::mutex> lock(call_group.mutex);
 
   // If the result has just been added to the store, return it now instead of
   // potentially creating a new PendingCall.
@@ -416,14 +1190,44 @@ void Server::handleEvaluateCall(Request &request, Call call) {
     return;
   }
 
+  int priority = getPriority(request);
   auto item = call_group.calls.try_emplace(call, &call_group, call);
   PendingCall &pending_call = item.first->second;
-  request.sendAccepted();
+  // If the client asked to wait, keep the request until handleCallResult()
+  // gets the result.
+  if (auto waiting = startWaiting(request, WaitingRequest::Kind::Evaluate)) {
+    llvm::erase_if(pending_call.waiting_requests, isClaimed);
+    pending_call.waiting_requests.emplace_back(std::move(waiting));
+  } else {
+    request.sendAccepted();
+  }
 
   if (item.second) {
-    // New PendingCall, add it to the queue.
-    call_group.unstarted_calls.push_back(&pending_call);
-  } else if (pending_call.assigned) {
+    // New PendingCall, send it to a waiting worker or add it to the queue.
+    pending_call.priority = priority;
+    call_group.num_jobs_queued++;
+    logJob("queued", pending_call);
+    if (!sendCallToWaitingWorker(pending_call, lock))
+      queueCall(pending_call, call_group.unstarted_calls);
+    return;
+  }
+
+  if (priority > pending_call.priority) {
+    // Another client needs this call sooner than the first one did.
+    if (pending_call.assigned) {
+      pending_call.priority = priority;
+      logJob("assigned", pending_call);
+    } else {
+      CallQueue *queue = removeFromQueues(call_group, &pending_call);
+      assert(queue);
+      pending_call.priority = priority;
+      queue->insert(&pending_call);
+      logJob(queue == &call_group.calls_to_retry ? "retry" : "queued",
+             pending_call);
+    }
+  }
+
+  if (pending_call.assigned) {
     // Print a warning and requeue the job if it was started many minutes ago.
     // Maybe the worker crashed.
     auto minutes = chrono::floor<chrono::minutes>(steady_clock::now() -
@@ -436,33 +1240,46 @@ void Server::handleEvaluateCall(Request &request, Call call) {
       // still running and this job is just really slow.
       pending_call.timeout_minutes *= 2;
       pending_call.assigned = false;
-      call_group.calls_to_retry.push_back(&pending_call);
+      call_group.num_jobs_retried++;
+      logJob("retry", pending_call);
+      if (!sendCallToWaitingWorker(pending_call, lock))
+        queueCall(pending_call, call_group.calls_to_retry);
     }
   }
 }
 
 void Server::handleCallResult(const Call &call, Link result) {
   // Remove the PendingCall.
-  // No deadlock: we don't hold any other mutexes.
-  std::unique_lock<std::mutex> lock(mutex);
-  auto call_group_it = call_groups.find(call.Name);
-  if (call_group_it == call_groups.end())
+  CallGroup *call_group_ptr = call_groups.lookup(call.Name);
+  if (!call_group_ptr)
     return;
-  CallGroup &call_group = call_group_it->second;
-  lock.unlock();
+  CallGroup &call_group = *call_group_ptr;
   // No deadlock: we don't hold any other mutexes.
-  lock = std::unique_lock<std::mutex>(call_group.mutex);
+  std::unique_lock<std::mutex> lock(call_group.mutex);
   auto pending_call_it = call_group.calls.find(call);
   if (pending_call_it == call_group.calls.end())
     return;
   PendingCall &pending_call = pending_call_it->second;
+  if (!pending_call.finished) {
+    call_group.num_jobs_finished++;
+    if (pending_call.assigned)
+      call_group.job_durations.observe(steady_clock::now() -
+                                       pending_call.start_time);
+  }
   pending_call.finished = true;
+  logJob("finished", pending_call);
+  auto waiting_requests = std::move(pending_call.waiting_requests);
   pending_call.deleteIfPossible();
+  lock.unlock();
+
+  for (auto &waiting : waiting_requests)
+    if (waiting->claim())
+      waiting->request->sendContentNode(Node(store, result.getCID()),
+                                        std::nullopt,
+                                        Request::CacheControl::Mutable);
 }
 
-void Server::sendCallToWorker(PendingCall &pending_call, Request &worker,
-                              std::unique_lock<std::mutex> call_group_lock) {
-  assert(!worker.responded);
+Node Server::assignCall(PendingCall &pending_call) {
   Node node(node_map_arg,
             {
                 {"func", Node(utf8_string_arg, pending_call.call.Name)},
@@ -470,11 +1287,109 @@ void Server::sendCallToWorker(PendingCall &pending_call, Request &worker,
             });
   for (const CID &arg : pending_call.call.Args)
     node["args"].emplace_back(store, arg);
+  // Workers can use the priority as a hint for calls they make themselves.
+  if (pending_call.priority)
+    node["priority"] = pending_call.priority;
+  CallGroup &call_group = *pending_call.call_group;
+  virtual_clock = call_group.virtual_time;
+  call_group.virtual_time += 1.0 / call_group.weight;
+  call_group.num_jobs_assigned++;
   pending_call.assigned = true;
   pending_call.start_time = steady_clock::now();
+  logJob("assigned", pending_call);
+  return node;
+}
+
+void Server::takeJobs(CallGroup &call_group, unsigned max_jobs,
+                      std::vector<Node> &jobs) {
+  // Submit all possible unstarted_calls before we submit any jobs from
+  // calls_to_retry (which have already been assigned at least once).
+  for (CallQueue *queue :
+       {&call_group.unstarted_calls, &call_group.calls_to_retry}) {
+    while (jobs.size() < max_jobs) {
+      call_group.deleteSomeFinishedCalls();
+      if (queue->empty())
+        break;
+      PendingCall *pending_call = *queue->begin();
+      queue->erase(queue->begin());
+      jobs.emplace_back(assignCall(*pending_call));
+    }
+  }
+}
 
-  // Unlock the mutex after we're done using pending_call, but before we call
-  // Request::sendContentNode (which may be expensive).
-  call_group_lock.unlock();
-  worker.sendContentNode(node, std::nullopt, Request::CacheControl::Ephemeral);
+CallGroup *Server::pickCallGroup(const WorkerGroup &worker_group) {
+  // Lower keys are better: unstarted calls before retries, then higher
+  // priorities, then whatever the scheduling policy prefers.
+  using Key = std::tuple<bool, std::int64_t, double, std::uint64_t>;
+  CallGroup *best = nullptr;
+  Key best_key;
+  for (CallGroup *call_group : worker_group.call_groups) {
+    // No deadlock: we don't hold any other mutexes.
+    std::lock_guard<std::mutex> lock(call_group->mutex);
+    call_group->deleteSomeFinishedCalls();
+    bool retry = call_group->unstarted_calls.empty();
+    const CallQueue &queue =
+        retry ? call_group->calls_to_retry : call_group->unstarted_calls;
+    if (queue.empty())
+      continue;
+    const PendingCall &next = **queue.begin();
+    double virtual_time = scheduling_policy == SchedulingPolicy::Fair
+                              ? call_group->virtual_time
+                              : 0;
+    Key key(retry, -std::int64_t(next.priority), virtual_time, next.sequence);
+    if (!best || key < best_key) {
+      best = call_group;
+      best_key = key;
+    }
+  }
+  return best;
+}
+
+void Server::queueCall(PendingCall &pending_call, CallQueue &queue) {
+  CallGroup &call_group = *pending_call.call_group;
+  // Don't let a func that had nothing to do build up credit while it was
+  // idle, or it would starve the other funcs when it got busy again.
+  if (call_group.unstarted_calls.empty() && call_group.calls_to_retry.empty())
+    call_group.virtual_time =
+        std::max(call_group.virtual_time, virtual_clock.load());
+  queue.insert(&pending_call);
+}
+
+void Server::sendJobs(Request &worker, std::vector<Node> jobs) {
+  assert(!worker.responded);
+  // Workers that didn't ask for a list get a single job, or null.
+  if (!getMaxJobs(worker)) {
+    assert(jobs.size() <= 1);
+    return worker.sendContentNode(jobs.empty() ? Node(nullptr) : jobs[0],
+                                  std::nullopt,
+                                  Request::CacheControl::Ephemeral);
+  }
+  Node list(node_list_arg);
+  for (Node &job : jobs)
+    list.emplace_back(std::move(job));
+  worker.sendContentNode(list, std::nullopt, Request::CacheControl::Ephemeral);
+}
+
+bool Server::sendCallToWaitingWorker(
+    PendingCall &pending_call, std::unique_lock<std::mutex> &call_group_lock) {
+  auto &waiting_workers = pending_call.call_group->waiting_workers;
+  while (!waiting_workers.empty()) {
+    auto waiting = std::move(waiting_workers.front());
+    waiting_workers.pop_front();
+    if (waiting->request->isClientGone()) {
+      // Don't give the job to a worker that isn't listening anymore.
+      waiting->claim();
+      continue;
+    }
+    if (waiting->claim()) {
+      std::vector<Node> jobs;
+      jobs.emplace_back(assignCall(pending_call));
+      // Unlock the mutex after we're done using pending_call, but before we
+      // send the response (which may be expensive).
+      call_group_lock.unlock();
+      sendJobs(*waiting->request, std::move(jobs));
+      return true;
+    }
+  }
+  return false;
 }
@@ -0,0 +1,387 @@
+#include "memodb/ShardedStore.h"
+
+#include <algorithm>
+#include <future>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <variant>
+
+#include <llvm/ADT/ScopeExit.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/xxhash.h>
+
+using namespace memodb;
+
+// Number of points each shard has on the consistent hashing ring. More points
+// spread the keys more evenly between shards.
+static constexpr unsigned POINTS_PER_SHARD = 128;
+
+// The shards that have a Batch in progress on the current thread, for each
+// ShardedStore. Like in RocksDBStore, a thread_local map is used because
+// batches belong to threads.
+static thread_local std::map<const ShardedStore *, std::vector<bool>>
+    thread_batches;
+
+// Set while a thread runs its part of a parallel operation over the shards.
+// If that part needs every shard again, it runs inline. Waiting for the pool
+// could deadlock, because the pool's threads may all be busy, or waiting for a
+// lock held by the thread that's waiting.
+static thread_local bool in_shard_task = false;
+
+static std::uint64_t hashBytes(llvm::ArrayRef<std::uint8_t> bytes) {
+  return llvm::xxHash64(llvm::StringRef(
+      reinterpret_cast<const char *>(bytes.data()), bytes.size()));
+}
+
+// These hashes determine where everything is stored, so they must never
+// change.
+static std::uint64_t hashName(const Name &Name) {
+  std::string key;
+  if (const Head *head = std::get_if<Head>(&Name)) {
+    key = "h" + head->Name;
+  } else if (const Call *call = std::get_if<Call>(&Name)) {
+    key = "c" + call->Name;
+    key.push_back('\0');
+    for (const CID &arg : call->Args) {
+      auto bytes = arg.asBytes();
+      key.append(bytes.begin(), bytes.end());
+    }
+  } else {
+    return hashBytes(std::get<CID>(Name).asBytes());
+  }
+  return llvm::xxHash64(key);
+}
+
+ShardedStore::ShardedStore(std::vector<std::unique_ptr<Store>> shards)
+    : shards(std::move(shards)) {
+  if (this->shards.empty())
+    llvm::report_fatal_error("ShardedStore needs at least one shard");
+  // A shard's points depend only on its index, so appending a shard doesn't
+  // move any of the other shards' points.
+  for (std::size_t i = 0; i < this->shards.size(); ++i)
+    for (unsigned j = 0; j < POINTS_PER_SHARD; ++j)
+      ring.emplace_back(
+          llvm::xxHash64(("shard" + llvm::Twine(i) + "/" + llvm::Twine(j))
+                             .str()),
+          i);
+  std::sort(ring.begin(), ring.end());
+  if (this->shards.size() > 1)
+    pool = std::make_unique<llvm::ThreadPool>(
+        llvm::hardware_concurrency(this->shards.size() - 1));
+}
+
+ShardedStore::~ShardedStore() {}
+
+std::size_t ShardedStore::getShardIndexForHash(std::uint64_t hash) const {
+  // Use the first point at or after the hash, wrapping around the ring.
+  auto iter = std::lower_bound(
+      ring.begin(), ring.end(), hash,
+      [](const std::pair<std::uint64_t, std::size_t> &point,
+         std::uint64_t hash) { return point.first < hash; });
+  if (iter == ring.end())
+    iter = ring.begin();
+  return iter->second;
+}
+
+std::size_t ShardedStore::getShardIndex(const CID &CID) const {
+  return getShardIndexForHash(hashBytes(CID.asBytes()));
+}
+
+std::size_t ShardedStore::getShardIndex(const Name &Name) const {
+  return getShardIndexForHash(hashName(Name));
+}
+
+void ShardedStore::forEachShard(const std::function<void(std::size_t)> &F) {
+  std::vector<std::size_t> indexes(shards.size());
+  std::iota(indexes.begin(), indexes.end(), 0);
+  runOnShards(indexes, F);
+}
+
+void ShardedStore::runOnShards(llvm::ArrayRef<std::size_t> indexes,
+                               const std::function<void(std::size_t)> &F) {
+  if (indexes.size() <= 1 || in_shard_task || thread_batches.count(this)) {
+    for (std::size_t i : indexes)
+      F(i);
+    return;
+  }
+  auto runTask = [&F](std::size_t i) {
+    in_shard_task = true;
+    auto reset = llvm::make_scope_exit([] { in_shard_task = false; });
+    F(i);
+  };
+  std::vector<std::shared_future<void>> futures;
+  for (std::size_t i : indexes.drop_front())
+    futures.push_back(pool->async(runTask, i));
+  runTask(indexes.front());
+  for (auto &future : futures)
+    future.wait();
+}
+
+template <typename T, typename FuncT>
+void ShardedStore::forEachGroup(llvm::ArrayRef<T> keys, FuncT F) {
+  std::vector<std::vector<std::size_t>> indexes(shards.size());
+  std::vector<std::vector<T>> groups(shards.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    std::size_t shard = getShardIndex(keys[i]);
+    indexes[shard].push_back(i);
+    groups[shard].push_back(keys[i]);
+  }
+  std::vector<std::size_t> nonempty;
+  for (std::size_t shard = 0; shard < shards.size(); ++shard)
+    if (!groups[shard].empty())
+      nonempty.push_back(shard);
+  runOnShards(nonempty, [&](std::size_t shard) {
+    F(*shards[shard], llvm::ArrayRef<T>(groups[shard]), indexes[shard]);
+  });
+}
+
+llvm::Optional<Node> ShardedStore::getOptional(const CID &CID) {
+  if (CID.isIdentity())
+    return llvm::cantFail(Node::loadFromIPLD(*this, CID, {}));
+  return shards[getShardIndex(CID)]->getOptional(CID);
+}
+
+llvm::Optional<CID> ShardedStore::resolveOptional(const Name &Name) {
+  if (const CID *cid = std::get_if<CID>(&Name))
+    return *cid;
+  return shards[getShardIndex(Name)]->resolveOptional(Name);
+}
+
+CID ShardedStore::put(const Node &value) {
+  auto ipld = value.saveAsIPLD();
+  if (ipld.second.empty())
+    return ipld.first;
+  return shards[getShardIndex(ipld.first)]->put(value);
+}
+
+void ShardedStore::set(const Name &Name, const CID &ref) {
+  // The other shards may have pending writes for the Nodes this name refers
+  // to, which must be written first.
+  auto iter = thread_batches.find(this);
+  if (iter != thread_batches.end()) {
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+      if (iter->second[i]) {
+        commitBatchOn(*shards[i]);
+        iter->second[i] = beginBatchOn(*shards[i]);
+      }
+    }
+  }
+  shards[getShardIndex(Name)]->set(Name, ref);
+}
+
+std::vector<Name> ShardedStore::list_names_using(const CID &ref) {
+  std::vector<std::vector<Name>> results(shards.size());
+  forEachShard([&](std::size_t i) {
+    // Ignore stale copies left behind after a shard was added.
+    for (Name &name : shards[i]->list_names_using(ref))
+      if (getShardIndex(name) == i)
+        results[i].emplace_back(std::move(name));
+  });
+  std::vector<Name> result;
+  for (auto &names : results)
+    std::move(names.begin(), names.end(), std::back_inserter(result));
+  return result;
+}
+
+std::vector<std::string> ShardedStore::list_funcs() {
+  std::vector<std::vector<std::string>> results(shards.size());
+  forEachShard([&](std::size_t i) { results[i] = shards[i]->list_funcs(); });
+  std::vector<std::string> result;
+  for (auto &funcs : results)
+    std::move(funcs.begin(), funcs.end(), std::back_inserter(result));
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+// The shards are scanned in parallel, but F is called on the current thread,
+// in sorted order. That keeps the order the same no matter how the shards'
+// scans interleave (so exports are deterministic), and lets F use this store
+// without tying up the pool.
+template <typename T>
+static void callInOrder(std::vector<std::vector<T>> &results,
+                        const std::function<bool(const T &)> &F) {
+  std::vector<T> items;
+  for (auto &shard_items : results)
+    std::move(shard_items.begin(), shard_items.end(),
+              std::back_inserter(items));
+  std::sort(items.begin(), items.end());
+  for (const T &item : items)
+    if (F(item))
+      return;
+}
+
+void ShardedStore::eachHead(std::function<bool(const Head &)> F) {
+  std::vector<std::vector<Head>> results(shards.size());
+  forEachShard([&](std::size_t i) {
+    shards[i]->eachHead([&](const Head &head) {
+      if (getShardIndex(head) == i)
+        results[i].push_back(head);
+      return false;
+    });
+  });
+  callInOrder(results, F);
+}
+
+void ShardedStore::eachCall(llvm::StringRef Func,
+                            std::function<bool(const Call &)> F) {
+  std::vector<std::vector<Call>> results(shards.size());
+  forEachShard([&](std::size_t i) {
+    shards[i]->eachCall(Func, [&](const Call &call) {
+      if (getShardIndex(call) == i)
+        results[i].push_back(call);
+      return false;
+    });
+  });
+  callInOrder(results, F);
+}
+
+void ShardedStore::head_delete(const Head &Head) {
+  shards[getShardIndex(Head)]->head_delete(Head);
+}
+
+void ShardedStore::call_invalidate(llvm::StringRef name) {
+  forEachShard([&](std::size_t i) { shards[i]->call_invalidate(name); });
+}
+
+bool ShardedStore::has(const CID &CID) {
+  if (CID.isIdentity())
+    return true;
+  return shards[getShardIndex(CID)]->has(CID);
+}
+
+bool ShardedStore::has(const Name &Name) {
+  if (const CID *cid = std::get_if<CID>(&Name))
+    return has(*cid);
+  return shards[getShardIndex(Name)]->has(Name);
+}
+
+std::vector<llvm::Optional<Node>>
+ShardedStore::getMany(llvm::ArrayRef<CID> CIDs) {
+  std::vector<llvm::Optional<Node>> result(CIDs.size());
+  forEachGroup(CIDs, [&](Store &shard, llvm::ArrayRef<CID> group,
+                         const std::vector<std::size_t> &indexes) {
+    auto nodes = shard.getMany(group);
+    for (std::size_t i = 0; i < indexes.size(); ++i)
+      result[indexes[i]] = std::move(nodes[i]);
+  });
+  return result;
+}
+
+bool ShardedStore::viewBytes(const CID &CID,
+                             std::function<void(BytesRef)> F) {
+  return shards[getShardIndex(CID)]->viewBytes(CID, std::move(F));
+}
+
+void ShardedStore::viewManyBytes(llvm::ArrayRef<CID> CIDs,
+                                 std::function<void(size_t, BytesRef)> F) {
+  std::mutex mutex;
+  forEachGroup(CIDs, [&](Store &shard, llvm::ArrayRef<CID> group,
+                         const std::vector<std::size_t> &indexes) {
+    shard.viewManyBytes(group, [&](size_t i, BytesRef bytes) {
+      std::lock_guard<std::mutex> lock(mutex);
+      F(indexes[i], bytes);
+    });
+  });
+}
+
+std::vector<CID> ShardedStore::putMany(llvm::ArrayRef<Node> values) {
+  std::vector<CID> result;
+  std::vector<CID> cids;
+  std::vector<std::size_t> value_indexes;
+  for (std::size_t i = 0; i < values.size(); ++i) {
+    result.push_back(values[i].saveAsIPLD().first);
+    if (!result[i].isIdentity()) {
+      cids.push_back(result[i]);
+      value_indexes.push_back(i);
+    }
+  }
+  forEachGroup(llvm::ArrayRef<CID>(cids),
+               [&](Store &shard, llvm::ArrayRef<CID> group,
+                   const std::vector<std::size_t> &indexes) {
+                 std::vector<Node> group_values;
+                 for (std::size_t i : indexes)
+                   group_values.push_back(values[value_indexes[i]]);
+                 shard.putMany(group_values);
+               });
+  return result;
+}
+
+std::vector<bool> ShardedStore::hasMany(llvm::ArrayRef<CID> CIDs) {
+  std::vector<bool> result(CIDs.size(), true);
+  std::vector<CID> cids;
+  std::vector<std::size_t> cid_indexes;
+  for (std::size_t i = 0; i < CIDs.size(); ++i) {
+    if (!CIDs[i].isIdentity()) {
+      cids.push_back(CIDs[i]);
+      cid_indexes.push_back(i);
+    }
+  }
+  forEachGroup(llvm::ArrayRef<CID>(cids),
+               [&](Store &shard, llvm::ArrayRef<CID> group,
+                   const std::vector<std::size_t> &indexes) {
+                 auto present = shard.hasMany(group);
+                 for (std::size_t i = 0; i < indexes.size(); ++i)
+                   result[cid_indexes[indexes[i]]] = present[i];
+               });
+  return result;
+}
+
+std::vector<llvm::Optional<CID>>
+ShardedStore::resolveMany(llvm::ArrayRef<Name> Names) {
+  std::vector<llvm::Optional<CID>> result(Names.size());
+  forEachGroup(Names, [&](Store &shard, llvm::ArrayRef<Name> group,
+                          const std::vector<std::size_t> &indexes) {
+    auto cids = shard.resolveMany(group);
+    for (std::size_t i = 0; i < indexes.size(); ++i)
+      result[indexes[i]] = std::move(cids[i]);
+  });
+  return result;
+}
+
+std::vector<std::vector<Name>>
+ShardedStore::listNamesUsingMany(llvm::ArrayRef<CID> CIDs) {
+  // Any shard may have Names that use a CID, so ask every shard about every
+  // CID, but only once per batch.
+  std::vector<std::vector<std::vector<Name>>> results(shards.size());
+  forEachShard(
+      [&](std::size_t i) { results[i] = shards[i]->listNamesUsingMany(CIDs); });
+  std::vector<std::vector<Name>> result(CIDs.size());
+  for (std::size_t i = 0; i < shards.size(); ++i)
+    for (std::size_t j = 0; j < CIDs.size(); ++j)
+      for (Name &name : results[i][j])
+        if (getShardIndex(name) == i)
+          result[j].emplace_back(std::move(name));
+  return result;
+}
+
+bool ShardedStore::beginBatch() {
+  if (thread_batches.count(this))
+    return false;
+  std::vector<bool> began;
+  for (auto &shard : shards)
+    began.push_back(beginBatchOn(*shard));
+  thread_batches[this] = std::move(began);
+  return true;
+}
+
+void ShardedStore::commitBatch() {
+  std::vector<bool> began = std::move(thread_batches[this]);
+  thread_batches.erase(this);
+  for (std::size_t i = 0; i < shards.size(); ++i)
+    if (began[i])
+      commitBatchOn(*shards[i]);
+}
+
+void ShardedStore::abortBatch() {
+  std::vector<bool> began = std::move(thread_batches[this]);
+  thread_batches.erase(this);
+  for (std::size_t i = 0; i < shards.size(); ++i)
+    if (began[i])
+      abortBatchOn(*shards[i]);
+}
@@ -7,7 +7,11 @@
 #include <llvm/Support/raw_os_ostream.h>
 #include <sstream>
 
+#include "memodb/CachingStore.h"
 #include "memodb/Multibase.h"
+#include "memodb/PathGraph.h"
+#include "memodb/ShardedStore.h"
+#include "memodb/TieredStore.h"
 #include "memodb/URI.h"
 
 using namespace memodb;
@@ -37,7 +41,30 @@ bool Call::operator!=(const Call &other) const { return !(*this == other); }
 
 std::unique_ptr<Store> Store::open(llvm::StringRef uri,
                                    bool create_if_missing) {
-  if (uri.startswith("sqlite:")) {
+  if (uri.startswith("cache:")) {
+    return std::make_unique<CachingStore>(
+        Store::open(uri.substr(6), create_if_missing));
+  } else if (uri.consume_front("tiered:")) {
+    // "|" can't appear in a valid URI, so it separates the two stores.
+    auto [local_uri, remote_uri] = uri.split('|');
+    if (remote_uri.empty())
+      llvm::report_fatal_error("tiered: URI must be like tiered:LOCAL|REMOTE");
+    // The local store is just a cache, so it's always safe to create it.
+    return std::make_unique<TieredStore>(
+        Store::open(local_uri, /*create_if_missing*/ true),
+        Store::open(remote_uri, create_if_missing));
+  } else if (uri.consume_front("shard:")) {
+    llvm::SmallVector<llvm::StringRef, 8> shard_uris;
+    uri.split(shard_uris, ',');
+    std::vector<std::unique_ptr<Store>> shards;
+    for (llvm::StringRef shard_uri : shard_uris) {
+      // SQLite stores need every Node's links to be in the same store.
+      if (shard_uri.startswith("sqlite:"))
+        llvm::report_fatal_error("sqlite: stores can't be used as shards");
+      shards.emplace_back(Store::open(shard_uri, create_if_missing));
+    }
+    return std::make_unique<ShardedStore>(std::move(shards));
+  } else if (uri.startswith("sqlite:")) {
     return memodb_sqlite_open(uri.substr(7), create_if_missing);
   } else if (uri.startswith("car:")) {
     return memodb_car_open(uri, create_if_missing);
@@ -140,6 +167,82 @@ bool Store::has(const Name &Name) {
   return resolveOptional(Name).hasValue();
 }
 
+std::vector<llvm::Optional<Node>> Store::getMany(llvm::ArrayRef<CID> CIDs) {
+  std::vector<llvm::Optional<Node>> Result;
+  Result.reserve(CIDs.size());
+  for (const CID &CID : CIDs)
+    Result.emplace_back(getOptional(CID));
+  return Result;
+}
+
+bool Store::viewBytes(const CID &CID, std::function<void(BytesRef)> F) {
+  auto Value = getOptional(CID);
+  if (!Value)
+    return false;
+  F(Value->as<BytesRef>());
+  return true;
+}
+
+void Store::viewManyBytes(llvm::ArrayRef<CID> CIDs,
+                          std::function<void(size_t, BytesRef)> F) {
+  auto Values = getMany(CIDs);
+  for (size_t i = 0; i < Values.size(); i++)
+    if (Values[i])
+      F(i, Values[i]->as<BytesRef>());
+}
+
+std::vector<CID> Store::putMany(llvm::ArrayRef<Node> values) {
+  std::vector<CID> Result;
+  Result.reserve(values.size());
+  for (const Node &value : values)
+    Result.emplace_back(put(value));
+  return Result;
+}
+
+std::vector<bool> Store::hasMany(llvm::ArrayRef<CID> CIDs) {
+  std::vector<bool> Result;
+  Result.reserve(CIDs.size());
+  for (const CID &CID : CIDs)
+    Result.push_back(has(CID));
+  return Result;
+}
+
+std::vector<llvm::Optional<CID>>
+Store::resolveMany(llvm::ArrayRef<Name> Names) {
+  std::vector<llvm::Optional<CID>> Result;
+  Result.reserve(Names.size());
+  for (const Name &Name : Names)
+    Result.emplace_back(resolveOptional(Name));
+  return Result;
+}
+
+std::vector<std::vector<Name>>
+Store::listNamesUsingMany(llvm::ArrayRef<CID> CIDs) {
+  std::vector<std::vector<Name>> Result;
+  Result.reserve(CIDs.size());
+  for (const CID &CID : CIDs)
+    Result.emplace_back(list_names_using(CID));
+  return Result;
+}
+
+std::size_t Store::collectGarbage(std::chrono::seconds grace_period) {
+  llvm::report_fatal_error("This store doesn't support garbage collection");
+}
+
+Store::Batch::Batch(Store &store)
+    : store(store), active(store.beginBatch()) {}
+
+Store::Batch::~Batch() {
+  if (active)
+    store.abortBatch();
+}
+
+void Store::Batch::commit() {
+  if (active)
+    store.commitBatch();
+  active = false;
+}
+
 Node Store::get(const CID &CID) { return *getOptional(CID); }
 
 CID Store::resolve(const Name &Name) { return *resolveOptional(Name); }
@@ -163,52 +266,5 @@ std::vector<Call> Store::list_calls(llvm::StringRef Func) {
 }
 
 std::vector<Path> Store::list_paths_to(const CID &ref) {
-  using memodb::Node;
-  auto listPathsWithin = [](const Node &Value,
-                            const CID &Ref) -> std::vector<std::vector<Node>> {
-    std::vector<std::vector<Node>> Result;
-    std::vector<Node> CurPath;
-    std::function<void(const Node &)> recurse = [&](const Node &Value) {
-      if (Value.kind() == Kind::Link) {
-        if (Value.as<CID>() == Ref)
-          Result.push_back(CurPath);
-      } else if (Value.kind() == Kind::List) {
-        for (size_t i = 0; i < Value.size(); i++) {
-          CurPath.push_back(i);
-          recurse(Value[i]);
-          CurPath.pop_back();
-        }
-      } else if (Value.kind() == Kind::Map) {
-        for (const auto &item : Value.map_range()) {
-          CurPath.emplace_back(utf8_string_arg, item.key());
-          recurse(item.value());
-          CurPath.pop_back();
-        }
-      }
-    };
-    recurse(Value);
-    return Result;
-  };
-
-  std::vector<Path> Result;
-  std::vector<Node> BackwardsPath;
-  std::function<void(const CID &)> recurse = [&](const CID &Ref) {
-    for (const auto &Parent : list_names_using(Ref)) {
-      if (const CID *ParentRef = std::get_if<CID>(&Parent)) {
-        const Node Node = get(*ParentRef);
-        for (const auto &Subpath : listPathsWithin(Node, Ref)) {
-          BackwardsPath.insert(BackwardsPath.end(), Subpath.rbegin(),
-                               Subpath.rend());
-          recurse(*ParentRef);
-          BackwardsPath.erase(BackwardsPath.end() - Subpath.size(),
-                              BackwardsPath.end());
-        }
-      } else {
-        Result.emplace_back(Parent, std::vector<Node>(BackwardsPath.rbegin(),
-                                                      BackwardsPath.rend()));
-      }
-    }
-  };
-  recurse(ref);
-  return Result;
+  return buildPathGraph(*this, ref).getPaths();
 }
@@ -0,0 +1,330 @@
+#include "memodb/TieredStore.h"
+
+#include <mutex>
+#include <utility>
+#include <variant>
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+
+using namespace memodb;
+namespace fibers = boost::fibers;
+
+// Pending Nodes are sent to the remote store once they add up to this many
+// bytes.
+static constexpr std::size_t MAX_PENDING_BYTES = 16 << 20;
+
+static llvm::StringRef getKey(const CID &cid) {
+  auto bytes = cid.asBytes();
+  return llvm::StringRef(reinterpret_cast<const char *>(bytes.data()),
+                         bytes.size());
+}
+
+// Nodes that have been added through the TieredStore but haven't been written
+// to the remote store yet. The locks are fiber-aware, because ClientEvaluator
+// runs many evaluations on each thread: a fiber waiting for another fiber to
+// finish sending Nodes must let that fiber run.
+class TieredStore::Pending {
+public:
+  fibers::mutex mutex;
+  fibers::condition_variable cv;
+  // The following fields are protected by mutex.
+  // Nodes that haven't been sent yet, in the order they were added, so each
+  // Node is sent after the Nodes it links to.
+  std::vector<CID> queue;
+  std::size_t queue_bytes = 0;
+  // Every Node that hasn't been written yet, including the ones being sent.
+  llvm::StringMap<Node> nodes;
+  // Only one thread sends Nodes at a time, to keep them in order.
+  bool sending = false;
+
+  llvm::Optional<Node> lookup(const CID &cid) {
+    std::unique_lock<fibers::mutex> lock(mutex);
+    auto iter = nodes.find(getKey(cid));
+    if (iter == nodes.end())
+      return llvm::None;
+    return iter->second;
+  }
+};
+
+TieredStore::TieredStore(std::unique_ptr<Store> local,
+                         std::unique_ptr<Store> remote)
+    : local(std::move(local)), owned_remote(std::move(remote)),
+      remote(*owned_remote), pending(std::make_unique<Pending>()) {}
+
+TieredStore::TieredStore(std::unique_ptr<Store> local, Store &remote)
+    : local(std::move(local)), remote(remote),
+      pending(std::make_unique<Pending>()) {}
+
+TieredStore::~TieredStore() { flush(); }
+
+void TieredStore::flush() {
+  std::unique_lock<fibers::mutex> lock(pending->mutex);
+  while (!pending->queue.empty() || pending->sending) {
+    if (pending->sending) {
+      pending->cv.wait(lock);
+      continue;
+    }
+    std::vector<CID> cids = std::move(pending->queue);
+    pending->queue.clear();
+    pending->queue_bytes = 0;
+    std::vector<Node> values;
+    values.reserve(cids.size());
+    for (const CID &cid : cids)
+      values.emplace_back(pending->nodes.find(getKey(cid))->second);
+    pending->sending = true;
+    lock.unlock();
+
+    // Other workers may have sent some of the same Nodes already.
+    std::vector<bool> present = remote.hasMany(cids);
+    std::vector<Node> missing;
+    for (std::size_t i = 0; i < cids.size(); ++i)
+      if (!present[i])
+        missing.emplace_back(std::move(values[i]));
+    remote.putMany(missing);
+
+    lock.lock();
+    for (const CID &cid : cids)
+      pending->nodes.erase(getKey(cid));
+    pending->sending = false;
+    pending->cv.notify_all();
+  }
+}
+
+bool TieredStore::linksAreLocal(const Node &node) {
+  std::vector<CID> links;
+  node.eachLink([&](const CID &link) {
+    if (!link.isIdentity())
+      links.push_back(link);
+  });
+  if (links.empty())
+    return true;
+  for (bool present : local->hasMany(links))
+    if (!present)
+      return false;
+  return true;
+}
+
+void TieredStore::cacheNodes(llvm::ArrayRef<CID> CIDs,
+                             llvm::ArrayRef<llvm::Optional<Node>> nodes) {
+  std::vector<std::size_t> todo;
+  std::vector<CID> links;
+  for (std::size_t i = 0; i < CIDs.size(); ++i) {
+    if (!nodes[i] || CIDs[i].isIdentity())
+      continue;
+    todo.push_back(i);
+    nodes[i]->eachLink([&](const CID &link) {
+      if (!link.isIdentity())
+        links.push_back(link);
+    });
+  }
+  if (todo.empty())
+    return;
+  llvm::StringSet<> present;
+  std::vector<bool> links_present = local->hasMany(links);
+  for (std::size_t i = 0; i < links.size(); ++i)
+    if (links_present[i])
+      present.insert(getKey(links[i]));
+
+  // A Node may link to another Node fetched at the same time, so keep adding
+  // Nodes until none of the remaining ones can be added.
+  Store::Batch batch(*local);
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    std::vector<std::size_t> next_todo;
+    for (std::size_t i : todo) {
+      bool ready = true;
+      nodes[i]->eachLink([&](const CID &link) {
+        if (!link.isIdentity() && !present.count(getKey(link)))
+          ready = false;
+      });
+      if (!ready) {
+        next_todo.push_back(i);
+        continue;
+      }
+      local->put(*nodes[i]);
+      present.insert(getKey(CIDs[i]));
+      progress = true;
+    }
+    todo = std::move(next_todo);
+  }
+  batch.commit();
+}
+
+void TieredStore::cacheCall(const Call &call, const CID &result) {
+  std::vector<CID> links;
+  for (const CID &cid : call.Args)
+    if (!cid.isIdentity())
+      links.push_back(cid);
+  if (!result.isIdentity())
+    links.push_back(result);
+  for (bool present : local->hasMany(links))
+    if (!present)
+      return;
+  local->set(call, result);
+}
+
+llvm::Optional<Node> TieredStore::getOptional(const CID &CID) {
+  if (auto node = local->getOptional(CID))
+    return node;
+  if (auto node = pending->lookup(CID))
+    return node;
+  auto node = remote.getOptional(CID);
+  if (node)
+    cacheNodes(CID, node);
+  return node;
+}
+
+std::vector<llvm::Optional<Node>>
+TieredStore::getMany(llvm::ArrayRef<CID> CIDs) {
+  auto result = local->getMany(CIDs);
+  std::vector<CID> missing;
+  std::vector<std::size_t> missing_indexes;
+  for (std::size_t i = 0; i < CIDs.size(); i++) {
+    if (!result[i])
+      result[i] = pending->lookup(CIDs[i]);
+    if (!result[i]) {
+      missing.push_back(CIDs[i]);
+      missing_indexes.push_back(i);
+    }
+  }
+  if (missing.empty())
+    return result;
+  auto fetched = remote.getMany(missing);
+  cacheNodes(missing, fetched);
+  for (std::size_t i = 0; i < missing.size(); i++)
+    result[missing_indexes[i]] = std::move(fetched[i]);
+  return result;
+}
+
+bool TieredStore::has(const CID &CID) { return hasMany(CID)[0]; }
+
+bool TieredStore::has(const Name &Name) { return Store::has(Name); }
+
+std::vector<bool> TieredStore::hasMany(llvm::ArrayRef<CID> CIDs) {
+  auto result = local->hasMany(CIDs);
+  std::vector<CID> missing;
+  std::vector<std::size_t> missing_indexes;
+  for (std::size_t i = 0; i < CIDs.size(); i++) {
+    if (!result[i] && pending->lookup(CIDs[i]))
+      result[i] = true;
+    if (!result[i]) {
+      missing.push_back(CIDs[i]);
+      missing_indexes.push_back(i);
+    }
+  }
+  if (missing.empty())
+    return result;
+  auto fetched = remote.hasMany(missing);
+  for (std::size_t i = 0; i < missing.size(); i++)
+    result[missing_indexes[i]] = fetched[i];
+  return result;
+}
+
+CID TieredStore::put(const Node &value) {
+  auto ipld = value.saveAsIPLD();
+  if (ipld.second.empty())
+    return ipld.first;
+  if (linksAreLocal(value))
+    local->put(value);
+
+  std::unique_lock<fibers::mutex> lock(pending->mutex);
+  if (pending->nodes.try_emplace(getKey(ipld.first), value).second) {
+    pending->queue.push_back(ipld.first);
+    pending->queue_bytes += ipld.second.size();
+  }
+  bool full = pending->queue_bytes > MAX_PENDING_BYTES;
+  lock.unlock();
+  if (full)
+    flush();
+  return ipld.first;
+}
+
+llvm::Optional<CID> TieredStore::resolveOptional(const Name &Name) {
+  const Call *call = std::get_if<Call>(&Name);
+  if (!call)
+    return remote.resolveOptional(Name);
+  if (auto cid = local->resolveOptional(Name))
+    return cid;
+  auto cid = remote.resolveOptional(Name);
+  if (cid)
+    cacheCall(*call, *cid);
+  return cid;
+}
+
+std::vector<llvm::Optional<CID>>
+TieredStore::resolveMany(llvm::ArrayRef<Name> Names) {
+  std::vector<llvm::Optional<CID>> result(Names.size());
+  std::vector<Name> calls;
+  std::vector<std::size_t> call_indexes;
+  for (std::size_t i = 0; i < Names.size(); i++) {
+    if (std::holds_alternative<Call>(Names[i])) {
+      calls.push_back(Names[i]);
+      call_indexes.push_back(i);
+    }
+  }
+  auto local_results = local->resolveMany(calls);
+  for (std::size_t i = 0; i < calls.size(); i++)
+    result[call_indexes[i]] = std::move(local_results[i]);
+
+  std::vector<Name> missing;
+  std::vector<std::size_t> missing_indexes;
+  for (std::size_t i = 0; i < Names.size(); i++) {
+    if (!result[i]) {
+      missing.push_back(Names[i]);
+      missing_indexes.push_back(i);
+    }
+  }
+  if (missing.empty())
+    return result;
+  auto fetched = remote.resolveMany(missing);
+  for (std::size_t i = 0; i < missing.size(); i++) {
+    if (fetched[i])
+      if (const Call *call = std::get_if<Call>(&missing[i]))
+        cacheCall(*call, *fetched[i]);
+    result[missing_indexes[i]] = std::move(fetched[i]);
+  }
+  return result;
+}
+
+void TieredStore::set(const Name &Name, const CID &ref) {
+  // The remote store must have the Node before anything refers to it.
+  flush();
+  remote.set(Name, ref);
+  if (const Call *call = std::get_if<Call>(&Name))
+    cacheCall(*call, ref);
+}
+
+std::vector<Name> TieredStore::list_names_using(const CID &ref) {
+  flush();
+  return remote.list_names_using(ref);
+}
+
+std::vector<std::vector<Name>>
+TieredStore::listNamesUsingMany(llvm::ArrayRef<CID> CIDs) {
+  flush();
+  return remote.listNamesUsingMany(CIDs);
+}
+
+std::vector<std::string> TieredStore::list_funcs() {
+  return remote.list_funcs();
+}
+
+void TieredStore::eachHead(std::function<bool(const Head &)> F) {
+  remote.eachHead(std::move(F));
+}
+
+void TieredStore::eachCall(llvm::StringRef Func,
+                           std::function<bool(const Call &)> F) {
+  remote.eachCall(Func, std::move(F));
+}
+
+void TieredStore::head_delete(const Head &Head) { remote.head_delete(Head); }
+
+void TieredStore::call_invalidate(llvm::StringRef name) {
+  remote.call_invalidate(name);
+  local->call_invalidate(name);
+}
@@ -0,0 +1,233 @@
+#include "memodb/Transfer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/ErrorHandling.h>
+
+#include "memodb/Multibase.h"
+#include "memodb/Node.h"
+
+using namespace memodb;
+using llvm::ArrayRef;
+using llvm::StringRef;
+using llvm::Twine;
+
+namespace {
+// Copies Nodes using several threads. Instead of recursing, each thread takes
+// a batch of CIDs from a shared worklist, fetches the ones that are missing
+// from the target, and adds their links back to the worklist. A Node is only
+// written to the target after all the Nodes it links to have been written,
+// so the target never has dangling links, even if the transfer is
+// interrupted.
+class Transfer {
+public:
+  Transfer(Store &source, Store &target, const TransferOptions &options)
+      : source(source), target(target), options(options) {}
+
+  void add(const CID &cid);
+  std::size_t run();
+
+private:
+  struct Entry {
+    /// The Node, if it has been fetched but not written yet.
+    std::optional<Node> node;
+    /// The number of links that haven't been written yet.
+    unsigned remaining = 0;
+    /// Fetched Nodes that are waiting for this one to be written.
+    std::vector<Entry *> parents;
+    bool done = false;
+  };
+
+  Entry &getEntry(const CID &cid, bool &inserted);
+  void complete(Entry &entry);
+  void work();
+  void checkBatch(std::unique_lock<std::mutex> &lock);
+  void writeBatch(std::unique_lock<std::mutex> &lock);
+
+  Store &source;
+  Store &target;
+  const TransferOptions &options;
+  std::size_t batch_size;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  // The following fields are protected by mutex.
+  // CIDs that need to be checked.
+  std::vector<CID> worklist;
+  // Fetched Nodes whose links have all been written.
+  std::vector<Entry *> ready;
+  // Every CID that has ever been added to the worklist.
+  llvm::StringMap<Entry> entries;
+  // The number of threads working on a batch.
+  unsigned num_busy = 0;
+  std::size_t num_copied = 0;
+  std::size_t next_report;
+};
+} // end anonymous namespace
+
+Transfer::Entry &Transfer::getEntry(const CID &cid, bool &inserted) {
+  ArrayRef<std::uint8_t> bytes = cid.asBytes();
+  auto result = entries.try_emplace(StringRef(
+      reinterpret_cast<const char *>(bytes.data()), bytes.size()));
+  inserted = result.second;
+  return result.first->second;
+}
+
+void Transfer::add(const CID &cid) {
+  bool inserted;
+  getEntry(cid, inserted);
+  if (inserted)
+    worklist.push_back(cid);
+}
+
+void Transfer::complete(Entry &entry) {
+  entry.done = true;
+  entry.node.reset();
+  for (Entry *parent : entry.parents)
+    if (--parent->remaining == 0)
+      ready.push_back(parent);
+  entry.parents.clear();
+  entry.parents.shrink_to_fit();
+}
+
+std::size_t Transfer::run() {
+  batch_size = std::max(options.batch_size, std::size_t(1));
+  next_report = std::max(options.progress_interval, std::size_t(1));
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < std::max(options.num_threads, 1u); ++i)
+    threads.emplace_back([this]() { work(); });
+  work();
+  for (auto &thread : threads)
+    thread.join();
+  return num_copied;
+}
+
+void Transfer::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cv.wait(lock, [this]() {
+      return !ready.empty() || !worklist.empty() || num_busy == 0;
+    });
+    // Writing Nodes takes priority, so fetched Nodes don't pile up in memory.
+    if (!ready.empty())
+      writeBatch(lock);
+    else if (!worklist.empty())
+      checkBatch(lock);
+    else
+      return; // No thread is busy, so no more work will be added.
+    cv.notify_all();
+  }
+}
+
+void Transfer::checkBatch(std::unique_lock<std::mutex> &lock) {
+  // Take CIDs from the end of the worklist, so we finish each DAG before
+  // starting the next one and the worklist stays small.
+  std::size_t size = std::min(batch_size, worklist.size());
+  std::vector<CID> batch(worklist.end() - size, worklist.end());
+  worklist.erase(worklist.end() - size, worklist.end());
+  ++num_busy;
+  lock.unlock();
+
+  std::vector<bool> present = target.hasMany(batch);
+  std::vector<CID> missing;
+  for (std::size_t i = 0; i < batch.size(); ++i)
+    if (!present[i])
+      missing.push_back(batch[i]);
+  auto nodes = source.getMany(missing);
+  for (std::size_t i = 0; i < missing.size(); ++i)
+    if (!nodes[i])
+      llvm::report_fatal_error("Node missing from source store: " +
+                               Twine(missing[i].asString(Multibase::base64url)));
+
+  lock.lock();
+  --num_busy;
+  bool inserted;
+  for (std::size_t i = 0; i < batch.size(); ++i)
+    if (present[i])
+      complete(getEntry(batch[i], inserted));
+  for (std::size_t i = 0; i < missing.size(); ++i) {
+    Entry &entry = getEntry(missing[i], inserted);
+    entry.node = std::move(*nodes[i]);
+    entry.node->eachLink([&](const CID &link) {
+      Entry &child = getEntry(link, inserted);
+      if (inserted)
+        worklist.push_back(link);
+      if (!child.done) {
+        child.parents.push_back(&entry);
+        ++entry.remaining;
+      }
+    });
+    if (entry.remaining == 0)
+      ready.push_back(&entry);
+  }
+}
+
+void Transfer::writeBatch(std::unique_lock<std::mutex> &lock) {
+  std::size_t size = std::min(batch_size, ready.size());
+  std::vector<Entry *> batch(ready.end() - size, ready.end());
+  ready.erase(ready.end() - size, ready.end());
+  std::vector<Node> values;
+  for (Entry *entry : batch)
+    values.emplace_back(std::move(*entry->node));
+  ++num_busy;
+  lock.unlock();
+
+  Store::Batch write_batch(target);
+  target.putMany(values);
+  write_batch.commit();
+  values.clear();
+
+  lock.lock();
+  --num_busy;
+  for (Entry *entry : batch)
+    complete(*entry);
+  num_copied += batch.size();
+  if (num_copied >= next_report) {
+    if (options.progress)
+      options.progress(num_copied, worklist.size());
+    while (next_report <= num_copied)
+      next_report += std::max(options.progress_interval, std::size_t(1));
+  }
+}
+
+std::size_t memodb::transferNodes(Store &source, Store &target,
+                                  ArrayRef<CID> roots,
+                                  const TransferOptions &options) {
+  Transfer transfer(source, target, options);
+  for (const CID &cid : roots)
+    transfer.add(cid);
+  return transfer.run();
+}
+
+std::size_t memodb::transferNames(Store &source, Store &target,
+                                  ArrayRef<Name> names,
+                                  const TransferOptions &options) {
+  auto results = source.resolveMany(names);
+  std::vector<CID> roots;
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    if (!results[i])
+      llvm::report_fatal_error("Name missing from source store: " +
+                               Twine(names[i].asURI().encode()));
+    roots.push_back(*results[i]);
+    if (const Call *call = std::get_if<Call>(&names[i]))
+      roots.insert(roots.end(), call->Args.begin(), call->Args.end());
+  }
+
+  std::size_t num_copied = transferNodes(source, target, roots, options);
+
+  Store::Batch batch(target);
+  for (std::size_t i = 0; i < names.size(); ++i)
+    if (!std::holds_alternative<CID>(names[i]))
+      target.set(names[i], *results[i]);
+  batch.commit();
+  return num_copied;
+}
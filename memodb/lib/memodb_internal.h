@@ -9,8 +9,11 @@ namespace memodb {
 class Evaluator;
 class Store;
 
+// If local isn't null, it's used as a TieredStore in front of the server.
 std::unique_ptr<Evaluator> createClientEvaluator(llvm::StringRef path,
-                                                 unsigned num_threads);
+                                                 unsigned num_threads,
+                                                 bool cache,
+                                                 std::unique_ptr<Store> local);
 
 }; // namespace memodb
 
@@ -0,0 +1,361 @@
+// Microbenchmarks for MemoDB stores and evaluators. These are meant to be
+// run by hand when evaluating performance changes; the numbers they print are
+// only comparable between runs on the same machine.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <boost/fiber/fiber.hpp>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "memodb/Evaluator.h"
+#include "memodb/Node.h"
+#include "memodb/Store.h"
+#include "memodb/ToolSupport.h"
+
+using namespace llvm;
+using namespace memodb;
+
+cl::OptionCategory BenchCategory("MemoDB benchmark options");
+
+static cl::SubCommand
+    StoreCommand("store", "Measure store put/get/set/resolve speed (writes "
+                          "bench/* heads and bench.call calls to the store)");
+
+static cl::SubCommand EvaluatorCommand(
+    "evaluator", "Measure thread pool scaling with the test.* funcs (writes "
+                 "test.nqueens and test.ackermann calls to the store)");
+
+static cl::SubCommand
+    NodeCommand("node", "Measure building, encoding, decoding and traversing "
+                        "a large Node");
+
+static cl::opt<std::string> StoreUriOrEmpty(
+    "store", cl::Optional,
+    cl::desc("URI of the MemoDB store (benchmarks write to it, so use a "
+             "scratch store)"),
+    cl::init(std::string(StringRef(std::getenv("MEMODB_STORE")))),
+    cl::cat(BenchCategory), cl::sub(*cl::AllSubCommands));
+
+static cl::opt<unsigned> NumOps("n", cl::desc("Number of operations per test"),
+                                cl::init(10000), cl::cat(BenchCategory),
+                                cl::sub(*cl::AllSubCommands));
+
+static cl::opt<unsigned> ValueSize("value-size",
+                                   cl::desc("Size in bytes of each value"),
+                                   cl::init(64), cl::cat(BenchCategory),
+                                   cl::sub(StoreCommand));
+
+static cl::opt<unsigned> BatchSize(
+    "batch-size", cl::desc("Number of items per getMany/putMany call"),
+    cl::init(1000), cl::cat(BenchCategory), cl::sub(StoreCommand));
+
+static cl::opt<unsigned>
+    NumFibers("fibers",
+              cl::desc("Number of fibers for the concurrent get test"),
+              cl::init(16), cl::cat(BenchCategory), cl::sub(StoreCommand));
+
+static cl::opt<unsigned>
+    MaxThreads("max-threads",
+               cl::desc("Largest number of threads to test (doubling from 1)"),
+               cl::init(64), cl::cat(BenchCategory), cl::sub(EvaluatorCommand));
+
+static cl::opt<unsigned> NQueensSize("nqueens-size",
+                                     cl::desc("Board size for test.nqueens"),
+                                     cl::init(7), cl::cat(BenchCategory),
+                                     cl::sub(EvaluatorCommand));
+
+static cl::opt<unsigned> AckermannN("ackermann-n",
+                                    cl::desc("Second argument for "
+                                             "test.ackermann (the first is 2)"),
+                                    cl::init(100), cl::cat(BenchCategory),
+                                    cl::sub(EvaluatorCommand));
+
+static StringRef GetStoreUri() {
+  if (StoreUriOrEmpty.empty()) {
+    report_fatal_error("You must provide a MemoDB store URI, such as "
+                       "sqlite:/tmp/example.bcdb, using the -store option or "
+                       "the MEMODB_STORE environment variable.");
+  }
+  return StoreUriOrEmpty;
+}
+
+namespace {
+class Timer {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+public:
+  double seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  }
+};
+} // end anonymous namespace
+
+static void report(StringRef what, unsigned count, double seconds) {
+  outs() << format("%-16s %10u ops %10.3f s %12.0f ops/s\n",
+                   what.str().c_str(), count, seconds, count / seconds);
+}
+
+static Node makeValue(unsigned i) {
+  // Unique bytes per value, so every put creates a new block.
+  std::vector<std::uint8_t> bytes(ValueSize);
+  for (size_t j = 0; j < bytes.size(); j++)
+    bytes[j] = static_cast<std::uint8_t>((i >> (8 * (j % 4))) + j / 4);
+  return Node(byte_string_arg, bytes);
+}
+
+static int BenchStore() {
+  if (BatchSize == 0)
+    report_fatal_error("-batch-size must be positive");
+  if (NumFibers == 0)
+    report_fatal_error("-fibers must be positive");
+  auto store = Store::open(GetStoreUri(), /*create_if_missing*/ true);
+  // Make the values distinct from any previous run on the same store.
+  unsigned base = static_cast<unsigned>(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+  std::vector<CID> cids;
+  cids.reserve(NumOps);
+
+  {
+    Timer timer;
+    for (unsigned i = 0; i < NumOps; i++)
+      cids.push_back(store->put(makeValue(base + i)));
+    report("put", NumOps, timer.seconds());
+  }
+
+  {
+    Timer timer;
+    for (const CID &cid : cids)
+      store->get(cid);
+    report("get", NumOps, timer.seconds());
+  }
+
+  {
+    // Remote stores can overlap requests made by different fibers.
+    Timer timer;
+    std::vector<boost::fibers::fiber> fibers;
+    for (unsigned f = 0; f < NumFibers; f++)
+      fibers.emplace_back([&, f]() {
+        for (size_t i = f; i < cids.size(); i += NumFibers)
+          store->get(cids[i]);
+      });
+    for (auto &fiber : fibers)
+      fiber.join();
+    report(("get " + Twine(NumFibers) + " fibers").str(), NumOps,
+           timer.seconds());
+  }
+
+  {
+    std::vector<Node> values;
+    for (unsigned i = 0; i < NumOps; i++)
+      values.emplace_back(makeValue(base + NumOps + i));
+    Timer timer;
+    for (size_t i = 0; i < values.size(); i += BatchSize)
+      store->putMany(ArrayRef<Node>(values).slice(
+          i, std::min<size_t>(BatchSize, values.size() - i)));
+    report("putMany", NumOps, timer.seconds());
+  }
+
+  {
+    Timer timer;
+    for (size_t i = 0; i < cids.size(); i += BatchSize)
+      store->getMany(ArrayRef<CID>(cids).slice(
+          i, std::min<size_t>(BatchSize, cids.size() - i)));
+    report("getMany", NumOps, timer.seconds());
+  }
+
+  {
+    Timer timer;
+    for (unsigned i = 0; i < NumOps; i++)
+      store->set(Head(("bench/" + Twine(i)).str()), cids[i]);
+    report("set head", NumOps, timer.seconds());
+  }
+
+  {
+    Timer timer;
+    for (unsigned i = 0; i < NumOps; i++)
+      store->resolve(Head(("bench/" + Twine(i)).str()));
+    report("resolve head", NumOps, timer.seconds());
+  }
+
+  {
+    Timer timer;
+    for (unsigned i = 0; i < NumOps; i++)
+      store->set(Call("bench.call", {cids[i]}), cids[i]);
+    report("set call", NumOps, timer.seconds());
+  }
+
+  {
+    Timer timer;
+    for (unsigned i = 0; i < NumOps; i++)
+      store->resolve(Call("bench.call", {cids[i]}));
+    report("resolve call", NumOps, timer.seconds());
+  }
+
+  // The bench/* heads are left in place (not every store supports
+  // head_delete()); they will be overwritten by the next run.
+  store->call_invalidate("bench.call");
+  return 0;
+}
+
+static int BenchEvaluator() {
+  if (MaxThreads == 0)
+    report_fatal_error("-max-threads must be positive");
+  std::vector<StringRef> funcs = {"test.nqueens", "test.ackermann"};
+  {
+    // Results are discarded with call_invalidate() between runs, so don't
+    // touch a store that already has results the benchmark didn't make.
+    auto store = Store::open(GetStoreUri(), /*create_if_missing*/ true);
+    for (StringRef func : funcs) {
+      bool has_calls = false;
+      store->eachCall(func, [&](const Call &) {
+        has_calls = true;
+        return true;
+      });
+      if (has_calls)
+        report_fatal_error("store already has " + func +
+                           " results; use a scratch store");
+    }
+  }
+
+  // Only one handle is open at a time, because stores like rocksdb: lock the
+  // database.
+  auto run = [&](unsigned num_threads, StringRef func,
+                 const std::vector<Node> &args) {
+    auto evaluator = Evaluator::createLocal(
+        Store::open(GetStoreUri(), /*create_if_missing*/ false), num_threads);
+    std::vector<CID> arg_cids;
+    for (const Node &arg : args)
+      arg_cids.push_back(evaluator->getStore().put(arg));
+    Timer timer;
+    evaluator->evaluate(Call(func, arg_cids));
+    double seconds = timer.seconds();
+    std::string what = (func + " x" + Twine(num_threads)).str();
+    // Each call's result is stored with set(), so count those as the ops.
+    unsigned count = 0;
+    evaluator->getStore().eachCall(func, [&](const Call &) {
+      count++;
+      return false;
+    });
+    report(what, count, seconds);
+    // Discard the results, so the next run has to recompute them.
+    evaluator->getStore().call_invalidate(func);
+  };
+
+  for (unsigned num_threads = 1; num_threads <= MaxThreads; num_threads *= 2)
+    run(num_threads, funcs[0],
+        {Node(NQueensSize.getValue()), Node(node_list_arg)});
+  for (unsigned num_threads = 1; num_threads <= MaxThreads; num_threads *= 2)
+    run(num_threads, funcs[1], {Node(2), Node(AckermannN.getValue())});
+  return 0;
+}
+
+// Make a Node shaped like the result of smout.grouped_callees: a map from
+// group names to lists of candidates, each a small map of integers, a list of
+// integers, and a link.
+static Node makeLargeNode(Store &store) {
+  Node result(node_map_arg);
+  for (unsigned i = 0; i < NumOps; i++) {
+    Node &group = result[("group " + Twine(i % 1000)).str()];
+    if (group.is_null())
+      group = Node(node_list_arg);
+    Node nodes(node_list_arg);
+    for (unsigned j = 0; j < 8; j++)
+      nodes.emplace_back(i * 8 + j);
+    group.emplace_back(Node(
+        node_map_arg,
+        {{"callee", Node(store, Node(i).saveAsIPLD(true).first)},
+         {"callee_size", i % 97},
+         {"caller_savings", int(i % 31) - 15},
+         {"estimated_callee_size", i % 89},
+         {"nodes", nodes},
+         {"size", i % 13}}));
+  }
+  return result;
+}
+
+static std::uint64_t countNodes(const Node &node) {
+  std::uint64_t count = 1;
+  if (node.is_list())
+    for (const Node &item : node.list_range())
+      count += countNodes(item);
+  else if (node.is_map())
+    for (const auto &item : node.map_range())
+      count += countNodes(item.value());
+  return count;
+}
+
+static int BenchNode() {
+  auto store = Store::open(GetStoreUri(), /*create_if_missing*/ true);
+  Node node;
+  {
+    Timer timer;
+    node = makeLargeNode(*store);
+    report("build", NumOps, timer.seconds());
+  }
+  std::uint64_t num_nodes = countNodes(node);
+  outs() << format("%u candidates, %llu Nodes of %u bytes each\n",
+                   NumOps.getValue(), (unsigned long long)num_nodes,
+                   unsigned(sizeof(Node)));
+
+  std::vector<std::uint8_t> cbor;
+  {
+    Timer timer;
+    cbor = node.saveAsCBOR();
+    report("saveAsCBOR", NumOps, timer.seconds());
+  }
+  {
+    Timer timer;
+    node = cantFail(Node::loadFromCBOR(*store, cbor));
+    report("loadFromCBOR", NumOps, timer.seconds());
+  }
+  {
+    Timer timer;
+    if (countNodes(node) != num_nodes)
+      report_fatal_error("wrong number of Nodes after decoding");
+    report("traverse", NumOps, timer.seconds());
+  }
+  {
+    Timer timer;
+    Node copy = node;
+    report("copy", NumOps, timer.seconds());
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  InitTool X(argc, argv);
+
+  // Hide LLVM's options, since they're mostly irrelevant.
+  ReorganizeOptions([](cl::Option *O) {
+    if (!OptionHasCategory(*O, BenchCategory)) {
+      O->setHiddenFlag(cl::Hidden);
+      O->addSubCommand(*cl::AllSubCommands);
+    }
+  });
+
+  cl::ParseCommandLineOptions(argc, argv, "MemoDB Benchmarks");
+
+  if (StoreCommand) {
+    return BenchStore();
+  } else if (EvaluatorCommand) {
+    return BenchEvaluator();
+  } else if (NodeCommand) {
+    return BenchNode();
+  } else {
+    cl::PrintHelpMessage(false, true);
+    return 0;
+  }
+}
@@ -1,6 +1,7 @@
 // This file is based on the example code here:
 // https://www.boost.org/doc/libs/1_78_0/libs/beast/example/advanced/server/advanced_server.cpp
 
+#include <atomic>
 #include <chrono>
 #include <cstdlib>
 #include <ctime>
@@ -9,6 +10,8 @@
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <string>
+#include <tuple>
 #include <vector>
 
 #include <boost/asio.hpp>
@@ -23,7 +26,9 @@
 #include <llvm/Support/Error.h>
 #include <llvm/Support/Threading.h>
 
+#include "memodb/CBORBody.h"
 #include "memodb/HTTP.h"
+#include "memodb/Metrics.h"
 #include "memodb/Request.h"
 #include "memodb/Server.h"
 #include "memodb/Store.h"
@@ -54,6 +59,25 @@ static cl::opt<std::string> StoreUriOrEmpty(
     cl::init(std::string(llvm::StringRef(std::getenv("MEMODB_STORE")))),
     cl::cat(server_category));
 
+static cl::opt<std::string>
+    job_log_option("job-log",
+                   cl::desc("File used to keep queued jobs across restarts"),
+                   cl::value_desc("path"), cl::cat(server_category));
+
+static cl::opt<Server::SchedulingPolicy> schedule_option(
+    "schedule", cl::desc("How to choose between funcs when assigning jobs"),
+    cl::init(Server::SchedulingPolicy::Fair),
+    cl::values(clEnumValN(Server::SchedulingPolicy::Fair, "fair",
+                          "share workers between funcs by weight"),
+               clEnumValN(Server::SchedulingPolicy::OldestFirst, "oldest",
+                          "start the oldest job of any func")),
+    cl::cat(server_category));
+
+static cl::list<std::string> func_weight_option(
+    "func-weight", cl::desc("Relative share of workers for a func"),
+    cl::value_desc("func=weight"), cl::ZeroOrMore, cl::CommaSeparated,
+    cl::cat(server_category));
+
 // Note: this doesn't affect the number of RocksDB threads.
 static cl::opt<std::string>
     threads_option("j", cl::desc("Number of server threads, or \"all\""),
@@ -71,12 +95,16 @@ static llvm::StringRef GetStoreUri() {
 
 static std::mutex g_stdout_mutex;
 
+// The number of open HTTPSessions, reported by GET /metrics.
+static std::atomic<unsigned> num_connections = 0;
+
 namespace {
-template <class Send> class BeastHTTPRequest : public HTTPRequest {
+template <class Session> class BeastHTTPRequest : public HTTPRequest {
 public:
-  BeastHTTPRequest(Send &send, http::request<http::string_body> &&request)
+  BeastHTTPRequest(std::shared_ptr<Session> session,
+                   http::request<CBORBody> &&request)
       : HTTPRequest(request.method_string(), URI::parse(request.target())),
-        send(send), request(std::move(request)) {
+        session(std::move(session)), request(std::move(request)) {
     response.version(request.version());
   }
 
@@ -91,7 +119,23 @@ public:
     return iter->value();
   }
 
-  llvm::StringRef getBody() const override { return request.body(); }
+  std::optional<Node>
+  getContentNode(Store &store,
+                 const std::optional<Node> &default_node) override {
+    // CBOR bodies are decoded while they're received. The Server only asks
+    // for the content once, so we can move the Node instead of copying it.
+    CBORBody::value_type &body = request.body();
+    if (!body.error.empty()) {
+      sendError(Status::BadRequest, "/problems/invalid-or-unsupported-cbor",
+                "Invalid or unsupported CBOR", body.error);
+      return std::nullopt;
+    }
+    if (body.node)
+      return std::move(body.node);
+    return HTTPRequest::getContentNode(store, default_node);
+  }
+
+  llvm::StringRef getBody() const override { return request.body().raw; }
 
   void sendStatus(std::uint16_t status) override { response.result(status); }
 
@@ -101,17 +145,28 @@ public:
   }
 
   void sendBody(const llvm::Twine &body) override {
-    response.body() = body.str();
+    sendOwnedBody(body.str());
+  }
+
+  void sendOwnedBody(std::string &&body) override {
+    response.body() = std::move(body);
     responded = true;
     response.content_length(response.body().size());
-    send(std::move(response), request);
+    // If the Server held on to the request for long polling, this may be
+    // running on a different thread than the session.
+    auto self = std::static_pointer_cast<BeastHTTPRequest>(shared_from_this());
+    net::dispatch(session->getExecutor(), [self]() {
+      self->session->sendResponse(std::move(self->response), self->request);
+    });
   }
 
   void sendEmptyBody() override { sendBody(""); }
 
+  bool isClientGone() const override { return session->isClientGone(); }
+
 private:
-  Send &send;
-  http::request<http::string_body> request;
+  std::shared_ptr<Session> session;
+  http::request<CBORBody> request;
   http::response<http::string_body> response;
 };
 } // end anonymous namespace
@@ -125,14 +180,24 @@ static void writeEndpoint(std::ostream &os, const tcp::endpoint &endpoint) {
   os << endpoint.address();
 }
 
-template <class Send>
-static void handleRequest(Server &server,
-                          http::request<http::string_body> &&req, Send &send) {
-  // NOTE: Boost's example code uses "Send &&" instead of "Send &". This is
-  // incorrect because, if the Send (which is actually a HTTPSession::Queue) is
-  // moved into the BeastHTTPRequest, its contents will be deleted too soon.
-  BeastHTTPRequest request_class(send, std::move(req));
-  server.handleRequest(request_class);
+template <typename T> static void disableNagle(T &socket) {}
+
+static void disableNagle(tcp::socket &socket) {
+  // Clients may pipeline requests, so responses can be written back to back.
+  // Don't let Nagle's algorithm delay them.
+  beast::error_code ec;
+  socket.set_option(tcp::no_delay(true), ec);
+  // ignore errors
+}
+
+static void handleTimeoutsPeriodically(Server &server,
+                                       net::steady_timer &timer) {
+  server.handleTimeouts();
+  timer.expires_after(std::chrono::seconds(1));
+  timer.async_wait([&server, &timer](beast::error_code ec) {
+    if (!ec)
+      handleTimeoutsPeriodically(server, timer);
+  });
 }
 
 namespace {
@@ -161,17 +226,15 @@ class HTTPSession : public std::enable_shared_from_this<HTTPSession<Protocol>> {
 
     bool isFull() const { return items.size() >= limit; }
 
-    bool onWrite() {
+    void onWrite() {
       assert(!items.empty());
-      auto const was_full = isFull();
       items.erase(items.begin());
       if (!items.empty())
         (*items.front())();
-      return was_full;
     }
 
     void operator()(http::response<http::string_body> &&msg,
-                    const http::request<http::string_body> &req) {
+                    const http::request<CBORBody> &req) {
       struct WorkImpl : Work {
         HTTPSession<Protocol> &self;
         http::response<http::string_body> msg;
@@ -204,21 +267,88 @@ class HTTPSession : public std::enable_shared_from_this<HTTPSession<Protocol>> {
   Server &server;
   Queue queue;
 
-  std::optional<http::request_parser<http::string_body>> parser;
+  std::optional<http::request_parser<CBORBody>> parser;
+
+  // True while we're reading or handling a request.
+  bool reading = false;
+
+  // The number of requests we've read but haven't sent responses to yet.
+  // Responses must be sent in the same order as the requests, so we don't
+  // read any more requests while the Server is holding one for long polling.
+  unsigned num_unanswered = 0;
+
+  // True while we're waiting to see whether the client closes the connection.
+  bool watching = false;
+
+  // Set if the client closes the connection while the Server is holding a
+  // request. Read by other threads.
+  std::atomic<bool> client_gone = false;
 
 public:
   HTTPSession(typename Protocol::socket &&socket, Server &server)
-      : stream(std::move(socket)), server(server), queue(*this) {}
+      : stream(std::move(socket)), server(server), queue(*this) {
+    disableNagle(stream.socket());
+    ++num_connections;
+  }
+
+  ~HTTPSession() { --num_connections; }
 
   void run() {
     auto self = this->shared_from_this();
-    net::dispatch(stream.get_executor(), [self]() { self->doRead(); });
+    net::dispatch(stream.get_executor(), [self]() { self->maybeRead(); });
+  }
+
+  auto getExecutor() { return stream.get_executor(); }
+
+  bool isClientGone() const { return client_gone; }
+
+  // Must be called on the session's executor.
+  void sendResponse(http::response<http::string_body> &&msg,
+                    const http::request<CBORBody> &req) {
+    queue(std::move(msg), req);
+    --num_unanswered;
+    maybeRead();
   }
 
 private:
+  void maybeRead() {
+    if (reading || queue.isFull())
+      return;
+    if (num_unanswered)
+      return watchForClose();
+    reading = true;
+    doRead();
+  }
+
+  // While we aren't reading, check whether the client closes the connection,
+  // so the Server doesn't give jobs to workers that have gone away.
+  void watchForClose() {
+    if (watching)
+      return;
+    watching = true;
+    auto self = this->shared_from_this();
+    stream.socket().async_wait(
+        net::socket_base::wait_read, [self](beast::error_code ec) {
+          self->watching = false;
+          // If we've started reading again, the read will notice the close.
+          if (ec || self->reading)
+            return;
+          // Peek so any pipelined request is still there when we read it.
+          char c;
+          auto &socket = self->stream.socket();
+          socket.non_blocking(true, ec);
+          if (!ec)
+            socket.receive(net::buffer(&c, 1), net::socket_base::message_peek,
+                           ec);
+          if (ec && ec != net::error::would_block)
+            self->client_gone = true;
+        });
+  }
+
   void doRead() {
     parser.emplace();
     parser->body_limit({}); // disable request size limit
+    parser->get().body().store = &server.getStore();
     // Don't set an expiration time for the request (if the client is
     // processing something, it may not send any requests for many minutes).
     auto self = this->shared_from_this();
@@ -237,9 +367,12 @@ private:
       std::cerr << "read: " << ec.message() << "\n";
       return;
     }
-    handleRequest(server, parser->release(), queue);
-    if (!queue.isFull())
-      doRead();
+    auto request = std::make_shared<BeastHTTPRequest<HTTPSession>>(
+        this->shared_from_this(), parser->release());
+    ++num_unanswered;
+    server.handleRequest(*request);
+    reading = false;
+    maybeRead();
   }
 
   void onWrite(bool close, beast::error_code ec,
@@ -251,8 +384,8 @@ private:
     }
     if (close)
       return doClose();
-    if (queue.onWrite())
-      doRead();
+    queue.onWrite();
+    maybeRead();
   }
 
   void doClose() {
@@ -261,7 +394,7 @@ private:
   }
 
   void writeLog(const http::response<http::string_body> &response,
-                const http::request<http::string_body> &request) {
+                const http::request<CBORBody> &request) {
     // https://en.wikipedia.org/wiki/Common_Log_Format
 
     // There are so many successful requests, writing the log is actually a
@@ -338,6 +471,22 @@ int main(int argc, char **argv) {
 
   // Create the protocol-agnostic Server instance.
   Server server(*store);
+  server.setSchedulingPolicy(schedule_option);
+  for (llvm::StringRef item : func_weight_option) {
+    llvm::StringRef func, weight_str;
+    std::tie(func, weight_str) = item.rsplit('=');
+    unsigned weight;
+    if (func.empty() || weight_str.getAsInteger(10, weight) || weight == 0)
+      llvm::report_fatal_error("invalid func weight: " + item);
+    server.setFuncWeight(func, weight);
+  }
+  if (!job_log_option.empty())
+    server.openJobLog(job_log_option);
+  server.addMetrics([](llvm::raw_ostream &os) {
+    printMetricHeader(os, "memodb_http_connections", "gauge",
+                      "Open HTTP connections.");
+    os << "memodb_http_connections " << num_connections << "\n";
+  });
 
   int thread_count;
   Optional<llvm::ThreadPoolStrategy> strategy_or_none =
@@ -373,6 +522,10 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // Respond to long polling requests that have timed out.
+  net::steady_timer timeout_timer(ioc);
+  handleTimeoutsPeriodically(server, timeout_timer);
+
   // TODO: do we need to capture SIGINT/SIGTERM like the example code?
 
   // Run the I/O service on the requested number of threads.
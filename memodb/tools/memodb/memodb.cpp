@@ -1,3 +1,4 @@
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
 #include <llvm/ADT/StringRef.h>
@@ -20,10 +21,12 @@
 
 #include "memodb/CAR.h"
 #include "memodb/Evaluator.h"
+#include "memodb/PathGraph.h"
 #include "memodb/Request.h"
 #include "memodb/Server.h"
 #include "memodb/Store.h"
 #include "memodb/ToolSupport.h"
+#include "memodb/Transfer.h"
 #include "memodb/URI.h"
 
 using namespace llvm;
@@ -38,6 +41,8 @@ static cl::SubCommand EvaluateCommand(
     "evaluate",
     "Evaluate an arbitrary func (if the func is built in to memodb)");
 static cl::SubCommand ExportCommand("export", "Export values to a CAR file");
+static cl::SubCommand
+    GCCommand("gc", "Delete Nodes that can't be reached from a head or call");
 static cl::SubCommand GetCommand("get", "Get a value");
 static cl::SubCommand InitCommand("init", "Initialize a store");
 static cl::SubCommand
@@ -292,6 +297,13 @@ static int Evaluate() {
   return 0;
 }
 
+// parallelism options
+
+static cl::opt<unsigned>
+    Threads("j", cl::init(8), cl::desc("Number of Nodes to fetch in parallel"),
+            cl::cat(MemoDBCategory), cl::sub(ExportCommand),
+            cl::sub(PathsToCommand), cl::sub(TransferCommand));
+
 // memodb export
 
 static cl::list<std::string> NamesToExport(cl::Positional, cl::ZeroOrMore,
@@ -300,20 +312,55 @@ static cl::list<std::string> NamesToExport(cl::Positional, cl::ZeroOrMore,
                                            cl::cat(MemoDBCategory),
                                            cl::sub(ExportCommand));
 
+static cl::opt<bool>
+    Resume("resume",
+           cl::desc("Continue an interrupted export to the same output file"),
+           cl::cat(MemoDBCategory), cl::sub(ExportCommand));
+
 static int Export() {
-  auto OutputFile = GetOutputFile();
-  if (!OutputFile)
-    return 1;
+  CARExportOptions Options;
+  Options.num_threads = Threads;
   std::vector<Name> names;
   for (StringRef NameURI : NamesToExport)
     names.emplace_back(GetNameFromURI(NameURI));
   auto store = Store::open(GetStoreUri());
-  CID RootRef = exportToCARFile(OutputFile->os(), *store, names);
+
+  if (OutputFilename != "-") {
+    // Write to the file directly instead of through a ToolOutputFile, so a
+    // partial file is left behind if we're interrupted and -resume can
+    // continue it.
+    Options.resume = Resume;
+    CID RootRef = exportToCARFile(OutputFilename, *store, names, Options);
+    llvm::errs() << "Exported with Root CID: " << RootRef << "\n";
+    return 0;
+  }
+  if (Resume)
+    report_fatal_error("-resume requires an output file");
+
+  auto OutputFile = GetOutputFile();
+  if (!OutputFile)
+    return 1;
+  CID RootRef = exportToCARFile(OutputFile->os(), *store, names, Options);
   OutputFile->keep();
   llvm::errs() << "Exported with Root CID: " << RootRef << "\n";
   return 0;
 }
 
+// memodb gc
+
+static cl::opt<unsigned> GracePeriod(
+    "grace", cl::init(60),
+    cl::desc("Keep Nodes that were added less than this many seconds ago"),
+    cl::value_desc("seconds"), cl::cat(MemoDBCategory), cl::sub(GCCommand));
+
+static int GC() {
+  auto store = Store::open(GetStoreUri());
+  size_t NumDeleted =
+      store->collectGarbage(std::chrono::seconds(GracePeriod));
+  errs() << "deleted " << NumDeleted << " nodes\n";
+  return 0;
+}
+
 // memodb get
 
 static int Get() {
@@ -338,6 +385,12 @@ static int Init() {
 
 // memodb paths-to
 
+static cl::opt<bool>
+    PrintGraph("graph",
+               cl::desc("Print the graph of Nodes leading to the target, "
+                        "instead of every path"),
+               cl::cat(MemoDBCategory), cl::sub(PathsToCommand));
+
 static int PathsTo() {
   auto db = Store::open(GetStoreUri());
   auto ref = ReadRef(*db, TargetURI);
@@ -345,12 +398,28 @@ static int PathsTo() {
     errs() << "not found\n";
     return 1;
   }
-  for (const auto &path : db->list_paths_to(*ref)) {
+  PathGraphOptions Options;
+  Options.num_threads = Threads;
+  PathGraph Graph = buildPathGraph(*db, *ref, Options);
+  if (PrintGraph) {
+    for (const auto &Item : Graph.getAllEdges()) {
+      outs() << Name(Item.first) << '\n';
+      for (const auto &Edge : Item.second) {
+        outs() << "  <- " << Edge.Parent;
+        for (const auto &item : Edge.Subpath)
+          outs() << '[' << item << ']';
+        outs() << '\n';
+      }
+    }
+    return 0;
+  }
+  Graph.eachPath([](const Path &path) {
     outs() << path.first;
     for (const auto &item : path.second)
       outs() << '[' << item << ']';
     outs() << '\n';
-  }
+    return false;
+  });
   return 0;
 }
 
@@ -399,43 +468,27 @@ static int Transfer() {
   auto SourceDb = Store::open(GetStoreUri());
   auto TargetDb = Store::open(TargetStoreURI);
 
-  std::function<void(const CID &)> transferRef = [&](const CID &Ref) {
-    if (!TargetDb->has(Ref)) {
-      Node Value = SourceDb->get(Ref);
-      TargetDb->put(Value);
-      Value.eachLink(transferRef);
-    }
-  };
-
-  auto transferName = [&](const Name &Name) {
-    errs() << "transferring " << Name << "\n";
-    if (const CID *Ref = std::get_if<CID>(&Name)) {
-      transferRef(*Ref);
-    } else if (const Head *head = std::get_if<Head>(&Name)) {
-      auto Result = SourceDb->resolve(Name);
-      transferRef(Result);
-      TargetDb->set(*head, Result);
-    } else if (const Call *call = std::get_if<Call>(&Name)) {
-      for (const CID &Arg : call->Args)
-        transferRef(Arg);
-      CID Result = SourceDb->resolve(Name);
-      transferRef(Result);
-      TargetDb->set(*call, Result);
-    } else {
-      llvm_unreachable("impossible Name type");
-    }
-  };
-
+  std::vector<Name> Names;
   if (NamesToTransfer.empty()) {
     for (const Head &head : SourceDb->list_heads())
-      transferName(head);
+      Names.emplace_back(head);
     for (StringRef Func : SourceDb->list_funcs())
       for (const Call &call : SourceDb->list_calls(Func))
-        transferName(call);
+        Names.emplace_back(call);
   } else {
     for (StringRef NameURI : NamesToTransfer)
-      transferName(GetNameFromURI(NameURI));
+      Names.emplace_back(GetNameFromURI(NameURI));
   }
+
+  errs() << "transferring " << Names.size() << " names\n";
+  TransferOptions Options;
+  Options.num_threads = Threads;
+  Options.progress = [](size_t NumCopied, size_t NumWaiting) {
+    errs() << "copied " << NumCopied << " nodes, " << NumWaiting
+           << " more to check\n";
+  };
+  size_t NumCopied = transferNames(*SourceDb, *TargetDb, Names, Options);
+  errs() << "copied " << NumCopied << " nodes\n";
   return 0;
 }
 
@@ -462,6 +515,8 @@ int main(int argc, char **argv) {
     return Evaluate();
   } else if (ExportCommand) {
     return Export();
+  } else if (GCCommand) {
+    return GC();
   } else if (GetCommand) {
     return Get();
   } else if (InitCommand) {
@@ -0,0 +1,110 @@
+#include "memodb/CAR.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "FakeStore.h"
+#include "memodb/CID.h"
+#include "memodb/Node.h"
+#include "memodb/Store.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+
+namespace {
+
+class CARExportTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    // Make a DAG with shared subtrees.
+    std::vector<CID> leaves;
+    for (unsigned i = 0; i < 50; ++i)
+      leaves.push_back(store.put(makeLeaf(i)));
+    for (unsigned i = 0; i < 20; ++i) {
+      Node list(node_list_arg);
+      for (unsigned j = 0; j < 10; ++j)
+        list.emplace_back(store, leaves[(i * 7 + j) % leaves.size()]);
+      CID cid = store.put(list);
+      if (i % 2)
+        store.set(Head("head" + std::to_string(i)), cid);
+      else
+        store.set(Call("func", {leaves[i]}), cid);
+    }
+  }
+
+  std::string path(llvm::StringRef name) { return dir.path(name); }
+
+  std::string readFile(const std::string &path) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    EXPECT_TRUE(buffer);
+    return buffer ? (*buffer)->getBuffer().str() : "";
+  }
+
+  TempDir dir;
+  LockedFakeStore store;
+};
+
+TEST_F(CARExportTest, RoundTrip) {
+  CARExportOptions options;
+  options.num_threads = 4;
+  options.prefetch_limit = 3;
+  exportToCARFile(path("out.car"), store, {}, options);
+
+  auto car = Store::open("car:" + path("out.car"));
+  store.eachHead([&](const Head &head) {
+    CID cid = store.resolve(head);
+    EXPECT_EQ(car->resolve(head), cid);
+    EXPECT_EQ(car->get(cid), store.get(cid));
+    return false;
+  });
+  store.eachCall("func", [&](const Call &call) {
+    CID cid = store.resolve(call);
+    EXPECT_EQ(car->resolve(call), cid);
+    EXPECT_EQ(car->get(cid), store.get(cid));
+    Node value = store.get(cid);
+    for (const Node &item : value.list_range())
+      EXPECT_EQ(car->get(item.as<CID>()), store.get(item.as<CID>()));
+    return false;
+  });
+}
+
+TEST_F(CARExportTest, Deterministic) {
+  CARExportOptions options;
+  options.num_threads = 0;
+  exportToCARFile(path("serial.car"), store, {}, options);
+  options.num_threads = 8;
+  exportToCARFile(path("parallel.car"), store, {}, options);
+  EXPECT_EQ(readFile(path("serial.car")), readFile(path("parallel.car")));
+}
+
+TEST_F(CARExportTest, Resume) {
+  exportToCARFile(path("full.car"), store);
+  std::string full = readFile(path("full.car"));
+
+  // Pretend the export was interrupted at various points, including in the
+  // middle of a block.
+  for (std::size_t size : {std::size_t(0), std::size_t(0x100),
+                           std::size_t(0x200), std::size_t(0x201),
+                           full.size() / 3, full.size() - 1, full.size()}) {
+    {
+      std::error_code EC;
+      llvm::raw_fd_ostream os(path("partial.car"), EC);
+      ASSERT_FALSE(EC);
+      // The header is only written at the end.
+      os.write_zeros(std::min(size, std::size_t(0x200)));
+      if (size > 0x200)
+        os << llvm::StringRef(full).slice(0x200, size);
+    }
+    CARExportOptions options;
+    options.num_threads = 2;
+    options.resume = true;
+    exportToCARFile(path("partial.car"), store, {}, options);
+    EXPECT_EQ(readFile(path("partial.car")), full) << "size " << size;
+  }
+}
+
+} // end anonymous namespace
@@ -0,0 +1,87 @@
+#include "memodb/CachingStore.h"
+
+#include <memory>
+#include <string>
+
+#include "FakeStore.h"
+#include "MockStore.h"
+#include "memodb/CID.h"
+#include "memodb/Node.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+using ::testing::Return;
+
+namespace {
+
+const Node large_node = makeLeaf(0);
+
+TEST(CachingStoreTest, GetCached) {
+  const CID cid = large_node.saveAsIPLD().first;
+  ASSERT_FALSE(cid.isIdentity());
+  MockStore inner;
+  EXPECT_CALL(inner, getOptional(cid)).WillOnce(Return(large_node));
+  CachingStore store(inner);
+  EXPECT_TRUE(large_node == store.get(cid));
+  EXPECT_TRUE(large_node == store.get(cid));
+  EXPECT_TRUE(store.has(cid));
+}
+
+TEST(CachingStoreTest, GetMissingNotCached) {
+  const CID cid = large_node.saveAsIPLD().first;
+  MockStore inner;
+  EXPECT_CALL(inner, getOptional(cid))
+      .Times(2)
+      .WillRepeatedly(Return(llvm::None));
+  CachingStore store(inner);
+  EXPECT_FALSE(store.getOptional(cid).hasValue());
+  EXPECT_FALSE(store.getOptional(cid).hasValue());
+}
+
+TEST(CachingStoreTest, Eviction) {
+  const CID cid = large_node.saveAsIPLD().first;
+  MockStore inner;
+  EXPECT_CALL(inner, getOptional(cid))
+      .Times(2)
+      .WillRepeatedly(Return(large_node));
+  // Too small to hold any Nodes.
+  CachingStore store(inner, 64);
+  store.get(cid);
+  store.get(cid);
+}
+
+TEST(CachingStoreTest, CallCached) {
+  const CID cid = large_node.saveAsIPLD().first;
+  const Name call = Call("func", {cid});
+  const Name head = Head("head");
+  MockStore inner;
+  EXPECT_CALL(inner, resolveOptional(call)).WillOnce(Return(cid));
+  EXPECT_CALL(inner, resolveOptional(head))
+      .Times(2)
+      .WillRepeatedly(Return(cid));
+  CachingStore store(inner);
+  EXPECT_EQ(cid, store.resolve(call));
+  EXPECT_EQ(cid, store.resolve(call));
+  EXPECT_EQ(cid, store.resolve(head));
+  EXPECT_EQ(cid, store.resolve(head));
+}
+
+TEST(CachingStoreTest, CallInvalidate) {
+  const CID cid = large_node.saveAsIPLD().first;
+  const Name call = Call("func", {cid});
+  const Name other_call = Call("other", {cid});
+  MockStore inner;
+  EXPECT_CALL(inner, set(call, cid));
+  EXPECT_CALL(inner, call_invalidate(llvm::StringRef("func")));
+  EXPECT_CALL(inner, resolveOptional(call)).WillOnce(Return(llvm::None));
+  EXPECT_CALL(inner, resolveOptional(other_call)).WillOnce(Return(cid));
+  CachingStore store(inner);
+  store.set(call, cid);
+  EXPECT_EQ(cid, store.resolve(call));
+  EXPECT_EQ(cid, store.resolve(other_call));
+  store.call_invalidate("func");
+  EXPECT_FALSE(store.resolveOptional(call).hasValue());
+  EXPECT_EQ(cid, store.resolve(other_call));
+}
+
+} // end anonymous namespace
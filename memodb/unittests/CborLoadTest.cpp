@@ -1,18 +1,39 @@
 #include "memodb/Node.h"
 
+#include <algorithm>
+
 #include "gtest/gtest.h"
 
 #include "MockStore.h"
+#include "memodb/CBORDecoder.h"
 
 using namespace memodb;
 
 namespace {
 
+// Decode with CBORDecoder, feeding it pieces of the given size.
+llvm::Expected<Node> load_incrementally(Store &store,
+                                        llvm::ArrayRef<uint8_t> cbor,
+                                        size_t piece_size) {
+  CBORDecoder decoder(store);
+  for (size_t i = 0; i < cbor.size(); i += piece_size) {
+    auto piece = cbor.slice(i, std::min(piece_size, cbor.size() - i));
+    if (auto error = decoder.feed(piece))
+      return std::move(error);
+  }
+  return decoder.finish();
+}
+
 void test_load(const Node &expected, const std::vector<uint8_t> &cbor) {
   MockStore store;
   auto actual = Node::loadFromCBOR(store, cbor);
   EXPECT_TRUE(static_cast<bool>(actual));
   EXPECT_EQ(expected, *actual);
+  for (size_t piece_size : {size_t(1), size_t(2), size_t(3), cbor.size()}) {
+    auto incremental = load_incrementally(store, cbor, piece_size);
+    ASSERT_TRUE(static_cast<bool>(incremental));
+    EXPECT_EQ(expected, *incremental);
+  }
 }
 
 void test_invalid(const std::vector<uint8_t> &cbor) {
@@ -20,6 +41,11 @@ void test_invalid(const std::vector<uint8_t> &cbor) {
   auto actual = Node::loadFromCBOR(store, cbor);
   ASSERT_FALSE(static_cast<bool>(actual));
   llvm::consumeError(actual.takeError());
+  for (size_t piece_size : {size_t(1), size_t(2), size_t(3), cbor.size()}) {
+    auto incremental = load_incrementally(store, cbor, piece_size);
+    ASSERT_FALSE(static_cast<bool>(incremental));
+    llvm::consumeError(incremental.takeError());
+  }
 }
 
 TEST(CborLoadTest, Integer) {
@@ -326,4 +352,20 @@ TEST(CborLoadTest, IntegerOutOfRange) {
   test_invalid({0x3b, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00});
 }
 
+TEST(CborLoadTest, ExtraBytes) {
+  test_invalid({0x00, 0x00});
+  test_invalid({0x81, 0x00, 0x00});
+}
+
+TEST(CborLoadTest, IncrementalLargeString) {
+  MockStore store;
+  Node expected(utf8_string_arg, std::string(100000, 'x'));
+  std::vector<uint8_t> cbor = expected.saveAsCBOR();
+  for (size_t piece_size : {size_t(1), size_t(4096), size_t(65536)}) {
+    auto actual = load_incrementally(store, cbor, piece_size);
+    ASSERT_TRUE(static_cast<bool>(actual));
+    EXPECT_EQ(expected, *actual);
+  }
+}
+
 } // end anonymous namespace
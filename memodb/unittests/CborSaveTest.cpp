@@ -1,5 +1,8 @@
 #include "memodb/Node.h"
 
+#include <llvm/Support/raw_ostream.h>
+#include <string>
+
 #include "MockStore.h"
 #include "gtest/gtest.h"
 
@@ -10,6 +13,12 @@ namespace {
 void test_save(const Node &value, const std::vector<uint8_t> &expected) {
   std::vector<uint8_t> out = value.saveAsCBOR();
   EXPECT_EQ(expected, out);
+
+  std::string stream_out;
+  llvm::raw_string_ostream stream(stream_out);
+  value.saveAsCBOR(stream);
+  stream.flush();
+  EXPECT_EQ(std::string(expected.begin(), expected.end()), stream_out);
 }
 
 TEST(CborSaveTest, Integer) {
@@ -1,9 +1,16 @@
 #include "memodb/Evaluator.h"
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <future>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "FakeStore.h"
 #include "MockStore.h"
 #include "memodb/CID.h"
 #include "memodb/Node.h"
@@ -24,6 +31,47 @@ NodeOrCID binary(Evaluator &, Link arg0, Link arg1) {
   return Node(arg0->as<int>() - arg1->as<int>());
 }
 
+// Blocks threads until it's opened.
+class Gate {
+public:
+  void open() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      is_open = true;
+    }
+    cv.notify_all();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return is_open; });
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool is_open = false;
+};
+
+// Set by each test that uses slow or recordThread.
+std::atomic<unsigned> num_slow_evaluations = 0;
+Gate *slow_started, *slow_finish, *record_started;
+
+NodeOrCID slow(Evaluator &, Link arg) {
+  num_slow_evaluations++;
+  slow_started->open();
+  slow_finish->wait();
+  return *arg;
+}
+
+std::thread::id record_thread_id;
+
+NodeOrCID recordThread(Evaluator &, Link arg) {
+  record_thread_id = std::this_thread::get_id();
+  record_started->open();
+  return *arg;
+}
+
 TEST(EvaluatorTest, Nullary) {
   const Name name(Call("nullary", {}));
   const CID cid = *CID::parse("uAXEACGdudWxsYXJ5");
@@ -140,4 +188,72 @@ TEST(EvaluatorTest, ThreadPool) {
   EXPECT_EQ(result_cid, future.getCID());
 }
 
+TEST(EvaluatorTest, NestedThreadPool) {
+  // test.nqueens makes many nested evaluateAsync() calls and waits for them
+  // from inside worker threads.
+  TempDir dir;
+  std::string uri = "sqlite:" + dir.path("store.db");
+  Store::open(uri, /*create_if_missing*/ true);
+  for (unsigned num_threads : {0, 1, 4}) {
+    auto evaluator = Evaluator::createLocal(Store::open(uri), num_threads);
+    evaluator->getStore().call_invalidate("test.nqueens");
+    EXPECT_EQ(10, evaluator->evaluate("test.nqueens", Node(5),
+                                      Node(node_list_arg))
+                      ->as<int>());
+  }
+}
+
+TEST(EvaluatorTest, DeduplicateInFlight) {
+  TempDir dir;
+  auto evaluator = Evaluator::createLocal(
+      Store::open("sqlite:" + dir.path("store.db"),
+                  /*create_if_missing*/ true),
+      4);
+  evaluator->registerFunc("slow", slow);
+  Gate started, finish;
+  slow_started = &started;
+  slow_finish = &finish;
+  num_slow_evaluations = 0;
+  std::vector<Future> futures;
+  for (unsigned i = 0; i < 8; i++)
+    futures.emplace_back(evaluator->evaluateAsync("slow", Node(7)));
+  // Any Tasks that start while the first evaluation is running must wait for
+  // it instead of evaluating the Call again.
+  started.wait();
+  finish.open();
+  for (auto &future : futures)
+    EXPECT_EQ(7, future->as<int>());
+  EXPECT_EQ(1u, num_slow_evaluations);
+  evaluator.reset();
+}
+
+TEST(EvaluatorTest, HelpOnlyWithRelatedTasks) {
+  // A thread waiting for a Task must not run unrelated Tasks, because they
+  // could end up waiting for a Call that's in flight lower on its stack.
+  TempDir dir;
+  auto evaluator = Evaluator::createLocal(
+      Store::open("sqlite:" + dir.path("store.db"),
+                  /*create_if_missing*/ true),
+      1);
+  evaluator->registerFunc("slow", slow);
+  evaluator->registerFunc("record", recordThread);
+  Gate started, finish, recorded;
+  slow_started = &started;
+  slow_finish = &finish;
+  record_started = &recorded;
+  auto slow_future = evaluator->evaluateAsync("slow", Node(8));
+  // Wait until the only worker thread is busy with the slow Task, so the
+  // record Task stays queued while this thread waits for the slow one.
+  started.wait();
+  auto record_future = evaluator->evaluateAsync("record", Node(9));
+  finish.open();
+  EXPECT_EQ(8, slow_future->as<int>());
+  // Don't wait with get() until the record Task has been claimed, or this
+  // thread would run it.
+  recorded.wait();
+  EXPECT_EQ(9, record_future->as<int>());
+  EXPECT_NE(std::this_thread::get_id(), record_thread_id);
+  evaluator.reset();
+}
+
 } // end anonymous namespace
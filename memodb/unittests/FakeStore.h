@@ -1,12 +1,18 @@
 #ifndef MEMODB_FAKESTORE_H
 #define MEMODB_FAKESTORE_H
 
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <llvm/ADT/Optional.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/FileSystem.h>
 
 #include "memodb/CID.h"
 #include "memodb/Node.h"
@@ -15,6 +21,36 @@
 
 namespace memodb {
 
+// Make a Node that's large enough that it won't have an identity CID, so it
+// will actually be stored.
+inline Node makeLeaf(unsigned i) {
+  return Node(node_list_arg,
+              {"a leaf that is too long for an identity CID", i});
+}
+
+// A temporary directory that is deleted, with everything in it, when the
+// TempDir is destroyed.
+class TempDir {
+public:
+  TempDir() {
+    if (llvm::sys::fs::createUniqueDirectory("memodb-test", dir))
+      llvm::report_fatal_error("can't create temporary directory");
+  }
+
+  TempDir(const TempDir &) = delete;
+  TempDir &operator=(const TempDir &) = delete;
+
+  ~TempDir() { llvm::sys::fs::remove_directories(dir); }
+
+  // Get the path of a file inside the directory.
+  std::string path(llvm::StringRef name) const {
+    return (dir + "/" + name).str();
+  }
+
+private:
+  llvm::SmallString<128> dir;
+};
+
 class FakeStore : public Store {
 public:
   llvm::Optional<Node> getOptional(const CID &CID) override {
@@ -88,6 +124,55 @@ private:
   std::map<std::string, std::map<Call, CID>> calls;
 };
 
+// FakeStore isn't thread-safe, so this version serializes all accesses to it.
+class LockedFakeStore : public FakeStore {
+public:
+  llvm::Optional<Node> getOptional(const CID &CID) override {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return FakeStore::getOptional(CID);
+  }
+
+  llvm::Optional<CID> resolveOptional(const Name &Name) override {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return FakeStore::resolveOptional(Name);
+  }
+
+  CID put(const Node &value) override {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return FakeStore::put(value);
+  }
+
+  void set(const Name &Name, const CID &ref) override {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    FakeStore::set(Name, ref);
+  }
+
+private:
+  std::recursive_mutex mutex;
+};
+
+// A store that counts reads, and checks that Nodes are only added after the
+// Nodes they link to, like SQLite stores do.
+class StrictStore : public LockedFakeStore {
+public:
+  llvm::Optional<Node> getOptional(const CID &CID) override {
+    ++num_gets;
+    return LockedFakeStore::getOptional(CID);
+  }
+
+  CID put(const Node &value) override {
+    value.eachLink([&](const CID &link) { EXPECT_TRUE(contains(link)); });
+    return LockedFakeStore::put(value);
+  }
+
+  // Check for a Node without counting it as a read.
+  bool contains(const CID &cid) {
+    return LockedFakeStore::getOptional(cid).hasValue();
+  }
+
+  std::atomic<unsigned> num_gets{0};
+};
+
 } // namespace memodb
 
 #endif // MEMODB_FAKESTORE_H
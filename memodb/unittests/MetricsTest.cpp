@@ -0,0 +1,57 @@
+#include "memodb/Metrics.h"
+
+#include <string>
+
+#include <llvm/Support/raw_ostream.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+using ::testing::HasSubstr;
+
+namespace {
+
+TEST(MetricsTest, HistogramEmpty) {
+  Histogram histogram;
+  std::string buffer;
+  llvm::raw_string_ostream os(buffer);
+  histogram.print(os, "test_seconds");
+  EXPECT_THAT(os.str(), HasSubstr("test_seconds_bucket{le=\"1e-05\"} 0\n"));
+  EXPECT_THAT(os.str(), HasSubstr("test_seconds_bucket{le=\"+Inf\"} 0\n"));
+  EXPECT_THAT(os.str(), HasSubstr("test_seconds_sum 0\n"));
+  EXPECT_THAT(os.str(), HasSubstr("test_seconds_count 0\n"));
+}
+
+TEST(MetricsTest, HistogramBuckets) {
+  Histogram histogram;
+  histogram.observe(0.002);
+  histogram.observe(0.003);
+  histogram.observe(5.0);
+  histogram.observe(5000.0);
+  std::string buffer;
+  llvm::raw_string_ostream os(buffer);
+  histogram.print(os, "test_seconds", "func=\"foo\"");
+  // Buckets are cumulative, and include values equal to the bound.
+  EXPECT_THAT(os.str(),
+              HasSubstr("test_seconds_bucket{func=\"foo\",le=\"0.001\"} 0\n"));
+  EXPECT_THAT(os.str(),
+              HasSubstr("test_seconds_bucket{func=\"foo\",le=\"0.003\"} 2\n"));
+  EXPECT_THAT(os.str(),
+              HasSubstr("test_seconds_bucket{func=\"foo\",le=\"3\"} 2\n"));
+  EXPECT_THAT(os.str(),
+              HasSubstr("test_seconds_bucket{func=\"foo\",le=\"10\"} 3\n"));
+  EXPECT_THAT(os.str(),
+              HasSubstr("test_seconds_bucket{func=\"foo\",le=\"1000\"} 3\n"));
+  EXPECT_THAT(os.str(),
+              HasSubstr("test_seconds_bucket{func=\"foo\",le=\"+Inf\"} 4\n"));
+  EXPECT_THAT(os.str(), HasSubstr("test_seconds_sum{func=\"foo\"} 5005.005\n"));
+  EXPECT_THAT(os.str(), HasSubstr("test_seconds_count{func=\"foo\"} 4\n"));
+}
+
+TEST(MetricsTest, EscapeLabel) {
+  EXPECT_EQ("smout.candidates", escapeMetricLabel("smout.candidates"));
+  EXPECT_EQ("a\\\\b\\\"c\\nd", escapeMetricLabel("a\\b\"c\nd"));
+}
+
+} // end anonymous namespace
@@ -49,6 +49,7 @@ public:
   MOCK_METHOD(void, sendContentURIs,
               (const llvm::ArrayRef<URI> uris, CacheControl cache_control),
               (override));
+  MOCK_METHOD(bool, isClientGone, (), (const, override));
 
   void setWillByDefault() {
     ON_CALL(*this, sendContent)
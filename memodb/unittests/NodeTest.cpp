@@ -0,0 +1,36 @@
+#include "memodb/Node.h"
+
+#include <utility>
+
+#include "MockStore.h"
+#include "memodb/CID.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+
+namespace {
+
+TEST(NodeTest, MovedFromLink) {
+  MockStore store;
+  const CID cid = *CID::parse("uAXEAAfY");
+  const CID other_cid = *CID::parse("uAXEAAQE");
+
+  Node node(store, cid);
+  Node moved(std::move(node));
+  EXPECT_EQ(cid, moved.as<CID>());
+  EXPECT_EQ(cid, node.as<CID>());
+  EXPECT_EQ(moved, node);
+  EXPECT_FALSE(moved < node);
+  EXPECT_EQ(moved, Node(node));
+
+  Node assigned(store, other_cid);
+  assigned = std::move(node);
+  EXPECT_EQ(cid, assigned.as<CID>());
+  EXPECT_EQ(other_cid, node.as<CID>());
+
+  Node list(node_list_arg, {Node(store, cid), Node(store, other_cid)});
+  Node moved_list(std::move(list));
+  EXPECT_EQ(2u, moved_list.size());
+}
+
+} // end anonymous namespace
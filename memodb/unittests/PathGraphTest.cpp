@@ -0,0 +1,106 @@
+#include "memodb/PathGraph.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FakeStore.h"
+#include "memodb/CID.h"
+#include "memodb/Node.h"
+#include "memodb/Store.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+
+namespace {
+
+// Only the SQLite store tracks every link, so use it for all of these tests.
+class PathGraphTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    store = Store::open("sqlite:" + dir.path("store.db"),
+                        /*create_if_missing*/ true);
+  }
+
+  // Padding makes the Nodes large enough that they won't have identity CIDs.
+  Node padded(Node value) {
+    return Node(node_list_arg,
+                {std::move(value), Node(utf8_string_arg, std::string(64, 'x'))});
+  }
+
+  TempDir dir;
+  std::unique_ptr<Store> store;
+};
+
+TEST_F(PathGraphTest, Paths) {
+  CID leaf = store->put(Node(utf8_string_arg, std::string(64, 'y')));
+  CID mid0 = store->put(padded(Node(
+      node_map_arg, {{"a", Node(*store, leaf)}, {"b", Node(*store, leaf)}})));
+  CID mid1 = store->put(padded(Node(node_list_arg, {Node(*store, leaf)})));
+  CID top = store->put(
+      padded(Node(node_list_arg, {Node(*store, mid0), Node(*store, mid1)})));
+  store->set(Head("head"), top);
+  Call call("func", {leaf});
+  store->set(call, mid1);
+
+  // List indexes in paths are unsigned integers.
+  auto key = [](llvm::StringRef key) { return Node(utf8_string_arg, key); };
+  std::vector<Path> expected = {
+      {Head("head"), {0u, 0u, 0u, key("a")}},
+      {Head("head"), {0u, 0u, 0u, key("b")}},
+      {Head("head"), {0u, 1u, 0u, 0u}},
+      {call, {0u, 0u}},
+      {call, {}},
+  };
+
+  PathGraphOptions options;
+  options.num_threads = 1;
+  PathGraph graph = buildPathGraph(*store, leaf, options);
+  EXPECT_EQ(leaf, graph.getTarget());
+  EXPECT_EQ(4u, graph.getAllEdges().size());
+  // mid0 links to leaf twice, so it has two edges.
+  EXPECT_EQ(4u, graph.getEdges(leaf).size());
+  EXPECT_EQ(1u, graph.getEdges(top).size());
+  EXPECT_EQ(5u, graph.countPaths());
+  EXPECT_THAT(graph.getPaths(),
+              ::testing::UnorderedElementsAreArray(expected));
+  EXPECT_THAT(store->list_paths_to(leaf),
+              ::testing::UnorderedElementsAreArray(expected));
+
+  auto names = store->listNamesUsingMany({leaf, top});
+  ASSERT_EQ(2u, names.size());
+  EXPECT_EQ(store->list_names_using(leaf), names[0]);
+  EXPECT_EQ(std::vector<Name>({Head("head")}), names[1]);
+}
+
+TEST_F(PathGraphTest, Shared) {
+  // Each Node links to the previous one twice, so there are 2^40 paths, but
+  // only 41 Nodes in the graph.
+  CID leaf = store->put(padded(Node(0)));
+  CID cid = leaf;
+  for (int i = 0; i < 40; ++i)
+    cid = store->put(
+        padded(Node(node_list_arg, {Node(*store, cid), Node(*store, cid)})));
+  store->set(Head("head"), cid);
+
+  PathGraphOptions options;
+  options.num_threads = 4;
+  options.batch_size = 3;
+  PathGraph graph = buildPathGraph(*store, leaf, options);
+  EXPECT_EQ(41u, graph.getAllEdges().size());
+  EXPECT_EQ(std::size_t(1) << 40, graph.countPaths());
+
+  std::vector<Node> first;
+  std::size_t count = 0;
+  graph.eachPath([&](const Path &path) {
+    EXPECT_EQ(Name(Head("head")), path.first);
+    if (count == 0)
+      first = path.second;
+    return ++count == 1000;
+  });
+  EXPECT_EQ(1000u, count);
+  EXPECT_EQ(40u * 2, first.size());
+}
+
+} // end anonymous namespace
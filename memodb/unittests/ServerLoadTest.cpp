@@ -0,0 +1,219 @@
+#include "memodb/Server.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FakeStore.h"
+#include "MockRequest.h"
+#include "memodb/CID.h"
+#include "memodb/Multibase.h"
+#include "memodb/Node.h"
+#include "memodb/Request.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+using llvm::StringRef;
+using ::testing::_;
+using ::testing::NiceMock;
+
+namespace {
+
+// A POST /worker?wait request, which may be answered by another thread.
+struct WorkerRequest {
+  std::shared_ptr<NiceMock<MockRequest>> request;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::optional<Node> jobs;
+
+  WorkerRequest(Store &store, const CID &worker_cid)
+      : request(std::make_shared<NiceMock<MockRequest>>(
+            Request::Method::POST, "/worker?max_jobs=4&wait=1")) {
+    request->expectGetContent(Node(store, worker_cid));
+    ON_CALL(*request, sendContentNode)
+        .WillByDefault([this](const Node &node, const std::optional<CID> &,
+                              Request::CacheControl) {
+          std::lock_guard<std::mutex> lock(mutex);
+          request->responded = true;
+          jobs = node;
+          cv.notify_all();
+        });
+  }
+
+  // Wait for the response, expiring old long polls while we wait.
+  Node wait(Server &server) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!jobs) {
+      cv.wait_for(lock, std::chrono::milliseconds(100));
+      if (!jobs) {
+        lock.unlock();
+        server.handleTimeouts();
+        lock.lock();
+      }
+    }
+    return *jobs;
+  }
+};
+
+// Counts the answers to POST /call/.../evaluate?wait requests, which are
+// held by the Server until a worker sends the result.
+struct WaitingClients {
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned num_started = 0, num_answered = 0;
+
+  void start(Server &server, const std::string &uri, const Node &expected) {
+    auto request = std::make_shared<NiceMock<MockRequest>>(
+        Request::Method::POST, uri + "/evaluate?wait=60");
+    request->expectGetContent(std::nullopt);
+    ON_CALL(*request, sendContentNode)
+        .WillByDefault([this, request = request.get(), expected](
+                           const Node &node, const std::optional<CID> &,
+                           Request::CacheControl) {
+          EXPECT_EQ(node, expected);
+          std::lock_guard<std::mutex> lock(mutex);
+          request->responded = true;
+          ++num_answered;
+          cv.notify_all();
+        });
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++num_started;
+    }
+    server.handleRequest(*request);
+  }
+
+  // Wait for every request to be answered, expiring old long polls while we
+  // wait.
+  void waitForAll(Server &server) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (num_answered < num_started) {
+      cv.wait_for(lock, std::chrono::milliseconds(100));
+      lock.unlock();
+      server.handleTimeouts();
+      lock.lock();
+    }
+  }
+};
+
+static std::string callURI(StringRef func, const CID &arg) {
+  return "/call/" + func.str() + "/" + arg.asString(Multibase::base64url);
+}
+
+static unsigned getEnvOr(const char *name, unsigned default_value) {
+  const char *env = std::getenv(name);
+  return env ? std::max(std::atoi(env), 1) : default_value;
+}
+
+// Drive an in-process Server from many client and worker threads at once.
+// Every call is submitted twice: once without waiting, and once as a long
+// poll that the Server holds until the result arrives, so about half the
+// calls have a waiting client at any time.
+//
+// To use this as a benchmark of the server's locking, which also prints the
+// throughput, raise the number of calls with MEMODB_LOAD_TEST_CALLS and the
+// number of client and worker threads with MEMODB_LOAD_TEST_THREADS.
+// Thousands of calls give thousands of concurrent long polls.
+TEST(ServerLoadTest, ManyClientsAndWorkers) {
+  const unsigned num_funcs = 8;
+  const unsigned num_calls = getEnvOr("MEMODB_LOAD_TEST_CALLS", 2000);
+  const unsigned num_clients = getEnvOr("MEMODB_LOAD_TEST_THREADS", 16);
+  const unsigned num_workers = std::max(num_clients / 2, 1u);
+  const bool benchmarking = std::getenv("MEMODB_LOAD_TEST_CALLS") ||
+                            std::getenv("MEMODB_LOAD_TEST_THREADS");
+
+  LockedFakeStore store;
+  Node funcs(node_list_arg);
+  for (unsigned i = 0; i < num_funcs; ++i)
+    funcs.emplace_back(utf8_string_arg, "f" + std::to_string(i));
+  CID worker_cid = store.put(Node(node_map_arg, {{"funcs", funcs}}));
+  std::vector<CID> args;
+  for (unsigned i = 0; i < num_calls; ++i)
+    args.emplace_back(store.put(Node(i)));
+  Server server(store);
+
+  std::atomic<unsigned> num_finished = 0, num_requests = 0;
+  WaitingClients waiting;
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_clients; ++t) {
+    threads.emplace_back([&, t] {
+      for (unsigned i = t; i < num_calls; i += num_clients) {
+        std::string uri =
+            callURI("f" + std::to_string(i % num_funcs), args[i]);
+        NiceMock<MockRequest> request(Request::Method::POST,
+                                      uri + "/evaluate");
+        request.expectGetContent(std::nullopt);
+        server.handleRequest(request);
+        EXPECT_TRUE(request.responded);
+        num_requests++;
+        // Long-poll a call submitted by another client thread, which may
+        // not have been submitted yet or may already be finished.
+        unsigned j = (i + num_calls / 2) % num_calls;
+        waiting.start(server,
+                      callURI("f" + std::to_string(j % num_funcs), args[j]),
+                      Node(store, args[j]));
+        num_requests++;
+      }
+    });
+  }
+  for (unsigned t = 0; t < num_workers; ++t) {
+    threads.emplace_back([&] {
+      while (num_finished < num_calls) {
+        WorkerRequest worker(store, worker_cid);
+        server.handleRequest(*worker.request);
+        Node jobs = worker.wait(server);
+        num_requests++;
+        for (const Node &job : jobs.list_range()) {
+          // Each func is the identity function.
+          CID arg = job["args"][0].as<CID>();
+          NiceMock<MockRequest> result(
+              Request::Method::PUT,
+              callURI(job["func"].as<StringRef>(), arg));
+          result.expectGetContent(Node(store, arg));
+          server.handleRequest(result);
+          EXPECT_TRUE(result.responded);
+          num_requests++;
+          num_finished++;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  waiting.waitForAll(server);
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  if (benchmarking)
+    llvm::errs() << num_requests << " requests in "
+                 << llvm::format("%.3f s (%.0f requests/s)\n",
+                                 elapsed.count(),
+                                 num_requests / elapsed.count());
+
+  // Every call must have been evaluated exactly once.
+  EXPECT_EQ(num_finished, num_calls);
+  EXPECT_EQ(waiting.num_answered, num_calls);
+  for (unsigned i = 0; i < num_calls; ++i) {
+    std::string func = "f" + std::to_string(i % num_funcs);
+    MockRequest request(Request::Method::POST,
+                        callURI(func, args[i]) + "/evaluate");
+    request.expectGetContent(std::nullopt);
+    EXPECT_CALL(request, sendContentNode(Node(store, args[i]), _, _));
+    server.handleRequest(request);
+  }
+}
+
+} // end anonymous namespace
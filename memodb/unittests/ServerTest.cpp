@@ -1,14 +1,19 @@
 #include "memodb/Server.h"
 
+#include <chrono>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
 #include <memory>
 #include <optional>
 #include <string>
+#include <thread>
 
 #include "FakeStore.h"
 #include "MockRequest.h"
 #include "MockStore.h"
 #include "memodb/CID.h"
+#include "memodb/Multibase.h"
 #include "memodb/Node.h"
 #include "memodb/Request.h"
 #include "memodb/URI.h"
@@ -114,6 +119,32 @@ TEST(ServerTest, PostCIDLarge) {
             node);
 }
 
+TEST(ServerTest, PostCIDMissing) {
+  FakeStore store;
+  CID present = store.put(Node(node_list_arg, {1, 2, 3}));
+  CID missing = Node(node_list_arg, {4, 5, 6}).saveAsIPLD(true).first;
+  Server server(store);
+  MockRequest request(Request::Method::POST, "/cid?missing");
+  request.expectGetContent(Node(
+      node_list_arg, {Node(store, missing), Node(store, present),
+                      Node(store, missing)}));
+  EXPECT_CALL(request,
+              sendContentNode(Node(node_list_arg, {Node(store, missing),
+                                                   Node(store, missing)}),
+                              _, _));
+  server.handleRequest(request);
+  EXPECT_FALSE(store.has(missing));
+}
+
+TEST(ServerTest, PostCIDMissingInvalid) {
+  FakeStore store;
+  Server server(store);
+  MockRequest request(Request::Method::POST, "/cid?missing");
+  request.expectGetContent(Node(node_list_arg, {1}));
+  EXPECT_CALL(request, sendError(Request::Status::BadRequest, _, _, _));
+  server.handleRequest(request);
+}
+
 TEST(ServerTest, ListHeadsEmpty) {
   FakeStore store;
   Server server(store);
@@ -372,6 +403,499 @@ TEST(ServerTest, EvaluateBeforeWorker) {
   server.handleRequest(result_req);
 }
 
+TEST(ServerTest, WorkerWaitWithoutSharedPtr) {
+  FakeStore store;
+  CID worker_cid = store.put(
+      Node(node_map_arg, {{"funcs", Node(node_list_arg, {"id", "inc"})}}));
+  Server server(store);
+
+  // The request can't be kept after handleRequest() returns, so the server
+  // must respond immediately.
+  MockRequest worker_req(Request::Method::POST, "/worker?wait=30");
+  worker_req.expectGetContent(Node(store, worker_cid));
+  EXPECT_CALL(worker_req, sendContentNode(Node(nullptr), _,
+                                          Request::CacheControl::Ephemeral));
+
+  server.handleRequest(worker_req);
+}
+
+TEST(ServerTest, WorkerWaitBeforeEvaluate) {
+  FakeStore store;
+  CID worker_cid = store.put(
+      Node(node_map_arg, {{"funcs", Node(node_list_arg, {"id", "inc"})}}));
+  Server server(store);
+
+  auto worker_req =
+      std::make_shared<MockRequest>(Request::Method::POST, "/worker?wait=30");
+  worker_req->expectGetContent(Node(store, worker_cid));
+  EXPECT_CALL(*worker_req,
+              sendContentNode(
+                  Node(node_map_arg,
+                       {{"args", Node(node_list_arg,
+                                      {Node(store, *CID::parse("uAXEAAQA"))})},
+                        {"func", "inc"}}),
+                  _, Request::CacheControl::Ephemeral));
+
+  MockRequest evaluate_req(Request::Method::POST,
+                           "/call/inc/uAXEAAQA/evaluate");
+  evaluate_req.expectGetContent(std::nullopt);
+  EXPECT_CALL(evaluate_req, sendAccepted());
+
+  server.handleRequest(*worker_req);
+  EXPECT_FALSE(worker_req->responded);
+  server.handleRequest(evaluate_req);
+  EXPECT_TRUE(worker_req->responded);
+}
+
+TEST(ServerTest, WorkerWaitClientGone) {
+  FakeStore store;
+  CID worker_cid = store.put(
+      Node(node_map_arg, {{"funcs", Node(node_list_arg, {"id", "inc"})}}));
+  Server server(store);
+
+  auto gone_req =
+      std::make_shared<MockRequest>(Request::Method::POST, "/worker?wait=30");
+  gone_req->expectGetContent(Node(store, worker_cid));
+  EXPECT_CALL(*gone_req, isClientGone()).WillRepeatedly(Return(true));
+  EXPECT_CALL(*gone_req, sendContentNode(_, _, _)).Times(0);
+
+  auto worker_req =
+      std::make_shared<MockRequest>(Request::Method::POST, "/worker?wait=30");
+  worker_req->expectGetContent(Node(store, worker_cid));
+  EXPECT_CALL(*worker_req, isClientGone()).WillRepeatedly(Return(false));
+  EXPECT_CALL(*worker_req,
+              sendContentNode(
+                  Node(node_map_arg,
+                       {{"args", Node(node_list_arg,
+                                      {Node(store, *CID::parse("uAXEAAQA"))})},
+                        {"func", "inc"}}),
+                  _, Request::CacheControl::Ephemeral));
+
+  MockRequest evaluate_req(Request::Method::POST,
+                           "/call/inc/uAXEAAQA/evaluate");
+  evaluate_req.expectGetContent(std::nullopt);
+  EXPECT_CALL(evaluate_req, sendAccepted());
+
+  server.handleRequest(*gone_req);
+  server.handleRequest(*worker_req);
+  server.handleRequest(evaluate_req);
+  EXPECT_FALSE(gone_req->responded);
+  EXPECT_TRUE(worker_req->responded);
+}
+
+TEST(ServerTest, EvaluateWaitForResult) {
+  FakeStore store;
+  Server server(store);
+
+  auto evaluate_req = std::make_shared<MockRequest>(
+      Request::Method::POST, "/call/inc/uAXEAAQA/evaluate?wait=30");
+  evaluate_req->expectGetContent(std::nullopt);
+  EXPECT_CALL(*evaluate_req,
+              sendContentNode(Node(store, *CID::parse("uAXEAAQE")), _, _));
+
+  MockRequest put_req(Request::Method::PUT, "/call/inc/uAXEAAQA");
+  put_req.expectGetContent(Node(store, *CID::parse("uAXEAAQE")));
+  EXPECT_CALL(put_req, sendCreated(Eq(std::nullopt)));
+
+  server.handleRequest(*evaluate_req);
+  EXPECT_FALSE(evaluate_req->responded);
+  server.handleRequest(put_req);
+  EXPECT_TRUE(evaluate_req->responded);
+}
+
+TEST(ServerTest, WaitTimeout) {
+  FakeStore store;
+  CID worker_cid = store.put(
+      Node(node_map_arg, {{"funcs", Node(node_list_arg, {"id", "inc"})}}));
+  Server server(store);
+
+  auto worker_req =
+      std::make_shared<MockRequest>(Request::Method::POST, "/worker?wait=1");
+  worker_req->expectGetContent(Node(store, worker_cid));
+  EXPECT_CALL(*worker_req, sendContentNode(Node(nullptr), _,
+                                           Request::CacheControl::Ephemeral));
+
+  auto evaluate_req = std::make_shared<MockRequest>(
+      Request::Method::POST, "/call/other/uAXEAAQA/evaluate?wait=1");
+  evaluate_req->expectGetContent(std::nullopt);
+  EXPECT_CALL(*evaluate_req, sendAccepted());
+
+  server.handleRequest(*worker_req);
+  server.handleRequest(*evaluate_req);
+  server.handleTimeouts();
+  EXPECT_FALSE(worker_req->responded);
+  EXPECT_FALSE(evaluate_req->responded);
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  server.handleTimeouts();
+  EXPECT_TRUE(worker_req->responded);
+  EXPECT_TRUE(evaluate_req->responded);
+}
+
+// Send POST /call/func/.../evaluate, expecting the result to be unavailable.
+static void requestEvaluate(Server &server, StringRef func, const CID &arg,
+                            StringRef query = "") {
+  MockRequest evaluate_req(Request::Method::POST,
+                           "/call/" + func.str() + "/" +
+                               arg.asString(Multibase::base64url) +
+                               "/evaluate" + query.str());
+  evaluate_req.expectGetContent(std::nullopt);
+  EXPECT_CALL(evaluate_req, sendAccepted());
+  server.handleRequest(evaluate_req);
+}
+
+static void requestEvaluateInc(Server &server, const CID &arg) {
+  requestEvaluate(server, "inc", arg);
+}
+
+// Send POST /worker and return the job the server sent back. If max_jobs is
+// given, the server sends a list of jobs instead.
+static Node requestJob(Server &server, Store &store, const CID &worker_cid,
+                       std::optional<unsigned> max_jobs = std::nullopt) {
+  std::string uri = "/worker";
+  if (max_jobs)
+    uri += "?max_jobs=" + std::to_string(*max_jobs);
+  MockRequest worker_req(Request::Method::POST, uri);
+  worker_req.expectGetContent(Node(store, worker_cid));
+  Node job;
+  EXPECT_CALL(worker_req,
+              sendContentNode(_, _, Request::CacheControl::Ephemeral))
+      .WillOnce([&](const Node &node, const std::optional<CID> &,
+                    Request::CacheControl) {
+        job = node;
+        worker_req.responded = true;
+      });
+  server.handleRequest(worker_req);
+  return job;
+}
+
+TEST(ServerTest, JobLogRestoresQueue) {
+  TempDir dir;
+  std::string path = dir.path("jobs.log");
+  FakeStore store;
+  CID worker_cid =
+      store.put(Node(node_map_arg, {{"funcs", Node(node_list_arg, {"inc"})}}));
+  CID arg0 = *CID::parse("uAXEAAQA");
+  CID arg1 = *CID::parse("uAXEAAQE");
+  CID arg2 = *CID::parse("uAXEAAQI");
+
+  {
+    Server server(store);
+    server.openJobLog(path);
+    requestEvaluateInc(server, arg0);
+    requestEvaluateInc(server, arg1);
+    requestEvaluateInc(server, arg2);
+    EXPECT_EQ(arg0, requestJob(server, store, worker_cid)["args"][0].as<CID>());
+
+    MockRequest put_req(Request::Method::PUT, "/call/inc/uAXEAAQE");
+    put_req.expectGetContent(Node(store, arg2));
+    EXPECT_CALL(put_req, sendCreated(Eq(std::nullopt)));
+    server.handleRequest(put_req);
+  }
+
+  // inc(arg0) is still assigned to a worker, and inc(arg1) is finished.
+  Server server(store);
+  server.openJobLog(path);
+  EXPECT_EQ(arg2, requestJob(server, store, worker_cid)["args"][0].as<CID>());
+  EXPECT_TRUE(requestJob(server, store, worker_cid).is_null());
+}
+
+TEST(ServerTest, JobLogKeepsTimeouts) {
+  TempDir dir;
+  std::string path = dir.path("jobs.log");
+  FakeStore store;
+  CID worker_cid =
+      store.put(Node(node_map_arg, {{"funcs", Node(node_list_arg, {"inc"})}}));
+  CID arg0 = *CID::parse("uAXEAAQA");
+  CID arg1 = *CID::parse("uAXEAAQE");
+
+  {
+    auto start = std::chrono::system_clock::now() - std::chrono::minutes(10);
+    std::error_code ec;
+    llvm::raw_fd_ostream os(path, ec);
+    ASSERT_FALSE(ec);
+    os << "queued 4 0 /call/inc/uAXEAAQA\n";
+    os << "assigned 4 "
+       << std::chrono::duration_cast<std::chrono::seconds>(
+              start.time_since_epoch())
+              .count()
+       << " /call/inc/uAXEAAQA\n";
+    os << "queued 4 0 /call/inc/uAXEAAQE\n";
+    // An incomplete record, as if the server was killed while writing it.
+    os << "queued 4 0 /call/in";
+  }
+
+  Server server(store);
+  server.openJobLog(path);
+  EXPECT_EQ(arg1, requestJob(server, store, worker_cid)["args"][0].as<CID>());
+  EXPECT_TRUE(requestJob(server, store, worker_cid).is_null());
+
+  // inc(arg0) was assigned long enough ago that evaluating it again requeues
+  // it.
+  requestEvaluateInc(server, arg0);
+  EXPECT_EQ(arg0, requestJob(server, store, worker_cid)["args"][0].as<CID>());
+}
+
+TEST(ServerTest, WorkerMaxJobs) {
+  FakeStore store;
+  CID worker_cid =
+      store.put(Node(node_map_arg, {{"funcs", Node(node_list_arg, {"inc"})}}));
+  CID arg0 = *CID::parse("uAXEAAQA");
+  CID arg1 = *CID::parse("uAXEAAQE");
+  CID arg2 = *CID::parse("uAXEAAQI");
+  Server server(store);
+
+  EXPECT_EQ(Node(node_list_arg), requestJob(server, store, worker_cid, 4));
+  requestEvaluateInc(server, arg0);
+  requestEvaluateInc(server, arg1);
+  requestEvaluateInc(server, arg2);
+  Node jobs = requestJob(server, store, worker_cid, 2);
+  ASSERT_EQ(2u, jobs.size());
+  EXPECT_EQ(arg0, jobs[0]["args"][0].as<CID>());
+  EXPECT_EQ(arg1, jobs[1]["args"][0].as<CID>());
+  jobs = requestJob(server, store, worker_cid, 2);
+  ASSERT_EQ(1u, jobs.size());
+  EXPECT_EQ(arg2, jobs[0]["args"][0].as<CID>());
+}
+
+TEST(ServerTest, PostCallResults) {
+  FakeStore store;
+  CID worker_cid =
+      store.put(Node(node_map_arg, {{"funcs", Node(node_list_arg, {"inc"})}}));
+  CID arg0 = *CID::parse("uAXEAAQA");
+  CID arg1 = *CID::parse("uAXEAAQE");
+  CID arg2 = *CID::parse("uAXEAAQI");
+  Server server(store);
+  requestEvaluateInc(server, arg0);
+  requestEvaluateInc(server, arg1);
+  requestEvaluateInc(server, arg2);
+
+  MockRequest post_req(Request::Method::POST, "/call");
+  post_req.expectGetContent(Node(
+      node_list_arg,
+      {Node(node_map_arg, {{"func", "inc"},
+                           {"args", Node(node_list_arg, {Node(store, arg0)})},
+                           {"result", Node(store, arg1)}}),
+       Node(node_map_arg, {{"func", "inc"},
+                           {"args", Node(node_list_arg, {Node(store, arg1)})},
+                           {"result", Node(store, arg2)}})}));
+  EXPECT_CALL(post_req, sendCreated(Eq(std::nullopt)));
+  server.handleRequest(post_req);
+
+  EXPECT_EQ(arg1, store.resolve(Call("inc", {arg0})));
+  EXPECT_EQ(arg2, store.resolve(Call("inc", {arg1})));
+  // Only inc(arg2) is still queued.
+  Node jobs = requestJob(server, store, worker_cid, 4);
+  ASSERT_EQ(1u, jobs.size());
+  EXPECT_EQ(arg2, jobs[0]["args"][0].as<CID>());
+}
+
+TEST(ServerTest, PostCallResultsInvalid) {
+  FakeStore store;
+  Server server(store);
+  MockRequest post_req(Request::Method::POST, "/call");
+  // The args must be CIDs.
+  Node result(node_map_arg, {{"func", "inc"},
+                             {"args", Node(node_list_arg, {Node(7)})},
+                             {"result", Node(store, *CID::parse("uAXEAAQE"))}});
+  post_req.expectGetContent(Node(node_list_arg, {result}));
+  EXPECT_CALL(post_req,
+              sendError(Request::Status::BadRequest,
+                        Eq("/problems/invalid-call-results"), _, _));
+  server.handleRequest(post_req);
+}
+
+TEST(ServerTest, WorkerPriority) {
+  FakeStore store;
+  CID worker_cid =
+      store.put(Node(node_map_arg, {{"funcs", Node(node_list_arg, {"inc"})}}));
+  CID arg0 = *CID::parse("uAXEAAQA");
+  CID arg1 = *CID::parse("uAXEAAQE");
+  CID arg2 = *CID::parse("uAXEAAQI");
+  CID arg3 = *CID::parse("uAXEAAQM");
+  Server server(store);
+  requestEvaluate(server, "inc", arg0);
+  requestEvaluate(server, "inc", arg1, "?priority=5");
+  requestEvaluate(server, "inc", arg2, "?priority=-1");
+  requestEvaluate(server, "inc", arg3);
+  // Requesting a queued call with a higher priority moves it forward.
+  requestEvaluate(server, "inc", arg3, "?priority=1");
+  // But requesting it with a lower priority doesn't move it back.
+  requestEvaluate(server, "inc", arg1, "?priority=-5");
+
+  Node jobs = requestJob(server, store, worker_cid, 4);
+  ASSERT_EQ(4u, jobs.size());
+  EXPECT_EQ(arg1, jobs[0]["args"][0].as<CID>());
+  EXPECT_EQ(5, jobs[0]["priority"].as<int>());
+  EXPECT_EQ(arg3, jobs[1]["args"][0].as<CID>());
+  EXPECT_EQ(arg0, jobs[2]["args"][0].as<CID>());
+  EXPECT_FALSE(jobs[2].contains("priority"));
+  EXPECT_EQ(arg2, jobs[3]["args"][0].as<CID>());
+}
+
+// Queue inc(arg0)...inc(arg3) and then dec(arg0), dec(arg1), and return the
+// funcs of the jobs in the order a worker gets them.
+static std::vector<std::string> getJobFuncOrder(Server &server,
+                                                Store &store) {
+  CID worker_cid = store.put(
+      Node(node_map_arg, {{"funcs", Node(node_list_arg, {"inc", "dec"})}}));
+  for (StringRef arg : {"uAXEAAQA", "uAXEAAQE", "uAXEAAQI", "uAXEAAQM"})
+    requestEvaluate(server, "inc", *CID::parse(arg));
+  for (StringRef arg : {"uAXEAAQA", "uAXEAAQE"})
+    requestEvaluate(server, "dec", *CID::parse(arg));
+  Node jobs = requestJob(server, store, worker_cid, 8);
+  std::vector<std::string> result;
+  for (const Node &job : jobs.list_range())
+    result.emplace_back(job["func"].as<StringRef>());
+  return result;
+}
+
+TEST(ServerTest, WorkerFairShare) {
+  FakeStore store;
+  Server server(store);
+  EXPECT_EQ(std::vector<std::string>(
+                {"inc", "dec", "inc", "dec", "inc", "inc"}),
+            getJobFuncOrder(server, store));
+}
+
+TEST(ServerTest, WorkerFairShareWeighted) {
+  FakeStore store;
+  Server server(store);
+  server.setFuncWeight("inc", 2);
+  EXPECT_EQ(std::vector<std::string>(
+                {"inc", "dec", "inc", "inc", "dec", "inc"}),
+            getJobFuncOrder(server, store));
+}
+
+TEST(ServerTest, WorkerOldestFirst) {
+  FakeStore store;
+  Server server(store);
+  server.setSchedulingPolicy(Server::SchedulingPolicy::OldestFirst);
+  EXPECT_EQ(std::vector<std::string>(
+                {"inc", "inc", "inc", "inc", "dec", "dec"}),
+            getJobFuncOrder(server, store));
+}
+
+TEST(ServerTest, JobLogKeepsPriority) {
+  TempDir dir;
+  std::string path = dir.path("jobs.log");
+  FakeStore store;
+  CID worker_cid =
+      store.put(Node(node_map_arg, {{"funcs", Node(node_list_arg, {"inc"})}}));
+  CID arg0 = *CID::parse("uAXEAAQA");
+  CID arg1 = *CID::parse("uAXEAAQE");
+  CID arg2 = *CID::parse("uAXEAAQI");
+
+  {
+    std::error_code ec;
+    llvm::raw_fd_ostream os(path, ec);
+    ASSERT_FALSE(ec);
+    // A record without a priority, from an older server.
+    os << "queued 4 0 /call/inc/uAXEAAQA\n";
+    os << "queued 4 0 2 /call/inc/uAXEAAQE\n";
+    os << "queued 4 0 0 /call/inc/uAXEAAQI\n";
+    // inc(arg2) was requested again with a higher priority.
+    os << "queued 4 0 3 /call/inc/uAXEAAQI\n";
+  }
+
+  {
+    // Replay and compact the log.
+    Server server(store);
+    server.openJobLog(path);
+  }
+
+  // The compacted log keeps the priorities too.
+  Server server(store);
+  server.openJobLog(path);
+  Node jobs = requestJob(server, store, worker_cid, 4);
+  ASSERT_EQ(3u, jobs.size());
+  EXPECT_EQ(arg2, jobs[0]["args"][0].as<CID>());
+  EXPECT_EQ(arg1, jobs[1]["args"][0].as<CID>());
+  EXPECT_EQ(arg0, jobs[2]["args"][0].as<CID>());
+}
+
+TEST(ServerTest, JobLogCompactsWhileRunning) {
+  TempDir dir;
+  std::string path = dir.path("jobs.log");
+  FakeStore store;
+  CID worker_cid =
+      store.put(Node(node_map_arg, {{"funcs", Node(node_list_arg, {"inc"})}}));
+  CID pending_arg = Node(-1).saveAsIPLD().first;
+
+  {
+    Server server(store);
+    server.openJobLog(path, /*compact_bytes*/ 1);
+    requestEvaluateInc(server, pending_arg);
+    for (int i = 0; i < 100; i++) {
+      CID arg = Node(i).saveAsIPLD().first;
+      requestEvaluateInc(server, arg);
+      MockRequest put_req(Request::Method::PUT,
+                          "/call/inc/" + arg.asString(Multibase::base64url));
+      put_req.expectGetContent(Node(store, arg));
+      EXPECT_CALL(put_req, sendCreated(Eq(std::nullopt)));
+      server.handleRequest(put_req);
+    }
+
+    // The finished jobs should be compacted away without restarting.
+    std::uint64_t size = 0;
+    for (int i = 0; i < 100; i++) {
+      ASSERT_FALSE(llvm::sys::fs::file_size(path, size));
+      if (size < 200)
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_LT(size, 200u);
+  }
+
+  Server server(store);
+  server.openJobLog(path);
+  EXPECT_EQ(pending_arg,
+            requestJob(server, store, worker_cid)["args"][0].as<CID>());
+  EXPECT_TRUE(requestJob(server, store, worker_cid).is_null());
+}
+
+TEST(ServerTest, GetMetrics) {
+  FakeStore store;
+  CID worker_cid =
+      store.put(Node(node_map_arg, {{"funcs", Node(node_list_arg, {"inc"})}}));
+  CID arg0 = *CID::parse("uAXEAAQA");
+  CID arg1 = *CID::parse("uAXEAAQE");
+  Server server(store);
+  server.addMetrics([](llvm::raw_ostream &os) { os << "extra_metric 7\n"; });
+  requestEvaluateInc(server, arg0);
+  requestEvaluateInc(server, arg1);
+  requestJob(server, store, worker_cid);
+  MockRequest put_req(Request::Method::PUT, "/call/inc/uAXEAAQA");
+  put_req.expectGetContent(Node(store, arg1));
+  EXPECT_CALL(put_req, sendCreated(Eq(std::nullopt)));
+  server.handleRequest(put_req);
+
+  MockRequest request(Request::Method::GET, "/metrics");
+  std::string body;
+  EXPECT_CALL(request, sendContent(Request::ContentType::Plain, _))
+      .WillOnce([&](Request::ContentType, const StringRef &content) {
+        body = content.str();
+        request.responded = true;
+      });
+  server.handleRequest(request);
+  using ::testing::HasSubstr;
+  EXPECT_THAT(body, HasSubstr("# TYPE memodb_jobs_queued gauge\n"));
+  EXPECT_THAT(body, HasSubstr("memodb_jobs_queued{func=\"inc\"} 1\n"));
+  EXPECT_THAT(body, HasSubstr("memodb_jobs_running{func=\"inc\"} 0\n"));
+  EXPECT_THAT(body, HasSubstr("memodb_jobs_queued_total{func=\"inc\"} 2\n"));
+  EXPECT_THAT(body,
+              HasSubstr("memodb_jobs_assigned_total{func=\"inc\"} 1\n"));
+  EXPECT_THAT(body,
+              HasSubstr("memodb_jobs_finished_total{func=\"inc\"} 1\n"));
+  EXPECT_THAT(body,
+              HasSubstr("memodb_job_duration_seconds_count{func=\"inc\"} 1\n"));
+  EXPECT_THAT(body, HasSubstr("memodb_worker_groups 1\n"));
+  EXPECT_THAT(body, HasSubstr("memodb_request_duration_seconds_count{route="
+                              "\"worker\"} 1\n"));
+  EXPECT_THAT(body, HasSubstr("memodb_store_operation_duration_seconds_count{"
+                              "operation=\"set\"} 1\n"));
+  EXPECT_THAT(body, HasSubstr("extra_metric 7\n"));
+}
+
 // TODO: find a way to test interaction between threads.
 
 } // end anonymous namespace
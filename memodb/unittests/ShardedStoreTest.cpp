@@ -0,0 +1,205 @@
+#include "memodb/ShardedStore.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FakeStore.h"
+#include "memodb/CID.h"
+#include "memodb/Node.h"
+#include "memodb/Store.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+
+namespace {
+
+class ShardedStoreTest : public ::testing::Test {
+protected:
+  void SetUp() override { store = makeStore(NUM_SHARDS, fakes); }
+
+  static std::unique_ptr<ShardedStore>
+  makeStore(std::size_t num_shards, std::vector<FakeStore *> &fakes) {
+    std::vector<std::unique_ptr<Store>> shards;
+    fakes.clear();
+    for (std::size_t i = 0; i < num_shards; ++i) {
+      auto shard = std::make_unique<LockedFakeStore>();
+      fakes.push_back(shard.get());
+      shards.emplace_back(std::move(shard));
+    }
+    return std::make_unique<ShardedStore>(std::move(shards));
+  }
+
+  static constexpr std::size_t NUM_SHARDS = 4;
+  std::vector<FakeStore *> fakes;
+  std::unique_ptr<ShardedStore> store;
+};
+
+TEST_F(ShardedStoreTest, NodesAreSpread) {
+  std::vector<CID> cids;
+  for (unsigned i = 0; i < 200; ++i)
+    cids.push_back(store->put(makeLeaf(i)));
+  std::vector<unsigned> counts(NUM_SHARDS);
+  for (const CID &cid : cids) {
+    std::size_t index = store->getShardIndex(cid);
+    ++counts[index];
+    for (std::size_t i = 0; i < NUM_SHARDS; ++i)
+      EXPECT_EQ(fakes[i]->has(cid), i == index);
+    EXPECT_TRUE(store->has(cid));
+  }
+  for (unsigned count : counts)
+    EXPECT_GT(count, 20u);
+
+  std::vector<Node> values;
+  for (unsigned i = 0; i < 200; ++i)
+    values.push_back(makeLeaf(i + 1000));
+  std::vector<CID> more = store->putMany(values);
+  auto fetched = store->getMany(more);
+  auto present = store->hasMany(more);
+  for (unsigned i = 0; i < 200; ++i) {
+    EXPECT_EQ(fetched[i], values[i]);
+    EXPECT_TRUE(present[i]);
+    EXPECT_TRUE(fakes[store->getShardIndex(more[i])]->has(more[i]));
+  }
+}
+
+TEST_F(ShardedStoreTest, Names) {
+  CID leaf = store->put(makeLeaf(0));
+  std::vector<Name> names;
+  for (unsigned i = 0; i < 50; ++i) {
+    names.emplace_back(Head("head" + std::to_string(i)));
+    names.emplace_back(Call(i % 2 ? "odd" : "even", {store->put(makeLeaf(i))}));
+    store->set(names[i * 2], leaf);
+    store->set(names[i * 2 + 1], leaf);
+  }
+  for (const Name &name : names) {
+    EXPECT_EQ(store->resolve(name), leaf);
+    EXPECT_TRUE(fakes[store->getShardIndex(name)]->resolveOptional(name));
+  }
+  for (const auto &cid : store->resolveMany(names))
+    EXPECT_EQ(cid, leaf);
+
+  EXPECT_EQ(store->list_heads().size(), 50u);
+  EXPECT_EQ(store->list_funcs(), std::vector<std::string>({"even", "odd"}));
+  std::set<Call> calls;
+  store->eachCall("odd", [&](const Call &call) {
+    calls.insert(call);
+    return false;
+  });
+  EXPECT_EQ(calls.size(), 25u);
+
+  unsigned num_seen = 0;
+  store->eachCall("odd", [&](const Call &) { return ++num_seen == 3; });
+  EXPECT_EQ(num_seen, 3u);
+
+  store->call_invalidate("odd");
+  for (FakeStore *fake : fakes) {
+    fake->eachCall("odd", [](const Call &) {
+      ADD_FAILURE() << "call not invalidated";
+      return true;
+    });
+  }
+  store->head_delete(Head("head0"));
+  EXPECT_FALSE(store->has(Head("head0")));
+}
+
+TEST_F(ShardedStoreTest, EachInOrder) {
+  // Exports depend on eachHead() and eachCall() always using the same order.
+  CID leaf = store->put(makeLeaf(0));
+  for (unsigned i = 0; i < 50; ++i) {
+    store->set(Head("head" + std::to_string(i)), leaf);
+    store->set(Call("func", {store->put(makeLeaf(i))}), leaf);
+  }
+  std::vector<Head> heads;
+  std::vector<Call> calls;
+  std::set<std::thread::id> threads;
+  store->eachHead([&](const Head &head) {
+    heads.push_back(head);
+    threads.insert(std::this_thread::get_id());
+    return false;
+  });
+  store->eachCall("func", [&](const Call &call) {
+    calls.push_back(call);
+    threads.insert(std::this_thread::get_id());
+    return false;
+  });
+  EXPECT_EQ(heads.size(), 50u);
+  EXPECT_EQ(calls.size(), 50u);
+  EXPECT_TRUE(std::is_sorted(heads.begin(), heads.end()));
+  EXPECT_TRUE(std::is_sorted(calls.begin(), calls.end()));
+  EXPECT_EQ(threads, std::set<std::thread::id>({std::this_thread::get_id()}));
+}
+
+TEST_F(ShardedStoreTest, NestedManyOps) {
+  // Callbacks may run on the store's ThreadPool, and using the store from
+  // them must not wait for the pool.
+  std::vector<CID> cids;
+  for (unsigned i = 0; i < 100; ++i)
+    cids.push_back(store->put(
+        Node(byte_string_arg, "bytes that are too long for an identity CID " +
+                                  std::to_string(i))));
+  std::mutex mutex;
+  unsigned num_viewed = 0;
+  store->viewManyBytes(cids, [&](size_t, BytesRef) {
+    auto present = store->hasMany(cids);
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_EQ(present, std::vector<bool>(cids.size(), true));
+    ++num_viewed;
+  });
+  EXPECT_EQ(num_viewed, cids.size());
+
+  store->set(Head("head"), cids[0]);
+  store->eachHead([&](const Head &) {
+    EXPECT_EQ(store->getMany(cids).size(), cids.size());
+    return false;
+  });
+}
+
+TEST_F(ShardedStoreTest, Batch) {
+  Store::Batch batch(*store);
+  std::vector<Node> values;
+  for (unsigned i = 0; i < 20; ++i)
+    values.push_back(makeLeaf(i));
+  std::vector<CID> cids = store->putMany(values);
+  EXPECT_EQ(store->getMany(cids), std::vector<llvm::Optional<Node>>(
+                                      values.begin(), values.end()));
+  store->set(Head("head"), cids[0]);
+  batch.commit();
+  EXPECT_EQ(store->resolve(Head("head")), cids[0]);
+}
+
+TEST_F(ShardedStoreTest, AddingShard) {
+  std::vector<FakeStore *> bigger_fakes;
+  auto bigger = makeStore(NUM_SHARDS + 1, bigger_fakes);
+
+  // Only keys moved to the new shard change shards.
+  unsigned num_moved = 0;
+  for (unsigned i = 0; i < 1000; ++i) {
+    CID cid = makeLeaf(i).saveAsIPLD().first;
+    Head head("head" + std::to_string(i));
+    for (const Name &name : {Name(cid), Name(head)}) {
+      std::size_t old_index = store->getShardIndex(name);
+      std::size_t new_index = bigger->getShardIndex(name);
+      if (new_index != old_index) {
+        EXPECT_EQ(new_index, NUM_SHARDS);
+        ++num_moved;
+      }
+    }
+  }
+  EXPECT_GT(num_moved, 200u);
+  EXPECT_LT(num_moved, 700u);
+
+  // Copies of names left in the wrong shard are ignored.
+  CID leaf = store->put(makeLeaf(0));
+  Head head("stale");
+  std::size_t wrong = (store->getShardIndex(head) + 1) % NUM_SHARDS;
+  fakes[wrong]->set(head, leaf);
+  EXPECT_TRUE(store->list_heads().empty());
+  EXPECT_FALSE(store->has(head));
+}
+
+} // end anonymous namespace
@@ -0,0 +1,371 @@
+#include "memodb/Store.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <sqlite3.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FakeStore.h"
+#include "memodb/CID.h"
+#include "memodb/CachingStore.h"
+#include "memodb/Node.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+
+namespace {
+
+class SQLiteStoreTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    store = Store::open("sqlite:" + dir.path("store.db"),
+                        /*create_if_missing*/ true);
+  }
+
+  TempDir dir;
+  std::unique_ptr<Store> store;
+};
+
+void testBatched(Store &store) {
+  // These Nodes are large enough that they won't have identity CIDs.
+  const Node present0("the first Node that will be added to the store");
+  const Node present1(node_list_arg, {"the second Node", "added to the store"});
+  const Node missing("a Node that will never be added to the store");
+  const CID missing_cid = missing.saveAsIPLD().first;
+
+  ASSERT_FALSE(missing_cid.isIdentity());
+
+  auto cids = store.putMany({present0, present1});
+  ASSERT_EQ(2u, cids.size());
+  ASSERT_FALSE(cids[0].isIdentity());
+  ASSERT_FALSE(cids[1].isIdentity());
+  EXPECT_EQ(present0.saveAsIPLD().first, cids[0]);
+  EXPECT_EQ(present1.saveAsIPLD().first, cids[1]);
+  EXPECT_EQ(cids, store.putMany({present0, present1}));
+
+  auto nodes = store.getMany({cids[0], missing_cid, cids[1]});
+  ASSERT_EQ(3u, nodes.size());
+  ASSERT_TRUE(nodes[0].hasValue());
+  EXPECT_EQ(present0, *nodes[0]);
+  EXPECT_FALSE(nodes[1].hasValue());
+  ASSERT_TRUE(nodes[2].hasValue());
+  EXPECT_EQ(present1, *nodes[2]);
+
+  EXPECT_EQ(std::vector<bool>({true, false, true}),
+            store.hasMany({cids[0], missing_cid, cids[1]}));
+
+  store.set(Head("head0"), cids[0]);
+  store.set(Call("func", {cids[0]}), cids[1]);
+  auto resolved =
+      store.resolveMany({Head("head0"), Head("missing"), missing_cid,
+                         Call("func", {cids[0]}), Call("func", {cids[1]})});
+  ASSERT_EQ(5u, resolved.size());
+  EXPECT_EQ(cids[0], resolved[0]);
+  EXPECT_FALSE(resolved[1].hasValue());
+  EXPECT_EQ(missing_cid, resolved[2]);
+  EXPECT_EQ(cids[1], resolved[3]);
+  EXPECT_FALSE(resolved[4].hasValue());
+
+  EXPECT_TRUE(store.getMany({}).empty());
+  EXPECT_TRUE(store.putMany({}).empty());
+}
+
+TEST(StoreTest, BatchedDefault) {
+  FakeStore store;
+  testBatched(store);
+}
+
+TEST_F(SQLiteStoreTest, Batched) { testBatched(*store); }
+
+TEST_F(SQLiteStoreTest, BatchedCaching) {
+  CachingStore caching(*store);
+  testBatched(caching);
+  // Everything should be cached now.
+  testBatched(caching);
+}
+
+void testViewBytes(Store &store) {
+  const Node large(byte_string_arg, std::string(100, 'x'));
+  const Node small(byte_string_arg, std::string("tiny"));
+  const CID missing_cid =
+      Node(byte_string_arg, std::string(100, 'y')).saveAsIPLD().first;
+  CID large_cid = store.put(large);
+  CID small_cid = store.put(small);
+  ASSERT_FALSE(large_cid.isIdentity());
+  ASSERT_TRUE(small_cid.isIdentity());
+
+  std::vector<std::uint8_t> viewed;
+  auto save = [&](BytesRef bytes) {
+    viewed.assign(bytes.begin(), bytes.end());
+  };
+  EXPECT_TRUE(store.viewBytes(large_cid, save));
+  EXPECT_EQ(large.as<BytesRef>(), BytesRef(viewed));
+  EXPECT_TRUE(store.viewBytes(small_cid, save));
+  EXPECT_EQ(small.as<BytesRef>(), BytesRef(viewed));
+  EXPECT_FALSE(store.viewBytes(missing_cid, save));
+
+  std::vector<std::vector<std::uint8_t>> many(3);
+  std::vector<bool> found(3);
+  store.viewManyBytes({large_cid, missing_cid, small_cid},
+                      [&](size_t i, BytesRef bytes) {
+                        ASSERT_LT(i, 3u);
+                        found[i] = true;
+                        many[i].assign(bytes.begin(), bytes.end());
+                      });
+  EXPECT_EQ(std::vector<bool>({true, false, true}), found);
+  EXPECT_EQ(large.as<BytesRef>(), BytesRef(many[0]));
+  EXPECT_EQ(small.as<BytesRef>(), BytesRef(many[2]));
+}
+
+TEST(StoreTest, ViewBytesDefault) {
+  FakeStore store;
+  testViewBytes(store);
+}
+
+TEST_F(SQLiteStoreTest, ViewBytes) { testViewBytes(*store); }
+
+TEST(StoreTest, ViewBytesFromCBOR) {
+  // Byte strings are normally stored with Raw CIDs, but they can also be
+  // encoded as DAG-CBOR.
+  FakeStore store;
+  const Node bytes(byte_string_arg, std::string(100, 'x'));
+  auto content = bytes.saveAsCBOR();
+  CID cid = CID::calculate(Multicodec::DAG_CBOR, content);
+  std::optional<Node> storage;
+  auto viewed = Node::viewBytesFromIPLD(store, cid, content, storage);
+  ASSERT_TRUE(static_cast<bool>(viewed));
+  EXPECT_EQ(bytes.as<BytesRef>(), *viewed);
+  EXPECT_TRUE(storage.has_value());
+
+  CID list_cid = Node(node_list_arg).saveAsIPLD().first;
+  auto not_bytes = Node::viewBytesFromIPLD(store, list_cid, {}, storage);
+  EXPECT_FALSE(static_cast<bool>(not_bytes));
+  llvm::consumeError(not_bytes.takeError());
+}
+
+TEST_F(SQLiteStoreTest, BatchedIdentity) {
+  const Node identity(1);
+  const CID identity_cid = identity.saveAsIPLD().first;
+  ASSERT_TRUE(identity_cid.isIdentity());
+  auto nodes = store->getMany({identity_cid});
+  ASSERT_EQ(1u, nodes.size());
+  ASSERT_TRUE(nodes[0].hasValue());
+  EXPECT_EQ(identity, *nodes[0]);
+  EXPECT_EQ(std::vector<bool>({true}), store->hasMany({identity_cid}));
+}
+
+TEST_F(SQLiteStoreTest, BatchCommit) {
+  const Node node("a Node that is added inside a Store::Batch scope");
+  CID cid = node.saveAsIPLD().first;
+  {
+    Store::Batch batch(*store);
+    {
+      Store::Batch nested(*store);
+      store->put(node);
+      nested.commit();
+    }
+    EXPECT_TRUE(store->has(cid));
+    store->set(Head("head"), cid);
+    batch.commit();
+  }
+  EXPECT_TRUE(store->has(cid));
+  EXPECT_EQ(cid, store->resolveOptional(Head("head")));
+}
+
+TEST_F(SQLiteStoreTest, BatchAbort) {
+  const Node node("a Node that is added inside a Store::Batch scope");
+  CID cid = node.saveAsIPLD().first;
+  {
+    Store::Batch batch(*store);
+    store->put(node);
+    EXPECT_TRUE(store->has(cid));
+  }
+  EXPECT_FALSE(store->has(cid));
+}
+
+TEST_F(SQLiteStoreTest, CollectGarbage) {
+  // These Nodes are large enough that they won't have identity CIDs, except
+  // for small.
+  CID head_leaf = store->put(Node("a leaf that is kept because of a head"));
+  CID head_root =
+      store->put(Node(node_list_arg, {Node(*store, head_leaf), "head root"}));
+  CID arg = store->put(Node("an argument that is kept because of a call"));
+  CID result = store->put(Node("a result that is kept because of a call"));
+  CID shared = store->put(Node("a leaf used by both live and garbage Nodes"));
+  CID shared_user =
+      store->put(Node(node_list_arg, {Node(*store, shared), "a live user"}));
+  CID garbage_leaf = store->put(Node("a leaf that is only used by garbage"));
+  CID garbage_root = store->put(
+      Node(node_list_arg, {Node(*store, garbage_leaf), Node(*store, shared),
+                           Node(*store, head_root)}));
+  CID deleted = store->put(Node("a Node whose head will be deleted"));
+  // The small Node is only added to the blocks table when another Node links
+  // to it, so it's newer than its user.
+  CID small = Node(node_list_arg, {"small"}).saveAsIPLD().first;
+  ASSERT_TRUE(small.isIdentity());
+  CID small_user = store->put(Node(
+      node_list_arg, {Node(*store, small), "garbage that links to small"}));
+  // The newest Node is never deleted, so make it live.
+  CID newest = store->put(Node("the newest Node, which is kept anyway"));
+  store->set(Head("newest"), newest);
+
+  store->set(Head("head"), head_root);
+  store->set(Head("other"), shared_user);
+  store->set(Call("func", {arg}), result);
+  store->set(Head("deleted"), deleted);
+  store->head_delete(Head("deleted"));
+
+  EXPECT_EQ(5u, store->collectGarbage(std::chrono::seconds(0)));
+  for (const CID &cid :
+       {head_leaf, head_root, arg, result, shared, shared_user})
+    EXPECT_TRUE(store->has(cid));
+  for (const CID &cid : {garbage_leaf, garbage_root, deleted, small_user})
+    EXPECT_FALSE(store->has(cid));
+  EXPECT_EQ(std::vector<Name>({Name(shared_user)}),
+            store->list_names_using(shared));
+  EXPECT_EQ(0u, store->collectGarbage(std::chrono::seconds(0)));
+}
+
+TEST_F(SQLiteStoreTest, CollectGarbageGracePeriod) {
+  // A client may add a Node and only refer to it a little later, so a Node
+  // added before collection starts must be kept if it's referred to during
+  // the grace period.
+  CID garbage = store->put(makeLeaf(0));
+  CID pending = store->put(makeLeaf(1));
+  CID newest = store->put(makeLeaf(2));
+  std::size_t num_deleted = 0;
+  std::thread gc([&] {
+    num_deleted = store->collectGarbage(std::chrono::seconds(1));
+  });
+  store->set(Head("pending"), pending);
+  gc.join();
+  EXPECT_EQ(1u, num_deleted);
+  EXPECT_FALSE(store->has(garbage));
+  EXPECT_TRUE(store->has(pending));
+  // The newest Node is kept even though it's garbage, so Nodes added during
+  // collection can't reuse the bid of a deleted one.
+  EXPECT_TRUE(store->has(newest));
+  CID added = store->put(makeLeaf(3));
+  EXPECT_EQ(1u, store->collectGarbage(std::chrono::seconds(0)));
+  EXPECT_FALSE(store->has(newest));
+  EXPECT_TRUE(store->has(added));
+}
+
+#if BCDB_WITH_ZSTD
+// Count the rows returned by a query, reading the database file directly.
+static int countRows(const llvm::Twine &path, const char *sql) {
+  sqlite3 *db = nullptr;
+  EXPECT_EQ(SQLITE_OK, sqlite3_open_v2(path.str().c_str(), &db,
+                                       SQLITE_OPEN_READONLY, nullptr));
+  sqlite3_stmt *stmt = nullptr;
+  EXPECT_EQ(SQLITE_OK, sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr));
+  int count = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    count++;
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return count;
+}
+
+TEST_F(SQLiteStoreTest, Compression) {
+  std::vector<Node> nodes;
+  for (int i = 0; i < 1000; i++)
+    nodes.push_back(Node(
+        node_map_arg,
+        {{"index", i},
+         {"name", Node(utf8_string_arg,
+                       "compressible node number " + std::to_string(i))},
+         {"padding", Node(utf8_string_arg, std::string(100 + i % 50, 'x'))}}));
+  std::vector<CID> cids;
+  store.reset();
+  {
+    // Compress without a dictionary.
+    auto compressed = Store::open(
+        "sqlite:" + dir.path("store.db?compression=zstd"));
+    cids = compressed->putMany(nodes);
+  }
+  // CODEC_ZSTD is 1.
+  EXPECT_EQ(0, countRows(dir.path("store.db"),
+                         "SELECT bid FROM blocks WHERE codec != 1"));
+  EXPECT_EQ(int(nodes.size()), countRows(dir.path("store.db"),
+                                         "SELECT bid FROM blocks"));
+  EXPECT_EQ(0, countRows(dir.path("store.db"), "SELECT seq FROM zstd_dicts"));
+  {
+    // Train a dictionary and recompress the existing blocks with it.
+    auto trained = Store::open(
+        "sqlite:" + dir.path("store.db?compression=zstd&train_dictionary=1"));
+    cids.push_back(trained->put(
+        Node(utf8_string_arg, "a new block compressed with the dictionary, " +
+                                  std::string(100, 'x'))));
+  }
+  EXPECT_EQ(0, countRows(dir.path("store.db"),
+                         "SELECT bid FROM blocks WHERE codec != 1"));
+  EXPECT_EQ(1, countRows(dir.path("store.db"), "SELECT seq FROM zstd_dicts"));
+  // Compressed blocks must be readable without compression enabled.
+  store = Store::open("sqlite:" + dir.path("store.db"));
+  auto loaded = store->getMany(cids);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    ASSERT_TRUE(loaded[i].hasValue());
+    EXPECT_TRUE(nodes[i] == *loaded[i]);
+  }
+  ASSERT_TRUE(loaded.back().hasValue());
+  EXPECT_EQ(cids.back(), loaded.back()->saveAsIPLD().first);
+}
+
+TEST_F(SQLiteStoreTest, TrainDictionaryOnEmptyStore) {
+  // There's nothing to train on, so this should warn and go on compressing
+  // without a dictionary.
+  auto trained = Store::open(
+      "sqlite:" + dir.path("empty.db?compression=zstd&train_dictionary=1"),
+      /*create_if_missing*/ true);
+  CID cid = trained->put(
+      Node(utf8_string_arg, "compressed without a dictionary, " +
+                                std::string(100, 'x')));
+  trained.reset();
+  EXPECT_EQ(0, countRows(dir.path("empty.db"), "SELECT seq FROM zstd_dicts"));
+  EXPECT_EQ(1, countRows(dir.path("empty.db"),
+                         "SELECT bid FROM blocks WHERE codec = 1"));
+  store = Store::open("sqlite:" + dir.path("empty.db"));
+  EXPECT_TRUE(store->has(cid));
+}
+#endif
+
+#if BCDB_WITH_ROCKSDB
+TEST(RocksDBStoreTest, SetDuringInvalidate) {
+  // call_invalidate() deletes calls outside of transactions, so it must not
+  // leave behind refs for calls that were set while it was running.
+  TempDir dir;
+  auto store =
+      Store::open("rocksdb:" + dir.path("store"), /*create_if_missing*/ true);
+  CID result = store->put(makeLeaf(0));
+  auto makeCall = [](unsigned i) {
+    return Call("func", {Node(i).saveAsIPLD().first});
+  };
+  // Enough calls that invalidation is split into several writes.
+  const unsigned num_calls = 20000;
+  for (unsigned i = 0; i < num_calls; i += 2)
+    store->set(makeCall(i), result);
+
+  std::thread setter([&] {
+    for (unsigned i = 1; i < num_calls; i += 2)
+      store->set(makeCall(i), result);
+  });
+  store->call_invalidate("func");
+  setter.join();
+
+  std::vector<Name> calls;
+  store->eachCall("func", [&](const Call &call) {
+    calls.emplace_back(call);
+    return false;
+  });
+  std::vector<Name> users = store->list_names_using(result);
+  std::sort(calls.begin(), calls.end());
+  std::sort(users.begin(), users.end());
+  EXPECT_EQ(calls, users);
+}
+#endif
+
+} // end anonymous namespace
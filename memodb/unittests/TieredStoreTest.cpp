@@ -0,0 +1,133 @@
+#include "memodb/TieredStore.h"
+
+#include <memory>
+#include <string>
+
+#include "FakeStore.h"
+#include "memodb/CID.h"
+#include "memodb/Node.h"
+#include "memodb/Store.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+
+namespace {
+
+class TieredStoreTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    auto local_ptr = std::make_unique<StrictStore>();
+    local = local_ptr.get();
+    tiered = std::make_unique<TieredStore>(std::move(local_ptr), remote);
+  }
+
+  StrictStore remote;
+  StrictStore *local;
+  std::unique_ptr<TieredStore> tiered;
+};
+
+TEST_F(TieredStoreTest, ReadThrough) {
+  CID leaf = remote.put(makeLeaf(0));
+  CID parent =
+      remote.put(Node(node_list_arg, {Node(remote, leaf), "parent"}));
+
+  // The parent can't be cached until its child is.
+  EXPECT_EQ(tiered->get(parent), remote.get(parent));
+  EXPECT_FALSE(local->contains(parent));
+  EXPECT_EQ(tiered->get(leaf), remote.get(leaf));
+  EXPECT_TRUE(local->contains(leaf));
+  EXPECT_EQ(tiered->get(parent), remote.get(parent));
+  EXPECT_TRUE(local->contains(parent));
+
+  auto expected = remote.getMany({leaf, parent});
+  unsigned num_gets = remote.num_gets;
+  EXPECT_EQ(tiered->getMany({leaf, parent}), expected);
+  EXPECT_EQ(remote.num_gets, num_gets);
+}
+
+TEST_F(TieredStoreTest, GetManyCachesChildrenFirst) {
+  CID leaf = remote.put(makeLeaf(0));
+  CID parent =
+      remote.put(Node(node_list_arg, {Node(remote, leaf), "parent"}));
+  tiered->getMany({parent, leaf});
+  EXPECT_TRUE(local->contains(leaf));
+  EXPECT_TRUE(local->contains(parent));
+}
+
+TEST_F(TieredStoreTest, WriteBehind) {
+  CID leaf = tiered->put(makeLeaf(0));
+  CID parent =
+      tiered->put(Node(node_list_arg, {Node(*tiered, leaf), "parent"}));
+  EXPECT_TRUE(local->contains(leaf));
+  EXPECT_TRUE(local->contains(parent));
+  EXPECT_FALSE(remote.contains(leaf));
+  EXPECT_FALSE(remote.contains(parent));
+  EXPECT_TRUE(tiered->has(parent));
+
+  // Setting a Head sends the Nodes first.
+  tiered->set(Head("head"), parent);
+  EXPECT_TRUE(remote.contains(leaf));
+  EXPECT_TRUE(remote.contains(parent));
+  EXPECT_EQ(remote.resolve(Head("head")), parent);
+}
+
+TEST_F(TieredStoreTest, PendingNodeWithRemoteLinks) {
+  CID leaf = remote.put(makeLeaf(0));
+  CID parent =
+      tiered->put(Node(node_list_arg, {Node(remote, leaf), "parent"}));
+  // The leaf isn't local, so neither is the parent, but it can still be read
+  // before it's sent.
+  EXPECT_FALSE(local->contains(parent));
+  EXPECT_EQ(tiered->get(parent),
+            Node(node_list_arg, {Node(remote, leaf), "parent"}));
+  EXPECT_EQ(remote.num_gets, 0u);
+  tiered->flush();
+  EXPECT_TRUE(remote.contains(parent));
+}
+
+TEST_F(TieredStoreTest, CallCached) {
+  CID arg = remote.put(makeLeaf(0));
+  CID result = remote.put(makeLeaf(1));
+  Call call("func", {arg});
+  remote.set(call, result);
+
+  // The Call can't be cached until its argument and result are.
+  EXPECT_EQ(tiered->resolve(call), result);
+  EXPECT_FALSE(local->resolveOptional(call));
+  tiered->getMany({arg, result});
+  EXPECT_EQ(tiered->resolveMany({Name(call)})[0], result);
+  EXPECT_EQ(local->resolveOptional(call), result);
+
+  tiered->call_invalidate("func");
+  EXPECT_FALSE(local->resolveOptional(call));
+  EXPECT_FALSE(remote.resolveOptional(call));
+}
+
+TEST(TieredStoreURITest, SQLite) {
+  TempDir dir;
+  std::string local_uri = "sqlite:" + dir.path("local.db");
+  std::string remote_uri = "sqlite:" + dir.path("remote.db");
+  {
+    auto remote = Store::open(remote_uri, /*create_if_missing*/ true);
+    CID leaf = remote->put(makeLeaf(0));
+    remote->set(Head("leaf"), leaf);
+  }
+  {
+    auto store = Store::open("tiered:" + local_uri + "|" + remote_uri);
+    CID leaf = store->resolve(Head("leaf"));
+    store->get(leaf);
+    CID parent =
+        store->put(Node(node_list_arg, {Node(*store, leaf), "parent"}));
+    store->set(Head("parent"), parent);
+    EXPECT_EQ(store->get(parent)[0].as<CID>(), leaf);
+  }
+  {
+    // Heads are only stored remotely.
+    auto local = Store::open(local_uri);
+    EXPECT_FALSE(local->has(Head("parent")));
+    CID parent = Store::open(remote_uri)->resolve(Head("parent"));
+    EXPECT_TRUE(local->has(parent));
+  }
+}
+
+} // end anonymous namespace
@@ -0,0 +1,82 @@
+#include "memodb/Transfer.h"
+
+#include <cstddef>
+#include <vector>
+
+#include "FakeStore.h"
+#include "memodb/CID.h"
+#include "memodb/Node.h"
+#include "memodb/Store.h"
+#include "gtest/gtest.h"
+
+using namespace memodb;
+
+namespace {
+
+// Make a chain of Nodes, each linking to the previous one, and return the CID
+// of the last one. Chains of different lengths share no Nodes.
+static CID putChain(Store &store, unsigned length) {
+  CID cid = store.put(Node(node_list_arg, {"start", length}));
+  for (unsigned i = 0; i < length; ++i)
+    cid = store.put(Node(node_list_arg, {i, Node(store, cid)}));
+  return cid;
+}
+
+TEST(TransferTest, DeepChain) {
+  // Deep enough that recursing for each link could overflow the stack.
+  FakeStore source;
+  StrictStore target;
+  CID root = putChain(source, 100000);
+  TransferOptions options;
+  options.num_threads = 1;
+  std::vector<std::size_t> reports;
+  options.progress_interval = 10000;
+  options.progress = [&](std::size_t num_copied, std::size_t num_waiting) {
+    reports.push_back(num_copied);
+  };
+  EXPECT_EQ(transferNodes(source, target, {root}, options), 100001u);
+  EXPECT_EQ(target.get(root), source.get(root));
+  EXPECT_EQ(reports.size(), 10u);
+  reports.clear();
+  EXPECT_EQ(transferNodes(source, target, {root}, options), 0u);
+  EXPECT_TRUE(reports.empty());
+}
+
+TEST(TransferTest, SkipsPresentNodes) {
+  FakeStore source, target;
+  CID shared = putChain(source, 10);
+  putChain(target, 10);
+  CID root = source.put(
+      Node(node_list_arg, {Node(source, shared), Node(source, shared)}));
+  TransferOptions options;
+  options.num_threads = 1;
+  EXPECT_EQ(transferNodes(source, target, {root}, options), 1u);
+  EXPECT_TRUE(target.has(root));
+}
+
+TEST(TransferTest, Names) {
+  LockedFakeStore source;
+  StrictStore target;
+  std::vector<CID> args;
+  for (unsigned i = 0; i < 20; ++i)
+    args.push_back(putChain(source, i * 10));
+  std::vector<Name> names;
+  for (unsigned i = 0; i < 20; ++i) {
+    Call call("func", {args[i]});
+    source.set(call, args[(i + 1) % 20]);
+    names.emplace_back(call);
+  }
+  source.set(Head("head"), args[3]);
+  names.emplace_back(Head("head"));
+
+  TransferOptions options;
+  options.num_threads = 4;
+  options.batch_size = 7;
+  EXPECT_EQ(transferNames(source, target, names, options), 1920u);
+  for (const Name &name : names)
+    EXPECT_EQ(target.resolve(name), source.resolve(name));
+  for (const CID &arg : args)
+    EXPECT_EQ(target.get(arg), source.get(arg));
+}
+
+} // end anonymous namespace
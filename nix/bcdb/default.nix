@@ -1,5 +1,5 @@
 { stdenv, lib, nix-gitignore, clang, cmake, libsodium, llvm, python3, sqlite, boost175,
-rocksdb ? null, nng ? null,
+rocksdb ? null, nng ? null, zstd ? null,
 sanitize ? false }:
 
 let
@@ -42,7 +42,7 @@ in stdenv.mkDerivation {
   };
 
   nativeBuildInputs = [ clang cmake python3 ];
-  buildInputs = [ boost175 libsodium llvm nng rocksdb sqlite ];
+  buildInputs = [ boost175 libsodium llvm nng rocksdb sqlite zstd ];
 
   preConfigure = ''
     patchShebangs third_party/lit/lit.py